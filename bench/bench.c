@@ -0,0 +1,637 @@
+//
+//  bench.c
+//  cloudsync
+//
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "sqlite3.h"
+#include "cloudsync.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/*
+
+ Benchmarks the main costs of the extension on synthetic schemas:
+
+ insert_plain / update_plain        local writes on tables not augmented by cloudsync_init (baseline)
+ insert_synced / update_synced      the same writes on synchronized tables (tracking overhead)
+ changes_scan                       full scan of the cloudsync_changes virtual table
+ payload_encode                     cloudsync_payload_encode of all the changes
+ payload_apply                      cloudsync_payload_decode of that payload in a new database
+ init_backfill                      cloudsync_init of tables that already contain rows
+
+ Writes are measured one statement at a time (inside a single transaction), all the other benchmarks are
+ measured once per iteration. Results are printed as a table or, with --json, as a JSON document so that
+ runs of different releases can be compared.
+
+ */
+
+#define BENCH_DEFAULT_ROWS          10000
+#define BENCH_DEFAULT_ITERATIONS    5
+#define BENCH_DEFAULT_TABLES        20
+#define BENCH_DEFAULT_COLUMNS       32
+#define BENCH_DEFAULT_BLOB_SIZE     4096
+
+typedef enum {
+    BENCH_SCHEMA_NARROW,            // text pk and a few typed columns
+    BENCH_SCHEMA_WIDE,              // text pk and many columns
+    BENCH_SCHEMA_BLOB,              // text pk and a large BLOB column
+    BENCH_SCHEMA_COMPOSITE,         // composite text pk
+    BENCH_SCHEMA_MANY_TABLES,       // many narrow tables, the rows are spread across them
+    BENCH_SCHEMA_COUNT
+} bench_schema;
+
+static const char *bench_schema_names[BENCH_SCHEMA_COUNT] = {"narrow", "wide", "blob", "composite", "many_tables"};
+
+typedef struct {
+    int         rows;
+    int         iterations;
+    int         tables;
+    int         columns;
+    int         blob_size;
+    bool        json;
+    const char  *schema;            // NULL to run all schemas
+} bench_config;
+
+typedef struct {
+    double      *samples;           // latencies in us
+    int         count;
+    int         capacity;
+} bench_samples;
+
+typedef struct {
+    sqlite3     *db;
+    sqlite3_stmt **insert;          // one statement per table
+    sqlite3_stmt **update;
+    int         ntables;
+} bench_db;
+
+static bool bench_first_result = true;
+static uint64_t bench_seed = 88172645463325252ULL;
+
+// MARK: - Utils -
+
+static uint64_t bench_now_ns (void) {
+    #ifdef _WIN32
+    static LARGE_INTEGER frequency = {0};
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((counter.QuadPart / frequency.QuadPart) * 1000000000ULL + ((counter.QuadPart % frequency.QuadPart) * 1000000000ULL) / frequency.QuadPart);
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    #endif
+}
+
+static uint64_t bench_random (void) {
+    // xorshift64, the generated data must be the same on each run
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed;
+}
+
+static bool bench_samples_add (bench_samples *s, double value) {
+    if (s->count == s->capacity) {
+        int capacity = (s->capacity) ? s->capacity * 2 : 1024;
+        double *samples = (double *)realloc(s->samples, sizeof(double) * capacity);
+        if (!samples) return false;
+        s->samples = samples;
+        s->capacity = capacity;
+    }
+    s->samples[s->count++] = value;
+    return true;
+}
+
+static void bench_samples_reset (bench_samples *s) {
+    s->count = 0;
+}
+
+static int bench_compare_double (const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double bench_percentile (bench_samples *s, double p) {
+    // samples must be sorted, nearest-rank percentile
+    if (s->count == 0) return 0;
+    int index = (int)(p * s->count + 0.5) - 1;
+    if (index < 0) index = 0;
+    if (index >= s->count) index = s->count - 1;
+    return s->samples[index];
+}
+
+static int bench_exec (sqlite3 *db, const char *sql) {
+    char *errmsg = NULL;
+    int rc = sqlite3_exec(db, sql, NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "bench error: %s (%s)\n", (errmsg) ? errmsg : sqlite3_errmsg(db), sql);
+        sqlite3_free(errmsg);
+    }
+    return rc;
+}
+
+static int bench_open (sqlite3 **db) {
+    int rc = sqlite3_open(":memory:", db);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_cloudsync_init(*db, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    return bench_exec(*db, "PRAGMA journal_mode=MEMORY; PRAGMA synchronous=OFF;");
+}
+
+static void bench_close (sqlite3 *db) {
+    if (!db) return;
+    sqlite3_exec(db, "SELECT cloudsync_terminate();", NULL, NULL, NULL);
+    sqlite3_close(db);
+}
+
+// MARK: - Schemas -
+
+static int bench_schema_ntables (bench_config *config, bench_schema schema) {
+    return (schema == BENCH_SCHEMA_MANY_TABLES) ? config->tables : 1;
+}
+
+static int bench_schema_ncols (bench_config *config, bench_schema schema) {
+    // number of non primary key columns
+    switch (schema) {
+        case BENCH_SCHEMA_WIDE: return config->columns;
+        case BENCH_SCHEMA_BLOB: return 2;
+        case BENCH_SCHEMA_COMPOSITE: return 2;
+        default: return 4;
+    }
+}
+
+static int bench_schema_npks (bench_schema schema) {
+    return (schema == BENCH_SCHEMA_COMPOSITE) ? 3 : 1;
+}
+
+static char *bench_schema_create (bench_config *config, bench_schema schema, int table) {
+    char *sql = NULL;
+    switch (schema) {
+        case BENCH_SCHEMA_WIDE: {
+            sql = sqlite3_mprintf("CREATE TABLE t%d (id TEXT PRIMARY KEY NOT NULL", table);
+            for (int i=0; i<config->columns && sql; ++i) sql = sqlite3_mprintf("%z, c%d %s", sql, i, (i % 2) ? "INTEGER" : "TEXT");
+            if (sql) sql = sqlite3_mprintf("%z);", sql);
+            break;
+        }
+        case BENCH_SCHEMA_BLOB:
+            sql = sqlite3_mprintf("CREATE TABLE t%d (id TEXT PRIMARY KEY NOT NULL, name TEXT, data BLOB);", table);
+            break;
+        case BENCH_SCHEMA_COMPOSITE:
+            sql = sqlite3_mprintf("CREATE TABLE t%d (tenant TEXT NOT NULL, user TEXT NOT NULL, item TEXT NOT NULL, qty INTEGER, note TEXT, PRIMARY KEY (tenant, user, item));", table);
+            break;
+        default:
+            sql = sqlite3_mprintf("CREATE TABLE t%d (id TEXT PRIMARY KEY NOT NULL, name TEXT, age INTEGER, score REAL, note TEXT);", table);
+            break;
+    }
+    return sql;
+}
+
+static char *bench_schema_insert (bench_config *config, bench_schema schema, int table) {
+    int nparams = bench_schema_npks(schema) + bench_schema_ncols(config, schema);
+    char *sql = sqlite3_mprintf("INSERT INTO t%d VALUES (?", table);
+    for (int i=1; i<nparams && sql; ++i) sql = sqlite3_mprintf("%z, ?", sql);
+    if (sql) sql = sqlite3_mprintf("%z);", sql);
+    return sql;
+}
+
+static char *bench_schema_update (bench_schema schema, int table) {
+    // update a single non primary key column
+    switch (schema) {
+        case BENCH_SCHEMA_WIDE: return sqlite3_mprintf("UPDATE t%d SET c0 = ?1 WHERE id = ?2;", table);
+        case BENCH_SCHEMA_BLOB: return sqlite3_mprintf("UPDATE t%d SET name = ?1 WHERE id = ?2;", table);
+        case BENCH_SCHEMA_COMPOSITE: return sqlite3_mprintf("UPDATE t%d SET qty = ?1 WHERE tenant = ?2 AND user = ?3 AND item = ?4;", table);
+        default: return sqlite3_mprintf("UPDATE t%d SET name = ?1 WHERE id = ?2;", table);
+    }
+}
+
+static void bench_bind_pk (sqlite3_stmt *vm, bench_schema schema, int row, int index) {
+    char buf[64];
+    if (schema == BENCH_SCHEMA_COMPOSITE) {
+        snprintf(buf, sizeof(buf), "tenant-%04d", row % 97);
+        sqlite3_bind_text(vm, index, buf, -1, SQLITE_TRANSIENT);
+        snprintf(buf, sizeof(buf), "user-%06d", row % 7919);
+        sqlite3_bind_text(vm, index+1, buf, -1, SQLITE_TRANSIENT);
+        snprintf(buf, sizeof(buf), "item-%010d", row);
+        sqlite3_bind_text(vm, index+2, buf, -1, SQLITE_TRANSIENT);
+        return;
+    }
+    
+    snprintf(buf, sizeof(buf), "%08x-%04x-row-%010d", (unsigned)(row * 2654435761u), (unsigned)(row & 0xFFFF), row);
+    sqlite3_bind_text(vm, index, buf, -1, SQLITE_TRANSIENT);
+}
+
+static void bench_bind_row (bench_config *config, sqlite3_stmt *vm, bench_schema schema, int row, void *blob) {
+    char buf[64];
+    bench_bind_pk(vm, schema, row, 1);
+    
+    int index = bench_schema_npks(schema) + 1;
+    switch (schema) {
+        case BENCH_SCHEMA_WIDE:
+            for (int i=0; i<config->columns; ++i, ++index) {
+                if (i % 2) {sqlite3_bind_int64(vm, index, (sqlite3_int64)(bench_random() % 1000000)); continue;}
+                snprintf(buf, sizeof(buf), "value-%d-%llu", i, (unsigned long long)(bench_random() % 100000));
+                sqlite3_bind_text(vm, index, buf, -1, SQLITE_TRANSIENT);
+            }
+            break;
+        case BENCH_SCHEMA_BLOB:
+            snprintf(buf, sizeof(buf), "name-%d", row);
+            sqlite3_bind_text(vm, index, buf, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_blob(vm, index+1, blob, config->blob_size, SQLITE_STATIC);
+            break;
+        case BENCH_SCHEMA_COMPOSITE:
+            sqlite3_bind_int64(vm, index, (sqlite3_int64)(bench_random() % 1000));
+            snprintf(buf, sizeof(buf), "note-%llu", (unsigned long long)(bench_random() % 100000));
+            sqlite3_bind_text(vm, index+1, buf, -1, SQLITE_TRANSIENT);
+            break;
+        default:
+            snprintf(buf, sizeof(buf), "name-%d", row);
+            sqlite3_bind_text(vm, index, buf, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(vm, index+1, (sqlite3_int64)(bench_random() % 100));
+            sqlite3_bind_double(vm, index+2, (double)(bench_random() % 10000) / 100.0);
+            snprintf(buf, sizeof(buf), "note-%llu", (unsigned long long)(bench_random() % 100000));
+            sqlite3_bind_text(vm, index+3, buf, -1, SQLITE_TRANSIENT);
+            break;
+    }
+}
+
+static void bench_bind_update (sqlite3_stmt *vm, bench_schema schema, int row) {
+    char buf[64];
+    if (schema == BENCH_SCHEMA_COMPOSITE) sqlite3_bind_int64(vm, 1, (sqlite3_int64)(bench_random() % 1000));
+    else {
+        snprintf(buf, sizeof(buf), "updated-%llu", (unsigned long long)(bench_random() % 100000));
+        sqlite3_bind_text(vm, 1, buf, -1, SQLITE_TRANSIENT);
+    }
+    bench_bind_pk(vm, schema, row, 2);
+}
+
+static void bench_db_free (bench_db *b) {
+    for (int i=0; i<b->ntables; ++i) {
+        if (b->insert && b->insert[i]) sqlite3_finalize(b->insert[i]);
+        if (b->update && b->update[i]) sqlite3_finalize(b->update[i]);
+    }
+    free(b->insert);
+    free(b->update);
+    bench_close(b->db);
+    memset(b, 0, sizeof(bench_db));
+}
+
+static int bench_db_create (bench_config *config, bench_schema schema, bool synced, bool statements, bench_db *b) {
+    memset(b, 0, sizeof(bench_db));
+    b->ntables = bench_schema_ntables(config, schema);
+    int rc = bench_open(&b->db);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    if (statements) {
+        b->insert = (sqlite3_stmt **)calloc(b->ntables, sizeof(sqlite3_stmt *));
+        b->update = (sqlite3_stmt **)calloc(b->ntables, sizeof(sqlite3_stmt *));
+        if (!b->insert || !b->update) {rc = SQLITE_NOMEM; goto cleanup;}
+    }
+    
+    for (int i=0; i<b->ntables; ++i) {
+        char *sql = bench_schema_create(config, schema, i);
+        if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+        rc = bench_exec(b->db, sql);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto cleanup;
+    
+        if (synced) {
+            sql = sqlite3_mprintf("SELECT cloudsync_init('t%d');", i);
+            rc = bench_exec(b->db, sql);
+            sqlite3_free(sql);
+            if (rc != SQLITE_OK) goto cleanup;
+        }
+    
+        if (!statements) continue;
+    
+        sql = bench_schema_insert(config, schema, i);
+        if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+        rc = sqlite3_prepare_v2(b->db, sql, -1, &b->insert[i], NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto cleanup;
+    
+        sql = bench_schema_update(schema, i);
+        if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+        rc = sqlite3_prepare_v2(b->db, sql, -1, &b->update[i], NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto cleanup;
+    }
+    
+    return SQLITE_OK;
+    
+cleanup:
+    if (b->db) fprintf(stderr, "bench error: %s\n", sqlite3_errmsg(b->db));
+    bench_db_free(b);
+    return rc;
+}
+
+// MARK: - Report -
+
+static void bench_report (bench_config *config, bench_schema schema, const char *name, bench_samples *s, int64_t rows, int64_t bytes) {
+    qsort(s->samples, s->count, sizeof(double), bench_compare_double);
+    
+    double total_us = 0;
+    for (int i=0; i<s->count; ++i) total_us += s->samples[i];
+    double ops_sec = (total_us > 0) ? (double)s->count * 1000000.0 / total_us : 0;
+    double rows_sec = (total_us > 0) ? (double)rows * 1000000.0 / total_us : 0;
+    double p50 = bench_percentile(s, 0.50);
+    double p90 = bench_percentile(s, 0.90);
+    double p99 = bench_percentile(s, 0.99);
+    double max = (s->count) ? s->samples[s->count-1] : 0;
+    
+    if (config->json) {
+        printf("%s    {\"schema\": \"%s\", \"bench\": \"%s\", \"ops\": %d, \"rows\": %lld, \"bytes\": %lld, \"total_us\": %.3f, \"ops_per_sec\": %.3f, \"rows_per_sec\": %.3f, "
+               "\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}",
+               (bench_first_result) ? "" : ",\n", bench_schema_names[schema], name, s->count, (long long)rows, (long long)bytes, total_us, ops_sec, rows_sec, p50, p90, p99, max);
+    } else {
+        printf("%-12s %-16s %8d %12.0f %12.0f %10.2f %10.2f %10.2f %12.2f\n", bench_schema_names[schema], name, s->count, ops_sec, rows_sec, p50, p90, p99, max);
+    }
+    bench_first_result = false;
+    fflush(stdout);
+}
+
+// MARK: - Benchmarks -
+
+static int bench_writes (bench_config *config, bench_schema schema, bool synced, bench_samples *s, void *blob) {
+    bench_db b;
+    int rc = bench_db_create(config, schema, synced, true, &b);
+    if (rc != SQLITE_OK) return rc;
+    
+    const char *suffix = (synced) ? "synced" : "plain";
+    char name[32];
+    
+    // inserts
+    bench_samples_reset(s);
+    rc = bench_exec(b.db, "BEGIN;");
+    if (rc != SQLITE_OK) goto cleanup;
+    for (int i=0; i<config->rows; ++i) {
+        sqlite3_stmt *vm = b.insert[i % b.ntables];
+        bench_bind_row(config, vm, schema, i, blob);
+    
+        uint64_t start = bench_now_ns();
+        rc = sqlite3_step(vm);
+        uint64_t end = bench_now_ns();
+        sqlite3_reset(vm);
+        if (rc != SQLITE_DONE) goto cleanup;
+        if (!bench_samples_add(s, (double)(end - start) / 1000.0)) {rc = SQLITE_NOMEM; goto cleanup;}
+    }
+    rc = bench_exec(b.db, "COMMIT;");
+    if (rc != SQLITE_OK) goto cleanup;
+    snprintf(name, sizeof(name), "insert_%s", suffix);
+    bench_report(config, schema, name, s, config->rows, -1);
+    
+    // updates
+    bench_samples_reset(s);
+    rc = bench_exec(b.db, "BEGIN;");
+    if (rc != SQLITE_OK) goto cleanup;
+    for (int i=0; i<config->rows; ++i) {
+        sqlite3_stmt *vm = b.update[i % b.ntables];
+        bench_bind_update(vm, schema, i);
+    
+        uint64_t start = bench_now_ns();
+        rc = sqlite3_step(vm);
+        uint64_t end = bench_now_ns();
+        sqlite3_reset(vm);
+        if (rc != SQLITE_DONE) goto cleanup;
+        if (!bench_samples_add(s, (double)(end - start) / 1000.0)) {rc = SQLITE_NOMEM; goto cleanup;}
+    }
+    rc = bench_exec(b.db, "COMMIT;");
+    if (rc != SQLITE_OK) goto cleanup;
+    snprintf(name, sizeof(name), "update_%s", suffix);
+    bench_report(config, schema, name, s, config->rows, -1);
+    
+    rc = SQLITE_OK;
+    
+cleanup:
+    if (rc != SQLITE_OK) fprintf(stderr, "bench_writes error: %s\n", sqlite3_errmsg(b.db));
+    bench_db_free(&b);
+    return rc;
+}
+
+static int bench_fill (bench_config *config, bench_schema schema, bench_db *b, void *blob) {
+    int rc = bench_exec(b->db, "BEGIN;");
+    if (rc != SQLITE_OK) return rc;
+    
+    for (int i=0; i<config->rows; ++i) {
+        sqlite3_stmt *vm = b->insert[i % b->ntables];
+        bench_bind_row(config, vm, schema, i, blob);
+        rc = sqlite3_step(vm);
+        sqlite3_reset(vm);
+        if (rc != SQLITE_DONE) return rc;
+    }
+    
+    return bench_exec(b->db, "COMMIT;");
+}
+
+static int bench_sync (bench_config *config, bench_schema schema, bench_samples *s, void *blob) {
+    bench_db b, target;
+    memset(&target, 0, sizeof(bench_db));
+    sqlite3_stmt *vm = NULL;
+    void *payload = NULL;
+    int payload_size = 0;
+    
+    int rc = bench_db_create(config, schema, true, true, &b);
+    if (rc != SQLITE_OK) return rc;
+    rc = bench_fill(config, schema, &b, blob);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    // changes scan
+    int64_t nchanges = 0;
+    bench_samples_reset(s);
+    rc = sqlite3_prepare_v2(b.db, "SELECT tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq FROM cloudsync_changes WHERE db_version > 0;", -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    for (int i=0; i<config->iterations; ++i) {
+        nchanges = 0;
+        uint64_t start = bench_now_ns();
+        while ((rc = sqlite3_step(vm)) == SQLITE_ROW) ++nchanges;
+        uint64_t end = bench_now_ns();
+        sqlite3_reset(vm);
+        if (rc != SQLITE_DONE) goto cleanup;
+        if (!bench_samples_add(s, (double)(end - start) / 1000.0)) {rc = SQLITE_NOMEM; goto cleanup;}
+    }
+    sqlite3_finalize(vm);
+    vm = NULL;
+    bench_report(config, schema, "changes_scan", s, nchanges * config->iterations, -1);
+    
+    // payload encode
+    bench_samples_reset(s);
+    rc = sqlite3_prepare_v2(b.db, "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;", -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    for (int i=0; i<config->iterations; ++i) {
+        uint64_t start = bench_now_ns();
+        rc = sqlite3_step(vm);
+        uint64_t end = bench_now_ns();
+        if (rc != SQLITE_ROW) goto cleanup;
+    
+        if (!payload) {
+            payload_size = sqlite3_column_bytes(vm, 0);
+            payload = malloc((size_t)payload_size);
+            if (!payload) {rc = SQLITE_NOMEM; goto cleanup;}
+            memcpy(payload, sqlite3_column_blob(vm, 0), (size_t)payload_size);
+        }
+        sqlite3_reset(vm);
+        if (!bench_samples_add(s, (double)(end - start) / 1000.0)) {rc = SQLITE_NOMEM; goto cleanup;}
+    }
+    sqlite3_finalize(vm);
+    vm = NULL;
+    bench_report(config, schema, "payload_encode", s, nchanges * config->iterations, (int64_t)payload_size * config->iterations);
+    
+    // payload apply (into a new database each time)
+    bench_samples_reset(s);
+    for (int i=0; i<config->iterations; ++i) {
+        rc = bench_db_create(config, schema, true, false, &target);
+        if (rc != SQLITE_OK) goto cleanup;
+        rc = sqlite3_prepare_v2(target.db, "SELECT cloudsync_payload_decode(?);", -1, &vm, NULL);
+        if (rc != SQLITE_OK) goto cleanup;
+        sqlite3_bind_blob(vm, 1, payload, payload_size, SQLITE_STATIC);
+    
+        uint64_t start = bench_now_ns();
+        rc = sqlite3_step(vm);
+        uint64_t end = bench_now_ns();
+        if (rc != SQLITE_ROW) goto cleanup;
+    
+        sqlite3_finalize(vm);
+        vm = NULL;
+        bench_db_free(&target);
+        if (!bench_samples_add(s, (double)(end - start) / 1000.0)) {rc = SQLITE_NOMEM; goto cleanup;}
+    }
+    bench_report(config, schema, "payload_apply", s, nchanges * config->iterations, (int64_t)payload_size * config->iterations);
+    
+    rc = SQLITE_OK;
+    
+cleanup:
+    if (rc != SQLITE_OK) fprintf(stderr, "bench_sync error: %s\n", sqlite3_errmsg((target.db) ? target.db : b.db));
+    if (vm) sqlite3_finalize(vm);
+    if (payload) free(payload);
+    bench_db_free(&target);
+    bench_db_free(&b);
+    return rc;
+}
+
+static int bench_backfill (bench_config *config, bench_schema schema, bench_samples *s, void *blob) {
+    bench_samples_reset(s);
+    
+    for (int i=0; i<config->iterations; ++i) {
+        bench_db b;
+        int rc = bench_db_create(config, schema, false, true, &b);
+        if (rc != SQLITE_OK) return rc;
+        rc = bench_fill(config, schema, &b, blob);
+    
+        uint64_t start = bench_now_ns();
+        for (int t=0; t<b.ntables && rc == SQLITE_OK; ++t) {
+            char sql[64];
+            snprintf(sql, sizeof(sql), "SELECT cloudsync_init('t%d');", t);
+            rc = bench_exec(b.db, sql);
+        }
+        uint64_t end = bench_now_ns();
+    
+        bench_db_free(&b);
+        if (rc != SQLITE_OK) return rc;
+        if (!bench_samples_add(s, (double)(end - start) / 1000.0)) return SQLITE_NOMEM;
+    }
+    
+    bench_report(config, schema, "init_backfill", s, (int64_t)config->rows * config->iterations, -1);
+    return SQLITE_OK;
+}
+
+// MARK: - Main -
+
+static void bench_usage (const char *name) {
+    printf("Usage: %s [options]\n", name);
+    printf("  --rows N          rows written per schema (default %d)\n", BENCH_DEFAULT_ROWS);
+    printf("  --iterations N    iterations of the scan, encode, apply and backfill benchmarks (default %d)\n", BENCH_DEFAULT_ITERATIONS);
+    printf("  --tables N        tables of the many_tables schema (default %d)\n", BENCH_DEFAULT_TABLES);
+    printf("  --columns N       columns of the wide schema (default %d)\n", BENCH_DEFAULT_COLUMNS);
+    printf("  --blob-size N     BLOB size in bytes of the blob schema (default %d)\n", BENCH_DEFAULT_BLOB_SIZE);
+    printf("  --schema NAME     run only one schema (narrow, wide, blob, composite, many_tables)\n");
+    printf("  --json            print the results as JSON\n");
+}
+
+static bool bench_parse_int (int argc, const char *argv[], int *i, int *value) {
+    if (*i + 1 >= argc) return false;
+    int v = atoi(argv[++(*i)]);
+    if (v <= 0) return false;
+    *value = v;
+    return true;
+}
+
+int main (int argc, const char *argv[]) {
+    bench_config config = {
+        .rows = BENCH_DEFAULT_ROWS,
+        .iterations = BENCH_DEFAULT_ITERATIONS,
+        .tables = BENCH_DEFAULT_TABLES,
+        .columns = BENCH_DEFAULT_COLUMNS,
+        .blob_size = BENCH_DEFAULT_BLOB_SIZE,
+        .json = false,
+        .schema = NULL
+    };
+    
+    for (int i=1; i<argc; ++i) {
+        bool ok = true;
+        if (strcmp(argv[i], "--rows") == 0) ok = bench_parse_int(argc, argv, &i, &config.rows);
+        else if (strcmp(argv[i], "--iterations") == 0) ok = bench_parse_int(argc, argv, &i, &config.iterations);
+        else if (strcmp(argv[i], "--tables") == 0) ok = bench_parse_int(argc, argv, &i, &config.tables);
+        else if (strcmp(argv[i], "--columns") == 0) ok = bench_parse_int(argc, argv, &i, &config.columns);
+        else if (strcmp(argv[i], "--blob-size") == 0) ok = bench_parse_int(argc, argv, &i, &config.blob_size);
+        else if (strcmp(argv[i], "--schema") == 0 && i + 1 < argc) config.schema = argv[++i];
+        else if (strcmp(argv[i], "--json") == 0) config.json = true;
+        else ok = false;
+    
+        if (!ok) {
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (config.schema) {
+        int i = 0;
+        while (i < BENCH_SCHEMA_COUNT && strcmp(config.schema, bench_schema_names[i]) != 0) ++i;
+        if (i == BENCH_SCHEMA_COUNT) {
+            fprintf(stderr, "Unknown schema %s\n", config.schema);
+            return 1;
+        }
+    }
+    
+    unsigned char *blob = (unsigned char *)malloc((size_t)config.blob_size);
+    if (!blob) return 1;
+    for (int i=0; i<config.blob_size; ++i) blob[i] = (unsigned char)(bench_random() & 0xFF);
+    
+    if (config.json) {
+        printf("{\n  \"cloudsync\": \"%s\",\n  \"sqlite\": \"%s\",\n", CLOUDSYNC_VERSION, sqlite3_libversion());
+        printf("  \"config\": {\"rows\": %d, \"iterations\": %d, \"tables\": %d, \"columns\": %d, \"blob_size\": %d},\n", config.rows, config.iterations, config.tables, config.columns, config.blob_size);
+        printf("  \"results\": [\n");
+    } else {
+        printf("CloudSync %s benchmark (SQLite %s, %d rows, %d iterations)\n", CLOUDSYNC_VERSION, sqlite3_libversion(), config.rows, config.iterations);
+        printf("%-12s %-16s %8s %12s %12s %10s %10s %10s %12s\n", "schema", "bench", "ops", "ops/sec", "rows/sec", "p50 us", "p90 us", "p99 us", "max us");
+    }
+    
+    bench_samples samples = {NULL, 0, 0};
+    int rc = SQLITE_OK;
+    for (int i=0; i<BENCH_SCHEMA_COUNT && rc == SQLITE_OK; ++i) {
+        if (config.schema && strcmp(config.schema, bench_schema_names[i]) != 0) continue;
+    
+        rc = bench_writes(&config, (bench_schema)i, false, &samples, blob);
+        if (rc == SQLITE_OK) rc = bench_writes(&config, (bench_schema)i, true, &samples, blob);
+        if (rc == SQLITE_OK) rc = bench_sync(&config, (bench_schema)i, &samples, blob);
+        if (rc == SQLITE_OK) rc = bench_backfill(&config, (bench_schema)i, &samples, blob);
+    }
+    
+    if (config.json) printf("\n  ]\n}\n");
+    free(samples.samples);
+    free(blob);
+    return (rc == SQLITE_OK) ? 0 : 1;
+}
@@ -0,0 +1,297 @@
+//
+//  netbench.c
+//  cloudsync
+//
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "sqlite3.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/*
+
+ End-to-end benchmark of the network layer: the extension (built with network support) is loaded in a sender
+ and a receiver database, both initialized with the same connection string. Each round inserts --rows rows in
+ the sender, uploads them with cloudsync_network_send_changes and downloads them in the receiver with
+ cloudsync_network_check_changes, so the measured latencies include payload encoding, the HTTP requests
+ and the apply of the downloaded payload.
+
+ The default connection string points to the local server started by make bench-network
+ (--latency and --bandwidth of the server simulate slower networks).
+
+ */
+
+#define NETBENCH_DEFAULT_URL        "http://127.0.0.1:8091/bench.sqlite?apikey=bench"
+#define NETBENCH_DEFAULT_EXTENSION  "./dist/cloudsync"
+#define NETBENCH_DEFAULT_ROUNDS     20
+#define NETBENCH_DEFAULT_ROWS       1000
+
+typedef struct {
+    const char  *url;
+    const char  *extension;
+    int         rounds;
+    int         rows;
+    bool        json;
+} netbench_config;
+
+typedef struct {
+    double      *samples;           // latencies in us
+    int         count;
+} netbench_samples;
+
+// MARK: - Utils -
+
+static uint64_t netbench_now_ns (void) {
+    #ifdef _WIN32
+    static LARGE_INTEGER frequency = {0};
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((counter.QuadPart / frequency.QuadPart) * 1000000000ULL + ((counter.QuadPart % frequency.QuadPart) * 1000000000ULL) / frequency.QuadPart);
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    #endif
+}
+
+static int netbench_compare_double (const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double netbench_percentile (netbench_samples *s, double p) {
+    // samples must be sorted, nearest-rank percentile
+    if (s->count == 0) return 0;
+    int index = (int)(p * s->count + 0.5) - 1;
+    if (index < 0) index = 0;
+    if (index >= s->count) index = s->count - 1;
+    return s->samples[index];
+}
+
+static int netbench_exec (sqlite3 *db, const char *sql) {
+    char *errmsg = NULL;
+    int rc = sqlite3_exec(db, sql, NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "netbench error: %s (%s)\n", (errmsg) ? errmsg : sqlite3_errmsg(db), sql);
+        sqlite3_free(errmsg);
+    }
+    return rc;
+}
+
+static int64_t netbench_int (sqlite3 *db, const char *sql, int *rc) {
+    // runs a single value query, sets rc on error
+    sqlite3_stmt *vm = NULL;
+    int64_t value = -1;
+    *rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+    if (*rc == SQLITE_OK) {
+        *rc = sqlite3_step(vm);
+        if (*rc == SQLITE_ROW) {
+            value = sqlite3_column_int64(vm, 0);
+            *rc = SQLITE_OK;
+        }
+    }
+    if (*rc != SQLITE_OK) fprintf(stderr, "netbench error: %s (%s)\n", sqlite3_errmsg(db), sql);
+    sqlite3_finalize(vm);
+    return value;
+}
+
+static int netbench_open (netbench_config *config, sqlite3 **db) {
+    int rc = sqlite3_open(":memory:", db);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_enable_load_extension(*db, 1);
+    if (rc != SQLITE_OK) return rc;
+    
+    char *sql = sqlite3_mprintf("SELECT load_extension('%q');", config->extension);
+    rc = netbench_exec(*db, sql);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = netbench_exec(*db, "CREATE TABLE items (id TEXT PRIMARY KEY NOT NULL, name TEXT, qty INTEGER, note TEXT);"
+                            "SELECT cloudsync_init('items');");
+    if (rc != SQLITE_OK) return rc;
+    
+    sql = sqlite3_mprintf("SELECT cloudsync_network_init('%q');", config->url);
+    rc = netbench_exec(*db, sql);
+    sqlite3_free(sql);
+    return rc;
+}
+
+static void netbench_close (sqlite3 *db) {
+    if (!db) return;
+    sqlite3_exec(db, "SELECT cloudsync_network_cleanup(); SELECT cloudsync_terminate();", NULL, NULL, NULL);
+    sqlite3_close(db);
+}
+
+static int netbench_insert (sqlite3 *db, uint32_t run, int round, int rows) {
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, "INSERT INTO items (id, name, qty, note) VALUES (?, ?, ?, ?);", -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = netbench_exec(db, "BEGIN;");
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    char id[64], name[64];
+    for (int i=0; i<rows; ++i) {
+        snprintf(id, sizeof(id), "%08x-%06d-%08d", run, round, i);
+        snprintf(name, sizeof(name), "item %d", i);
+        sqlite3_bind_text(vm, 1, id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(vm, 2, name, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(vm, 3, i);
+        sqlite3_bind_text(vm, 4, "the quick brown fox jumps over the lazy dog", -1, SQLITE_STATIC);
+        rc = sqlite3_step(vm);
+        if (rc != SQLITE_DONE) goto cleanup;
+        sqlite3_reset(vm);
+    }
+    rc = netbench_exec(db, "COMMIT;");
+
+cleanup:
+    if (rc != SQLITE_OK && rc != SQLITE_DONE) {
+        fprintf(stderr, "netbench error: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    } else {
+        rc = SQLITE_OK;
+    }
+    sqlite3_finalize(vm);
+    return rc;
+}
+
+// MARK: - Reporting -
+
+static void netbench_report (netbench_config *config, const char *name, netbench_samples *s, int64_t rows, bool last) {
+    qsort(s->samples, s->count, sizeof(double), netbench_compare_double);
+    
+    double total = 0;
+    for (int i=0; i<s->count; ++i) total += s->samples[i];
+    double rows_sec = (total > 0) ? (double)rows * 1000000.0 / total : 0;
+    double p50 = netbench_percentile(s, 0.50);
+    double p90 = netbench_percentile(s, 0.90);
+    double p99 = netbench_percentile(s, 0.99);
+    double max = (s->count) ? s->samples[s->count - 1] : 0;
+    
+    if (config->json) {
+        printf("    {\"bench\": \"%s\", \"ops\": %d, \"rows_sec\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}%s\n",
+               name, s->count, rows_sec, p50, p90, p99, max, (last) ? "" : ",");
+    } else {
+        printf("%-16s %8d %12.1f %12.1f %12.1f %12.1f %12.1f\n", name, s->count, rows_sec, p50, p90, p99, max);
+    }
+}
+
+static void netbench_usage (const char *name) {
+    printf("Usage: %s [options]\n", name);
+    printf("  --url URL         connection string (default %s)\n", NETBENCH_DEFAULT_URL);
+    printf("  --extension PATH  extension to load (default %s)\n", NETBENCH_DEFAULT_EXTENSION);
+    printf("  --rounds N        send/check rounds (default %d)\n", NETBENCH_DEFAULT_ROUNDS);
+    printf("  --rows N          rows inserted in each round (default %d)\n", NETBENCH_DEFAULT_ROWS);
+    printf("  --json            print the results as JSON\n");
+}
+
+// MARK: - Main -
+
+int main (int argc, const char *argv[]) {
+    netbench_config config = {
+        .url = NETBENCH_DEFAULT_URL,
+        .extension = NETBENCH_DEFAULT_EXTENSION,
+        .rounds = NETBENCH_DEFAULT_ROUNDS,
+        .rows = NETBENCH_DEFAULT_ROWS,
+        .json = false
+    };
+    
+    for (int i=1; i<argc; ++i) {
+        bool ok = true;
+        bool has_value = (i + 1 < argc);
+        if (strcmp(argv[i], "--url") == 0 && has_value) config.url = argv[++i];
+        else if (strcmp(argv[i], "--extension") == 0 && has_value) config.extension = argv[++i];
+        else if (strcmp(argv[i], "--rounds") == 0 && has_value) ok = ((config.rounds = atoi(argv[++i])) > 0);
+        else if (strcmp(argv[i], "--rows") == 0 && has_value) ok = ((config.rows = atoi(argv[++i])) > 0);
+        else if (strcmp(argv[i], "--json") == 0) config.json = true;
+        else ok = false;
+    
+        if (!ok) {
+            netbench_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    sqlite3 *sender = NULL;
+    sqlite3 *receiver = NULL;
+    netbench_samples send_samples = {NULL, 0};
+    netbench_samples check_samples = {NULL, 0};
+    int64_t received = 0;
+    
+    int rc = netbench_open(&config, &sender);
+    if (rc == SQLITE_OK) rc = netbench_open(&config, &receiver);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    send_samples.samples = (double *)malloc(sizeof(double) * config.rounds);
+    check_samples.samples = (double *)malloc(sizeof(double) * config.rounds);
+    if (!send_samples.samples || !check_samples.samples) {rc = SQLITE_NOMEM; goto cleanup;}
+    
+    // catch up with the payloads already stored on the server (previous runs with the same database)
+    int64_t nbaseline = 0;
+    while (netbench_int(receiver, "SELECT cloudsync_network_check_changes();", &rc) > 0 && rc == SQLITE_OK);
+    if (rc == SQLITE_OK) nbaseline = netbench_int(receiver, "SELECT count(*) FROM items;", &rc);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    // the ids must differ from the rows uploaded by previous runs, otherwise they would not change the receiver
+    uint32_t run = 0;
+    sqlite3_randomness(sizeof(run), &run);
+    
+    for (int round=0; round<config.rounds; ++round) {
+        rc = netbench_insert(sender, run, round, config.rows);
+        if (rc != SQLITE_OK) goto cleanup;
+    
+        uint64_t start = netbench_now_ns();
+        rc = netbench_exec(sender, "SELECT cloudsync_network_send_changes();");
+        if (rc != SQLITE_OK) goto cleanup;
+        send_samples.samples[send_samples.count++] = (double)(netbench_now_ns() - start) / 1000.0;
+    
+        start = netbench_now_ns();
+        int64_t nrows = netbench_int(receiver, "SELECT cloudsync_network_check_changes();", &rc);
+        if (rc != SQLITE_OK) goto cleanup;
+        check_samples.samples[check_samples.count++] = (double)(netbench_now_ns() - start) / 1000.0;
+        if (nrows > 0) received += nrows;
+    }
+    
+    // the receiver must contain all the rows of the sender
+    int64_t nsender = netbench_int(sender, "SELECT count(*) FROM items;", &rc);
+    if (rc != SQLITE_OK) goto cleanup;
+    int64_t nreceiver = netbench_int(receiver, "SELECT count(*) FROM items;", &rc);
+    if (rc != SQLITE_OK) goto cleanup;
+    if (nreceiver - nbaseline != nsender) {
+        fprintf(stderr, "netbench error: the receiver got %lld rows instead of %lld\n", (long long)(nreceiver - nbaseline), (long long)nsender);
+        rc = SQLITE_ERROR;
+        goto cleanup;
+    }
+    
+    int64_t rows = (int64_t)config.rounds * config.rows;
+    if (config.json) {
+        printf("{\n  \"sqlite\": \"%s\",\n  \"url\": \"%s\",\n", sqlite3_libversion(), config.url);
+        printf("  \"config\": {\"rounds\": %d, \"rows\": %d},\n", config.rounds, config.rows);
+        printf("  \"changes_received\": %lld,\n  \"results\": [\n", (long long)received);
+    } else {
+        printf("CloudSync network benchmark (%s, %d rounds of %d rows, %lld changes received)\n", config.url, config.rounds, config.rows, (long long)received);
+        printf("%-16s %8s %12s %12s %12s %12s %12s\n", "bench", "ops", "rows/sec", "p50 us", "p90 us", "p99 us", "max us");
+    }
+    netbench_report(&config, "send_changes", &send_samples, rows, false);
+    netbench_report(&config, "check_changes", &check_samples, rows, true);
+    if (config.json) printf("  ]\n}\n");
+
+cleanup:
+    netbench_close(sender);
+    netbench_close(receiver);
+    free(send_samples.samples);
+    free(check_samples.samples);
+    return (rc == SQLITE_OK) ? 0 : 1;
+}
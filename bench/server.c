@@ -0,0 +1,553 @@
+//
+//  server.c
+//  cloudsync
+//
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+
+ Minimal HTTP/1.1 server that implements the endpoints used by the network layer, so that the real curl
+ code path (network_compute_endpoints, upload URL, PUT, notify, check and download) can be exercised and
+ measured offline. Point a client to it with:
+
+ SELECT cloudsync_network_init('http://127.0.0.1:8091/bench.sqlite?apikey=any');
+
+ Endpoints (relative to /v1/cloudsync/{database}/{site_id}):
+
+ GET  /upload                           returns the URL where the payload must be PUT
+ PUT  /blob/{token}                     stores the payload in a temporary file
+ POST /upload {"url": "..."}            appends the stored payload to the log of the database
+ POST /{db_version}/{seq}/check         returns the download URL of the next payload uploaded by another site
+                                        (an empty response if there is nothing new)
+ GET  /download/{n}                     returns the payload n and moves the cursor of the site past it
+
+ The log of each database is stored on disk ({dir}/{database}/{n}-{site_id}.payload) and reloaded at startup,
+ the cursors of the sites are kept in memory (after a restart every site downloads the log again, payloads are
+ idempotent). Unlike the hosted service, payloads are not merged: each check returns a single payload.
+
+ Connections are served one at a time, --latency delays each response and --bandwidth throttles the bodies
+ in both directions. Authentication headers are accepted and ignored.
+
+ */
+
+#ifdef _WIN32
+
+int main (void) {
+    fprintf(stderr, "The local sync server is not available on Windows.\n");
+    return 1;
+}
+
+#else
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SERVER_DEFAULT_PORT         8091
+#define SERVER_DEFAULT_DIR          "cloudsync-server"
+#define SERVER_PREFIX               "/v1/cloudsync/"
+#define SERVER_MAX_HEADER           65536
+#define SERVER_MAX_NAME             128
+#define SERVER_CHUNK_SIZE           16384
+
+typedef struct {
+    int64_t     index;
+    char        site_id[SERVER_MAX_NAME];
+} server_entry;
+
+typedef struct {
+    char        site_id[SERVER_MAX_NAME];
+    int64_t     cursor;
+} server_cursor;
+
+typedef struct {
+    char        name[SERVER_MAX_NAME];
+    server_entry *entries;
+    int64_t     nentries;
+    int64_t     aentries;
+    server_cursor *cursors;
+    int         ncursors;
+    int         acursors;
+} server_database;
+
+typedef struct {
+    int         port;
+    const char  *host;
+    const char  *dir;
+    int         latency;            // ms added to each response
+    int64_t     bandwidth;          // bytes per second, 0 means unlimited
+    bool        verbose;
+    
+    server_database *databases;
+    int         ndatabases;
+    int         adatabases;
+    uint64_t    tokens;
+} server_context;
+
+typedef struct {
+    char        method[16];
+    char        path[1024];
+    char        *body;
+    size_t      blen;
+} server_request;
+
+// MARK: - Utils -
+
+static uint64_t server_now_ns (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void server_sleep_ns (uint64_t ns) {
+    struct timespec ts = {.tv_sec = (time_t)(ns / 1000000000ULL), .tv_nsec = (long)(ns % 1000000000ULL)};
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+static void server_throttle (server_context *server, uint64_t start, size_t bytes) {
+    // sleep until the transferred bytes fit into the configured bandwidth
+    if (server->bandwidth <= 0) return;
+    uint64_t expected = (uint64_t)((double)bytes * 1000000000.0 / (double)server->bandwidth);
+    uint64_t elapsed = server_now_ns() - start;
+    if (expected > elapsed) server_sleep_ns(expected - elapsed);
+}
+
+static bool server_valid_name (const char *name) {
+    // database names and site ids become file names
+    if (!name[0] || strlen(name) >= SERVER_MAX_NAME || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return false;
+    for (const char *p = name; *p; ++p) {
+        char c = *p;
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '_' || c == '-')) return false;
+    }
+    return true;
+}
+
+static int server_mkdir (const char *path) {
+    if (mkdir(path, 0755) == 0 || errno == EEXIST) return 0;
+    return -1;
+}
+
+static bool server_write_all (int fd, const void *buffer, size_t len) {
+    const char *p = (const char *)buffer;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// MARK: - Log -
+
+static int server_compare_entry (const void *a, const void *b) {
+    int64_t x = ((const server_entry *)a)->index;
+    int64_t y = ((const server_entry *)b)->index;
+    return (x > y) - (x < y);
+}
+
+static bool server_database_append (server_database *database, int64_t index, const char *site_id) {
+    if (database->nentries == database->aentries) {
+        int64_t alloc = (database->aentries) ? database->aentries * 2 : 256;
+        server_entry *entries = (server_entry *)realloc(database->entries, sizeof(server_entry) * (size_t)alloc);
+        if (!entries) return false;
+        database->entries = entries;
+        database->aentries = alloc;
+    }
+    
+    server_entry *entry = &database->entries[database->nentries++];
+    entry->index = index;
+    snprintf(entry->site_id, sizeof(entry->site_id), "%s", site_id);
+    return true;
+}
+
+static server_database *server_database_get (server_context *server, const char *name) {
+    for (int i=0; i<server->ndatabases; ++i) {
+        if (strcmp(server->databases[i].name, name) == 0) return &server->databases[i];
+    }
+    
+    if (server->ndatabases == server->adatabases) {
+        int alloc = (server->adatabases) ? server->adatabases * 2 : 8;
+        server_database *databases = (server_database *)realloc(server->databases, sizeof(server_database) * (size_t)alloc);
+        if (!databases) return NULL;
+        server->databases = databases;
+        server->adatabases = alloc;
+    }
+    
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", server->dir, name);
+    if (server_mkdir(path) != 0) return NULL;
+    
+    server_database *database = &server->databases[server->ndatabases++];
+    memset(database, 0, sizeof(server_database));
+    snprintf(database->name, sizeof(database->name), "%s", name);
+    
+    // reload the log written by a previous run
+    DIR *dir = opendir(path);
+    if (dir) {
+        struct dirent *item;
+        while ((item = readdir(dir)) != NULL) {
+            long long index = 0;
+            char site_id[SERVER_MAX_NAME];
+            const char *ext = strstr(item->d_name, ".payload");
+            if (!ext || ext[8] != 0) continue;
+            if (sscanf(item->d_name, "%lld-%127[^.]", &index, site_id) != 2 || index <= 0) continue;
+            if (!server_database_append(database, index, site_id)) break;
+        }
+        closedir(dir);
+        qsort(database->entries, (size_t)database->nentries, sizeof(server_entry), server_compare_entry);
+    }
+    
+    return database;
+}
+
+static server_cursor *server_cursor_get (server_database *database, const char *site_id) {
+    for (int i=0; i<database->ncursors; ++i) {
+        if (strcmp(database->cursors[i].site_id, site_id) == 0) return &database->cursors[i];
+    }
+    
+    if (database->ncursors == database->acursors) {
+        int alloc = (database->acursors) ? database->acursors * 2 : 16;
+        server_cursor *cursors = (server_cursor *)realloc(database->cursors, sizeof(server_cursor) * (size_t)alloc);
+        if (!cursors) return NULL;
+        database->cursors = cursors;
+        database->acursors = alloc;
+    }
+    
+    server_cursor *cursor = &database->cursors[database->ncursors++];
+    snprintf(cursor->site_id, sizeof(cursor->site_id), "%s", site_id);
+    cursor->cursor = 0;
+    return cursor;
+}
+
+static server_entry *server_entry_find (server_database *database, int64_t index) {
+    for (int64_t i=0; i<database->nentries; ++i) {
+        if (database->entries[i].index == index) return &database->entries[i];
+    }
+    return NULL;
+}
+
+// MARK: - HTTP -
+
+static bool server_respond (server_context *server, int fd, int status, const char *content_type, const void *body, size_t blen) {
+    if (server->latency > 0) server_sleep_ns((uint64_t)server->latency * 1000000ULL);
+    
+    const char *reason = (status == 200) ? "OK" : (status == 400) ? "Bad Request" : (status == 404) ? "Not Found" : (status == 411) ? "Length Required" : "Internal Server Error";
+    char header[512];
+    int hlen = snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status, reason, content_type, blen);
+    if (!server_write_all(fd, header, (size_t)hlen)) return false;
+    
+    uint64_t start = server_now_ns();
+    size_t sent = 0;
+    while (sent < blen) {
+        size_t chunk = (blen - sent < SERVER_CHUNK_SIZE) ? blen - sent : SERVER_CHUNK_SIZE;
+        if (!server_write_all(fd, (const char *)body + sent, chunk)) return false;
+        sent += chunk;
+        server_throttle(server, start, sent);
+    }
+    return true;
+}
+
+static bool server_respond_text (server_context *server, int fd, int status, const char *text) {
+    return server_respond(server, fd, status, "text/plain", text, strlen(text));
+}
+
+static int server_read_request (server_context *server, int fd, server_request *request) {
+    // returns the HTTP status to reply with in case of error, 0 on success
+    char *buffer = (char *)malloc(SERVER_MAX_HEADER + 1);
+    if (!buffer) return 500;
+    
+    size_t used = 0;
+    char *end = NULL;
+    while (!end) {
+        if (used == SERVER_MAX_HEADER) {free(buffer); return 400;}
+        ssize_t n = recv(fd, buffer + used, SERVER_MAX_HEADER - used, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {free(buffer); return 400;}
+        used += (size_t)n;
+        buffer[used] = 0;
+        end = strstr(buffer, "\r\n\r\n");
+    }
+    
+    if (sscanf(buffer, "%15s %1023s", request->method, request->path) != 2) {free(buffer); return 400;}
+    
+    // headers
+    size_t content_length = 0;
+    bool has_length = false, expect_continue = false, chunked = false;
+    for (char *line = strstr(buffer, "\r\n") + 2; line < end; line = strstr(line, "\r\n") + 2) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = (size_t)strtoull(line + 15, NULL, 10);
+            has_length = true;
+        } else if (strncasecmp(line, "Expect:", 7) == 0 && strstr(line, "100-continue")) {
+            expect_continue = true;
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked")) {
+            chunked = true;
+        }
+    }
+    if (chunked || (!has_length && (strcmp(request->method, "PUT") == 0))) {free(buffer); return 411;}
+    
+    // curl waits for the interim response before sending large bodies
+    if (expect_continue) {
+        const char *interim = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (!server_write_all(fd, interim, strlen(interim))) {free(buffer); return 400;}
+    }
+    
+    // body (part of it could have been read together with the headers)
+    request->body = (char *)malloc(content_length + 1);
+    if (!request->body) {free(buffer); return 500;}
+    size_t header_size = (size_t)(end - buffer) + 4;
+    size_t already = used - header_size;
+    if (already > content_length) already = content_length;
+    memcpy(request->body, buffer + header_size, already);
+    free(buffer);
+    
+    uint64_t start = server_now_ns();
+    size_t received = already;
+    while (received < content_length) {
+        size_t chunk = (content_length - received < SERVER_CHUNK_SIZE) ? content_length - received : SERVER_CHUNK_SIZE;
+        ssize_t n = recv(fd, request->body + received, chunk, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 400;
+        received += (size_t)n;
+        server_throttle(server, start, received - already);
+    }
+    request->body[content_length] = 0;
+    request->blen = content_length;
+    return 0;
+}
+
+// MARK: - Endpoints -
+
+static bool server_upload_url (server_context *server, int fd, const char *database, const char *site_id) {
+    char url[1024];
+    snprintf(url, sizeof(url), "http://%s:%d%s%s/%s/blob/%llx%llx", server->host, server->port, SERVER_PREFIX, database, site_id,
+             (unsigned long long)server_now_ns(), (unsigned long long)++server->tokens);
+    return server_respond_text(server, fd, 200, url);
+}
+
+static bool server_upload_blob (server_context *server, int fd, const char *database, const char *token, server_request *request) {
+    if (!server_valid_name(token) || !server_database_get(server, database)) return server_respond_text(server, fd, 400, "Invalid upload URL.");
+    
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s/upload-%s.tmp", server->dir, database, token);
+    FILE *f = fopen(path, "wb");
+    if (!f) return server_respond_text(server, fd, 500, "Unable to store the payload.");
+    size_t written = fwrite(request->body, 1, request->blen, f);
+    fclose(f);
+    if (written != request->blen) return server_respond_text(server, fd, 500, "Unable to store the payload.");
+    
+    return server_respond_text(server, fd, 200, "");
+}
+
+static bool server_upload_notify (server_context *server, int fd, const char *database, const char *site_id, server_request *request) {
+    // the body is {"url":"<upload URL>"}, the token is the last component of the URL
+    const char *token = (request->body) ? strstr(request->body, "/blob/") : NULL;
+    if (!token) return server_respond_text(server, fd, 400, "Missing upload URL.");
+    token += 6;
+    
+    char name[SERVER_MAX_NAME];
+    size_t len = strcspn(token, "\"");
+    if (len == 0 || len >= sizeof(name)) return server_respond_text(server, fd, 400, "Invalid upload URL.");
+    memcpy(name, token, len);
+    name[len] = 0;
+    
+    server_database *db = server_database_get(server, database);
+    if (!server_valid_name(name) || !db) return server_respond_text(server, fd, 400, "Invalid upload URL.");
+    
+    char src[1024], dst[1024];
+    int64_t index = (db->nentries) ? db->entries[db->nentries - 1].index + 1 : 1;
+    snprintf(src, sizeof(src), "%s/%s/upload-%s.tmp", server->dir, database, name);
+    snprintf(dst, sizeof(dst), "%s/%s/%lld-%s.payload", server->dir, database, (long long)index, site_id);
+    if (rename(src, dst) != 0) return server_respond_text(server, fd, 404, "Unknown upload.");
+    if (!server_database_append(db, index, site_id)) return server_respond_text(server, fd, 500, "Out of memory.");
+    
+    if (server->verbose) printf("%s: payload %lld from %s\n", database, (long long)index, site_id);
+    return server_respond_text(server, fd, 200, "");
+}
+
+static bool server_check (server_context *server, int fd, const char *database, const char *site_id) {
+    server_database *db = server_database_get(server, database);
+    server_cursor *cursor = (db) ? server_cursor_get(db, site_id) : NULL;
+    if (!cursor) return server_respond_text(server, fd, 500, "Out of memory.");
+    
+    for (int64_t i=0; i<db->nentries; ++i) {
+        server_entry *entry = &db->entries[i];
+        if (entry->index <= cursor->cursor || strcmp(entry->site_id, site_id) == 0) continue;
+    
+        char url[1024];
+        snprintf(url, sizeof(url), "http://%s:%d%s%s/%s/download/%lld", server->host, server->port, SERVER_PREFIX, database, site_id, (long long)entry->index);
+        return server_respond_text(server, fd, 200, url);
+    }
+    
+    // nothing new
+    return server_respond_text(server, fd, 200, "");
+}
+
+static bool server_download (server_context *server, int fd, const char *database, const char *site_id, int64_t index) {
+    server_database *db = server_database_get(server, database);
+    server_entry *entry = (db) ? server_entry_find(db, index) : NULL;
+    if (!entry) return server_respond_text(server, fd, 404, "Unknown payload.");
+    
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s/%lld-%s.payload", server->dir, database, (long long)index, entry->site_id);
+    FILE *f = fopen(path, "rb");
+    if (!f) return server_respond_text(server, fd, 404, "Unknown payload.");
+    
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buffer = (size > 0) ? (char *)malloc((size_t)size) : NULL;
+    size_t nread = (buffer) ? fread(buffer, 1, (size_t)size, f) : 0;
+    fclose(f);
+    if (!buffer || nread != (size_t)size) {
+        free(buffer);
+        return server_respond_text(server, fd, 500, "Unable to read the payload.");
+    }
+    
+    // the cursor moves when the payload is served, payloads older than the cursor are not returned again
+    server_cursor *cursor = server_cursor_get(db, site_id);
+    if (cursor && index > cursor->cursor) cursor->cursor = index;
+    
+    bool result = server_respond(server, fd, 200, "application/octet-stream", buffer, (size_t)size);
+    free(buffer);
+    return result;
+}
+
+static void server_handle (server_context *server, int fd) {
+    server_request request;
+    memset(&request, 0, sizeof(server_request));
+    
+    int status = server_read_request(server, fd, &request);
+    if (status != 0) {
+        server_respond_text(server, fd, status, "Invalid request.");
+        free(request.body);
+        return;
+    }
+    if (server->verbose) printf("%s %s (%zu bytes)\n", request.method, request.path, request.blen);
+    
+    // /v1/cloudsync/{database}/{site_id}/{command...}
+    char *query = strchr(request.path, '?');
+    if (query) *query = 0;
+    if (strncmp(request.path, SERVER_PREFIX, strlen(SERVER_PREFIX)) != 0) {
+        server_respond_text(server, fd, 404, "Unknown endpoint.");
+        free(request.body);
+        return;
+    }
+    
+    char *components[8] = {NULL};
+    int ncomponents = 0;
+    for (char *p = strtok(request.path + strlen(SERVER_PREFIX), "/"); p && ncomponents < 8; p = strtok(NULL, "/")) components[ncomponents++] = p;
+    
+    const char *database = (ncomponents > 0) ? components[0] : "";
+    const char *site_id = (ncomponents > 1) ? components[1] : "";
+    bool is_get = (strcmp(request.method, "GET") == 0);
+    bool is_post = (strcmp(request.method, "POST") == 0);
+    bool is_put = (strcmp(request.method, "PUT") == 0);
+    
+    if (ncomponents < 3 || !server_valid_name(database) || !server_valid_name(site_id)) server_respond_text(server, fd, 404, "Unknown endpoint.");
+    else if (ncomponents == 3 && strcmp(components[2], "upload") == 0 && is_get) server_upload_url(server, fd, database, site_id);
+    else if (ncomponents == 3 && strcmp(components[2], "upload") == 0 && is_post) server_upload_notify(server, fd, database, site_id, &request);
+    else if (ncomponents == 4 && strcmp(components[2], "blob") == 0 && is_put) server_upload_blob(server, fd, database, components[3], &request);
+    else if (ncomponents == 4 && strcmp(components[2], "download") == 0 && is_get) server_download(server, fd, database, site_id, strtoll(components[3], NULL, 10));
+    else if (ncomponents == 5 && strcmp(components[4], "check") == 0 && is_post) server_check(server, fd, database, site_id);
+    else server_respond_text(server, fd, 404, "Unknown endpoint.");
+    
+    free(request.body);
+}
+
+// MARK: - Main -
+
+static void server_usage (const char *name) {
+    printf("Usage: %s [options]\n", name);
+    printf("  --port N          port to listen on (default %d)\n", SERVER_DEFAULT_PORT);
+    printf("  --host ADDRESS    address used in the returned URLs (default 127.0.0.1)\n");
+    printf("  --dir PATH        directory of the stored payloads (default %s)\n", SERVER_DEFAULT_DIR);
+    printf("  --latency MS      delay added to each response (default 0)\n");
+    printf("  --bandwidth N     max bytes per second of request and response bodies (default unlimited)\n");
+    printf("  --verbose         print each request\n");
+}
+
+int main (int argc, const char *argv[]) {
+    server_context server;
+    memset(&server, 0, sizeof(server_context));
+    server.port = SERVER_DEFAULT_PORT;
+    server.host = "127.0.0.1";
+    server.dir = SERVER_DEFAULT_DIR;
+    
+    for (int i=1; i<argc; ++i) {
+        bool ok = true;
+        bool has_value = (i + 1 < argc);
+        if (strcmp(argv[i], "--port") == 0 && has_value) ok = ((server.port = atoi(argv[++i])) > 0);
+        else if (strcmp(argv[i], "--host") == 0 && has_value) server.host = argv[++i];
+        else if (strcmp(argv[i], "--dir") == 0 && has_value) server.dir = argv[++i];
+        else if (strcmp(argv[i], "--latency") == 0 && has_value) ok = ((server.latency = atoi(argv[++i])) >= 0);
+        else if (strcmp(argv[i], "--bandwidth") == 0 && has_value) ok = ((server.bandwidth = strtoll(argv[++i], NULL, 10)) >= 0);
+        else if (strcmp(argv[i], "--verbose") == 0) server.verbose = true;
+        else ok = false;
+    
+        if (!ok) {
+            server_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (server_mkdir(server.dir) != 0) {
+        fprintf(stderr, "Unable to create directory %s (%s).\n", server.dir, strerror(errno));
+        return 1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to create socket (%s).\n", strerror(errno));
+        return 1;
+    }
+    
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    
+    // loopback only
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)server.port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+        fprintf(stderr, "Unable to listen on port %d (%s).\n", server.port, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    
+    printf("CloudSync local server listening on http://127.0.0.1:%d (storage %s)\n", server.port, server.dir);
+    fflush(stdout);
+    
+    while (true) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "accept error: %s\n", strerror(errno));
+            break;
+        }
+        server_handle(&server, client);
+        close(client);
+        if (server.verbose) fflush(stdout);
+    }
+    
+    close(fd);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,732 @@
+//
+//  sim.c
+//  cloudsync
+//
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "sqlite3.h"
+#include "cloudsync.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/*
+
+ In-process convergence simulator: N peers, each with its own in-memory database, sync through a relay
+ that behaves like the cloud service (an append-only log of the uploaded payloads).
+
+ Time is virtual (ms), so latencies cost nothing and hundreds of peers can be simulated on a single machine.
+ Every message between a peer and the relay goes through a transport with configurable latency, jitter,
+ loss and reordering (a reordered message is delayed by up to four extra latencies).
+
+ At each tick a peer:
+ - runs a batch of its workload (a mix of upserts, updates and deletes on a shared key space) until done
+ - uploads its own changes newer than the last db_version acknowledged by the relay (the upload is sent
+   again after a timeout if no ack is received, lost changes are included in the next upload)
+ - asks the relay for the log entries after its cursor and applies them with cloudsync_payload_decode
+
+ The simulation ends when every change has been uploaded and applied by every peer, then the content of
+ all peers is compared. Reported: virtual time to convergence (from the last local write), bytes and
+ messages per peer, CPU time spent in encode and merge.
+
+ */
+
+#define SIM_DEFAULT_PEERS           10
+#define SIM_DEFAULT_OPS             100
+#define SIM_DEFAULT_BATCH           5
+#define SIM_DEFAULT_KEYS            1000
+#define SIM_DEFAULT_INTERVAL        100
+#define SIM_DEFAULT_LATENCY         50
+#define SIM_DEFAULT_JITTER          20
+#define SIM_DEFAULT_MAX_TIME        3600000
+
+typedef enum {
+    SIM_EVENT_TICK,                 // peer timer
+    SIM_EVENT_UPLOAD,               // peer -> relay, data is a sim_entry
+    SIM_EVENT_ACK,                  // relay -> peer, arg1 is the acknowledged db_version
+    SIM_EVENT_CHECK,                // peer -> relay, arg1 is the peer cursor
+    SIM_EVENT_RESPONSE              // relay -> peer, arg1 and arg2 are the range of log entries
+} sim_event_type;
+
+typedef struct {
+    int64_t         time;           // virtual time in ms
+    uint64_t        order;          // events at the same time are processed in FIFO order
+    sim_event_type  type;
+    int             peer;
+    int64_t         arg1;
+    int64_t         arg2;
+    void            *data;
+} sim_event;
+
+typedef struct {
+    int             origin;
+    void            *blob;
+    int             size;
+    int64_t         db_version;     // max db_version of the changes in the payload
+} sim_entry;
+
+typedef struct {
+    sqlite3         *db;
+    sqlite3_stmt    *upsert_vm;
+    sqlite3_stmt    *update_vm;
+    sqlite3_stmt    *delete_vm;
+    sqlite3_stmt    *encode_vm;
+    sqlite3_stmt    *apply_vm;
+    
+    int             ops;
+    bool            dirty;          // local changes not uploaded yet
+    int64_t         acked;          // own db_version acknowledged by the relay
+    int64_t         upload_version; // max db_version of the upload in flight
+    int64_t         upload_timeout; // -1 if no upload is in flight
+    int64_t         cursor;         // relay log entries already applied
+    int64_t         check_timeout;  // -1 if no check is in flight
+    
+    uint64_t        bytes_sent;
+    uint64_t        bytes_received;
+    uint64_t        messages_sent;
+    uint64_t        messages_received;
+    uint64_t        rows_merged;
+    uint64_t        encode_ns;
+    uint64_t        merge_ns;
+} sim_peer;
+
+typedef struct {
+    // configuration
+    int             npeers;
+    int             ops;
+    int             batch;
+    int             keys;
+    int             upsert_pct;
+    int             update_pct;
+    int             interval;
+    int             latency;
+    int             jitter;
+    int             loss_pct;
+    int             reorder_pct;
+    int             timeout;
+    int64_t         max_time;
+    uint64_t        seed;
+    bool            json;
+    
+    // state
+    sim_peer        *peers;
+    sim_event       *events;
+    int             nevents;
+    int             aevents;
+    uint64_t        order;
+    int64_t         now;
+    int64_t         last_write;
+    int             pending_ops;    // peers that have not completed their workload
+    
+    // relay
+    sim_entry       *log;
+    int64_t         nlog;
+    int64_t         alog;
+    int64_t         *stored;        // max db_version stored in the log for each origin
+    
+    uint64_t        lost;
+    uint64_t        reordered;
+} sim_context;
+
+// MARK: - Utils -
+
+static uint64_t sim_cpu_ns (void) {
+    #ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+    uint64_t k = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    uint64_t u = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    return (k + u) * 100;
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    #endif
+}
+
+static uint64_t sim_wall_ns (void) {
+    #ifdef _WIN32
+    static LARGE_INTEGER frequency = {0};
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((counter.QuadPart / frequency.QuadPart) * 1000000000ULL + ((counter.QuadPart % frequency.QuadPart) * 1000000000ULL) / frequency.QuadPart);
+    #else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    #endif
+}
+
+static uint64_t sim_random (sim_context *sim) {
+    // xorshift64, a run is fully determined by its seed
+    sim->seed ^= sim->seed << 13;
+    sim->seed ^= sim->seed >> 7;
+    sim->seed ^= sim->seed << 17;
+    return sim->seed;
+}
+
+static int sim_random_range (sim_context *sim, int n) {
+    return (n > 0) ? (int)(sim_random(sim) % (uint64_t)n) : 0;
+}
+
+static int sim_exec (sqlite3 *db, const char *sql) {
+    char *errmsg = NULL;
+    int rc = sqlite3_exec(db, sql, NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "sim error: %s (%s)\n", (errmsg) ? errmsg : sqlite3_errmsg(db), sql);
+        sqlite3_free(errmsg);
+    }
+    return rc;
+}
+
+// MARK: - Events -
+
+static bool sim_event_before (sim_event *a, sim_event *b) {
+    return (a->time < b->time) || (a->time == b->time && a->order < b->order);
+}
+
+static bool sim_schedule (sim_context *sim, int64_t time, sim_event_type type, int peer, int64_t arg1, int64_t arg2, void *data) {
+    if (sim->nevents == sim->aevents) {
+        int alloc = (sim->aevents) ? sim->aevents * 2 : 1024;
+        sim_event *events = (sim_event *)realloc(sim->events, sizeof(sim_event) * alloc);
+        if (!events) return false;
+        sim->events = events;
+        sim->aevents = alloc;
+    }
+    
+    // binary min-heap ordered by (time, order)
+    sim_event event = {.time = time, .order = sim->order++, .type = type, .peer = peer, .arg1 = arg1, .arg2 = arg2, .data = data};
+    int i = sim->nevents++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!sim_event_before(&event, &sim->events[parent])) break;
+        sim->events[i] = sim->events[parent];
+        i = parent;
+    }
+    sim->events[i] = event;
+    return true;
+}
+
+static bool sim_next (sim_context *sim, sim_event *event) {
+    if (sim->nevents == 0) return false;
+    
+    *event = sim->events[0];
+    sim_event last = sim->events[--sim->nevents];
+    int i = 0;
+    while (true) {
+        int child = i * 2 + 1;
+        if (child >= sim->nevents) break;
+        if (child + 1 < sim->nevents && sim_event_before(&sim->events[child + 1], &sim->events[child])) ++child;
+        if (!sim_event_before(&sim->events[child], &last)) break;
+        sim->events[i] = sim->events[child];
+        i = child;
+    }
+    if (sim->nevents > 0) sim->events[i] = last;
+    return true;
+}
+
+static bool sim_transport_send (sim_context *sim, sim_event_type type, int peer, int64_t arg1, int64_t arg2, void *data, bool *delivered) {
+    // returns false only on out of memory, delivered is false if the message is lost
+    *delivered = false;
+    if (sim_random_range(sim, 100) < sim->loss_pct) {
+        ++sim->lost;
+        return true;
+    }
+    
+    int64_t delay = sim->latency + sim_random_range(sim, sim->jitter + 1);
+    if (sim_random_range(sim, 100) < sim->reorder_pct) {
+        delay += sim_random_range(sim, sim->latency * 4 + 1);
+        ++sim->reordered;
+    }
+    
+    *delivered = true;
+    return sim_schedule(sim, sim->now + delay, type, peer, arg1, arg2, data);
+}
+
+// MARK: - Peers -
+
+static int sim_peer_open (sim_context *sim, sim_peer *peer) {
+    int rc = sqlite3_open(":memory:", &peer->db);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_cloudsync_init(peer->db, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sim_exec(peer->db, "CREATE TABLE items (id TEXT PRIMARY KEY NOT NULL, peer INTEGER, counter INTEGER, note TEXT); SELECT cloudsync_init('items');");
+    if (rc != SQLITE_OK) return rc;
+    
+    const char *sql = "INSERT INTO items (id, peer, counter, note) VALUES (?1, ?2, 1, ?3) ON CONFLICT(id) DO UPDATE SET peer = excluded.peer, counter = counter + 1, note = excluded.note;";
+    rc = sqlite3_prepare_v2(peer->db, sql, -1, &peer->upsert_vm, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_prepare_v2(peer->db, "UPDATE items SET counter = counter + 1, note = ?3 WHERE id = ?1 AND ?2 IS NOT NULL;", -1, &peer->update_vm, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_prepare_v2(peer->db, "DELETE FROM items WHERE id = ?1;", -1, &peer->delete_vm, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    sql = "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq), max(db_version) FROM cloudsync_changes WHERE site_id=cloudsync_siteid() AND db_version>?;";
+    rc = sqlite3_prepare_v2(peer->db, sql, -1, &peer->encode_vm, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_prepare_v2(peer->db, "SELECT cloudsync_payload_decode(?);", -1, &peer->apply_vm, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    peer->acked = 0;
+    peer->upload_timeout = -1;
+    peer->check_timeout = -1;
+    return SQLITE_OK;
+}
+
+static void sim_peer_close (sim_peer *peer) {
+    if (peer->upsert_vm) sqlite3_finalize(peer->upsert_vm);
+    if (peer->update_vm) sqlite3_finalize(peer->update_vm);
+    if (peer->delete_vm) sqlite3_finalize(peer->delete_vm);
+    if (peer->encode_vm) sqlite3_finalize(peer->encode_vm);
+    if (peer->apply_vm) sqlite3_finalize(peer->apply_vm);
+    if (peer->db) {
+        sqlite3_exec(peer->db, "SELECT cloudsync_terminate();", NULL, NULL, NULL);
+        sqlite3_close(peer->db);
+    }
+}
+
+static int sim_peer_workload (sim_context *sim, int index) {
+    sim_peer *peer = &sim->peers[index];
+    int rc = sim_exec(peer->db, "BEGIN;");
+    if (rc != SQLITE_OK) return rc;
+    
+    for (int i=0; i<sim->batch && peer->ops < sim->ops; ++i, ++peer->ops) {
+        char key[32], note[64];
+        snprintf(key, sizeof(key), "k%06d", sim_random_range(sim, sim->keys));
+        snprintf(note, sizeof(note), "peer %d op %d", index, peer->ops);
+    
+        int op = sim_random_range(sim, 100);
+        sqlite3_stmt *vm = (op < sim->upsert_pct) ? peer->upsert_vm : (op < sim->upsert_pct + sim->update_pct) ? peer->update_vm : peer->delete_vm;
+        sqlite3_bind_text(vm, 1, key, -1, SQLITE_TRANSIENT);
+        if (vm != peer->delete_vm) {
+            sqlite3_bind_int(vm, 2, index);
+            sqlite3_bind_text(vm, 3, note, -1, SQLITE_TRANSIENT);
+        }
+        rc = sqlite3_step(vm);
+        sqlite3_reset(vm);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "sim error: %s\n", sqlite3_errmsg(peer->db));
+            sqlite3_exec(peer->db, "ROLLBACK;", NULL, NULL, NULL);
+            return rc;
+        }
+    }
+    
+    peer->dirty = true;
+    sim->last_write = sim->now;
+    if (peer->ops == sim->ops) --sim->pending_ops;
+    return sim_exec(peer->db, "COMMIT;");
+}
+
+static int sim_peer_upload (sim_context *sim, int index) {
+    sim_peer *peer = &sim->peers[index];
+    
+    // everything after the acknowledged db_version is sent again, so lost uploads are recovered
+    uint64_t start = sim_cpu_ns();
+    sqlite3_bind_int64(peer->encode_vm, 1, peer->acked);
+    int rc = sqlite3_step(peer->encode_vm);
+    if (rc != SQLITE_ROW) {
+        sqlite3_reset(peer->encode_vm);
+        return rc;
+    }
+    
+    peer->dirty = false;
+    if (sqlite3_column_type(peer->encode_vm, 0) == SQLITE_NULL) {
+        sqlite3_reset(peer->encode_vm);
+        peer->upload_timeout = -1;
+        return SQLITE_OK;
+    }
+    
+    sim_entry *entry = (sim_entry *)calloc(1, sizeof(sim_entry));
+    if (entry) {
+        entry->origin = index;
+        entry->size = sqlite3_column_bytes(peer->encode_vm, 0);
+        entry->db_version = sqlite3_column_int64(peer->encode_vm, 1);
+        entry->blob = malloc((size_t)entry->size);
+        if (entry->blob) memcpy(entry->blob, sqlite3_column_blob(peer->encode_vm, 0), (size_t)entry->size);
+    }
+    sqlite3_reset(peer->encode_vm);
+    peer->encode_ns += sim_cpu_ns() - start;
+    if (!entry || !entry->blob) {
+        if (entry) free(entry);
+        return SQLITE_NOMEM;
+    }
+    
+    peer->upload_version = entry->db_version;
+    peer->upload_timeout = sim->now + sim->timeout;
+    peer->bytes_sent += (uint64_t)entry->size;
+    peer->messages_sent++;
+    
+    bool delivered = false;
+    if (!sim_transport_send(sim, SIM_EVENT_UPLOAD, index, 0, 0, entry, &delivered)) {
+        free(entry->blob);
+        free(entry);
+        return SQLITE_NOMEM;
+    }
+    if (!delivered) {
+        free(entry->blob);
+        free(entry);
+    }
+    return SQLITE_OK;
+}
+
+static int sim_peer_check (sim_context *sim, int index) {
+    sim_peer *peer = &sim->peers[index];
+    peer->check_timeout = sim->now + sim->timeout;
+    peer->messages_sent++;
+    
+    bool delivered = false;
+    return (sim_transport_send(sim, SIM_EVENT_CHECK, index, peer->cursor, 0, NULL, &delivered)) ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+static int sim_peer_tick (sim_context *sim, int index) {
+    sim_peer *peer = &sim->peers[index];
+    int rc = SQLITE_OK;
+    
+    if (peer->ops < sim->ops) {
+        rc = sim_peer_workload(sim, index);
+        if (rc != SQLITE_OK) return rc;
+    }
+    
+    // a single upload in flight, a new one starts when it is acknowledged or timed out
+    bool timedout = (peer->upload_timeout != -1 && sim->now >= peer->upload_timeout);
+    if ((peer->dirty && peer->upload_timeout == -1) || timedout) {
+        rc = sim_peer_upload(sim, index);
+        if (rc != SQLITE_OK) return rc;
+    }
+    
+    if (peer->check_timeout == -1 || sim->now >= peer->check_timeout) {
+        rc = sim_peer_check(sim, index);
+        if (rc != SQLITE_OK) return rc;
+    }
+    
+    return sim_schedule(sim, sim->now + sim->interval, SIM_EVENT_TICK, index, 0, 0, NULL) ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+static int sim_peer_response (sim_context *sim, int index, int64_t from, int64_t to) {
+    sim_peer *peer = &sim->peers[index];
+    peer->messages_received++;
+    peer->check_timeout = -1;
+    
+    // entries before the cursor were already applied by a previous (reordered) response
+    for (int64_t i = (from > peer->cursor) ? from : peer->cursor; i < to; ++i) {
+        sim_entry *entry = &sim->log[i];
+        if (entry->origin == index) continue;
+    
+        uint64_t start = sim_cpu_ns();
+        sqlite3_bind_blob(peer->apply_vm, 1, entry->blob, entry->size, SQLITE_STATIC);
+        int rc = sqlite3_step(peer->apply_vm);
+        if (rc == SQLITE_ROW) peer->rows_merged += (uint64_t)sqlite3_column_int64(peer->apply_vm, 0);
+        sqlite3_reset(peer->apply_vm);
+        peer->merge_ns += sim_cpu_ns() - start;
+        if (rc != SQLITE_ROW) {
+            fprintf(stderr, "sim error: peer %d unable to apply entry %lld (%s)\n", index, (long long)i, sqlite3_errmsg(peer->db));
+            return rc;
+        }
+    }
+    
+    if (to > peer->cursor) peer->cursor = to;
+    return SQLITE_OK;
+}
+
+// MARK: - Relay -
+
+static bool sim_relay_upload (sim_context *sim, int index, sim_entry *entry) {
+    // a retransmitted upload with nothing new is only acknowledged
+    if (entry->db_version > sim->stored[index]) {
+        if (sim->nlog == sim->alog) {
+            int64_t alloc = (sim->alog) ? sim->alog * 2 : 1024;
+            sim_entry *log = (sim_entry *)realloc(sim->log, sizeof(sim_entry) * (size_t)alloc);
+            if (!log) return false;
+            sim->log = log;
+            sim->alog = alloc;
+        }
+        sim->log[sim->nlog++] = *entry;
+        sim->stored[index] = entry->db_version;
+    } else {
+        free(entry->blob);
+    }
+    
+    int64_t db_version = entry->db_version;
+    free(entry);
+    
+    bool delivered = false;
+    return sim_transport_send(sim, SIM_EVENT_ACK, index, db_version, 0, NULL, &delivered);
+}
+
+static bool sim_relay_check (sim_context *sim, int index, int64_t from) {
+    sim_peer *peer = &sim->peers[index];
+    
+    // the response carries all the payloads of the other peers after the cursor of the request
+    uint64_t bytes = 0;
+    for (int64_t i=from; i<sim->nlog; ++i) {
+        if (sim->log[i].origin != index) bytes += (uint64_t)sim->log[i].size;
+    }
+    
+    bool delivered = false;
+    if (!sim_transport_send(sim, SIM_EVENT_RESPONSE, index, from, sim->nlog, NULL, &delivered)) return false;
+    if (delivered) peer->bytes_received += bytes;
+    return true;
+}
+
+// MARK: - Simulation -
+
+static bool sim_synced (sim_context *sim) {
+    // all the changes are in the relay log and every peer has applied the whole log
+    if (sim->pending_ops > 0) return false;
+    
+    for (int i=0; i<sim->npeers; ++i) {
+        sim_peer *peer = &sim->peers[i];
+        if (peer->dirty || peer->upload_timeout != -1 || peer->cursor != sim->nlog) return false;
+    }
+    return true;
+}
+
+static uint64_t sim_digest (sim_peer *peer) {
+    // FNV-1a of the whole table content
+    uint64_t hash = 14695981039346656037ULL;
+    sqlite3_stmt *vm = NULL;
+    if (sqlite3_prepare_v2(peer->db, "SELECT id, peer, counter, note FROM items ORDER BY id;", -1, &vm, NULL) != SQLITE_OK) return 0;
+    
+    while (sqlite3_step(vm) == SQLITE_ROW) {
+        for (int i=0; i<4; ++i) {
+            const unsigned char *value = sqlite3_column_text(vm, i);
+            int len = sqlite3_column_bytes(vm, i);
+            for (int j=0; j<len; ++j) hash = (hash ^ value[j]) * 1099511628211ULL;
+            hash = (hash ^ (value ? 0x1F : 0x1E)) * 1099511628211ULL;
+        }
+    }
+    sqlite3_finalize(vm);
+    return hash;
+}
+
+static int sim_run (sim_context *sim, int64_t *converged) {
+    *converged = -1;
+    
+    // peers start at random offsets so that they don't tick at the same time
+    for (int i=0; i<sim->npeers; ++i) {
+        if (!sim_schedule(sim, sim_random_range(sim, sim->interval), SIM_EVENT_TICK, i, 0, 0, NULL)) return SQLITE_NOMEM;
+    }
+    
+    sim_event event;
+    int rc = SQLITE_OK;
+    while (sim_next(sim, &event)) {
+        if (event.time > sim->max_time) {
+            if (event.type == SIM_EVENT_UPLOAD) {
+                free(((sim_entry *)event.data)->blob);
+                free(event.data);
+            }
+            continue;
+        }
+        sim->now = event.time;
+        sim_peer *peer = &sim->peers[event.peer];
+    
+        switch (event.type) {
+            case SIM_EVENT_TICK:
+                rc = sim_peer_tick(sim, event.peer);
+                break;
+            case SIM_EVENT_UPLOAD:
+                rc = sim_relay_upload(sim, event.peer, (sim_entry *)event.data) ? SQLITE_OK : SQLITE_NOMEM;
+                break;
+            case SIM_EVENT_ACK:
+                peer->messages_received++;
+                if (event.arg1 > peer->acked) peer->acked = event.arg1;
+                if (peer->upload_timeout != -1 && event.arg1 >= peer->upload_version) peer->upload_timeout = -1;
+                break;
+            case SIM_EVENT_CHECK:
+                rc = sim_relay_check(sim, event.peer, event.arg1) ? SQLITE_OK : SQLITE_NOMEM;
+                break;
+            case SIM_EVENT_RESPONSE:
+                rc = sim_peer_response(sim, event.peer, event.arg1, event.arg2);
+                break;
+        }
+        if (rc != SQLITE_OK) break;
+    
+        if ((event.type == SIM_EVENT_ACK || event.type == SIM_EVENT_RESPONSE) && sim_synced(sim)) {
+            *converged = sim->now;
+            break;
+        }
+    }
+    
+    // release the uploads still in flight
+    for (int i=0; i<sim->nevents; ++i) {
+        if (sim->events[i].type != SIM_EVENT_UPLOAD) continue;
+        free(((sim_entry *)sim->events[i].data)->blob);
+        free(sim->events[i].data);
+    }
+    sim->nevents = 0;
+    return rc;
+}
+
+static void sim_report (sim_context *sim, int64_t converged, bool identical, double wall_ms) {
+    uint64_t bytes_total = 0, bytes_max = 0, messages = 0, rows = 0;
+    double merge_ms = 0, merge_max_ms = 0, encode_ms = 0;
+    for (int i=0; i<sim->npeers; ++i) {
+        sim_peer *peer = &sim->peers[i];
+        uint64_t bytes = peer->bytes_sent + peer->bytes_received;
+        bytes_total += bytes;
+        if (bytes > bytes_max) bytes_max = bytes;
+        messages += peer->messages_sent + peer->messages_received;
+        rows += peer->rows_merged;
+        double ms = (double)peer->merge_ns / 1000000.0;
+        merge_ms += ms;
+        if (ms > merge_max_ms) merge_max_ms = ms;
+        encode_ms += (double)peer->encode_ns / 1000000.0;
+    }
+    
+    int64_t convergence = (converged >= 0) ? converged - sim->last_write : -1;
+    if (sim->json) {
+        printf("{\n  \"cloudsync\": \"%s\",\n  \"sqlite\": \"%s\",\n", CLOUDSYNC_VERSION, sqlite3_libversion());
+        printf("  \"config\": {\"peers\": %d, \"ops\": %d, \"batch\": %d, \"keys\": %d, \"upsert\": %d, \"update\": %d, \"interval_ms\": %d, \"latency_ms\": %d, \"jitter_ms\": %d, \"loss\": %d, \"reorder\": %d, \"timeout_ms\": %d},\n",
+               sim->npeers, sim->ops, sim->batch, sim->keys, sim->upsert_pct, sim->update_pct, sim->interval, sim->latency, sim->jitter, sim->loss_pct, sim->reorder_pct, sim->timeout);
+        printf("  \"converged\": %s,\n  \"identical\": %s,\n  \"convergence_ms\": %lld,\n  \"virtual_time_ms\": %lld,\n  \"wall_time_ms\": %.3f,\n",
+               (converged >= 0) ? "true" : "false", (identical) ? "true" : "false", (long long)convergence, (long long)sim->now, wall_ms);
+        printf("  \"log_entries\": %lld,\n  \"messages\": %llu,\n  \"messages_lost\": %llu,\n  \"messages_reordered\": %llu,\n  \"rows_merged\": %llu,\n",
+               (long long)sim->nlog, (unsigned long long)messages, (unsigned long long)sim->lost, (unsigned long long)sim->reordered, (unsigned long long)rows);
+        printf("  \"bytes_total\": %llu,\n  \"bytes_per_peer_avg\": %.1f,\n  \"bytes_per_peer_max\": %llu,\n",
+               (unsigned long long)bytes_total, (double)bytes_total / sim->npeers, (unsigned long long)bytes_max);
+        printf("  \"encode_cpu_ms\": %.3f,\n  \"merge_cpu_ms\": %.3f,\n  \"merge_cpu_per_peer_avg_ms\": %.3f,\n  \"merge_cpu_per_peer_max_ms\": %.3f\n}\n",
+               encode_ms, merge_ms, merge_ms / sim->npeers, merge_max_ms);
+        return;
+    }
+    
+    printf("CloudSync %s convergence simulator (SQLite %s)\n", CLOUDSYNC_VERSION, sqlite3_libversion());
+    printf("peers %d, ops %d per peer, latency %d+%d ms, loss %d%%, reorder %d%%\n", sim->npeers, sim->ops, sim->latency, sim->jitter, sim->loss_pct, sim->reorder_pct);
+    if (converged >= 0) printf("converged:            %s after %lld ms (virtual time %lld ms)\n", (identical) ? "yes" : "NO, peers differ", (long long)convergence, (long long)sim->now);
+    else printf("converged:            no (stopped at virtual time %lld ms)\n", (long long)sim->now);
+    printf("wall time:            %.1f ms\n", wall_ms);
+    printf("messages:             %llu (%llu lost, %llu reordered)\n", (unsigned long long)messages, (unsigned long long)sim->lost, (unsigned long long)sim->reordered);
+    printf("relay log entries:    %lld\n", (long long)sim->nlog);
+    printf("rows merged:          %llu\n", (unsigned long long)rows);
+    printf("bytes per peer:       %.1f avg, %llu max (%llu total)\n", (double)bytes_total / sim->npeers, (unsigned long long)bytes_max, (unsigned long long)bytes_total);
+    printf("encode cpu:           %.1f ms\n", encode_ms);
+    printf("merge cpu per peer:   %.1f ms avg, %.1f ms max (%.1f ms total)\n", merge_ms / sim->npeers, merge_max_ms, merge_ms);
+}
+
+// MARK: - Main -
+
+static void sim_usage (const char *name) {
+    printf("Usage: %s [options]\n", name);
+    printf("  --peers N         number of peers (default %d)\n", SIM_DEFAULT_PEERS);
+    printf("  --ops N           workload operations per peer (default %d)\n", SIM_DEFAULT_OPS);
+    printf("  --batch N         operations per transaction (default %d)\n", SIM_DEFAULT_BATCH);
+    printf("  --keys N          size of the shared key space (default %d)\n", SIM_DEFAULT_KEYS);
+    printf("  --mix U,P         percentage of upserts and updates, the rest are deletes (default 50,40)\n");
+    printf("  --interval MS     tick interval of each peer (default %d)\n", SIM_DEFAULT_INTERVAL);
+    printf("  --latency MS      one way latency (default %d)\n", SIM_DEFAULT_LATENCY);
+    printf("  --jitter MS       random latency added to each message (default %d)\n", SIM_DEFAULT_JITTER);
+    printf("  --loss PCT        percentage of lost messages (default 0)\n");
+    printf("  --reorder PCT     percentage of reordered messages (default 0)\n");
+    printf("  --timeout MS      retransmission timeout (default 4 * (latency + jitter) + interval)\n");
+    printf("  --max-time MS     stop the simulation at this virtual time (default %d)\n", SIM_DEFAULT_MAX_TIME);
+    printf("  --seed N          random seed (default 1)\n");
+    printf("  --json            print the results as JSON\n");
+}
+
+static bool sim_parse_int (int argc, const char *argv[], int *i, int *value, int min) {
+    if (*i + 1 >= argc) return false;
+    int v = atoi(argv[++(*i)]);
+    if (v < min) return false;
+    *value = v;
+    return true;
+}
+
+int main (int argc, const char *argv[]) {
+    sim_context sim;
+    memset(&sim, 0, sizeof(sim_context));
+    sim.npeers = SIM_DEFAULT_PEERS;
+    sim.ops = SIM_DEFAULT_OPS;
+    sim.batch = SIM_DEFAULT_BATCH;
+    sim.keys = SIM_DEFAULT_KEYS;
+    sim.upsert_pct = 50;
+    sim.update_pct = 40;
+    sim.interval = SIM_DEFAULT_INTERVAL;
+    sim.latency = SIM_DEFAULT_LATENCY;
+    sim.jitter = SIM_DEFAULT_JITTER;
+    sim.timeout = -1;
+    sim.max_time = SIM_DEFAULT_MAX_TIME;
+    int seed = 1;
+    int max_time = SIM_DEFAULT_MAX_TIME;
+    
+    for (int i=1; i<argc; ++i) {
+        bool ok = true;
+        if (strcmp(argv[i], "--peers") == 0) ok = sim_parse_int(argc, argv, &i, &sim.npeers, 2);
+        else if (strcmp(argv[i], "--ops") == 0) ok = sim_parse_int(argc, argv, &i, &sim.ops, 0);
+        else if (strcmp(argv[i], "--batch") == 0) ok = sim_parse_int(argc, argv, &i, &sim.batch, 1);
+        else if (strcmp(argv[i], "--keys") == 0) ok = sim_parse_int(argc, argv, &i, &sim.keys, 1);
+        else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) ok = (sscanf(argv[++i], "%d,%d", &sim.upsert_pct, &sim.update_pct) == 2 && sim.upsert_pct >= 0 && sim.update_pct >= 0 && sim.upsert_pct + sim.update_pct <= 100);
+        else if (strcmp(argv[i], "--interval") == 0) ok = sim_parse_int(argc, argv, &i, &sim.interval, 1);
+        else if (strcmp(argv[i], "--latency") == 0) ok = sim_parse_int(argc, argv, &i, &sim.latency, 0);
+        else if (strcmp(argv[i], "--jitter") == 0) ok = sim_parse_int(argc, argv, &i, &sim.jitter, 0);
+        else if (strcmp(argv[i], "--loss") == 0) ok = sim_parse_int(argc, argv, &i, &sim.loss_pct, 0) && sim.loss_pct < 100;
+        else if (strcmp(argv[i], "--reorder") == 0) ok = sim_parse_int(argc, argv, &i, &sim.reorder_pct, 0) && sim.reorder_pct <= 100;
+        else if (strcmp(argv[i], "--timeout") == 0) ok = sim_parse_int(argc, argv, &i, &sim.timeout, 1);
+        else if (strcmp(argv[i], "--max-time") == 0) ok = sim_parse_int(argc, argv, &i, &max_time, 1);
+        else if (strcmp(argv[i], "--seed") == 0) ok = sim_parse_int(argc, argv, &i, &seed, 1);
+        else if (strcmp(argv[i], "--json") == 0) sim.json = true;
+        else ok = false;
+    
+        if (!ok) {
+            sim_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (sim.timeout == -1) sim.timeout = 4 * (sim.latency + sim.jitter) + sim.interval;
+    sim.max_time = max_time;
+    sim.seed = 88172645463325252ULL ^ (uint64_t)seed;
+    sim.pending_ops = (sim.ops > 0) ? sim.npeers : 0;
+    
+    int rc = SQLITE_OK;
+    bool identical = false;
+    int64_t converged = -1;
+    uint64_t start = sim_wall_ns();
+    
+    sim.peers = (sim_peer *)calloc((size_t)sim.npeers, sizeof(sim_peer));
+    sim.stored = (int64_t *)calloc((size_t)sim.npeers, sizeof(int64_t));
+    if (!sim.peers || !sim.stored) {rc = SQLITE_NOMEM; goto cleanup;}
+    
+    for (int i=0; i<sim.npeers; ++i) {
+        rc = sim_peer_open(&sim, &sim.peers[i]);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "sim error: unable to open peer %d (%s)\n", i, (sim.peers[i].db) ? sqlite3_errmsg(sim.peers[i].db) : "out of memory");
+            goto cleanup;
+        }
+    }
+    
+    rc = sim_run(&sim, &converged);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    // every change reached every peer, their content must be the same
+    if (converged >= 0) {
+        uint64_t digest = sim_digest(&sim.peers[0]);
+        identical = true;
+        for (int i=1; i<sim.npeers && identical; ++i) identical = (sim_digest(&sim.peers[i]) == digest);
+    }
+    
+    sim_report(&sim, converged, identical, (double)(sim_wall_ns() - start) / 1000000.0);
+    
+cleanup:
+    for (int i=0; sim.peers && i<sim.npeers; ++i) sim_peer_close(&sim.peers[i]);
+    for (int64_t i=0; i<sim.nlog; ++i) free(sim.log[i].blob);
+    free(sim.log);
+    free(sim.events);
+    free(sim.stored);
+    free(sim.peers);
+    
+    if (rc != SQLITE_OK) return 1;
+    return (converged >= 0 && identical) ? 0 : 2;
+}
@@ -0,0 +1,229 @@
+//
+//  clock.c
+//  cloudsync
+//
+
+#include "clock.h"
+#include "utils.h"
+#include "cloudsync_private.h"
+
+#ifndef SQLITE_CORE
+SQLITE_EXTENSION_INIT3
+#endif
+
+/*
+
+ A clock vector is the packed representation of all the clocks of a row (used by the tables initialized with
+ the packed storage mode), so that a meta-table contains a single row per primary key instead of 1 + ncols rows.
+
+ Each entry of the vector contains the (col_version, db_version, seq, site_id) clock of a column, identified
+ by its col_id. Two special entries exist:
+ * CLOUDSYNC_TOMBSTONE_COLID: the sentinel (its col_version is the causal length of the row)
+ * CLOCK_INSERT_COLID: the clock of the last local insert, inherited by all the columns that have not been
+   individually updated since then (the seq of an inherited clock is the insert seq plus the column index)
+
+ Encoding:
+ * The first byte is the format version (CLOCK_FORMAT_VERSION).
+ * Each entry is encoded as 5 unsigned varints (7 bits per byte, least significant group first):
+   col_id + 1, col_version, db_version, seq, site_id
+
+ */
+
+#define CLOCK_FORMAT_VERSION        1
+#define CLOCK_ENTRY_MAXSIZE         (5 * 10)
+
+// MARK: - Varint -
+
+static size_t clock_varint_put (char *buffer, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        buffer[n++] = (char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buffer[n++] = (char)value;
+    return n;
+}
+
+static bool clock_varint_get (const char *buffer, size_t blen, size_t *seek, uint64_t *value) {
+    uint64_t result = 0;
+    int shift = 0;
+
+    while (*seek < blen && shift < 64) {
+        uint8_t byte = (uint8_t)buffer[(*seek)++];
+        result |= ((uint64_t)(byte & 0x7F)) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return true;
+        }
+        shift += 7;
+    }
+
+    return false;
+}
+
+// MARK: - Encoding -
+
+int clock_vector_decode (clock_vector *v, const char *buffer, size_t blen) {
+    memset(v, 0, sizeof(clock_vector));
+    if (!buffer || blen == 0) return 0;
+    if ((uint8_t)buffer[0] != CLOCK_FORMAT_VERSION) return -1;
+
+    size_t seek = 1;
+    while (seek < blen) {
+        uint64_t values[5];
+        for (int i=0; i<5; ++i) {
+            if (!clock_varint_get(buffer, blen, &seek, &values[i])) return -1;
+        }
+
+        clock_entry *e = clock_vector_set(v, (int64_t)values[0] - 1);
+        if (!e) return -1;
+        e->col_version = (int64_t)values[1];
+        e->db_version = (int64_t)values[2];
+        e->seq = (int64_t)values[3];
+        e->site_id = (int64_t)values[4];
+    }
+
+    return 0;
+}
+
+char *clock_vector_encode (clock_vector *v, size_t *blen) {
+    char *buffer = (char *)cloudsync_memory_alloc((uint64_t)(1 + (v->count * CLOCK_ENTRY_MAXSIZE)));
+    if (!buffer) return NULL;
+
+    size_t n = 0;
+    buffer[n++] = CLOCK_FORMAT_VERSION;
+    for (int i=0; i<v->count; ++i) {
+        clock_entry *e = &v->entries[i];
+        n += clock_varint_put(buffer+n, (uint64_t)(e->col_id + 1));
+        n += clock_varint_put(buffer+n, (uint64_t)e->col_version);
+        n += clock_varint_put(buffer+n, (uint64_t)e->db_version);
+        n += clock_varint_put(buffer+n, (uint64_t)e->seq);
+        n += clock_varint_put(buffer+n, (uint64_t)e->site_id);
+    }
+
+    *blen = n;
+    return buffer;
+}
+
+void clock_vector_free (clock_vector *v) {
+    if (v->entries) cloudsync_memory_free(v->entries);
+    memset(v, 0, sizeof(clock_vector));
+}
+
+int clock_vector_copy (clock_vector *v, clock_vector *out) {
+    // out is replaced by a copy of v (its entries are reused when large enough)
+    if (v->count > out->capacity) {
+        clock_entry *entries = (clock_entry *)cloudsync_memory_realloc(out->entries, (uint64_t)(v->count * sizeof(clock_entry)));
+        if (!entries) return -1;
+        out->entries = entries;
+        out->capacity = v->count;
+    }
+
+    if (v->count > 0) memcpy(out->entries, v->entries, (size_t)v->count * sizeof(clock_entry));
+    out->count = v->count;
+    return 0;
+}
+
+// MARK: - Entries -
+
+clock_entry *clock_vector_find (clock_vector *v, int64_t col_id) {
+    for (int i=0; i<v->count; ++i) {
+        if (v->entries[i].col_id == col_id) return &v->entries[i];
+    }
+    return NULL;
+}
+
+clock_entry *clock_vector_set (clock_vector *v, int64_t col_id) {
+    // returns the existing entry for col_id or a new zeroed one
+    clock_entry *e = clock_vector_find(v, col_id);
+    if (e) return e;
+
+    if (v->count >= v->capacity) {
+        int newcap = (v->capacity) ? v->capacity * 2 : 8;
+        clock_entry *entries = (clock_entry *)cloudsync_memory_realloc(v->entries, (uint64_t)(newcap * sizeof(clock_entry)));
+        if (!entries) return NULL;
+        v->entries = entries;
+        v->capacity = newcap;
+    }
+
+    e = &v->entries[v->count++];
+    memset(e, 0, sizeof(clock_entry));
+    e->col_id = col_id;
+    return e;
+}
+
+void clock_vector_remove (clock_vector *v, int64_t col_id) {
+    for (int i=0; i<v->count; ++i) {
+        if (v->entries[i].col_id != col_id) continue;
+        memmove(&v->entries[i], &v->entries[i+1], (size_t)(v->count - i - 1) * sizeof(clock_entry));
+        --v->count;
+        return;
+    }
+}
+
+void clock_vector_drop_columns (clock_vector *v) {
+    // remove everything except the sentinel
+    clock_entry *sentinel = clock_vector_find(v, CLOUDSYNC_TOMBSTONE_COLID);
+    if (sentinel) {
+        v->entries[0] = *sentinel;
+        v->count = 1;
+    } else {
+        v->count = 0;
+    }
+}
+
+int64_t clock_vector_max_db_version (clock_vector *v) {
+    int64_t max = 0;
+    for (int i=0; i<v->count; ++i) {
+        if (v->entries[i].db_version > max) max = v->entries[i].db_version;
+    }
+    return max;
+}
+
+int64_t clock_vector_cl (clock_vector *v) {
+    // same as the causal length computed from the per-column layout
+    clock_entry *sentinel = clock_vector_find(v, CLOUDSYNC_TOMBSTONE_COLID);
+    if (sentinel) return sentinel->col_version;
+    return (v->count > 0) ? 1 : 0;
+}
+
+int clock_vector_expand (clock_vector *v, const int *col_ids, int ncols, clock_vector *out) {
+    // build the per-column view of the row: the sentinel, then one entry for each column in col_ids
+    // (col_ids NULL means that the columns are unknown, so only the entries actually stored are returned)
+    memset(out, 0, sizeof(clock_vector));
+
+    clock_entry *sentinel = clock_vector_find(v, CLOUDSYNC_TOMBSTONE_COLID);
+    if (sentinel) {
+        clock_entry *e = clock_vector_set(out, CLOUDSYNC_TOMBSTONE_COLID);
+        if (!e) return -1;
+        *e = *sentinel;
+    }
+
+    if (!col_ids) {
+        for (int i=0; i<v->count; ++i) {
+            if (v->entries[i].col_id == CLOUDSYNC_TOMBSTONE_COLID || v->entries[i].col_id == CLOCK_INSERT_COLID) continue;
+            clock_entry *e = clock_vector_set(out, v->entries[i].col_id);
+            if (!e) return -1;
+            *e = v->entries[i];
+        }
+        return 0;
+    }
+
+    clock_entry *inserted = clock_vector_find(v, CLOCK_INSERT_COLID);
+    for (int i=0; i<ncols; ++i) {
+        clock_entry *entry = clock_vector_find(v, col_ids[i]);
+        if (!entry && !inserted) continue;
+
+        clock_entry *e = clock_vector_set(out, col_ids[i]);
+        if (!e) return -1;
+        if (entry) {
+            *e = *entry;
+        } else {
+            *e = *inserted;
+            e->col_id = col_ids[i];
+            e->seq = inserted->seq + i;
+        }
+    }
+
+    return 0;
+}
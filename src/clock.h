@@ -0,0 +1,43 @@
+//
+//  clock.h
+//  cloudsync
+//
+
+#ifndef __CLOUDSYNC_CLOCK__
+#define __CLOUDSYNC_CLOCK__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// col_id of the clock inherited by all the columns without an entry of their own (set by a local insert)
+#define CLOCK_INSERT_COLID          -1
+
+typedef struct {
+    int64_t     col_id;             // CLOUDSYNC_TOMBSTONE_COLID for the sentinel, CLOCK_INSERT_COLID for the insert clock
+    int64_t     col_version;
+    int64_t     db_version;
+    int64_t     seq;
+    int64_t     site_id;            // ordinal in cloudsync_site_id (0 is the local site)
+} clock_entry;
+
+typedef struct {
+    clock_entry *entries;
+    int         count;
+    int         capacity;
+} clock_vector;
+
+int clock_vector_decode (clock_vector *v, const char *buffer, size_t blen);
+char *clock_vector_encode (clock_vector *v, size_t *blen);
+void clock_vector_free (clock_vector *v);
+int clock_vector_copy (clock_vector *v, clock_vector *out);
+
+clock_entry *clock_vector_find (clock_vector *v, int64_t col_id);
+clock_entry *clock_vector_set (clock_vector *v, int64_t col_id);
+void clock_vector_remove (clock_vector *v, int64_t col_id);
+void clock_vector_drop_columns (clock_vector *v);
+int64_t clock_vector_max_db_version (clock_vector *v);
+int64_t clock_vector_cl (clock_vector *v);
+int clock_vector_expand (clock_vector *v, const int *col_ids, int ncols, clock_vector *out);
+
+#endif
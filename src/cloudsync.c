@@ -23,6 +23,14 @@
 #include "vtab.h"
 #include "utils.h"
 #include "dbutils.h"
+#include "clock.h"
+#include "schema.h"
+
+#define kcalloc(N,Z)                        cloudsync_memory_zeroalloc((uint64_t)(N) * (uint64_t)(Z))
+#define kmalloc(Z)                          cloudsync_memory_alloc((uint64_t)(Z))
+#define krealloc(P,Z)                       cloudsync_memory_realloc((P), (uint64_t)(Z))
+#define kfree(P)                            do {if (P) cloudsync_memory_free(P);} while (0)
+#include "khash.h"
 
 #ifndef CLOUDSYNC_OMIT_NETWORK
 #include "network.h"
@@ -67,6 +75,7 @@ SQLITE_EXTENSION_INIT1
 
 #define CLOUDSYNC_DEFAULT_ALGO                  "cls"
 #define CLOUDSYNC_INIT_NTABLES                  128
+#define CLOUDSYNC_ARENA_BLOCK_SIZE              16*1024
 #define CLOUDSYNC_VALUE_NOTSET                  -1
 #define CLOUDSYNC_MIN_DB_VERSION                0
 
@@ -74,6 +83,8 @@ SQLITE_EXTENSION_INIT1
 #define CLOUDSYNC_PAYLOAD_VERSION               1
 #define CLOUDSYNC_PAYLOAD_SIGNATURE             'CLSY'
 #define CLOUDSYNC_PAYLOAD_APPLY_CALLBACK_KEY    "cloudsync_payload_apply_callback"
+#define CLOUDSYNC_SNAPSHOT_SCHEMA               "cloudsync_snapshot"
+#define CLOUDSYNC_SNAPSHOT_VERSION              1
 
 #ifndef MAX
 #define MAX(a, b)                               (((a)>(b))?(a):(b))
@@ -107,45 +118,133 @@ typedef struct {
 #define SYNCBIT_SET(_data)                  _data->insync = 1
 #define SYNCBIT_RESET(_data)                _data->insync = 0
 #define BUMP_SEQ(_data)                     ((_data)->seq += 1, (_data)->seq - 1)
+#define TABLE_STATS_ADD(_table, _stat, _n)  ((_table)->stats[_stat] += (_n), (_table)->conn_stats[_stat] += (_n))
 
 // MARK: -
 
 typedef struct {
+    uint8_t         bytes[UUID_LEN];
+} cloudsync_siteid_key;
+
+typedef struct {
+    sqlite3_int64   ord;                            // rowid in cloudsync_site_id
+    bool            pending;                        // added by a transaction that is not committed yet
+} cloudsync_siteid_ord;
+
+static inline khint_t siteid_key_hash (cloudsync_siteid_key key) {
+    // site_ids are UUIDv7 (the first bytes are a timestamp), so the hash is computed on the random tail
+    uint64_t value;
+    memcpy(&value, key.bytes + UUID_LEN - sizeof(uint64_t), sizeof(uint64_t));
+    return kh_int64_hash_func(value);
+}
+
+#define siteid_key_equal(a, b)              (memcmp((a).bytes, (b).bytes, UUID_LEN) == 0)
+KHASH_INIT(SITEID_ORD, cloudsync_siteid_key, cloudsync_siteid_ord, 1, siteid_key_hash, siteid_key_equal)
+
+// statements of a table context, compiled on first use by table_stmt
+typedef enum {
+    TABLE_STMT_META_PKEXISTS = 0,                   // check if a primary key already exist in the augmented table
+    TABLE_STMT_META_SENTINEL_UPDATE,                // update a local sentinel row
+    TABLE_STMT_META_SENTINEL_INSERT,                // insert a local sentinel row
+    TABLE_STMT_META_ROW_INSERT_UPDATE,              // insert/update a local row
+    TABLE_STMT_META_ROW_DROP,                       // delete rows from meta
+    TABLE_STMT_META_UPDATE_MOVE,                    // update rows in meta when pk changes
+    TABLE_STMT_META_LOCAL_CL,                       // compute local cl value
+    TABLE_STMT_META_WINNER_CLOCK,                   // get the rowid of the last inserted/updated row in the meta table
+    TABLE_STMT_META_MERGE_DELETE_DROP,
+    TABLE_STMT_META_ZERO_CLOCK,
+    TABLE_STMT_META_COL_VERSION,
+    TABLE_STMT_META_SITE_ID,
+    TABLE_STMT_META_CLOCKS_SELECT,                  // load the clock vector of a row (packed storage only)
+    TABLE_STMT_META_CLOCKS_UPSERT,                  // store the clock vector of a row (packed storage only)
+    TABLE_STMT_META_CLOCKS_DELETE,                  // delete a row without clocks (packed storage only)
+    TABLE_STMT_REAL_COL_VALUES,                     // retrieve all column values based on pk
+    TABLE_STMT_REAL_MERGE_DELETE,
+    TABLE_STMT_REAL_MERGE_SENTINEL,
+    TABLE_STMT_COUNT
+} table_stmt_id;
+
+// a statement of a table context, linked in the LRU list of the connection while it is compiled
+typedef struct cloudsync_cached_stmt {
+    sqlite3_stmt                    *vm;            // NULL until first use and after an eviction
+    char                            *sql;           // generated on first use, kept to compile the statement again
+    struct cloudsync_cached_stmt    *prev;
+    struct cloudsync_cached_stmt    *next;
+} cloudsync_cached_stmt;
+
+// the compiled statements of all the tables of a connection, most recently used first
+typedef struct {
+    cloudsync_cached_stmt   *head;
+    cloudsync_cached_stmt   *tail;
+    int                     count;                  // number of compiled statements
+    int                     limit;                  // stmt_cache_size setting (0 means no limit)
+    uint64_t                *stats;                 // counters of the connection (hits, misses and evictions)
+} cloudsync_stmt_cache;
+
+// the budget is never lower than this, so that the few statements used together by an operation are never evicted
+// between their lookup and their execution (a statement still running is never evicted)
+#define CLOUDSYNC_STMT_CACHE_MIN_SIZE       32
+
+// the clock vector of the row being updated or merged in a packed meta-table, kept between the operations on its
+// columns so that it is read and written just once per row (see packed_batch_begin)
+typedef struct {
+    struct cloudsync_table_context *table;    // table of the buffered row (NULL if no row is buffered)
+    char            *pk;
+    size_t          pklen;
+    clock_vector    v;
+    bool            dirty;                      // v must be written back to the meta-table
+    bool            active;                     // loads and stores are buffered
+    
+    // state of the buffered row before the change being merged (see packed_batch_next)
+    struct cloudsync_table_context *saved_table;
+    char            *saved_pk;
+    size_t          saved_pklen;
+    clock_vector    saved;
+    bool            saved_dirty;
+} cloudsync_packed_row;
+
+typedef struct cloudsync_table_context {
     table_algo      algo;                           // CRDT algoritm associated to the table
     char            *name;                          // table name
+    sqlite3         *db;                            // connection used to compile the statements
     char            **col_name;                     // array of column names
-    sqlite3_stmt    **col_merge_stmt;               // array of merge insert stmt (indexed by col_name)
-    sqlite3_stmt    **col_value_stmt;               // array of column value stmt (indexed by col_name)
-    int             *col_id;                        // array of column id
+    cloudsync_cached_stmt *col_merge_stmt;          // array of merge insert stmt (indexed by col_name, see table_column_stmt)
+    cloudsync_cached_stmt *col_value_stmt;          // array of column value stmt (indexed by col_name, see table_column_stmt)
+    int             *col_id;                        // array of column id (from the cloudsync_columns dictionary)
+    schema_shared   *schema;                        // owner of col_name and col_id when shared with other connections (see schema.c)
     int             ncols;                          // number of non primary key cols
     int             npks;                           // number of primary key cols
     bool            enabled;                        // flag to check if a table is enabled or disabled
+    bool            packed;                         // clocks stored as a single clock vector per row (see clock.c)
+    bool            intpk;                          // meta-table keyed by the integer value of a rowid primary key
     #if !CLOUDSYNC_DISABLE_ROWIDONLY_TABLES
     bool            rowid_only;                     // a table with no primary keys other than the implicit rowid
     #endif
     
-    char            **pk_name;                      // array of primary key names
-    
-    // precompiled statements
-    sqlite3_stmt    *meta_pkexists_stmt;            // check if a primary key already exist in the augmented table
-    sqlite3_stmt    *meta_sentinel_update_stmt;     // update a local sentinel row
-    sqlite3_stmt    *meta_sentinel_insert_stmt;     // insert a local sentinel row
-    sqlite3_stmt    *meta_row_insert_update_stmt;   // insert/update a local row
-    sqlite3_stmt    *meta_row_drop_stmt;            // delete rows from meta
-    sqlite3_stmt    *meta_update_move_stmt;         // update rows in meta when pk changes
-    sqlite3_stmt    *meta_local_cl_stmt;            // compute local cl value
-    sqlite3_stmt    *meta_winner_clock_stmt;        // get the rowid of the last inserted/updated row in the meta table
-    sqlite3_stmt    *meta_merge_delete_drop;
-    sqlite3_stmt    *meta_zero_clock_stmt;
-    sqlite3_stmt    *meta_col_version_stmt;
-    sqlite3_stmt    *meta_site_id_stmt;
-    
-    sqlite3_stmt    *real_col_values_stmt;          // retrieve all column values based on pk
-    sqlite3_stmt    *real_merge_delete_stmt;
-    sqlite3_stmt    *real_merge_sentinel_stmt;
+    char            **pk_name;                      // array of primary key names (set by cloudsync_begin_alter)
+    sqlite3_int64   alter_changes;                  // sqlite3_total_changes64 when cloudsync_begin_alter was called
+    bool            alter_rowid_pk;                 // dbutils_table_has_rowid_pk when cloudsync_begin_alter was called
+    
+    uint64_t        stats[CLOUDSYNC_STAT_TABLE_COUNT];  // per-table counters (see stats.h)
+    uint64_t        *conn_stats;                    // counters of the connection, updated together with the table ones
+    
+    // statements compiled on first use (opening a connection doesn't depend on the number of tables and columns),
+    // their SQL is kept so that a statement evicted from stmt_cache can be compiled again without generating it
+    cloudsync_cached_stmt stmts[TABLE_STMT_COUNT];
+    cloudsync_stmt_cache *stmt_cache;               // LRU list of the connection (NULL for a table outside a context)
+    cloudsync_packed_row *packed_row;               // row buffer of the connection (NULL for a table outside a context)
     
 } cloudsync_table_context;
 
+typedef struct {
+    cloudsync_table_context *table;
+    sqlite3_value   *pk;                        // encoded (or integer) primary key of the cached row
+    sqlite3_value   **values;                   // values of the non primary key columns (same order of table->col_name)
+    int             nvalues;
+    bool            exists;                     // false if the row does not exist (or it is not visible because of RLS)
+    sqlite3_int64   total_changes;              // sqlite3_total_changes64 when the row was loaded
+} cloudsync_row_cache;
+
 struct cloudsync_pk_decode_bind_context {
     sqlite3_stmt    *vm;
     char            *tbl;
@@ -179,6 +278,7 @@ struct cloudsync_context {
     sqlite3_stmt    *data_version_stmt;
     sqlite3_stmt    *db_version_stmt;
     sqlite3_stmt    *getset_siteid_stmt;
+    sqlite3_stmt    *get_siteid_stmt;
     int             data_version;
     int             schema_version;
     uint64_t        schema_hash;
@@ -192,12 +292,59 @@ struct cloudsync_context {
     // used to set an order inside each transaction
     int             seq;
     
+    // db_version of the last committed local change and of the last sent change, both mirrored
+    // from cloudsync_settings so checking for unsent changes doesn't need to scan the meta tables
+    sqlite3_int64   local_db_version;
+    // db_version of the local changes performed in the current transaction (already persisted in it)
+    sqlite3_int64   pending_local_db_version;
+    sqlite3_int64   send_db_version;
+    int             local_data_version;
+    sqlite3_stmt    *local_version_stmt;
+    
     // augmented tables are stored in-memory so we do not need to retrieve information about col names and cid
     // from the disk each time a write statement is performed
     // we do also not need to use an hash map here because for few tables the direct in-memory comparison with table name is faster
     cloudsync_table_context **tables;
     int tables_count;
     int tables_alloc;
+    
+    // transaction grouping of cloudsync_payload_apply (0 means no limit) and its persistent statements
+    int             apply_group_dbversions;
+    int             apply_group_rows;
+    int             apply_group_ms;
+    bool            apply_in_use;
+    sqlite3_stmt    *apply_stmt;
+    sqlite3_stmt    *apply_savepoint_stmt;
+    sqlite3_stmt    *apply_release_stmt;
+    
+    // number of rows backfilled by each batch of cloudsync_init and cloudsync_backfill (0 means no limit)
+    sqlite3_int64   backfill_batch;
+    
+    // ordinals of the site_ids already seen, so that merging a change doesn't need to write to cloudsync_site_id
+    khash_t(SITEID_ORD) *siteid_ords;
+    int             siteid_pending;             // number of entries added by the current transaction
+    int             siteid_data_version;        // data_version the entries are valid for
+    bool            siteid_checked;             // data_version already checked in the current transaction
+    
+    // values of the last base row read by cloudsync_col_value while a cloudsync_changes scan is active
+    cloudsync_row_cache row_cache;
+    int             changes_scans;              // number of open cloudsync_changes cursors
+    
+    // hot-path counters and latency histograms exposed by the cloudsync_stats virtual table
+    cloudsync_stats stats;
+    
+    // compiled statements of the table contexts, bounded by the stmt_cache_size setting
+    cloudsync_stmt_cache stmt_cache;
+    
+    // process-wide metadata of the tables used while loading them (shared_schema setting, see schema.c)
+    bool            shared_schema;
+    schema_shared   *schema;
+    
+    // transient allocations of the tracking and apply paths, reset at the end of each transaction
+    cloudsync_arena arena;
+    
+    // clock vector of the packed row being updated or merged
+    cloudsync_packed_row packed_row;
 };
 
 typedef struct {
@@ -206,6 +353,7 @@ typedef struct {
     size_t      bused;
     uint64_t    nrows;
     uint16_t    ncols;
+    uint64_t    start_us;
 } cloudsync_data_payload;
 
 #ifdef _MSC_VER
@@ -223,7 +371,7 @@ typedef struct PACKED {
     uint16_t    ncols;
     uint32_t    nrows;
     uint64_t    schema_hash;
-    uint8_t     unused[6];        // padding to ensure the struct is exactly 32 bytes
+    uint8_t     sender[6];        // low 48 bits of the sender site_id (all zeros if unknown), also pads the struct to exactly 32 bytes
 } cloudsync_payload_header;
 
 typedef struct {
@@ -232,8 +380,25 @@ typedef struct {
     sqlite3_value   **old_values;
     int             count;
     int             capacity;
+    bool            in_arena;           // the arrays are allocated in a scope of the context arena
+    cloudsync_arena_mark mark;
 } cloudsync_update_payload;
 
+typedef struct {
+    uint8_t         site_id[UUID_LEN];
+    sqlite3_int64   db_version;
+    sqlite3_int64   seq;
+    bool            dirty;                      // high-water mark advanced while applying the current payload
+    bool            frozen;                     // a row from this origin was not applied, so the mark cannot advance anymore
+} cloudsync_site_version;
+
+typedef struct {
+    sqlite3_int64           sender;             // sender tag of the payload (0 means unknown and disables the vector)
+    cloudsync_site_version  *items;
+    int                     count;
+    int                     alloc;
+} cloudsync_site_vector;
+
 #ifdef _MSC_VER
     #pragma pack(pop)
 #endif
@@ -247,7 +412,10 @@ bool force_uncompressed_blob = false;
 
 int db_version_rebuild_stmt (sqlite3 *db, cloudsync_context *data);
 int cloudsync_load_siteid (sqlite3 *db, cloudsync_context *data);
-int local_mark_insert_or_update_meta (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, const char *col_name, sqlite3_int64 db_version, int seq);
+int local_mark_insert_or_update_meta (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, int col_id, sqlite3_int64 db_version, int seq);
+int local_update_version (sqlite3 *db, cloudsync_context *data, sqlite3_int64 db_version);
+void row_cache_clear (cloudsync_row_cache *cache);
+int cloudsync_register (sqlite3 *db, char **pzErrMsg, cloudsync_context **context);
 
 // MARK: - STMT Utils -
 
@@ -283,6 +451,11 @@ CLOUDSYNC_STMT_VALUE stmt_execute (sqlite3_stmt *stmt, cloudsync_context *data)
     return result;
 }
 
+static inline int meta_step (cloudsync_table_context *table, sqlite3_stmt *vm) {
+    TABLE_STATS_ADD(table, CLOUDSYNC_STAT_META_STATEMENTS, 1);
+    return sqlite3_step(vm);
+}
+
 int stmt_count (sqlite3_stmt *stmt, const char *value, size_t len, int type) {
     int result = -1;
     int rc = SQLITE_OK;
@@ -308,6 +481,8 @@ cleanup:
 }
 
 sqlite3_stmt *stmt_reset (sqlite3_stmt *stmt) {
+    // table statements are compiled on first use, so a statement that failed to compile is NULL
+    if (!stmt) return NULL;
     sqlite3_clear_bindings(stmt);
     sqlite3_reset(stmt);
     return NULL;
@@ -336,13 +511,31 @@ int stmts_add_tocontext (sqlite3 *db, cloudsync_context *data) {
         // get and set index of the site_id
         // in SQLite, we can’t directly combine an INSERT and a SELECT to both insert a row and return an identifier (rowid) in a single statement,
         // however, we can use a workaround by leveraging the INSERT statement with ON CONFLICT DO UPDATE and then combining it with RETURNING rowid
-        const char *sql = "INSERT INTO cloudsync_site_id (site_id) VALUES (?) ON CONFLICT(site_id) DO UPDATE SET site_id = site_id RETURNING rowid;";
+        // the rowid is explicitly assigned above the high-water mark left by cloudsync_gc, so the ordinal of a collected site_id is never reused
+        const char *sql = "INSERT INTO cloudsync_site_id (rowid, site_id) SELECT max(IFNULL((SELECT max(rowid) FROM cloudsync_site_id), 0), IFNULL((SELECT CAST(value AS INTEGER) FROM cloudsync_settings WHERE key = '" CLOUDSYNC_KEY_SITEID_HWM "'), 0)) + 1, ?1 WHERE true ON CONFLICT(site_id) DO UPDATE SET site_id = site_id RETURNING rowid;";
         int rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &data->getset_siteid_stmt, NULL);
         DEBUG_STMT("getset_siteid_stmt %p", data->getset_siteid_stmt);
         if (rc != SQLITE_OK) return rc;
         DEBUG_SQL("getset_siteid_stmt: %s", sql);
     }
     
+    if (data->get_siteid_stmt == NULL) {
+        const char *sql = "SELECT rowid FROM cloudsync_site_id WHERE site_id = ?;";
+        int rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &data->get_siteid_stmt, NULL);
+        DEBUG_STMT("get_siteid_stmt %p", data->get_siteid_stmt);
+        if (rc != SQLITE_OK) return rc;
+        DEBUG_SQL("get_siteid_stmt: %s", sql);
+    }
+    
+    if (data->local_version_stmt == NULL) {
+        // the row is written only when the value changes (see local_update_version)
+        const char *sql = "INSERT INTO cloudsync_settings (key, value) VALUES ('" CLOUDSYNC_KEY_LOCAL_DBVERSION "', ?1) ON CONFLICT(key) DO UPDATE SET value = excluded.value WHERE value IS NOT excluded.value;";
+        int rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &data->local_version_stmt, NULL);
+        DEBUG_STMT("local_version_stmt %p", data->local_version_stmt);
+        if (rc != SQLITE_OK) return rc;
+        DEBUG_SQL("local_version_stmt: %s", sql);
+    }
+    
     return db_version_rebuild_stmt(db, data);
 }
 
@@ -362,7 +555,7 @@ char *db_version_build_query (sqlite3 *db) {
          UNION ALL
          SELECT max(db_version) as version FROM "table3_cloudsync"
          UNION
-         SELECT value as version FROM cloudsync_settings WHERE key = 'pre_alter_dbversion'
+         SELECT CAST(value AS INTEGER) as version FROM cloudsync_settings WHERE key = 'pre_alter_dbversion'
      )
      */
     
@@ -377,7 +570,7 @@ char *db_version_build_query (sqlite3 *db) {
                       "SELECT 'SELECT max(db_version) as version FROM \"' || tbl_name || '\"' as part FROM table_names"
                       "), "
                       "combined_query AS ("
-                      "SELECT GROUP_CONCAT(part, ' UNION ALL ') || ' UNION SELECT value as version FROM cloudsync_settings WHERE key = ''pre_alter_dbversion''' as full_query FROM query_parts"
+                      "SELECT GROUP_CONCAT(part, ' UNION ALL ') || ' UNION SELECT CAST(value AS INTEGER) as version FROM cloudsync_settings WHERE key = ''pre_alter_dbversion''' as full_query FROM query_parts"
                       ") "
                       "SELECT 'SELECT max(version) as version FROM (' || full_query || ');' FROM combined_query;";
     return dbutils_text_select(db, sql);
@@ -614,6 +807,57 @@ char *table_build_value_sql (sqlite3 *db, cloudsync_table_context *table, const
     return query;
 }
     
+void stmt_cache_link (cloudsync_stmt_cache *cache, cloudsync_cached_stmt *entry) {
+    // insert as the most recently used
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) cache->head->prev = entry;
+    else cache->tail = entry;
+    cache->head = entry;
+    cache->count++;
+}
+
+void stmt_cache_unlink (cloudsync_stmt_cache *cache, cloudsync_cached_stmt *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else cache->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else cache->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+    cache->count--;
+}
+
+void stmt_cache_trim (cloudsync_stmt_cache *cache, int room) {
+    // finalize the least recently used statements until room statements can be added without exceeding the budget,
+    // their SQL is kept in the entry and table_stmt_get compiles them again on their next use
+    if (cache->limit <= 0) return;
+    int limit = (cache->limit < CLOUDSYNC_STMT_CACHE_MIN_SIZE) ? CLOUDSYNC_STMT_CACHE_MIN_SIZE : cache->limit;
+    
+    cloudsync_cached_stmt *entry = cache->tail;
+    while (entry && cache->count + room > limit) {
+        cloudsync_cached_stmt *prev = entry->prev;
+        // a statement that is still running (for example the merge statement that fired the trigger being executed) is skipped
+        if (!sqlite3_stmt_busy(entry->vm)) {
+            stmt_cache_unlink(cache, entry);
+            sqlite3_finalize(entry->vm);
+            entry->vm = NULL;
+            cache->stats[CLOUDSYNC_STAT_STMT_CACHE_EVICTIONS] += 1;
+        }
+        entry = prev;
+    }
+}
+
+void table_stmt_free (cloudsync_table_context *table, cloudsync_cached_stmt *entry) {
+    if (entry->vm) {
+        if (table->stmt_cache) stmt_cache_unlink(table->stmt_cache, entry);
+        sqlite3_finalize(entry->vm);
+        entry->vm = NULL;
+    }
+    if (entry->sql) {
+        cloudsync_memory_free(entry->sql);
+        entry->sql = NULL;
+    }
+}
+
 cloudsync_table_context *table_create (const char *name, table_algo algo) {
     DEBUG_DBFUNCTION("table_create %s", name);
     
@@ -636,7 +880,7 @@ void table_free (cloudsync_table_context *table) {
     if (!table) return;
     
     if (table->ncols > 0) {
-        if (table->col_name) {
+        if (table->col_name && !table->schema) {
             for (int i=0; i<table->ncols; ++i) {
                 cloudsync_memory_free(table->col_name[i]);
             }
@@ -644,194 +888,182 @@ void table_free (cloudsync_table_context *table) {
         }
         if (table->col_merge_stmt) {
             for (int i=0; i<table->ncols; ++i) {
-                sqlite3_finalize(table->col_merge_stmt[i]);
+                table_stmt_free(table, &table->col_merge_stmt[i]);
             }
             cloudsync_memory_free(table->col_merge_stmt);
         }
         if (table->col_value_stmt) {
             for (int i=0; i<table->ncols; ++i) {
-                sqlite3_finalize(table->col_value_stmt[i]);
+                table_stmt_free(table, &table->col_value_stmt[i]);
             }
             cloudsync_memory_free(table->col_value_stmt);
         }
-        if (table->col_id) {
+        if (table->col_id && !table->schema) {
             cloudsync_memory_free(table->col_id);
         }
     }
+    schema_shared_release(table->schema);
     
     if (table->pk_name) sqlite3_free_table(table->pk_name);
     if (table->name) cloudsync_memory_free(table->name);
-    if (table->meta_pkexists_stmt) sqlite3_finalize(table->meta_pkexists_stmt);
-    if (table->meta_sentinel_update_stmt) sqlite3_finalize(table->meta_sentinel_update_stmt);
-    if (table->meta_sentinel_insert_stmt) sqlite3_finalize(table->meta_sentinel_insert_stmt);
-    if (table->meta_row_insert_update_stmt) sqlite3_finalize(table->meta_row_insert_update_stmt);
-    if (table->meta_row_drop_stmt) sqlite3_finalize(table->meta_row_drop_stmt);
-    if (table->meta_update_move_stmt) sqlite3_finalize(table->meta_update_move_stmt);
-    if (table->meta_local_cl_stmt) sqlite3_finalize(table->meta_local_cl_stmt);
-    if (table->meta_winner_clock_stmt) sqlite3_finalize(table->meta_winner_clock_stmt);
-    if (table->meta_merge_delete_drop) sqlite3_finalize(table->meta_merge_delete_drop);
-    if (table->meta_zero_clock_stmt) sqlite3_finalize(table->meta_zero_clock_stmt);
-    if (table->meta_col_version_stmt) sqlite3_finalize(table->meta_col_version_stmt);
-    if (table->meta_site_id_stmt) sqlite3_finalize(table->meta_site_id_stmt);
-    
-    if (table->real_col_values_stmt) sqlite3_finalize(table->real_col_values_stmt);
-    if (table->real_merge_delete_stmt) sqlite3_finalize(table->real_merge_delete_stmt);
-    if (table->real_merge_sentinel_stmt) sqlite3_finalize(table->real_merge_sentinel_stmt);
+    for (int i=0; i<TABLE_STMT_COUNT; ++i) {
+        table_stmt_free(table, &table->stmts[i]);
+    }
     
     cloudsync_memory_free(table);
 }
 
-int table_add_stmts (sqlite3 *db, cloudsync_table_context *table, int ncols) {
-    int rc = SQLITE_OK;
-    char *sql = NULL;
-    
+char *table_build_packed_stmt_sql (cloudsync_table_context *table, table_stmt_id id) {
+    // CREATE TABLE IF NOT EXISTS \"%w_cloudsync\" (pk BLOB NOT NULL PRIMARY KEY, db_version INTEGER, clocks BLOB) WITHOUT ROWID;
+    // reads expand the clock vector through the cloudsync_clocks table-valued function and use the same
+    // parameters of the per-column statements, so that the merge code does not depend on the storage mode
+    switch (id) {
+        case TABLE_STMT_META_CLOCKS_SELECT:
+            return cloudsync_memory_mprintf("SELECT clocks FROM \"%w_cloudsync\" WHERE pk=?;", table->name);
+            
+        case TABLE_STMT_META_CLOCKS_UPSERT:
+            return cloudsync_memory_mprintf("INSERT OR REPLACE INTO \"%w_cloudsync\" (pk, db_version, clocks) VALUES (?, ?, ?);", table->name);
+            
+        case TABLE_STMT_META_CLOCKS_DELETE:
+            return cloudsync_memory_mprintf("DELETE FROM \"%w_cloudsync\" WHERE pk=?;", table->name);
+            
+        // local cl (pk is bound twice like in the per-column statement)
+        case TABLE_STMT_META_LOCAL_CL:
+            return cloudsync_memory_mprintf("SELECT c.cl FROM \"%w_cloudsync\" AS r, cloudsync_clocks('%q', r.pk, r.clocks) AS c WHERE r.pk=?1 AND r.pk=?2 LIMIT 1;", table->name, table->name);
+            
+        case TABLE_STMT_META_COL_VERSION:
+            return cloudsync_memory_mprintf("SELECT c.col_version FROM \"%w_cloudsync\" AS r, cloudsync_clocks('%q', r.pk, r.clocks) AS c WHERE r.pk=? AND c.col_id=?;", table->name, table->name);
+            
+        case TABLE_STMT_META_SITE_ID:
+            return cloudsync_memory_mprintf("SELECT c.site_id FROM \"%w_cloudsync\" AS r, cloudsync_clocks('%q', r.pk, r.clocks) AS c WHERE r.pk=? AND c.col_id=?;", table->name, table->name);
+            
+        default:
+            return NULL;
+    }
+}
+
+char *table_build_stmt_sql (sqlite3 *db, cloudsync_table_context *table, table_stmt_id id) {
     // META TABLE statements
     
-    // CREATE TABLE IF NOT EXISTS \"%w_cloudsync\" (pk BLOB NOT NULL, col_name TEXT NOT NULL, col_version INTEGER, db_version INTEGER, site_id INTEGER DEFAULT 0, seq INTEGER, PRIMARY KEY (pk, col_name));
+    // CREATE TABLE IF NOT EXISTS \"%w_cloudsync\" (pk BLOB NOT NULL, col_id INTEGER NOT NULL, col_version INTEGER, db_version INTEGER, site_id INTEGER DEFAULT 0, seq INTEGER, PRIMARY KEY (pk, col_id));
     
-    // precompile the pk exists statement
+    // pk exists statement
     // we do not need an index on the pk column because it is already covered by the fact that it is part of the prikeys
     // EXPLAIN QUERY PLAN reports: SEARCH table_name USING PRIMARY KEY (pk=?)
-    sql = cloudsync_memory_mprintf("SELECT EXISTS(SELECT 1 FROM \"%w_cloudsync\" WHERE pk = ? LIMIT 1);", table->name);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("meta_pkexists_stmt: %s", sql);
-    
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_pkexists_stmt, NULL);
+    if (id == TABLE_STMT_META_PKEXISTS) return cloudsync_memory_mprintf("SELECT EXISTS(SELECT 1 FROM \"%w_cloudsync\" WHERE pk = ? LIMIT 1);", table->name);
     
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    // precompile the update local sentinel statement
-    sql = cloudsync_memory_mprintf("UPDATE \"%w_cloudsync\" SET col_version = CASE col_version %% 2 WHEN 0 THEN col_version + 1 ELSE col_version + 2 END, db_version = ?, seq = ?, site_id = 0 WHERE pk = ? AND col_name = '%s';", table->name, CLOUDSYNC_TOMBSTONE_VALUE);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("meta_sentinel_update_stmt: %s", sql);
-    
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_sentinel_update_stmt, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
+    // REAL TABLE statements
+    if (id == TABLE_STMT_REAL_COL_VALUES) return (table->ncols > 0) ? table_build_values_sql(db, table) : NULL;
+    if (id == TABLE_STMT_REAL_MERGE_DELETE) return table_build_mergedelete_sql(db, table);
+    if (id == TABLE_STMT_REAL_MERGE_SENTINEL) return table_build_mergeinsert_sql(db, table, NULL);
     
-    // precompile the insert local sentinel statement
-    sql = cloudsync_memory_mprintf("INSERT INTO \"%w_cloudsync\" (pk, col_name, col_version, db_version, seq, site_id) SELECT ?, '%s', 1, ?, ?, 0 WHERE 1 ON CONFLICT DO UPDATE SET col_version = CASE col_version %% 2 WHEN 0 THEN col_version + 1 ELSE col_version + 2 END, db_version = ?, seq = ?, site_id = 0;", table->name, CLOUDSYNC_TOMBSTONE_VALUE);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("meta_sentinel_insert_stmt: %s", sql);
+    // a packed meta-table is updated by reading and writing its clock vectors
+    if (table->packed) return table_build_packed_stmt_sql(table, id);
     
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_sentinel_insert_stmt, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
+    switch (id) {
+        // update local sentinel statement
+        case TABLE_STMT_META_SENTINEL_UPDATE:
+            return cloudsync_memory_mprintf("UPDATE \"%w_cloudsync\" SET col_version = CASE col_version %% 2 WHEN 0 THEN col_version + 1 ELSE col_version + 2 END, db_version = ?, seq = ?, site_id = 0 WHERE pk = ? AND col_id = %d;", table->name, CLOUDSYNC_TOMBSTONE_COLID);
+            
+        // insert local sentinel statement
+        case TABLE_STMT_META_SENTINEL_INSERT:
+            return cloudsync_memory_mprintf("INSERT INTO \"%w_cloudsync\" (pk, col_id, col_version, db_version, seq, site_id) SELECT ?, %d, 1, ?, ?, 0 WHERE 1 ON CONFLICT DO UPDATE SET col_version = CASE col_version %% 2 WHEN 0 THEN col_version + 1 ELSE col_version + 2 END, db_version = ?, seq = ?, site_id = 0;", table->name, CLOUDSYNC_TOMBSTONE_COLID);
+            
+        // insert/update local row statement
+        case TABLE_STMT_META_ROW_INSERT_UPDATE:
+            return cloudsync_memory_mprintf("INSERT INTO \"%w_cloudsync\" (pk, col_id, col_version, db_version, seq, site_id ) SELECT ?, ?, ?, ?, ?, 0 WHERE 1 ON CONFLICT DO UPDATE SET col_version = col_version + 1, db_version = ?, seq = ?, site_id = 0;", table->name);
+            
+        // delete rows from meta
+        case TABLE_STMT_META_ROW_DROP:
+        case TABLE_STMT_META_MERGE_DELETE_DROP:
+            return cloudsync_memory_mprintf("DELETE FROM \"%w_cloudsync\" WHERE pk=? AND col_id!=%d;", table->name, CLOUDSYNC_TOMBSTONE_COLID);
+            
+        // update rows from meta when pk changes
+        // see https://github.com/sqliteai/sqlite-sync/blob/main/docs/PriKey.md for more details
+        case TABLE_STMT_META_UPDATE_MOVE:
+            return cloudsync_memory_mprintf("UPDATE OR REPLACE \"%w_cloudsync\" SET pk=?, db_version=?, col_version=1, seq=cloudsync_seq(), site_id=0 WHERE (pk=? AND col_id!=%d);", table->name, CLOUDSYNC_TOMBSTONE_COLID);
+            
+        // local cl
+        case TABLE_STMT_META_LOCAL_CL:
+            return cloudsync_memory_mprintf("SELECT COALESCE((SELECT col_version FROM \"%w_cloudsync\" WHERE pk=? AND col_id=%d), (SELECT 1 FROM \"%w_cloudsync\" WHERE pk=?));", table->name, CLOUDSYNC_TOMBSTONE_COLID, table->name);
+            
+        // rowid of the last inserted/updated row in the meta table
+        case TABLE_STMT_META_WINNER_CLOCK:
+            return cloudsync_memory_mprintf("INSERT OR REPLACE INTO \"%w_cloudsync\" (pk, col_id, col_version, db_version, seq, site_id) VALUES (?, ?, ?, cloudsync_db_version_next(?), ?, ?) RETURNING ((db_version << 30) | seq);", table->name);
+            
+        // zero clock
+        case TABLE_STMT_META_ZERO_CLOCK:
+            return cloudsync_memory_mprintf("UPDATE \"%w_cloudsync\" SET col_version = 0, db_version = cloudsync_db_version_next(?) WHERE pk=? AND col_id!=%d;", table->name, CLOUDSYNC_TOMBSTONE_COLID);
+            
+        case TABLE_STMT_META_COL_VERSION:
+            return cloudsync_memory_mprintf("SELECT col_version FROM \"%w_cloudsync\" WHERE pk=? AND col_id=?;", table->name);
+            
+        case TABLE_STMT_META_SITE_ID:
+            return cloudsync_memory_mprintf("SELECT site_id FROM \"%w_cloudsync\" WHERE pk=? AND col_id=?;", table->name);
+            
+        default:
+            return NULL;
+    }
+}
 
-    // precompile the insert/update local row statement
-    sql = cloudsync_memory_mprintf("INSERT INTO \"%w_cloudsync\" (pk, col_name, col_version, db_version, seq, site_id ) SELECT ?, ?, ?, ?, ?, 0 WHERE 1 ON CONFLICT DO UPDATE SET col_version = col_version + 1, db_version = ?, seq = ?, site_id = 0;", table->name);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("meta_row_insert_update_stmt: %s", sql);
-    
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_row_insert_update_stmt, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    // precompile the delete rows from meta
-    sql = cloudsync_memory_mprintf("DELETE FROM \"%w_cloudsync\" WHERE pk=? AND col_name!='%s';", table->name, CLOUDSYNC_TOMBSTONE_VALUE);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("meta_row_drop_stmt: %s", sql);
-    
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_row_drop_stmt, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    // precompile the update rows from meta when pk changes
-    // see https://github.com/sqliteai/sqlite-sync/blob/main/docs/PriKey.md for more details
-    sql = cloudsync_memory_mprintf("UPDATE OR REPLACE \"%w_cloudsync\" SET pk=?, db_version=?, col_version=1, seq=cloudsync_seq(), site_id=0 WHERE (pk=? AND col_name!='%s');", table->name, CLOUDSYNC_TOMBSTONE_VALUE);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("meta_update_move_stmt: %s", sql);
-    
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_update_move_stmt, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    // local cl
-    sql = cloudsync_memory_mprintf("SELECT COALESCE((SELECT col_version FROM \"%w_cloudsync\" WHERE pk=? AND col_name='%s'), (SELECT 1 FROM \"%w_cloudsync\" WHERE pk=?));", table->name, CLOUDSYNC_TOMBSTONE_VALUE, table->name);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("meta_local_cl_stmt: %s", sql);
-    
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_local_cl_stmt, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    // rowid of the last inserted/updated row in the meta table
-    sql = cloudsync_memory_mprintf("INSERT OR REPLACE INTO \"%w_cloudsync\" (pk, col_name, col_version, db_version, seq, site_id) VALUES (?, ?, ?, cloudsync_db_version_next(?), ?, ?) RETURNING ((db_version << 30) | seq);", table->name);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("meta_winner_clock_stmt: %s", sql);
-    
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_winner_clock_stmt, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    sql = cloudsync_memory_mprintf("DELETE FROM \"%w_cloudsync\" WHERE pk=? AND col_name!='%s';", table->name, CLOUDSYNC_TOMBSTONE_VALUE);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("meta_merge_delete_drop: %s", sql);
-    
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_merge_delete_drop, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    // zero clock
-    sql = cloudsync_memory_mprintf("UPDATE \"%w_cloudsync\" SET col_version = 0, db_version = cloudsync_db_version_next(?) WHERE pk=? AND col_name!='%s';", table->name, CLOUDSYNC_TOMBSTONE_VALUE);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("meta_zero_clock_stmt: %s", sql);
-    
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_zero_clock_stmt, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    // col_version
-    sql = cloudsync_memory_mprintf("SELECT col_version FROM \"%w_cloudsync\" WHERE pk=? AND col_name=?;", table->name);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("meta_col_version_stmt: %s", sql);
-    
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_col_version_stmt, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    // site_id
-    sql = cloudsync_memory_mprintf("SELECT site_id FROM \"%w_cloudsync\" WHERE pk=? AND col_name=?;", table->name);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("meta_site_id_stmt: %s", sql);
-    
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_site_id_stmt, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    // REAL TABLE statements
-    
-    // precompile the get column value statement
-    if (ncols > 0) {
-        sql = table_build_values_sql(db, table);
-        if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-        DEBUG_SQL("real_col_values_stmt: %s", sql);
-        
-        rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->real_col_values_stmt, NULL);
-        cloudsync_memory_free(sql);
-        if (rc != SQLITE_OK) goto cleanup;
+sqlite3_stmt *table_stmt_compile (cloudsync_table_context *table, cloudsync_cached_stmt *entry, table_stmt_id id, int index, bool is_merge) {
+    // the SQL is generated only the first time (it can require pragma_table_info queries)
+    if (entry->sql == NULL) {
+        if (index < 0) entry->sql = table_build_stmt_sql(table->db, table, id);
+        else if (is_merge) entry->sql = table_build_mergeinsert_sql(table->db, table, table->col_name[index]);
+        else entry->sql = table_build_value_sql(table->db, table, table->col_name[index]);
+        if (entry->sql == NULL) return NULL;
     }
+    DEBUG_SQL("table_stmt %s (%d/%d): %s", table->name, id, index, entry->sql);
     
-    sql = table_build_mergedelete_sql(db, table);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("real_merge_delete: %s", sql);
-    
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->real_merge_delete_stmt, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
+    // make room before compiling, so that the new statement is never the one evicted
+    cloudsync_stmt_cache *cache = table->stmt_cache;
+    if (cache) stmt_cache_trim(cache, 1);
     
-    sql = table_build_mergeinsert_sql(db, table, NULL);
-    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
-    DEBUG_SQL("real_merge_sentinel: %s", sql);
+    int rc = sqlite3_prepare_v3(table->db, entry->sql, -1, SQLITE_PREPARE_PERSISTENT, &entry->vm, NULL);
+    if (rc != SQLITE_OK) {
+        printf("table_stmt_compile error: %s\n", sqlite3_errmsg(table->db));
+        entry->vm = NULL;
+        return NULL;
+    }
     
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->real_merge_sentinel_stmt, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto cleanup;
+    if (cache) {
+        cache->stats[CLOUDSYNC_STAT_STMT_CACHE_MISSES] += 1;
+        stmt_cache_link(cache, entry);
+    }
+    return entry->vm;
+}
+
+sqlite3_stmt *table_stmt_get (cloudsync_table_context *table, cloudsync_cached_stmt *entry, table_stmt_id id, int index, bool is_merge) {
+    if (entry->vm == NULL) return table_stmt_compile(table, entry, id, index, is_merge);
     
-cleanup:
-    if (rc != SQLITE_OK) printf("table_add_stmts error: %s\n", sqlite3_errmsg(db));
-    return rc;
+    cloudsync_stmt_cache *cache = table->stmt_cache;
+    if (cache) {
+        cache->stats[CLOUDSYNC_STAT_STMT_CACHE_HITS] += 1;
+        if (cache->head != entry) {
+            stmt_cache_unlink(cache, entry);
+            stmt_cache_link(cache, entry);
+        }
+    }
+    return entry->vm;
+}
+
+sqlite3_stmt *table_stmt (cloudsync_table_context *table, table_stmt_id id) {
+    // NULL if the statement cannot be compiled (or doesn't apply to the storage mode of the table)
+    return table_stmt_get(table, &table->stmts[id], id, -1, false);
+}
+
+sqlite3_stmt *table_column_stmt (cloudsync_table_context *table, int index, bool is_merge) {
+    cloudsync_cached_stmt *entry = (is_merge) ? &table->col_merge_stmt[index] : &table->col_value_stmt[index];
+    return table_stmt_get(table, entry, TABLE_STMT_COUNT, index, is_merge);
+}
+
+int table_bind_pk (cloudsync_table_context *table, sqlite3_stmt *vm, int index, const char *pk, size_t pklen) {
+    // the meta-table of a table whose primary key is the rowid stores the integer value instead of the encoded pk
+    // (it falls back to the blob if pk does not contain a single integer, so the mismatch is reported by the statement)
+    int64_t value = 0;
+    if (table->intpk && pk_decode_prikey_int64((char *)pk, pklen, &value)) return sqlite3_bind_int64(vm, index, value);
+    return sqlite3_bind_blob(vm, index, (const void *)pk, (int)pklen, SQLITE_STATIC);
 }
 
 cloudsync_table_context *table_lookup (cloudsync_context *data, const char *table_name) {
@@ -847,18 +1079,50 @@ cloudsync_table_context *table_lookup (cloudsync_context *data, const char *tabl
     return NULL;
 }
 
+int table_column_name_index (cloudsync_table_context *table, const char *col_name) {
+    for (int i=0; i<table->ncols; ++i) {
+        if (strcasecmp(table->col_name[i], col_name) == 0) return i;
+    }
+    return -1;
+}
+
 sqlite3_stmt *table_column_lookup (cloudsync_table_context *table, const char *col_name, bool is_merge, int *index) {
     DEBUG_DBFUNCTION("table_column_lookup %s", col_name);
     
+    int i = table_column_name_index(table, col_name);
+    if (index) *index = i;
+    return (i >= 0) ? table_column_stmt(table, i, is_merge) : NULL;
+}
+
+int table_column_id (cloudsync_table_context *table, const char *col_name) {
+    // map a column name to the col_id stored in the meta-table (-1 if the column is unknown)
+    if ((col_name == NULL) || (strcmp(col_name, CLOUDSYNC_TOMBSTONE_VALUE) == 0)) return CLOUDSYNC_TOMBSTONE_COLID;
+    
+    int index = table_column_name_index(table, col_name);
+    return (index >= 0) ? table->col_id[index] : -1;
+}
+
+int table_column_index (cloudsync_table_context *table, sqlite3_int64 col_id) {
     for (int i=0; i<table->ncols; ++i) {
-        if (strcasecmp(table->col_name[i], col_name) == 0) {
-            if (index) *index = i;
-            return (is_merge) ? table->col_merge_stmt[i] : table->col_value_stmt[i];
-        }
+        if (table->col_id[i] == col_id) return i;
     }
+    return -1;
+}
+
+int table_column_dictionary_id (sqlite3 *db, const char *table_name, const char *col_name) {
+    // retrieve the id of the column from the cloudsync_columns dictionary, registering it the first time
+    // (the dictionary is read first so that loading an already known table never writes to the database)
+    char *sql = cloudsync_memory_mprintf("SELECT IFNULL((SELECT col_id FROM cloudsync_columns WHERE tbl_name = '%q' AND col_name = '%q'), 0);", table_name, col_name);
+    if (!sql) return -1;
+    sqlite3_int64 col_id = dbutils_int_select(db, sql);
+    cloudsync_memory_free(sql);
+    if (col_id != 0) return (int)col_id;
     
-    if (index) *index = -1;
-    return NULL;
+    sql = cloudsync_memory_mprintf("INSERT INTO cloudsync_columns (tbl_name, col_id, col_name) SELECT '%q', IFNULL(MAX(col_id), 0) + 1, '%q' FROM cloudsync_columns WHERE tbl_name = '%q' RETURNING col_id;", table_name, col_name, table_name);
+    if (!sql) return -1;
+    col_id = dbutils_int_select(db, sql);
+    cloudsync_memory_free(sql);
+    return (int)col_id;
 }
 
 int table_remove (cloudsync_context *data, const char *table_name) {
@@ -867,6 +1131,7 @@ int table_remove (cloudsync_context *data, const char *table_name) {
     for (int i=0; i<data->tables_count; ++i) {
         const char *name = (data->tables[i]) ? data->tables[i]->name : NULL;
         if ((name) && (strcasecmp(name, table_name) == 0)) {
+            if (data->row_cache.table == data->tables[i]) row_cache_clear(&data->row_cache);
             data->tables[i] = NULL;
             return i;
         }
@@ -877,76 +1142,33 @@ int table_remove (cloudsync_context *data, const char *table_name) {
 int table_add_to_context_cb (void *xdata, int ncols, char **values, char **names) {
     cloudsync_table_context *table = (cloudsync_table_context *)xdata;
     
-    sqlite3 *db = sqlite3_db_handle(table->meta_pkexists_stmt);
-    if (!db) return SQLITE_ERROR;
-    
+    // the column statements are compiled on first use by table_column_stmt
     int index = table->ncols;
     for (int i=0; i<ncols; i+=2) {
         const char *name = values[i];
-        int cid = (int)strtol(values[i+1], NULL, 0);
+        int col_id = (values[i+1]) ? (int)strtol(values[i+1], NULL, 10) : 0;
+        if (col_id <= 0) col_id = table_column_dictionary_id(table->db, table->name, name);
+        if (col_id <= 0) return SQLITE_ERROR;
         
-        table->col_id[index] = cid;
+        table->col_id[index] = col_id;
         table->col_name[index] = cloudsync_string_dup(name, true);
         if (!table->col_name[index]) return 1;
-        
-        char *sql = table_build_mergeinsert_sql(db, table, name);
-        if (!sql) return SQLITE_NOMEM;
-        DEBUG_SQL("col_merge_stmt[%d]: %s", index, sql);
-        
-        int rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->col_merge_stmt[index], NULL);
-        cloudsync_memory_free(sql);
-        if (rc != SQLITE_OK) return rc;
-        if (!table->col_merge_stmt[index]) return SQLITE_MISUSE;
-        
-        sql = table_build_value_sql(db, table, name);
-        if (!sql) return SQLITE_NOMEM;
-        DEBUG_SQL("col_value_stmt[%d]: %s", index, sql);
-        
-        rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->col_value_stmt[index], NULL);
-        cloudsync_memory_free(sql);
-        if (rc != SQLITE_OK) return rc;
-        if (!table->col_value_stmt[index]) return SQLITE_MISUSE;
     }
     table->ncols += 1;
     
     return 0;
 }
 
-bool table_add_to_context (sqlite3 *db, cloudsync_context *data, table_algo algo, const char *table_name) {
-    DEBUG_DBFUNCTION("cloudsync_context_add_table %s", table_name);
-    
-    // check if table is already in the global context and in that case just return
-    cloudsync_table_context *table = table_lookup(data, table_name);
-    if (table) return true;
-    
-    // is there any space available?
-    if (data->tables_alloc <= data->tables_count + 1) {
-        // realloc tables
-        cloudsync_table_context **clone = (cloudsync_table_context **)cloudsync_memory_realloc(data->tables, sizeof(cloudsync_table_context) * data->tables_alloc + CLOUDSYNC_INIT_NTABLES);
-        if (!clone) goto abort_add_table;
-        
-        // reset new entries
-        for (int i=data->tables_alloc; i<data->tables_alloc + CLOUDSYNC_INIT_NTABLES; ++i) {
-            clone[i] = NULL;
-        }
-        
-        // replace old ptr
-        data->tables = clone;
-        data->tables_alloc += CLOUDSYNC_INIT_NTABLES;
-    }
-    
-    // setup a new table context
-    table = table_create(table_name, algo);
-    if (!table) return false;
-    
-    // fill remaining metadata in the table
+bool table_load_schema (sqlite3 *db, cloudsync_context *data, cloudsync_table_context *table) {
+    // primary keys and columns from pragma_table_info, col_id from the cloudsync_columns dictionary
+    const char *table_name = table->name;
     char *sql = cloudsync_memory_mprintf("SELECT count(*) FROM pragma_table_info('%q') WHERE pk>0;", table_name);
-    if (!sql) goto abort_add_table;
+    if (!sql) return false;
     table->npks = (int)dbutils_int_select(db, sql);
     cloudsync_memory_free(sql);
     if (table->npks == -1) {
         dbutils_context_result_error(data->sqlite_ctx, "%s", sqlite3_errmsg(db));
-        goto abort_add_table;
+        return false;
     }
     
     if (table->npks == 0) {
@@ -959,70 +1181,177 @@ bool table_add_to_context (sqlite3 *db, cloudsync_context *data, table_algo algo
     }
     
     sql = cloudsync_memory_mprintf("SELECT count(*) FROM pragma_table_info('%q') WHERE pk=0;", table_name);
-    if (!sql) goto abort_add_table;
+    if (!sql) return false;
     int64_t ncols = (int64_t)dbutils_int_select(db, sql);
     cloudsync_memory_free(sql);
     if (ncols == -1) {
         dbutils_context_result_error(data->sqlite_ctx, "%s", sqlite3_errmsg(db));
-        goto abort_add_table;
+        return false;
     }
     
-    int rc = table_add_stmts(db, table, (int)ncols);
-    if (rc != SQLITE_OK) goto abort_add_table;
-    
     // a table with only pk(s) is totally legal
     if (ncols > 0) {
         table->col_name = (char **)cloudsync_memory_alloc((sqlite3_uint64)(sizeof(char *) * ncols));
-        if (!table->col_name) goto abort_add_table;
+        if (!table->col_name) return false;
         
         table->col_id = (int *)cloudsync_memory_alloc((sqlite3_uint64)(sizeof(int) * ncols));
-        if (!table->col_id) goto abort_add_table;
-        
-        table->col_merge_stmt = (sqlite3_stmt **)cloudsync_memory_alloc((sqlite3_uint64)(sizeof(sqlite3_stmt *) * ncols));
-        if (!table->col_merge_stmt) goto abort_add_table;
-        
-        table->col_value_stmt = (sqlite3_stmt **)cloudsync_memory_alloc((sqlite3_uint64)(sizeof(sqlite3_stmt *) * ncols));
-        if (!table->col_value_stmt) goto abort_add_table;
+        if (!table->col_id) return false;
         
-        sql = cloudsync_memory_mprintf("SELECT name, cid FROM pragma_table_info('%q') WHERE pk=0 ORDER BY cid;", table_name);
-        if (!sql) goto abort_add_table;
+        // the col_id of the columns already known by the cloudsync_columns dictionary are read with the same query
+        sql = cloudsync_memory_mprintf("SELECT p.name, c.col_id FROM pragma_table_info('%q') AS p LEFT JOIN cloudsync_columns AS c ON c.tbl_name = '%q' AND c.col_name = p.name WHERE p.pk=0 ORDER BY p.cid;", table_name, table_name);
+        if (!sql) return false;
         int rc = sqlite3_exec(db, sql, table_add_to_context_cb, (void *)table, NULL);
         cloudsync_memory_free(sql);
-        if (rc == SQLITE_ABORT) goto abort_add_table;
-    }
-    
-    // lookup the first free slot
-    for (int i=0; i<data->tables_alloc; ++i) {
-        if (data->tables[i] == NULL) {
-            data->tables[i] = table;
-            if (i > data->tables_count - 1) ++data->tables_count;
-            break;
-        }
+        if (rc == SQLITE_ABORT) return false;
     }
     
     return true;
-    
-abort_add_table:
-    table_free(table);
-    return false;
 }
 
-bool table_remove_from_context (cloudsync_context *data, cloudsync_table_context *table) {
-    return (table_remove(data, table->name) != -1);
+void table_use_schema (cloudsync_table_context *table, schema_shared *schema, const schema_table *meta) {
+    // col_name and col_id are read-only, they are owned by the shared entry
+    schema_shared_retain(schema);
+    table->schema = schema;
+    table->col_name = meta->col_name;
+    table->col_id = meta->col_id;
+    table->ncols = meta->ncols;
+    table->npks = meta->npks;
+    #if !CLOUDSYNC_DISABLE_ROWIDONLY_TABLES
+    table->rowid_only = meta->rowid_only;
+    #endif
 }
 
-sqlite3_stmt *cloudsync_colvalue_stmt (sqlite3 *db, cloudsync_context *data, const char *tbl_name, bool *persistent) {
-    sqlite3_stmt *vm = NULL;
+void table_share_schema (cloudsync_table_context *table, schema_shared *schema) {
+    // publish the metadata just discovered, the table keeps its own copy if it cannot be published
+    schema_table *meta = (schema_table *)cloudsync_memory_zeroalloc(sizeof(schema_table));
+    if (!meta) return;
+    meta->name = cloudsync_string_dup(table->name, false);
+    if (!meta->name) {
+        cloudsync_memory_free(meta);
+        return;
+    }
+    meta->col_name = table->col_name;
+    meta->col_id = table->col_id;
+    meta->ncols = table->ncols;
+    meta->npks = table->npks;
+    #if !CLOUDSYNC_DISABLE_ROWIDONLY_TABLES
+    meta->rowid_only = table->rowid_only;
+    #endif
     
-    cloudsync_table_context *table = table_lookup(data, tbl_name);
-    if (table) {
-        char *col_name = NULL;
-        if (table->ncols > 0) {
-            col_name = table->col_name[0];
-            // retrieve col_value precompiled statement
-            vm = table_column_lookup(table, col_name, false, NULL);
-            *persistent = true;
-        } else {
+    const schema_table *published = schema_shared_publish(schema, meta);
+    if (!published) {
+        cloudsync_memory_free(meta->name);
+        cloudsync_memory_free(meta);
+        return;
+    }
+    
+    // another connection could have published the same table in the meantime (meta has been freed)
+    table_use_schema(table, schema, published);
+}
+
+bool table_add_to_context (sqlite3 *db, cloudsync_context *data, table_algo algo, const char *table_name) {
+    DEBUG_DBFUNCTION("cloudsync_context_add_table %s", table_name);
+    
+    // check if table is already in the global context and in that case just return
+    cloudsync_table_context *table = table_lookup(data, table_name);
+    if (table) return true;
+    
+    // is there any space available?
+    if (data->tables_alloc <= data->tables_count + 1) {
+        // realloc tables
+        cloudsync_table_context **clone = (cloudsync_table_context **)cloudsync_memory_realloc(data->tables, sizeof(cloudsync_table_context) * data->tables_alloc + CLOUDSYNC_INIT_NTABLES);
+        if (!clone) goto abort_add_table;
+        
+        // reset new entries
+        for (int i=data->tables_alloc; i<data->tables_alloc + CLOUDSYNC_INIT_NTABLES; ++i) {
+            clone[i] = NULL;
+        }
+        
+        // replace old ptr
+        data->tables = clone;
+        data->tables_alloc += CLOUDSYNC_INIT_NTABLES;
+    }
+    
+    // setup a new table context
+    table = table_create(table_name, algo);
+    if (!table) return false;
+    table->conn_stats = data->stats.counters;
+    table->stmt_cache = &data->stmt_cache;
+    table->packed_row = &data->packed_row;
+    table->db = db;
+    
+    // the metadata of the table is discovered only by the first connection to the database (see schema.c)
+    const schema_table *meta = (data->schema) ? schema_shared_lookup(data->schema, table_name) : NULL;
+    if (meta) table_use_schema(table, data->schema, meta);
+    else if (!table_load_schema(db, data, table)) goto abort_add_table;
+    else if (data->schema) table_share_schema(table, data->schema);
+    
+    table->packed = dbutils_table_settings_is_packed(db, table_name);
+    table->intpk = dbutils_metatable_is_intpk(db, table_name);
+    
+    // the column statements are compiled on first use by table_column_stmt
+    if (table->ncols > 0) {
+        table->col_merge_stmt = (cloudsync_cached_stmt *)cloudsync_memory_zeroalloc((uint64_t)(sizeof(cloudsync_cached_stmt) * table->ncols));
+        if (!table->col_merge_stmt) goto abort_add_table;
+        
+        table->col_value_stmt = (cloudsync_cached_stmt *)cloudsync_memory_zeroalloc((uint64_t)(sizeof(cloudsync_cached_stmt) * table->ncols));
+        if (!table->col_value_stmt) goto abort_add_table;
+    }
+    
+    // lookup the first free slot
+    for (int i=0; i<data->tables_alloc; ++i) {
+        if (data->tables[i] == NULL) {
+            data->tables[i] = table;
+            if (i > data->tables_count - 1) ++data->tables_count;
+            break;
+        }
+    }
+    
+    return true;
+    
+abort_add_table:
+    table_free(table);
+    return false;
+}
+
+bool table_remove_from_context (cloudsync_context *data, cloudsync_table_context *table) {
+    return (table_remove(data, table->name) != -1);
+}
+
+void cloudsync_schema_attach (sqlite3 *db, cloudsync_context *data) {
+    // called before the tables are loaded from the settings, the site_id distinguishes a database file replaced by another one
+    if (!data->shared_schema || data->schema) return;
+    if (dbutils_table_exists(db, CLOUDSYNC_SITEID_NAME) == false) return;
+    
+    int size = 0, rc = SQLITE_OK;
+    char *site_id = dbutils_blob_select(db, "SELECT site_id FROM cloudsync_site_id WHERE rowid=0;", &size, NULL, &rc);
+    if (site_id && size == UUID_LEN) {
+        data->schema = schema_shared_acquire(sqlite3_db_filename(db, "main"), (const uint8_t *)site_id, dbutils_schema_hash(db));
+    }
+    if (site_id) cloudsync_memory_free(site_id);
+}
+
+void cloudsync_schema_detach (sqlite3 *db, cloudsync_context *data) {
+    // called before the schema of the synced tables is changed: the tables loaded from now on are not shared and
+    // the connections opened later discover the new schema (the ones already open keep the metadata they use)
+    schema_shared_invalidate(sqlite3_db_filename(db, "main"));
+    schema_shared_release(data->schema);
+    data->schema = NULL;
+}
+
+sqlite3_stmt *cloudsync_colvalue_stmt (sqlite3 *db, cloudsync_context *data, const char *tbl_name, bool *persistent) {
+    sqlite3_stmt *vm = NULL;
+    
+    cloudsync_table_context *table = table_lookup(data, tbl_name);
+    if (table) {
+        char *col_name = NULL;
+        if (table->ncols > 0) {
+            col_name = table->col_name[0];
+            // retrieve col_value precompiled statement (it belongs to the stmt_cache of the connection,
+            // so it must be used before another table statement is requested)
+            vm = table_column_lookup(table, col_name, false, NULL);
+            *persistent = true;
+        } else {
             char *sql = table_build_value_sql(db, table, "*");
             sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
             cloudsync_memory_free(sql);
@@ -1033,1354 +1362,3481 @@ sqlite3_stmt *cloudsync_colvalue_stmt (sqlite3 *db, cloudsync_context *data, con
     return vm;
 }
 
-// MARK: - Merge Insert -
+// MARK: - Packed Storage -
 
-sqlite3_int64 merge_get_local_cl (cloudsync_table_context *table, const char *pk, int pklen, const char **err) {
-    sqlite3_stmt *vm = table->meta_local_cl_stmt;
-    sqlite3_int64 result = -1;
-    
-    int rc = sqlite3_bind_blob(vm, 1, (const void *)pk, pklen, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    rc = sqlite3_bind_blob(vm, 2, (const void *)pk, pklen, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    rc = sqlite3_step(vm);
-    if (rc == SQLITE_ROW) result = sqlite3_column_int64(vm, 0);
-    else if (rc == SQLITE_DONE) result = 0;
+// a packed meta-table contains a single row per primary key (see clock.c), every local and merge operation
+// performs the same changes of the per-column statements on the clock vector of the row and then writes it back
+
+const int *cloudsync_table_col_ids (cloudsync_context *data, const char *table_name, int *ncols) {
+    cloudsync_table_context *table = table_lookup(data, table_name);
+    if (!table) return NULL;
     
-cleanup:
-    if (result == -1) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-    stmt_reset(vm);
-    return result;
+    *ncols = table->ncols;
+    return table->col_id;
 }
 
-int merge_get_col_version (cloudsync_table_context *table, const char *col_name, const char *pk, int pklen, sqlite3_int64 *version, const char **err) {
-    sqlite3_stmt *vm = table->meta_col_version_stmt;
-    
-    int rc = sqlite3_bind_blob(vm, 1, (const void *)pk, pklen, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup;
+int packed_read (cloudsync_table_context *table, const char *pk, size_t pklen, clock_vector *v) {
+    sqlite3_stmt *vm = table_stmt(table, TABLE_STMT_META_CLOCKS_SELECT);
+    memset(v, 0, sizeof(clock_vector));
     
-    rc = sqlite3_bind_text(vm, 2, col_name, -1, SQLITE_STATIC);
+    int rc = table_bind_pk(table, vm, 1, pk, pklen);
     if (rc != SQLITE_OK) goto cleanup;
     
-    rc = sqlite3_step(vm);
+    rc = meta_step(table, vm);
     if (rc == SQLITE_ROW) {
-        *version = sqlite3_column_int64(vm, 0);
+        const char *buffer = (const char *)sqlite3_column_blob(vm, 0);
+        size_t blen = (size_t)sqlite3_column_bytes(vm, 0);
+        rc = (clock_vector_decode(v, buffer, blen) == 0) ? SQLITE_OK : SQLITE_CORRUPT;
+    } else if (rc == SQLITE_DONE) {
         rc = SQLITE_OK;
     }
     
 cleanup:
-    if ((rc != SQLITE_OK) && (rc != SQLITE_DONE)) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
     stmt_reset(vm);
     return rc;
 }
 
-int merge_set_winner_clock (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pk_len, const char *colname, sqlite3_int64 col_version, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, sqlite3_int64 *rowid, const char **err) {
-    
-    // get/set site_id
-    sqlite3_stmt *vm = data->getset_siteid_stmt;
-    int rc = sqlite3_bind_blob(vm, 1, (const void *)site_id, site_len, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup_merge;
-    
-    rc = sqlite3_step(vm);
-    if (rc != SQLITE_ROW) goto cleanup_merge;
-    
-    int64_t ord = sqlite3_column_int64(vm, 0);
-    stmt_reset(vm);
-    
-    vm = table->meta_winner_clock_stmt;
-    rc = sqlite3_bind_blob(vm, 1, (const void *)pk, pk_len, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup_merge;
+int packed_write (cloudsync_table_context *table, const char *pk, size_t pklen, clock_vector *v) {
+    sqlite3_stmt *vm = NULL;
+    char *buffer = NULL;
+    int rc = SQLITE_OK;
     
-    rc = sqlite3_bind_text(vm, 2, (colname) ? colname : CLOUDSYNC_TOMBSTONE_VALUE, -1, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup_merge;
+    // a row without clocks is removed from the meta-table
+    if (v->count == 0) {
+        vm = table_stmt(table, TABLE_STMT_META_CLOCKS_DELETE);
+        rc = table_bind_pk(table, vm, 1, pk, pklen);
+        if (rc == SQLITE_OK) rc = meta_step(table, vm);
+        goto cleanup;
+    }
     
-    rc = sqlite3_bind_int64(vm, 3, col_version);
-    if (rc != SQLITE_OK) goto cleanup_merge;
+    size_t blen = 0;
+    buffer = clock_vector_encode(v, &blen);
+    if (!buffer) return SQLITE_NOMEM;
     
-    rc = sqlite3_bind_int64(vm, 4, db_version);
-    if (rc != SQLITE_OK) goto cleanup_merge;
+    vm = table_stmt(table, TABLE_STMT_META_CLOCKS_UPSERT);
+    rc = table_bind_pk(table, vm, 1, pk, pklen);
+    if (rc != SQLITE_OK) goto cleanup;
     
-    rc = sqlite3_bind_int64(vm, 5, seq);
-    if (rc != SQLITE_OK) goto cleanup_merge;
+    // db_version is the max of all the clocks so that the db_version index can be used to skip whole rows
+    rc = sqlite3_bind_int64(vm, 2, clock_vector_max_db_version(v));
+    if (rc != SQLITE_OK) goto cleanup;
     
-    rc = sqlite3_bind_int64(vm, 6, ord);
-    if (rc != SQLITE_OK) goto cleanup_merge;
+    rc = sqlite3_bind_blob(vm, 3, buffer, (int)blen, SQLITE_STATIC);
+    if (rc != SQLITE_OK) goto cleanup;
     
-    rc = sqlite3_step(vm);
-    if (rc == SQLITE_ROW) {
-        *rowid = sqlite3_column_int64(vm, 0);
-        rc = SQLITE_OK;
-    }
+    rc = meta_step(table, vm);
     
-cleanup_merge:
-    if (rc != SQLITE_OK) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+cleanup:
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
     stmt_reset(vm);
+    if (buffer) cloudsync_memory_free(buffer);
     return rc;
 }
 
-int merge_insert_col (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, const char *col_name, sqlite3_value *col_value, sqlite3_int64 col_version, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, sqlite3_int64 *rowid, const char **err) {
-    int index;
-    sqlite3_stmt *vm = table_column_lookup(table, col_name, true, &index);
-    if (vm == NULL) {
-        *err = "Unable to retrieve column merge precompiled statement in merge_insert_col.";
-        return SQLITE_MISUSE;
-    }
+// MARK: Row buffer
+
+// while a batch is active (the local update of a row or a payload apply) the clock vector of the last row loaded is
+// kept in the packed_row buffer of the connection, packed_load and packed_store work on it and the row is written back
+// only when another row is loaded or the batch ends, so a row is decoded, encoded and stored once instead of once per column
+
+static void packed_row_clear (cloudsync_packed_row *row) {
+    if (row->pk) cloudsync_memory_free(row->pk);
+    clock_vector_free(&row->v);
+    row->table = NULL;
+    row->pk = NULL;
+    row->pklen = 0;
+    row->dirty = false;
+}
+
+static bool packed_row_match (cloudsync_packed_row *row, cloudsync_table_context *table, const char *pk, size_t pklen) {
+    return (row->table == table && row->pklen == pklen && memcmp(row->pk, pk, pklen) == 0);
+}
+
+static int packed_row_flush (cloudsync_packed_row *row) {
+    // write the buffered row back to its meta-table and release it
+    int rc = (row->table && row->dirty) ? packed_write(row->table, row->pk, row->pklen, &row->v) : SQLITE_OK;
+    packed_row_clear(row);
+    return rc;
+}
+
+static int packed_row_sync (cloudsync_packed_row *row) {
+    // write the buffered row back to its meta-table, so that it can be read by a statement, and keep it
+    int rc = (row->table && row->dirty) ? packed_write(row->table, row->pk, row->pklen, &row->v) : SQLITE_OK;
+    if (rc == SQLITE_OK) row->dirty = false;
+    return rc;
+}
+
+static int packed_row_fetch (cloudsync_table_context *table, const char *pk, size_t pklen) {
+    // make the row identified by pk the buffered one
+    cloudsync_packed_row *row = table->packed_row;
+    if (packed_row_match(row, table, pk, pklen)) return SQLITE_OK;
     
-    // INSERT INTO table (pk1, pk2, col_name) VALUES (?, ?, ?) ON CONFLICT DO UPDATE SET col_name=?;"
+    int rc = packed_row_flush(row);
+    if (rc != SQLITE_OK) return rc;
     
-    // bind primary key(s)
-    int rc = pk_decode_prikey((char *)pk, (size_t)pklen, pk_decode_bind_callback, vm);
-    if (rc < 0) {
-        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-        rc = sqlite3_errcode(sqlite3_db_handle(vm));
-        stmt_reset(vm);
+    rc = packed_read(table, pk, pklen, &row->v);
+    if (rc == SQLITE_OK) {
+        row->pk = (char *)cloudsync_memory_alloc((uint64_t)pklen);
+        if (!row->pk) rc = SQLITE_NOMEM;
+    }
+    if (rc != SQLITE_OK) {
+        packed_row_clear(row);
         return rc;
     }
     
-    // bind value
-    if (col_value) {
-        rc = sqlite3_bind_value(vm, table->npks+1, col_value);
-        if (rc == SQLITE_OK) rc = sqlite3_bind_value(vm, table->npks+2, col_value);
-        if (rc != SQLITE_OK) {
-            *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-            stmt_reset(vm);
-            return rc;
-        }
-        
-    }
+    memcpy(row->pk, pk, pklen);
+    row->pklen = pklen;
+    row->table = table;
+    return SQLITE_OK;
+}
+
+int packed_load (cloudsync_table_context *table, const char *pk, size_t pklen, clock_vector *v) {
+    cloudsync_packed_row *row = table->packed_row;
+    if (!row || !row->active) return packed_read(table, pk, pklen, v);
     
-    // perform real operation and disable triggers
+    memset(v, 0, sizeof(clock_vector));
+    int rc = packed_row_fetch(table, pk, pklen);
+    if (rc != SQLITE_OK) return rc;
+    return (clock_vector_copy(&row->v, v) == 0) ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+int packed_store (cloudsync_table_context *table, const char *pk, size_t pklen, clock_vector *v) {
+    // the buffered row takes the ownership of the entries of v
+    cloudsync_packed_row *row = table->packed_row;
+    if (!row || !row->active) return packed_write(table, pk, pklen, v);
     
-    // in case of GOS we reused the table->col_merge_stmt statement
-    // which looks like: INSERT INTO table (pk1, pk2, col_name) VALUES (?, ?, ?) ON CONFLICT DO UPDATE SET col_name=?;"
-    // but the UPDATE in the CONFLICT statement would return SQLITE_CONSTRAINT because the trigger raises the error
-    // the trick is to disable that trigger before executing the statement
-    if (table->algo == table_algo_crdt_gos) table->enabled = 0;
-    SYNCBIT_SET(data);
-    rc = sqlite3_step(vm);
-    DEBUG_MERGE("merge_insert(%02x%02x): %s (%d)", data->site_id[UUID_LEN-2], data->site_id[UUID_LEN-1], sqlite3_expanded_sql(vm), rc);
-    stmt_reset(vm);
-    SYNCBIT_RESET(data);
-    if (table->algo == table_algo_crdt_gos) table->enabled = 1;
+    int rc = packed_row_fetch(table, pk, pklen);
+    if (rc != SQLITE_OK) return rc;
     
-    if (rc != SQLITE_DONE) {
-        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-        return rc;
+    clock_vector_free(&row->v);
+    row->v = *v;
+    row->dirty = true;
+    memset(v, 0, sizeof(clock_vector));
+    return SQLITE_OK;
+}
+
+int packed_get_clock (cloudsync_table_context *table, const char *pk, size_t pklen, int col_id, sqlite3_int64 *cl, sqlite3_int64 *col_version) {
+    // same as the TABLE_STMT_META_LOCAL_CL (cl not NULL) and TABLE_STMT_META_COL_VERSION statements, served by the
+    // buffered row while a batch is active, returns SQLITE_DONE if the column has no clock
+    cloudsync_packed_row *row = table->packed_row;
+    bool buffered = (row && row->active);
+    clock_vector tmp = {0};
+    clock_vector *v = &tmp;
+    
+    int rc = (buffered) ? packed_row_fetch(table, pk, pklen) : packed_read(table, pk, pklen, &tmp);
+    if (rc != SQLITE_OK) goto cleanup;
+    if (buffered) v = &row->v;
+    
+    if (cl) {
+        *cl = clock_vector_cl(v);
+        goto cleanup;
     }
     
-    return merge_set_winner_clock(data, table, pk, pklen, col_name, col_version, db_version, site_id, site_len, seq, rowid, err);
+    // a column without an entry of its own inherits the insert clock
+    clock_entry *e = clock_vector_find(v, col_id);
+    if (!e && col_id != CLOUDSYNC_TOMBSTONE_COLID && table_column_index(table, col_id) >= 0) e = clock_vector_find(v, CLOCK_INSERT_COLID);
+    if (e) *col_version = e->col_version;
+    else rc = SQLITE_DONE;
+    
+cleanup:
+    clock_vector_free(&tmp);
+    return rc;
 }
 
-int merge_delete (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, const char *colname, sqlite3_int64 cl, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, sqlite3_int64 *rowid, const char **err) {
-    int rc = SQLITE_OK;
-    
-    // reset return value
-    *rowid = 0;
+bool packed_batch_begin (cloudsync_context *data) {
+    // returns false if a batch is already active (the outer one is in charge of ending it)
+    cloudsync_packed_row *row = &data->packed_row;
+    if (row->active) return false;
     
-    // bind pk
-    sqlite3_stmt *vm = table->real_merge_delete_stmt;
-    rc = pk_decode_prikey((char *)pk, (size_t)pklen, pk_decode_bind_callback, vm);
-    if (rc < 0) {
-        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-        rc = sqlite3_errcode(sqlite3_db_handle(vm));
-        stmt_reset(vm);
+    row->active = true;
+    return true;
+}
+
+static void packed_saved_clear (cloudsync_packed_row *row) {
+    if (row->saved_pk) cloudsync_memory_free(row->saved_pk);
+    clock_vector_free(&row->saved);
+    row->saved_table = NULL;
+    row->saved_pk = NULL;
+    row->saved_pklen = 0;
+    row->saved_dirty = false;
+}
+
+int packed_batch_next (cloudsync_context *data, const char *tbl, size_t tbl_len, const char *pk, size_t pklen, bool flush) {
+    // called by a payload apply before merging each change (outside any statement): the buffered row is written back
+    // if the change belongs to another row (or flush is true), then the state of the row is saved so that the
+    // change can be undone by packed_batch_failed if its statement fails
+    cloudsync_packed_row *row = &data->packed_row;
+    if (!row->active) return SQLITE_OK;
+    
+    bool same = (!flush && row->table && row->pklen == pklen && memcmp(row->pk, pk, pklen) == 0 &&
+                 strlen(row->table->name) == tbl_len && strncasecmp(row->table->name, tbl, tbl_len) == 0);
+    int rc = (same) ? SQLITE_OK : packed_row_flush(row);
+    if (rc != SQLITE_OK || !row->table) {
+        packed_saved_clear(row);
         return rc;
     }
     
-    // perform real operation and disable triggers
-    SYNCBIT_SET(data);
-    rc = sqlite3_step(vm);
-    DEBUG_MERGE("merge_delete(%02x%02x): %s (%d)", data->site_id[UUID_LEN-2], data->site_id[UUID_LEN-1], sqlite3_expanded_sql(vm), rc);
-    stmt_reset(vm);
-    SYNCBIT_RESET(data);
-    if (rc == SQLITE_DONE) rc = SQLITE_OK;
-    if (rc != SQLITE_OK) {
-        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-        return rc;
+    if (row->saved_table != row->table || row->saved_pklen != row->pklen || memcmp(row->saved_pk, row->pk, row->pklen) != 0) {
+        packed_saved_clear(row);
+        row->saved_pk = (char *)cloudsync_memory_alloc((uint64_t)row->pklen);
+        if (!row->saved_pk) return SQLITE_NOMEM;
+        memcpy(row->saved_pk, row->pk, row->pklen);
+        row->saved_pklen = row->pklen;
+        row->saved_table = row->table;
+    }
+    if (clock_vector_copy(&row->v, &row->saved) != 0) {
+        packed_saved_clear(row);
+        return SQLITE_NOMEM;
     }
+    row->saved_dirty = row->dirty;
+    return SQLITE_OK;
+}
+
+void packed_batch_failed (cloudsync_context *data) {
+    // the statement of the change has been rolled back, so the buffered row goes back to its saved state
+    // (the saved state is moved, it is saved again by the next packed_batch_next)
+    cloudsync_packed_row *row = &data->packed_row;
+    if (!row->active) return;
     
-    rc = merge_set_winner_clock(data, table, pk, pklen, colname, cl, db_version, site_id, site_len, seq, rowid, err);
-    if (rc != SQLITE_OK) return rc;
+    packed_row_clear(row);
+    if (!row->saved_table) return;
     
-    // drop clocks _after_ setting the winner clock so we don't lose track of the max db_version!!
-    // this must never come before `set_winner_clock`
-    vm = table->meta_merge_delete_drop;
-    rc = sqlite3_bind_blob(vm, 1, (const void *)pk, pklen, SQLITE_STATIC);
-    if (rc == SQLITE_OK) rc = sqlite3_step(vm);
-    stmt_reset(vm);
-    if (rc == SQLITE_DONE) rc = SQLITE_OK;
-    if (rc != SQLITE_OK) {
-        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-    }
+    row->table = row->saved_table;
+    row->pk = row->saved_pk;
+    row->pklen = row->saved_pklen;
+    row->v = row->saved;
+    row->dirty = row->saved_dirty;
     
+    memset(&row->saved, 0, sizeof(clock_vector));
+    row->saved_pk = NULL;
+    packed_saved_clear(row);
+}
+
+int packed_batch_end (cloudsync_context *data, bool commit) {
+    cloudsync_packed_row *row = &data->packed_row;
+    int rc = (commit) ? packed_row_flush(row) : SQLITE_OK;
+    packed_row_clear(row);
+    packed_saved_clear(row);
+    row->active = false;
     return rc;
 }
 
-int merge_zeroclock_on_resurrect(cloudsync_table_context *table, sqlite3_int64 db_version, const char *pk, int pklen, const char **err) {
-    sqlite3_stmt *vm = table->meta_zero_clock_stmt;
-    
-    int rc = sqlite3_bind_int64(vm, 1, db_version);
+// MARK: Clocks
+
+int packed_update_sentinel (cloudsync_table_context *table, const char *pk, size_t pklen, sqlite3_int64 db_version, int seq, bool create) {
+    // same as meta_sentinel_update_stmt (create false) and meta_sentinel_insert_stmt (create true)
+    clock_vector v;
+    int rc = packed_load(table, pk, pklen, &v);
     if (rc != SQLITE_OK) goto cleanup;
     
-    rc = sqlite3_bind_blob(vm, 2, (const void *)pk, pklen, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup;
+    clock_entry *e = clock_vector_find(&v, CLOUDSYNC_TOMBSTONE_COLID);
+    if (!e && !create) goto cleanup;
     
-    rc = sqlite3_step(vm);
-    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    sqlite3_int64 col_version = 1;
+    if (e) col_version = (e->col_version % 2 == 0) ? e->col_version + 1 : e->col_version + 2;
+    
+    e = clock_vector_set(&v, CLOUDSYNC_TOMBSTONE_COLID);
+    if (!e) {rc = SQLITE_NOMEM; goto cleanup;}
+    e->col_version = col_version;
+    e->db_version = db_version;
+    e->seq = seq;
+    e->site_id = 0;
+    
+    rc = packed_store(table, pk, pklen, &v);
     
 cleanup:
-    if (rc != SQLITE_OK) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-    stmt_reset(vm);
+    clock_vector_free(&v);
     return rc;
 }
 
-// executed only if insert_cl == local_cl
-int merge_did_cid_win (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, sqlite3_value *insert_value, const char *site_id, int site_len, const char *col_name, sqlite3_int64 col_version, bool *didwin_flag, const char **err) {
+int packed_mark_column (cloudsync_table_context *table, const char *pk, size_t pklen, int col_id, int col_version, sqlite3_int64 db_version, int seq) {
+    // same as meta_row_insert_update_stmt, a column without an entry of its own inherits the insert clock
+    clock_vector v;
+    int rc = packed_load(table, pk, pklen, &v);
+    if (rc != SQLITE_OK) goto cleanup;
     
-    if (col_name == NULL) col_name = CLOUDSYNC_TOMBSTONE_VALUE;
+    clock_entry *e = clock_vector_find(&v, col_id);
+    clock_entry *inserted = (col_id != CLOUDSYNC_TOMBSTONE_COLID) ? clock_vector_find(&v, CLOCK_INSERT_COLID) : NULL;
+    sqlite3_int64 version = (e) ? e->col_version + 1 : ((inserted) ? inserted->col_version + 1 : col_version);
     
-    sqlite3_int64 local_version;
-    int rc = merge_get_col_version(table, col_name, pk, pklen, &local_version, err);
-    if (rc == SQLITE_DONE) {
-        // no rows returned, the incoming change wins if there's nothing there locally
-        *didwin_flag = true;
-        return SQLITE_OK;
-    }
-    if (rc != SQLITE_OK) return rc;
+    e = clock_vector_set(&v, col_id);
+    if (!e) {rc = SQLITE_NOMEM; goto cleanup;}
+    e->col_version = version;
+    e->db_version = db_version;
+    e->seq = seq;
+    e->site_id = 0;
     
-    // rc == SQLITE_OK, means that a row with a version exists
-    if (local_version != col_version) {
-        if (col_version > local_version) {*didwin_flag = true; return SQLITE_OK;}
-        if (col_version < local_version) {*didwin_flag = false; return SQLITE_OK;}
-    }
+    rc = packed_store(table, pk, pklen, &v);
     
-    // rc == SQLITE_ROW and col_version == local_version, need to compare values
+cleanup:
+    clock_vector_free(&v);
+    return rc;
+}
+
+int packed_mark_insert (cloudsync_context *data, cloudsync_table_context *table, const char *pk, size_t pklen, sqlite3_int64 db_version) {
+    // a single insert clock replaces the ncols entries written by meta_row_insert_update_stmt,
+    // the seq values of all the columns are reserved so that each column still gets a unique seq
+    clock_vector v;
+    int rc = packed_load(table, pk, pklen, &v);
+    if (rc != SQLITE_OK) goto cleanup;
     
-    // retrieve col_value precompiled statement
-    sqlite3_stmt *vm = table_column_lookup(table, col_name, false, NULL);
-    if (!vm) {
-        *err = "Unable to retrieve column value precompiled statement in merge_did_cid_win.";
-        return SQLITE_ERROR;
-    }
+    sqlite3_int64 seq = data->seq;
+    data->seq += table->ncols;
     
-    // bind primary key values
-    rc = pk_decode_prikey((char *)pk, (size_t)pklen, pk_decode_bind_callback, (void *)vm);
-    if (rc < 0) {
-        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-        rc = sqlite3_errcode(sqlite3_db_handle(vm));
-        stmt_reset(vm);
-        return rc;
-    }
+    clock_entry *inserted = clock_vector_find(&v, CLOCK_INSERT_COLID);
+    sqlite3_int64 version = (inserted) ? inserted->col_version + 1 : 1;
+    
+    // columns updated after the previous insert keep their own entry,
+    // unless the bumped clock is the same one they would inherit
+    for (int i=v.count-1; i>=0; --i) {
+        clock_entry *e = &v.entries[i];
+        int index = table_column_index(table, e->col_id);
+        if (index < 0) continue;
         
-    // execute vm
-    sqlite3_value *local_value;
-    rc = sqlite3_step(vm);
-    if (rc == SQLITE_DONE) {
-        // meta entry exists but the actual value is missing
-        // we should allow the value_compare function to make a decision
-        // value_compare has been modified to handle the case where lvalue is NULL
-        local_value = NULL;
-        rc = SQLITE_OK;
-    } else if (rc == SQLITE_ROW) {
-        local_value = sqlite3_column_value(vm, 0);
-        rc = SQLITE_OK;
-    } else {
-        goto cleanup;
+        e->col_version += 1;
+        e->db_version = db_version;
+        e->seq = seq + index;
+        e->site_id = 0;
+        if (e->col_version == version) clock_vector_remove(&v, e->col_id);
     }
     
-    // compare values
-    int ret = dbutils_value_compare(insert_value, local_value);
-    // reset after compare, otherwise local value would be deallocated
-    vm = stmt_reset(vm);
+    inserted = clock_vector_set(&v, CLOCK_INSERT_COLID);
+    if (!inserted) {rc = SQLITE_NOMEM; goto cleanup;}
+    inserted->col_version = version;
+    inserted->db_version = db_version;
+    inserted->seq = seq;
+    inserted->site_id = 0;
     
-    bool compare_site_id = (ret == 0 && data->merge_equal_values == true);
-    if (!compare_site_id) {
-        *didwin_flag = (ret > 0);
-        goto cleanup;
+    rc = packed_store(table, pk, pklen, &v);
+    
+cleanup:
+    clock_vector_free(&v);
+    return rc;
+}
+
+int packed_drop_columns (cloudsync_table_context *table, const char *pk, size_t pklen) {
+    // same as meta_row_drop_stmt and meta_merge_delete_drop
+    clock_vector v;
+    int rc = packed_load(table, pk, pklen, &v);
+    if (rc == SQLITE_OK && v.count > 0) {
+        clock_vector_drop_columns(&v);
+        rc = packed_store(table, pk, pklen, &v);
     }
+    clock_vector_free(&v);
+    return rc;
+}
+
+int packed_update_move (cloudsync_context *data, cloudsync_table_context *table, const char *pk, size_t pklen, const char *oldpk, size_t oldpklen, sqlite3_int64 db_version) {
+    // same as meta_update_move_stmt, every column clock of the old row (inherited ones included) is moved to the new row
+    clock_vector oldv, expanded, v;
+    memset(&expanded, 0, sizeof(clock_vector));
+    memset(&v, 0, sizeof(clock_vector));
     
-    // values are the same and merge_equal_values is true
-    vm = table->meta_site_id_stmt;
-    rc = sqlite3_bind_blob(vm, 1, (const void *)pk, pklen, SQLITE_STATIC);
+    int rc = packed_load(table, oldpk, oldpklen, &oldv);
     if (rc != SQLITE_OK) goto cleanup;
     
-    rc = sqlite3_bind_text(vm, 2, col_name, -1, SQLITE_STATIC);
+    if (clock_vector_expand(&oldv, table->col_id, table->ncols, &expanded) != 0) {rc = SQLITE_NOMEM; goto cleanup;}
+    
+    rc = packed_load(table, pk, pklen, &v);
     if (rc != SQLITE_OK) goto cleanup;
     
-    rc = sqlite3_step(vm);
-    if (rc == SQLITE_ROW) {
-        const void *local_site_id = sqlite3_column_blob(vm, 0);
-        ret = memcmp(site_id, local_site_id, site_len);
-        *didwin_flag = (ret > 0);
-        stmt_reset(vm);
-        return SQLITE_OK;
+    bool moved = false;
+    for (int i=0; i<expanded.count; ++i) {
+        if (expanded.entries[i].col_id == CLOUDSYNC_TOMBSTONE_COLID) continue;
+        
+        clock_entry *e = clock_vector_set(&v, expanded.entries[i].col_id);
+        if (!e) {rc = SQLITE_NOMEM; goto cleanup;}
+        e->col_version = 1;
+        e->db_version = db_version;
+        e->seq = BUMP_SEQ(data);
+        e->site_id = 0;
+        moved = true;
     }
+    if (!moved) goto cleanup;
     
-    // handle error condition here
-    stmt_reset(vm);
-    *err = "Unable to find site_id for previous change. The cloudsync table is probably corrupted.";
-    return SQLITE_ERROR;
+    rc = packed_store(table, pk, pklen, &v);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    clock_vector_drop_columns(&oldv);
+    rc = packed_store(table, oldpk, oldpklen, &oldv);
     
 cleanup:
-    if (rc != SQLITE_OK) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-    if (vm) stmt_reset(vm);
+    clock_vector_free(&oldv);
+    clock_vector_free(&expanded);
+    clock_vector_free(&v);
     return rc;
 }
 
-int merge_sentinel_only_insert (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, sqlite3_int64 cl, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, sqlite3_int64 *rowid, const char **err) {
-    
-    // reset return value
-    *rowid = 0;
-    
-    // bind pk
-    sqlite3_stmt *vm = table->real_merge_sentinel_stmt;
-    int rc = pk_decode_prikey((char *)pk, (size_t)pklen, pk_decode_bind_callback, vm);
-    if (rc < 0) {
-        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-        rc = sqlite3_errcode(sqlite3_db_handle(vm));
-        stmt_reset(vm);
-        return rc;
-    }
+int packed_set_winner_clock (cloudsync_context *data, cloudsync_table_context *table, const char *pk, size_t pklen, int col_id, sqlite3_int64 col_version, sqlite3_int64 db_version, sqlite3_int64 seq, sqlite3_int64 site_id, sqlite3_int64 *rowid) {
+    // same as meta_winner_clock_stmt
+    clock_vector v;
+    int rc = packed_load(table, pk, pklen, &v);
+    if (rc != SQLITE_OK) goto cleanup;
     
-    // perform real operation and disable triggers
-    SYNCBIT_SET(data);
-    rc = sqlite3_step(vm);
-    stmt_reset(vm);
-    SYNCBIT_RESET(data);
-    if (rc == SQLITE_DONE) rc = SQLITE_OK;
-    if (rc != SQLITE_OK) {
-        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-        return rc;
-    }
+    sqlite3_int64 version = db_version_next(table->db, data, db_version);
+    clock_entry *e = clock_vector_set(&v, col_id);
+    if (!e) {rc = SQLITE_NOMEM; goto cleanup;}
+    e->col_version = col_version;
+    e->db_version = version;
+    e->seq = seq;
+    e->site_id = site_id;
     
-    rc = merge_zeroclock_on_resurrect(table, db_version, pk, pklen, err);
-    if (rc != SQLITE_OK) return rc;
+    rc = packed_store(table, pk, pklen, &v);
+    if (rc == SQLITE_OK) *rowid = (version << 30) | seq;
     
-    return merge_set_winner_clock(data, table, pk, pklen, NULL, cl, db_version, site_id, site_len, seq, rowid, err);
+cleanup:
+    clock_vector_free(&v);
+    return rc;
 }
 
-int cloudsync_merge_insert_gos (sqlite3_vtab *vtab, cloudsync_context *data, cloudsync_table_context *table, const char *insert_pk, int insert_pk_len, const char *insert_name, sqlite3_value *insert_value, sqlite3_int64 insert_col_version, sqlite3_int64 insert_db_version, const char *insert_site_id, int insert_site_id_len, sqlite3_int64 insert_seq, sqlite3_int64 *rowid) {
-    // Grow-Only Set (GOS) Algorithm: Only insertions are allowed, deletions and updates are prevented from a trigger.
+int packed_zero_clock (cloudsync_context *data, cloudsync_table_context *table, const char *pk, size_t pklen, sqlite3_int64 db_version) {
+    // same as meta_zero_clock_stmt
+    clock_vector v;
+    int rc = packed_load(table, pk, pklen, &v);
+    if (rc != SQLITE_OK) goto cleanup;
     
-    const char *err = NULL;
-    int rc = merge_insert_col(data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version,
-                              insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
-    if (rc != SQLITE_OK) {
-        cloudsync_vtab_set_error(vtab, "Unable to perform GOS merge_insert_col: %s", err);
+    sqlite3_int64 version = CLOUDSYNC_VALUE_NOTSET;
+    for (int i=0; i<v.count; ++i) {
+        if (v.entries[i].col_id == CLOUDSYNC_TOMBSTONE_COLID) continue;
+        if (version == CLOUDSYNC_VALUE_NOTSET) version = db_version_next(table->db, data, db_version);
+        v.entries[i].col_version = 0;
+        v.entries[i].db_version = version;
     }
     
+    if (version != CLOUDSYNC_VALUE_NOTSET) rc = packed_store(table, pk, pklen, &v);
+    
+cleanup:
+    clock_vector_free(&v);
     return rc;
 }
 
-int cloudsync_merge_insert (sqlite3_vtab *vtab, int argc, sqlite3_value **argv, sqlite3_int64 *rowid) {
-    // this function performs the merging logic for an insert in a cloud-synchronized table. It handles
-    // different scenarios including conflicts, causal lengths, delete operations, and resurrecting rows
-    // based on the incoming data (from remote nodes or clients) and the local database state
-
-    // this function handles different CRDT algorithms (GOS, DWS, AWS, and CLS).
-    // the merging strategy is determined based on the table->algo value.
-    
-    // meta table declaration:
-    // tbl TEXT NOT NULL, pk BLOB NOT NULL, col_name TEXT NOT NULL,"
-    // "col_value ANY, col_version INTEGER NOT NULL, db_version INTEGER NOT NULL,"
-    // "site_id BLOB NOT NULL, cl INTEGER NOT NULL, seq INTEGER NOT NULL
-    
-    // meta information to retrieve from arguments:
-    // argv[0] -> table name (TEXT)
-    // argv[1] -> primary key (BLOB)
-    // argv[2] -> column name (TEXT or NULL if sentinel)
-    // argv[3] -> column value (ANY)
-    // argv[4] -> column version (INTEGER)
-    // argv[5] -> database version (INTEGER)
-    // argv[6] -> site ID (BLOB, identifies the origin of the update)
-    // argv[7] -> causal length (INTEGER, tracks the order of operations)
-    // argv[8] -> sequence number (INTEGER, unique per operation)
-    
-    // extract table name
-    const char *insert_tbl = (const char *)sqlite3_value_text(argv[0]);
-    
-    // lookup table
-    cloudsync_context *data = cloudsync_vtab_get_context(vtab);
-    cloudsync_table_context *table = table_lookup(data, insert_tbl);
-    if (!table) return cloudsync_vtab_set_error(vtab, "Unable to find table %s,", insert_tbl);
-    
-    // extract the remaining fields from the input values
-    const char *insert_pk = (const char *)sqlite3_value_blob(argv[1]);
-    int insert_pk_len = sqlite3_value_bytes(argv[1]);
-    const char *insert_name = (sqlite3_value_type(argv[2]) == SQLITE_NULL) ? CLOUDSYNC_TOMBSTONE_VALUE : (const char *)sqlite3_value_text(argv[2]);
-    sqlite3_value *insert_value = argv[3];
-    sqlite3_int64 insert_col_version = sqlite3_value_int64(argv[4]);
-    sqlite3_int64 insert_db_version = sqlite3_value_int64(argv[5]);
-    const char *insert_site_id = (const char *)sqlite3_value_blob(argv[6]);
-    int insert_site_id_len = sqlite3_value_bytes(argv[6]);
-    sqlite3_int64 insert_cl = sqlite3_value_int64(argv[7]);
-    sqlite3_int64 insert_seq = sqlite3_value_int64(argv[8]);
-    const char *err = NULL;
-    
-    // perform different logic for each different table algorithm
-    if (table->algo == table_algo_crdt_gos) return cloudsync_merge_insert_gos(vtab, data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid);
-    
-    // Handle DWS and AWS algorithms here
-    // Delete-Wins Set (DWS): table_algo_crdt_dws
-    // Add-Wins Set (AWS): table_algo_crdt_aws
-    
-    // Causal-Length Set (CLS) Algorithm (default)
-    
-    // compute the local causal length for the row based on the primary key
-    // the causal length is used to determine the order of operations and resolve conflicts.
-    sqlite3_int64 local_cl = merge_get_local_cl(table, insert_pk, insert_pk_len, &err);
-    if (local_cl < 0) {
-        return cloudsync_vtab_set_error(vtab, "Unable to compute local causal length: %s", err);
-    }
+int packed_compact (sqlite3 *db, cloudsync_table_context *table) {
+    // same as the compaction of a per-column meta-table after an ALTER TABLE: inherited clocks are made explicit
+    // (the insert clock refers to the columns before the alter) and the clocks of the removed columns are deleted
+    sqlite3_stmt *vm = NULL;
+    int *col_ids = NULL;
+    int ncols = 0;
     
-    // if the incoming causal length is older than the local causal length, we can safely ignore it
-    // because the local changes are more recent
-    if (insert_cl < local_cl) return SQLITE_OK;
+    char *sql = cloudsync_memory_mprintf("SELECT col_id FROM cloudsync_columns WHERE tbl_name = '%q' AND col_name IN (SELECT name FROM pragma_table_info('%q') WHERE pk=0);", table->name, table->name);
+    if (!sql) return SQLITE_NOMEM;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+    cloudsync_memory_free(sql);
+    if (rc != SQLITE_OK) goto cleanup;
     
-    // check if the operation is a delete by examining the causal length
-    // even causal lengths typically signify delete operations
-    bool is_delete = (insert_cl % 2 == 0);
-    if (is_delete) {
-        // if it's a delete, check if the local state is at the same causal length
-        // if it is, no further action is needed
-        if (local_cl == insert_cl) return SQLITE_OK;
-        
-        // perform a delete merge if the causal length is newer than the local one
-        int rc = merge_delete(data, table, insert_pk, insert_pk_len, insert_name, insert_col_version,
-                              insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
-        if (rc != SQLITE_OK) cloudsync_vtab_set_error(vtab, "Unable to perform merge_delete: %s", err);
-        return rc;
+    if (table->ncols > 0) {
+        col_ids = (int *)cloudsync_memory_alloc((sqlite3_uint64)(sizeof(int) * table->ncols));
+        if (!col_ids) {rc = SQLITE_NOMEM; goto cleanup;}
     }
     
-    // if the operation is a sentinel-only insert (indicating a new row or resurrected row with no column update), handle it separately.
-    bool is_sentinel_only = (strcmp(insert_name, CLOUDSYNC_TOMBSTONE_VALUE) == 0);
-    if (is_sentinel_only) {
-        if (local_cl == insert_cl) return SQLITE_OK;
-        
-        // perform a sentinel-only insert to track the existence of the row
-        int rc = merge_sentinel_only_insert(data, table, insert_pk, insert_pk_len, insert_col_version,
-                                            insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
-        if (rc != SQLITE_OK) cloudsync_vtab_set_error(vtab, "Unable to perform merge_sentinel_only_insert: %s", err);
-        return rc;
+    // columns not known by the table context were added by the alter and have no clocks yet
+    while ((rc = sqlite3_step(vm)) == SQLITE_ROW) {
+        int col_id = sqlite3_column_int(vm, 0);
+        if (table_column_index(table, col_id) >= 0) col_ids[ncols++] = col_id;
     }
+    if (rc != SQLITE_DONE) goto cleanup;
+    sqlite3_finalize(vm);
     
-    // from this point I can be sure that insert_name is not sentinel
+    sql = cloudsync_memory_mprintf("SELECT pk, clocks FROM \"%w_cloudsync\";", table->name);
+    if (!sql) {vm = NULL; rc = SQLITE_NOMEM; goto cleanup;}
+    rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+    cloudsync_memory_free(sql);
+    if (rc != SQLITE_OK) goto cleanup;
     
-    // handle the case where a row is being resurrected (e.g., after a delete, a new insert for the same row)
-    // odd causal lengths can "resurrect" rows
-    bool needs_resurrect = (insert_cl > local_cl && insert_cl % 2 == 1);
-    bool row_exists_locally = local_cl != 0;
-   
-    // if a resurrection is needed, insert a sentinel to mark the row as alive
-    // this handles out-of-order deliveries where the row was deleted and is now being re-inserted
-    if (needs_resurrect && (row_exists_locally || (!row_exists_locally && insert_cl > 1))) {
-        int rc = merge_sentinel_only_insert(data, table, insert_pk, insert_pk_len, insert_cl,
-                                            insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
-        if (rc != SQLITE_OK) {
-            cloudsync_vtab_set_error(vtab, "Unable to perform merge_sentinel_only_insert: %s", err);
-            return rc;
+    // rows are rewritten in place, so visiting a row twice produces the same result
+    while ((rc = sqlite3_step(vm)) == SQLITE_ROW) {
+        const char *pk = (const char *)sqlite3_column_blob(vm, 0);
+        size_t pklen = (size_t)sqlite3_column_bytes(vm, 0);
+        
+        clock_vector v, expanded;
+        if (clock_vector_decode(&v, (const char *)sqlite3_column_blob(vm, 1), (size_t)sqlite3_column_bytes(vm, 1)) != 0) {
+            clock_vector_free(&v);
+            rc = SQLITE_CORRUPT;
+            goto cleanup;
         }
+        rc = (clock_vector_expand(&v, col_ids, ncols, &expanded) == 0) ? packed_store(table, pk, pklen, &expanded) : SQLITE_NOMEM;
+        clock_vector_free(&v);
+        clock_vector_free(&expanded);
+        if (rc != SQLITE_OK) goto cleanup;
     }
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
     
-    // at this point, we determine whether the incoming change wins based on causal length
-    // this can be due to a resurrection, a non-existent local row, or a conflict resolution
-    bool flag = false;
-    int rc = merge_did_cid_win(data, table, insert_pk, insert_pk_len, insert_value, insert_site_id, insert_site_id_len, insert_name, insert_col_version, &flag, &err);
-    if (rc != SQLITE_OK) {
-        cloudsync_vtab_set_error(vtab, "Unable to perform merge_did_cid_win: %s", err);
-        return rc;
-    }
-    
-    // check if the incoming change wins and should be applied
-    bool does_cid_win = ((needs_resurrect) || (!row_exists_locally) || (flag));
-    if (!does_cid_win) return SQLITE_OK;
-    
-    // perform the final column insert or update if the incoming change wins
-    rc = merge_insert_col(data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
-    if (rc != SQLITE_OK) cloudsync_vtab_set_error(vtab, "Unable to perform merge_insert_col: %s", err);
+cleanup:
+    if (vm) sqlite3_finalize(vm);
+    if (col_ids) cloudsync_memory_free(col_ids);
     return rc;
 }
 
-// MARK: - Private -
+// MARK: - Site ID Ordinals -
 
-bool cloudsync_config_exists (sqlite3 *db) {
-    return dbutils_table_exists(db, CLOUDSYNC_SITEID_NAME) == true;
+// Meta-tables store the ordinal (the rowid in cloudsync_site_id) of the site_id of each clock. Only a handful of
+// distinct site_ids ever appear, so their ordinals are kept in memory and cloudsync_site_id is written only the
+// first time a new site_id is seen. Entries added by a transaction are marked as pending until it commits and
+// are dropped if it (or a savepoint of it) is rolled back, because the rows they refer to are gone.
+// Another connection can change cloudsync_site_id too (cloudsync_gc, a snapshot restore), so the first lookup of
+// each transaction drops the whole map if PRAGMA data_version reports a commit performed by someone else.
+
+void siteid_ords_reset (cloudsync_context *data) {
+    if (data->siteid_ords) kh_destroy(SITEID_ORD, data->siteid_ords);
+    data->siteid_ords = NULL;
+    data->siteid_pending = 0;
 }
 
-void *cloudsync_context_create (void) {
-    cloudsync_context *data = (cloudsync_context *)cloudsync_memory_zeroalloc((uint64_t)(sizeof(cloudsync_context)));
-    DEBUG_SETTINGS("cloudsync_context_create %p", data);
-    
-    data->libversion = CLOUDSYNC_VERSION;
-    data->pending_db_version = CLOUDSYNC_VALUE_NOTSET;
-    #if CLOUDSYNC_DEBUG
-    data->debug = 1;
-    #endif
+void siteid_ords_commit (cloudsync_context *data) {
+    data->siteid_checked = false;
+    if (data->siteid_pending == 0) return;
     
-    // allocate space for 128 tables (it can grow if needed)
-    data->tables = (cloudsync_table_context **)cloudsync_memory_zeroalloc((uint64_t)(CLOUDSYNC_INIT_NTABLES * sizeof(cloudsync_table_context *)));
-    if (!data->tables) {
-        cloudsync_memory_free(data);
-        return NULL;
+    khash_t(SITEID_ORD) *h = data->siteid_ords;
+    for (khiter_t k = kh_begin(h); k != kh_end(h); ++k) {
+        if (kh_exist(h, k)) kh_value(h, k).pending = false;
     }
-    data->tables_alloc = CLOUDSYNC_INIT_NTABLES;
-    data->tables_count = 0;
-        
-    return data;
+    data->siteid_pending = 0;
 }
 
-void cloudsync_context_free (void *ptr) {
-    DEBUG_SETTINGS("cloudsync_context_free %p", ptr);
-    if (!ptr) return;
-        
-    cloudsync_context *data = (cloudsync_context*)ptr;
-    cloudsync_memory_free(data->tables);
-    cloudsync_memory_free(data);
+void siteid_ords_rollback (cloudsync_context *data) {
+    data->siteid_checked = false;
+    if (data->siteid_pending == 0) return;
+    
+    khash_t(SITEID_ORD) *h = data->siteid_ords;
+    for (khiter_t k = kh_begin(h); k != kh_end(h); ++k) {
+        if (kh_exist(h, k) && kh_value(h, k).pending) kh_del(SITEID_ORD, h, k);
+    }
+    data->siteid_pending = 0;
 }
 
-const char *cloudsync_context_init (sqlite3 *db, cloudsync_context *data, sqlite3_context *context) {
-    if (!data && context) data = (cloudsync_context *)sqlite3_user_data(context);
-
-    // perform init just the first time, if the site_id field is not set.
-    // The data->site_id value could exists while settings tables don't exists if the
-    // cloudsync_context_init was previously called in init transaction that was rolled back
-    // because of an error during the init process.
-    if (data->site_id[0] == 0 || !dbutils_table_exists(db, CLOUDSYNC_SITEID_NAME)) {
-        if (dbutils_settings_init(db, data, context) != SQLITE_OK) return NULL;
-        if (stmts_add_tocontext(db, data) != SQLITE_OK) return NULL;
-        if (cloudsync_load_siteid(db, data) != SQLITE_OK) return NULL;
-        
-        data->sqlite_ctx = context;
-        data->schema_hash = dbutils_schema_hash(db);
+sqlite3_int64 siteid_ord_get (cloudsync_context *data, const char *site_id, int site_len) {
+    // returns the ordinal of site_id (inserting it into cloudsync_site_id the first time), or -1 in case of error
+    cloudsync_siteid_key key = {0};
+    bool cacheable = (site_len == UUID_LEN);
+    if (cacheable && !data->siteid_checked) {
+        // data_version_stmt is stepped directly so the data->data_version value used by db_version_check_uptodate is not consumed
+        int version = -1;
+        sqlite3_stmt *vm = data->data_version_stmt;
+        if (sqlite3_step(vm) == SQLITE_ROW) version = sqlite3_column_int(vm, 0);
+        sqlite3_reset(vm);
+        if (version == -1 || version != data->siteid_data_version) siteid_ords_reset(data);
+        data->siteid_data_version = version;
+        data->siteid_checked = true;
+    }
+    if (cacheable) {
+        memcpy(key.bytes, site_id, UUID_LEN);
+        if (data->siteid_ords) {
+            khiter_t k = kh_get(SITEID_ORD, data->siteid_ords, key);
+            if (k != kh_end(data->siteid_ords)) return kh_value(data->siteid_ords, k).ord;
+        }
     }
     
-    return (const char *)data->site_id;
-}
-
-void cloudsync_sync_key(cloudsync_context *data, const char *key, const char *value) {
-    DEBUG_SETTINGS("cloudsync_sync_key key: %s value: %s", key, value);
+    // a site_id already stored by another connection (or before the map was reset) is only read
+    sqlite3_stmt *vm = data->get_siteid_stmt;
+    int rc = sqlite3_bind_blob(vm, 1, (const void *)site_id, site_len, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+    sqlite3_int64 ord = (rc == SQLITE_ROW) ? sqlite3_column_int64(vm, 0) : -1;
+    stmt_reset(vm);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) return -1;
     
-    // sync data
-    if (strcmp(key, CLOUDSYNC_KEY_SCHEMAVERSION) == 0) {
-        data->schema_version = (int)strtol(value, NULL, 0);
-        return;
+    if (ord < 0) {
+        vm = data->getset_siteid_stmt;
+        rc = sqlite3_bind_blob(vm, 1, (const void *)site_id, site_len, SQLITE_STATIC);
+        if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+        ord = (rc == SQLITE_ROW) ? sqlite3_column_int64(vm, 0) : -1;
+        stmt_reset(vm);
+        if (ord < 0) return -1;
     }
     
-    if (strcmp(key, CLOUDSYNC_KEY_DEBUG) == 0) {
-        data->debug = 0;
-        if (value && (value[0] != 0) && (value[0] != '0')) data->debug = 1;
-        return;
+    if (!cacheable) return ord;
+    if (!data->siteid_ords) {
+        data->siteid_ords = kh_init(SITEID_ORD);
+        if (!data->siteid_ords) return ord;
     }
-}
-
-#if 0
-void cloudsync_sync_table_key(cloudsync_context *data, const char *table, const char *column, const char *key, const char *value) {
-    DEBUG_SETTINGS("cloudsync_sync_table_key table: %s column: %s key: %s value: %s", table, column, key, value);
-    // Unused in this version
-    return;
-}
-#endif
-
-int cloudsync_commit_hook (void *ctx) {
-    cloudsync_context *data = (cloudsync_context *)ctx;
     
-    data->db_version = data->pending_db_version;
-    data->pending_db_version = CLOUDSYNC_VALUE_NOTSET;
-    data->seq = 0;
+    // the row could have been read or inserted by the current transaction, so the entry is pending in both cases
+    int ret = 0;
+    khiter_t k = kh_put(SITEID_ORD, data->siteid_ords, key, &ret);
+    if (ret < 0) return ord;
+    kh_value(data->siteid_ords, k).ord = ord;
+    kh_value(data->siteid_ords, k).pending = true;
+    data->siteid_pending += 1;
     
-    return SQLITE_OK;
+    return ord;
 }
 
-void cloudsync_rollback_hook (void *ctx) {
-    cloudsync_context *data = (cloudsync_context *)ctx;
-    
-    data->pending_db_version = CLOUDSYNC_VALUE_NOTSET;
-    data->seq = 0;
+void cloudsync_siteid_rollback (cloudsync_context *data) {
+    siteid_ords_rollback(data);
 }
 
-int cloudsync_finalize_alter (sqlite3_context *context, cloudsync_context *data, cloudsync_table_context *table) {
-    int rc = SQLITE_OK;
-    sqlite3 *db = sqlite3_context_db_handle(context);
-
-    db_version_check_uptodate(db, data);
-
-    // If primary key columns change (in the schema)
-    // We need to drop, re-create and backfill
-    // the clock table.
-    // A change in pk columns means a change in all identities
-    // of all rows.
-    // We can determine this by comparing unique index on lookaside table vs
-    // pks on source table
-    char *errmsg = NULL;
-    char **result = NULL;
-    int nrows, ncols;
-    char *sql = cloudsync_memory_mprintf("SELECT name FROM pragma_table_info('%q') WHERE pk>0 ORDER BY pk;", table->name);
-    rc = sqlite3_get_table(db, sql, &result, &nrows, &ncols, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) {
-        DEBUG_SQLITE_ERROR(rc, "cloudsync_finalize_alter", db);
-        goto finalize;
-    } else if (errmsg || ncols != 1) {
-        rc = SQLITE_MISUSE;
-        goto finalize;
-    }
-    
-    bool pk_diff = false;
-    if (nrows != table->npks) {
-        pk_diff = true;
-    } else {
-        for (int i=0; i<nrows; ++i) {
-            if (strcmp(table->pk_name[i], result[i]) != 0) {
-                pk_diff = true;
-                break;
-            }
-        }
-    }
-    
-    if (pk_diff) {
-        // drop meta-table, it will be recreated
-        char *sql = cloudsync_memory_mprintf("DROP TABLE IF EXISTS \"%w_cloudsync\";", table->name);
-        rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
-        cloudsync_memory_free(sql);
-        if (rc != SQLITE_OK) {
-            DEBUG_SQLITE_ERROR(rc, "cloudsync_finalize_alter", db);
-            goto finalize;
-        }
-    } else {
-        // compact meta-table
-        // delete entries for removed columns
-        char *sql = cloudsync_memory_mprintf("DELETE FROM \"%w_cloudsync\" WHERE \"col_name\" NOT IN ("
-                                             "SELECT name FROM pragma_table_info('%q') UNION SELECT '%s'"
-                                             ")", table->name, table->name, CLOUDSYNC_TOMBSTONE_VALUE);
-        rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
-        cloudsync_memory_free(sql);
-        if (rc != SQLITE_OK) {
-            DEBUG_SQLITE_ERROR(rc, "cloudsync_finalize_alter", db);
-            goto finalize;
-        }
-        
-        char *singlequote_escaped_table_name = cloudsync_memory_mprintf("%q", table->name);
-        sql = cloudsync_memory_mprintf("SELECT group_concat('\"%w\".\"' || format('%%w', name) || '\"', ',') FROM pragma_table_info('%s') WHERE pk>0 ORDER BY pk;", singlequote_escaped_table_name, singlequote_escaped_table_name);
-        cloudsync_memory_free(singlequote_escaped_table_name);
-        if (!sql) {
-            rc = SQLITE_NOMEM;
-            goto finalize;
-        }
-        char *pkclause = dbutils_text_select(db, sql);
-        char *pkvalues = (pkclause) ? pkclause : "rowid";
-        cloudsync_memory_free(sql);
-        
-        // delete entries related to rows that no longer exist in the original table, but preserve tombstone
-        sql = cloudsync_memory_mprintf("DELETE FROM \"%w_cloudsync\" WHERE (\"col_name\" != '%s' OR (\"col_name\" = '%s' AND col_version %% 2 != 0)) AND NOT EXISTS (SELECT 1 FROM \"%w\" WHERE \"%w_cloudsync\".pk = cloudsync_pk_encode(%s) LIMIT 1);", table->name, CLOUDSYNC_TOMBSTONE_VALUE, CLOUDSYNC_TOMBSTONE_VALUE, table->name, table->name, pkvalues);
-        rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
-        if (pkclause) cloudsync_memory_free(pkclause);
-        cloudsync_memory_free(sql);
-        if (rc != SQLITE_OK) {
-            DEBUG_SQLITE_ERROR(rc, "cloudsync_finalize_alter", db);
-            goto finalize;
-        }
+// MARK: - Stats -
 
-    }
-    
-    char buf[256];
-    snprintf(buf, sizeof(buf), "%lld", data->db_version);
-    dbutils_settings_set_key_value(db, context, "pre_alter_dbversion", buf);
-    
-finalize:
-    sqlite3_free_table(result);
-    sqlite3_free(errmsg);
-    
-    return rc;
+cloudsync_stats *cloudsync_get_stats (sqlite3_context *context) {
+    cloudsync_context *data = (context) ? (cloudsync_context *)sqlite3_user_data(context) : NULL;
+    return (data) ? &data->stats : NULL;
 }
 
-int cloudsync_refill_metatable (sqlite3 *db, cloudsync_context *data, const char *table_name) {
-    cloudsync_table_context *table = table_lookup(data, table_name);
-    if (!table) return SQLITE_INTERNAL;
-    
-    sqlite3_stmt *vm = NULL;
-    sqlite3_int64 db_version = db_version_next(db, data, CLOUDSYNC_VALUE_NOTSET);
-    
-    char *sql = cloudsync_memory_mprintf("SELECT group_concat('\"' || format('%%w', name) || '\"', ',') FROM pragma_table_info('%q') WHERE pk>0 ORDER BY pk;", table_name);
-    char *pkclause_identifiers = dbutils_text_select(db, sql);
-    char *pkvalues_identifiers = (pkclause_identifiers) ? pkclause_identifiers : "rowid";
-    cloudsync_memory_free(sql);
-    
-    sql = cloudsync_memory_mprintf("SELECT group_concat('cloudsync_pk_decode(pk, ' || pk || ') AS ' || '\"' || format('%%w', name) || '\"', ',') FROM pragma_table_info('%q') WHERE pk>0 ORDER BY pk;", table_name);
-    char *pkdecode = dbutils_text_select(db, sql);
-    char *pkdecodeval = (pkdecode) ? pkdecode : "cloudsync_pk_decode(pk, 1) AS rowid";
-    cloudsync_memory_free(sql);
-     
-    sql = cloudsync_memory_mprintf("SELECT cloudsync_insert('%q', %s) FROM (SELECT %s FROM \"%w\" EXCEPT SELECT %s FROM \"%w_cloudsync\");", table_name, pkvalues_identifiers, pkvalues_identifiers, table_name, pkdecodeval, table_name);
-    int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto finalize;
-    
-    // fill missing colums
-    // for each non-pk column:
-    // The new query does 1 encode per source row and one indexed NOT-EXISTS probe.
-    // The old plan does many decodes per candidate and can’t use an index to rule out matches quickly—so it burns CPU and I/O.
-    
-    sql = cloudsync_memory_mprintf("WITH _cstemp1 AS (SELECT cloudsync_pk_encode(%s) AS pk FROM \"%w\") SELECT _cstemp1.pk FROM _cstemp1 WHERE NOT EXISTS (SELECT 1 FROM \"%w_cloudsync\" _cstemp2 WHERE _cstemp2.pk = _cstemp1.pk AND _cstemp2.col_name = ?);", pkvalues_identifiers, table_name, table_name);
-    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &vm, NULL);
-    cloudsync_memory_free(sql);
-    if (rc != SQLITE_OK) goto finalize;
-     
-    for (int i=0; i<table->ncols; ++i) {
-        char *col_name = table->col_name[i];
-
-        rc = sqlite3_bind_text(vm, 1, col_name, -1, SQLITE_STATIC);
-        if (rc != SQLITE_OK) goto finalize;
-        
-        while (1) {
-            rc = sqlite3_step(vm);
-            if (rc == SQLITE_ROW) {
-                const char *pk = (const char *)sqlite3_column_text(vm, 0);
-                size_t pklen = strlen(pk);
-                rc = local_mark_insert_or_update_meta(db, table, pk, pklen, col_name, db_version, BUMP_SEQ(data));
-            } else if (rc == SQLITE_DONE) {
-                rc = SQLITE_OK;
-                break;
-            } else {
-                break;
-            }
-        }
-        if (rc != SQLITE_OK) goto finalize;
+cloudsync_stats *cloudsync_context_stats (cloudsync_context *data) {
+    return &data->stats;
+}
 
-        sqlite3_reset(vm);
-    }
+const uint64_t *cloudsync_table_stats (cloudsync_context *data, int index, const char **tbl_name) {
+    // per-table counters of the index-th augmented table (NULL if index is out of range)
+    if (index < 0 || index >= data->tables_count) return NULL;
     
-finalize:
-    if (rc != SQLITE_OK) DEBUG_ALWAYS("cloudsync_refill_metatable error: %s", sqlite3_errmsg(db));
-    if (pkclause_identifiers) cloudsync_memory_free(pkclause_identifiers);
-    if (pkdecode) cloudsync_memory_free(pkdecode);
-    if (vm) sqlite3_finalize(vm);
-    return rc;
+    cloudsync_table_context *table = data->tables[index];
+    if (tbl_name) *tbl_name = table->name;
+    return table->stats;
 }
 
-// MARK: - Local -
+// MARK: - Merge Insert -
 
-int local_update_sentinel (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, sqlite3_int64 db_version, int seq) {
-    sqlite3_stmt *vm = table->meta_sentinel_update_stmt;
-    if (!vm) return -1;
+sqlite3_int64 merge_get_local_cl (cloudsync_table_context *table, const char *pk, int pklen, const char **err) {
+    if (table->packed) {
+        sqlite3_int64 cl = -1;
+        if (packed_get_clock(table, pk, (size_t)pklen, 0, &cl, NULL) != SQLITE_OK) *err = sqlite3_errmsg(table->db);
+        return cl;
+    }
     
-    int rc = sqlite3_bind_int64(vm, 1, db_version);
-    if (rc != SQLITE_OK) goto cleanup;
+    sqlite3_stmt *vm = table_stmt(table, TABLE_STMT_META_LOCAL_CL);
+    sqlite3_int64 result = -1;
     
-    rc = sqlite3_bind_int(vm, 2, seq);
+    int rc = table_bind_pk(table, vm, 1, pk, pklen);
     if (rc != SQLITE_OK) goto cleanup;
     
-    rc = sqlite3_bind_blob(vm, 3, pk, (int)pklen, SQLITE_STATIC);
+    rc = table_bind_pk(table, vm, 2, pk, pklen);
     if (rc != SQLITE_OK) goto cleanup;
     
-    rc = sqlite3_step(vm);
-    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    rc = meta_step(table, vm);
+    if (rc == SQLITE_ROW) result = sqlite3_column_int64(vm, 0);
+    else if (rc == SQLITE_DONE) result = 0;
     
 cleanup:
-    DEBUG_SQLITE_ERROR(rc, "local_update_sentinel", db);
-    sqlite3_reset(vm);
-    return rc;
+    if (result == -1) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+    stmt_reset(vm);
+    return result;
 }
 
-int local_mark_insert_sentinel_meta (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, sqlite3_int64 db_version, int seq) {
-    sqlite3_stmt *vm = table->meta_sentinel_insert_stmt;
-    if (!vm) return -1;
-    
-    int rc = sqlite3_bind_blob(vm, 1, pk, (int)pklen, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    rc = sqlite3_bind_int64(vm, 2, db_version);
-    if (rc != SQLITE_OK) goto cleanup;
+int merge_get_col_version (cloudsync_table_context *table, int col_id, const char *pk, int pklen, sqlite3_int64 *version, const char **err) {
+    if (table->packed) {
+        int rc = packed_get_clock(table, pk, (size_t)pklen, col_id, NULL, version);
+        if (rc != SQLITE_OK && rc != SQLITE_DONE) *err = sqlite3_errmsg(table->db);
+        return rc;
+    }
     
-    rc = sqlite3_bind_int(vm, 3, seq);
-    if (rc != SQLITE_OK) goto cleanup;
+    sqlite3_stmt *vm = table_stmt(table, TABLE_STMT_META_COL_VERSION);
     
-    rc = sqlite3_bind_int64(vm, 4, db_version);
+    int rc = table_bind_pk(table, vm, 1, pk, pklen);
     if (rc != SQLITE_OK) goto cleanup;
     
-    rc = sqlite3_bind_int(vm, 5, seq);
+    rc = sqlite3_bind_int(vm, 2, col_id);
     if (rc != SQLITE_OK) goto cleanup;
     
-    rc = sqlite3_step(vm);
-    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    rc = meta_step(table, vm);
+    if (rc == SQLITE_ROW) {
+        *version = sqlite3_column_int64(vm, 0);
+        rc = SQLITE_OK;
+    }
     
 cleanup:
-    DEBUG_SQLITE_ERROR(rc, "local_insert_sentinel", db);
-    sqlite3_reset(vm);
+    if ((rc != SQLITE_OK) && (rc != SQLITE_DONE)) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+    stmt_reset(vm);
     return rc;
 }
 
-int local_mark_insert_or_update_meta_impl (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, const char *col_name, int col_version, sqlite3_int64 db_version, int seq) {
+int merge_set_winner_clock (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pk_len, int col_id, sqlite3_int64 col_version, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, sqlite3_int64 *rowid, const char **err) {
     
-    sqlite3_stmt *vm = table->meta_row_insert_update_stmt;
-    if (!vm) return -1;
+    // get/set site_id
+    sqlite3_stmt *vm = data->getset_siteid_stmt;
+    int rc = SQLITE_OK;
+    int64_t ord = siteid_ord_get(data, site_id, site_len);
+    if (ord < 0) {rc = sqlite3_errcode(sqlite3_db_handle(vm)); if (rc == SQLITE_OK) rc = SQLITE_ERROR; goto cleanup_merge;}
     
-    int rc = sqlite3_bind_blob(vm, 1, pk, (int)pklen, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup;
+    if (table->packed) {
+        rc = packed_set_winner_clock(data, table, pk, (size_t)pk_len, col_id, col_version, db_version, seq, ord, rowid);
+        goto cleanup_merge;
+    }
     
-    rc = sqlite3_bind_text(vm, 2, (col_name) ? col_name : CLOUDSYNC_TOMBSTONE_VALUE, -1, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup;
+    vm = table_stmt(table, TABLE_STMT_META_WINNER_CLOCK);
+    rc = table_bind_pk(table, vm, 1, pk, pk_len);
+    if (rc != SQLITE_OK) goto cleanup_merge;
     
-    rc = sqlite3_bind_int(vm, 3, col_version);
-    if (rc != SQLITE_OK) goto cleanup;
+    rc = sqlite3_bind_int(vm, 2, col_id);
+    if (rc != SQLITE_OK) goto cleanup_merge;
+    
+    rc = sqlite3_bind_int64(vm, 3, col_version);
+    if (rc != SQLITE_OK) goto cleanup_merge;
     
     rc = sqlite3_bind_int64(vm, 4, db_version);
-    if (rc != SQLITE_OK) goto cleanup;
+    if (rc != SQLITE_OK) goto cleanup_merge;
     
-    rc = sqlite3_bind_int(vm, 5, seq);
-    if (rc != SQLITE_OK) goto cleanup;
+    rc = sqlite3_bind_int64(vm, 5, seq);
+    if (rc != SQLITE_OK) goto cleanup_merge;
     
-    rc = sqlite3_bind_int64(vm, 6, db_version);
-    if (rc != SQLITE_OK) goto cleanup;
+    rc = sqlite3_bind_int64(vm, 6, ord);
+    if (rc != SQLITE_OK) goto cleanup_merge;
+    
+    rc = meta_step(table, vm);
+    if (rc == SQLITE_ROW) {
+        *rowid = sqlite3_column_int64(vm, 0);
+        rc = SQLITE_OK;
+    }
+    
+cleanup_merge:
+    if (rc != SQLITE_OK) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+    stmt_reset(vm);
+    return rc;
+}
+
+int merge_insert_col (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, const char *col_name, sqlite3_value *col_value, sqlite3_int64 col_version, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, sqlite3_int64 *rowid, const char **err) {
+    int index;
+    sqlite3_stmt *vm = table_column_lookup(table, col_name, true, &index);
+    if (vm == NULL) {
+        *err = "Unable to retrieve column merge precompiled statement in merge_insert_col.";
+        return SQLITE_MISUSE;
+    }
+    
+    // INSERT INTO table (pk1, pk2, col_name) VALUES (?, ?, ?) ON CONFLICT DO UPDATE SET col_name=?;"
+    
+    // bind primary key(s)
+    int rc = pk_decode_prikey((char *)pk, (size_t)pklen, pk_decode_bind_callback, vm);
+    if (rc < 0) {
+        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+        rc = sqlite3_errcode(sqlite3_db_handle(vm));
+        stmt_reset(vm);
+        return rc;
+    }
+    
+    // bind value
+    if (col_value) {
+        rc = sqlite3_bind_value(vm, table->npks+1, col_value);
+        if (rc == SQLITE_OK) rc = sqlite3_bind_value(vm, table->npks+2, col_value);
+        if (rc != SQLITE_OK) {
+            *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+            stmt_reset(vm);
+            return rc;
+        }
+        
+    }
+    
+    // perform real operation and disable triggers
+    
+    // in case of GOS we reused the table->col_merge_stmt statement
+    // which looks like: INSERT INTO table (pk1, pk2, col_name) VALUES (?, ?, ?) ON CONFLICT DO UPDATE SET col_name=?;"
+    // but the UPDATE in the CONFLICT statement would return SQLITE_CONSTRAINT because the trigger raises the error
+    // the trick is to disable that trigger before executing the statement
+    if (table->algo == table_algo_crdt_gos) table->enabled = 0;
+    SYNCBIT_SET(data);
+    rc = sqlite3_step(vm);
+    DEBUG_MERGE("merge_insert(%02x%02x): %s (%d)", data->site_id[UUID_LEN-2], data->site_id[UUID_LEN-1], sqlite3_expanded_sql(vm), rc);
+    stmt_reset(vm);
+    SYNCBIT_RESET(data);
+    if (table->algo == table_algo_crdt_gos) table->enabled = 1;
+    
+    if (rc != SQLITE_DONE) {
+        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+        return rc;
+    }
+    
+    return merge_set_winner_clock(data, table, pk, pklen, table->col_id[index], col_version, db_version, site_id, site_len, seq, rowid, err);
+}
+
+int merge_delete (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, const char *colname, sqlite3_int64 cl, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, sqlite3_int64 *rowid, const char **err) {
+    int rc = SQLITE_OK;
+    
+    // reset return value
+    *rowid = 0;
+    
+    // bind pk
+    sqlite3_stmt *vm = table_stmt(table, TABLE_STMT_REAL_MERGE_DELETE);
+    rc = pk_decode_prikey((char *)pk, (size_t)pklen, pk_decode_bind_callback, vm);
+    if (rc < 0) {
+        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+        rc = sqlite3_errcode(sqlite3_db_handle(vm));
+        stmt_reset(vm);
+        return rc;
+    }
+    
+    // perform real operation and disable triggers
+    SYNCBIT_SET(data);
+    rc = sqlite3_step(vm);
+    DEBUG_MERGE("merge_delete(%02x%02x): %s (%d)", data->site_id[UUID_LEN-2], data->site_id[UUID_LEN-1], sqlite3_expanded_sql(vm), rc);
+    stmt_reset(vm);
+    SYNCBIT_RESET(data);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    if (rc != SQLITE_OK) {
+        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+        return rc;
+    }
+    
+    rc = merge_set_winner_clock(data, table, pk, pklen, table_column_id(table, colname), cl, db_version, site_id, site_len, seq, rowid, err);
+    if (rc != SQLITE_OK) return rc;
+    
+    // drop clocks _after_ setting the winner clock so we don't lose track of the max db_version!!
+    // this must never come before `set_winner_clock`
+    if (table->packed) {
+        rc = packed_drop_columns(table, pk, (size_t)pklen);
+        if (rc != SQLITE_OK) *err = sqlite3_errmsg(table->db);
+        return rc;
+    }
+    
+    vm = table_stmt(table, TABLE_STMT_META_MERGE_DELETE_DROP);
+    rc = table_bind_pk(table, vm, 1, pk, pklen);
+    if (rc == SQLITE_OK) rc = meta_step(table, vm);
+    stmt_reset(vm);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    if (rc != SQLITE_OK) {
+        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+    }
+    
+    return rc;
+}
+
+int merge_zeroclock_on_resurrect(cloudsync_context *data, cloudsync_table_context *table, sqlite3_int64 db_version, const char *pk, int pklen, const char **err) {
+    if (table->packed) {
+        int rc = packed_zero_clock(data, table, pk, (size_t)pklen, db_version);
+        if (rc != SQLITE_OK) *err = sqlite3_errmsg(table->db);
+        return rc;
+    }
+    
+    sqlite3_stmt *vm = table_stmt(table, TABLE_STMT_META_ZERO_CLOCK);
+    
+    int rc = sqlite3_bind_int64(vm, 1, db_version);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = table_bind_pk(table, vm, 2, pk, pklen);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = meta_step(table, vm);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    
+cleanup:
+    if (rc != SQLITE_OK) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+    stmt_reset(vm);
+    return rc;
+}
+
+// executed only if insert_cl == local_cl
+int merge_did_cid_win (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, sqlite3_value *insert_value, const char *site_id, int site_len, const char *col_name, sqlite3_int64 col_version, bool *didwin_flag, const char **err) {
+    
+    if (col_name == NULL) col_name = CLOUDSYNC_TOMBSTONE_VALUE;
+    int col_id = table_column_id(table, col_name);
+    
+    sqlite3_int64 local_version;
+    int rc = merge_get_col_version(table, col_id, pk, pklen, &local_version, err);
+    if (rc == SQLITE_DONE) {
+        // no rows returned, the incoming change wins if there's nothing there locally
+        *didwin_flag = true;
+        return SQLITE_OK;
+    }
+    if (rc != SQLITE_OK) return rc;
+    
+    // rc == SQLITE_OK, means that a row with a version exists
+    if (local_version != col_version) {
+        if (col_version > local_version) {*didwin_flag = true; return SQLITE_OK;}
+        if (col_version < local_version) {*didwin_flag = false; return SQLITE_OK;}
+    }
+    
+    // rc == SQLITE_ROW and col_version == local_version, need to compare values
+    
+    // retrieve col_value precompiled statement
+    sqlite3_stmt *vm = table_column_lookup(table, col_name, false, NULL);
+    if (!vm) {
+        *err = "Unable to retrieve column value precompiled statement in merge_did_cid_win.";
+        return SQLITE_ERROR;
+    }
+    
+    // bind primary key values
+    rc = pk_decode_prikey((char *)pk, (size_t)pklen, pk_decode_bind_callback, (void *)vm);
+    if (rc < 0) {
+        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+        rc = sqlite3_errcode(sqlite3_db_handle(vm));
+        stmt_reset(vm);
+        return rc;
+    }
+        
+    // execute vm
+    sqlite3_value *local_value;
+    rc = sqlite3_step(vm);
+    if (rc == SQLITE_DONE) {
+        // meta entry exists but the actual value is missing
+        // we should allow the value_compare function to make a decision
+        // value_compare has been modified to handle the case where lvalue is NULL
+        local_value = NULL;
+        rc = SQLITE_OK;
+    } else if (rc == SQLITE_ROW) {
+        local_value = sqlite3_column_value(vm, 0);
+        rc = SQLITE_OK;
+    } else {
+        goto cleanup;
+    }
+    
+    // compare values
+    int ret = dbutils_value_compare(insert_value, local_value);
+    // reset after compare, otherwise local value would be deallocated
+    vm = stmt_reset(vm);
+    
+    bool compare_site_id = (ret == 0 && data->merge_equal_values == true);
+    if (!compare_site_id) {
+        *didwin_flag = (ret > 0);
+        goto cleanup;
+    }
+    
+    // values are the same and merge_equal_values is true
+    // (the site_id is read from the meta-table, so a buffered packed row must be written first)
+    if (table->packed && table->packed_row->table == table) {
+        rc = packed_row_sync(table->packed_row);
+        if (rc != SQLITE_OK) {*err = sqlite3_errmsg(table->db); return rc;}
+    }
+    vm = table_stmt(table, TABLE_STMT_META_SITE_ID);
+    rc = table_bind_pk(table, vm, 1, pk, pklen);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int(vm, 2, col_id);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = meta_step(table, vm);
+    if (rc == SQLITE_ROW) {
+        const void *local_site_id = sqlite3_column_blob(vm, 0);
+        ret = memcmp(site_id, local_site_id, site_len);
+        *didwin_flag = (ret > 0);
+        stmt_reset(vm);
+        return SQLITE_OK;
+    }
+    
+    // handle error condition here
+    stmt_reset(vm);
+    *err = "Unable to find site_id for previous change. The cloudsync table is probably corrupted.";
+    return SQLITE_ERROR;
+    
+cleanup:
+    if (rc != SQLITE_OK) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+    if (vm) stmt_reset(vm);
+    return rc;
+}
+
+int merge_sentinel_only_insert (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, sqlite3_int64 cl, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, sqlite3_int64 *rowid, const char **err) {
+    
+    // reset return value
+    *rowid = 0;
+    
+    // bind pk
+    sqlite3_stmt *vm = table_stmt(table, TABLE_STMT_REAL_MERGE_SENTINEL);
+    int rc = pk_decode_prikey((char *)pk, (size_t)pklen, pk_decode_bind_callback, vm);
+    if (rc < 0) {
+        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+        rc = sqlite3_errcode(sqlite3_db_handle(vm));
+        stmt_reset(vm);
+        return rc;
+    }
+    
+    // perform real operation and disable triggers
+    SYNCBIT_SET(data);
+    rc = sqlite3_step(vm);
+    stmt_reset(vm);
+    SYNCBIT_RESET(data);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    if (rc != SQLITE_OK) {
+        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+        return rc;
+    }
+    
+    rc = merge_zeroclock_on_resurrect(data, table, db_version, pk, pklen, err);
+    if (rc != SQLITE_OK) return rc;
+    
+    return merge_set_winner_clock(data, table, pk, pklen, CLOUDSYNC_TOMBSTONE_COLID, cl, db_version, site_id, site_len, seq, rowid, err);
+}
+
+int cloudsync_merge_insert_gos (sqlite3_vtab *vtab, cloudsync_context *data, cloudsync_table_context *table, const char *insert_pk, int insert_pk_len, const char *insert_name, sqlite3_value *insert_value, sqlite3_int64 insert_col_version, sqlite3_int64 insert_db_version, const char *insert_site_id, int insert_site_id_len, sqlite3_int64 insert_seq, sqlite3_int64 *rowid) {
+    // Grow-Only Set (GOS) Algorithm: Only insertions are allowed, deletions and updates are prevented from a trigger.
+    
+    const char *err = NULL;
+    int rc = merge_insert_col(data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version,
+                              insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
+    if (rc != SQLITE_OK) {
+        cloudsync_vtab_set_error(vtab, "Unable to perform GOS merge_insert_col: %s", err);
+    } else {
+        TABLE_STATS_ADD(table, CLOUDSYNC_STAT_MERGES_WON, 1);
+    }
+    
+    return rc;
+}
+
+int cloudsync_merge_insert (sqlite3_vtab *vtab, int argc, sqlite3_value **argv, sqlite3_int64 *rowid) {
+    // this function performs the merging logic for an insert in a cloud-synchronized table. It handles
+    // different scenarios including conflicts, causal lengths, delete operations, and resurrecting rows
+    // based on the incoming data (from remote nodes or clients) and the local database state
+
+    // this function handles different CRDT algorithms (GOS, DWS, AWS, and CLS).
+    // the merging strategy is determined based on the table->algo value.
+    
+    // meta table declaration:
+    // tbl TEXT NOT NULL, pk BLOB NOT NULL, col_name TEXT NOT NULL,"
+    // "col_value ANY, col_version INTEGER NOT NULL, db_version INTEGER NOT NULL,"
+    // "site_id BLOB NOT NULL, cl INTEGER NOT NULL, seq INTEGER NOT NULL
+    
+    // meta information to retrieve from arguments:
+    // argv[0] -> table name (TEXT)
+    // argv[1] -> primary key (BLOB)
+    // argv[2] -> column name (TEXT or NULL if sentinel)
+    // argv[3] -> column value (ANY)
+    // argv[4] -> column version (INTEGER)
+    // argv[5] -> database version (INTEGER)
+    // argv[6] -> site ID (BLOB, identifies the origin of the update)
+    // argv[7] -> causal length (INTEGER, tracks the order of operations)
+    // argv[8] -> sequence number (INTEGER, unique per operation)
+    
+    // extract table name
+    const char *insert_tbl = (const char *)sqlite3_value_text(argv[0]);
+    
+    // lookup table
+    cloudsync_context *data = cloudsync_vtab_get_context(vtab);
+    cloudsync_table_context *table = table_lookup(data, insert_tbl);
+    if (!table) return cloudsync_vtab_set_error(vtab, "Unable to find table %s,", insert_tbl);
+    
+    // extract the remaining fields from the input values
+    const char *insert_pk = (const char *)sqlite3_value_blob(argv[1]);
+    int insert_pk_len = sqlite3_value_bytes(argv[1]);
+    const char *insert_name = (sqlite3_value_type(argv[2]) == SQLITE_NULL) ? CLOUDSYNC_TOMBSTONE_VALUE : (const char *)sqlite3_value_text(argv[2]);
+    sqlite3_value *insert_value = argv[3];
+    sqlite3_int64 insert_col_version = sqlite3_value_int64(argv[4]);
+    sqlite3_int64 insert_db_version = sqlite3_value_int64(argv[5]);
+    const char *insert_site_id = (const char *)sqlite3_value_blob(argv[6]);
+    int insert_site_id_len = sqlite3_value_bytes(argv[6]);
+    sqlite3_int64 insert_cl = sqlite3_value_int64(argv[7]);
+    sqlite3_int64 insert_seq = sqlite3_value_int64(argv[8]);
+    const char *err = NULL;
+    
+    TABLE_STATS_ADD(table, CLOUDSYNC_STAT_MERGES_ATTEMPTED, 1);
+    
+    // perform different logic for each different table algorithm
+    if (table->algo == table_algo_crdt_gos) return cloudsync_merge_insert_gos(vtab, data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid);
+    
+    // Handle DWS and AWS algorithms here
+    // Delete-Wins Set (DWS): table_algo_crdt_dws
+    // Add-Wins Set (AWS): table_algo_crdt_aws
+    
+    // Causal-Length Set (CLS) Algorithm (default)
+    
+    // compute the local causal length for the row based on the primary key
+    // the causal length is used to determine the order of operations and resolve conflicts.
+    sqlite3_int64 local_cl = merge_get_local_cl(table, insert_pk, insert_pk_len, &err);
+    if (local_cl < 0) {
+        return cloudsync_vtab_set_error(vtab, "Unable to compute local causal length: %s", err);
+    }
+    
+    // if the incoming causal length is older than the local causal length, we can safely ignore it
+    // because the local changes are more recent
+    if (insert_cl < local_cl) {
+        TABLE_STATS_ADD(table, CLOUDSYNC_STAT_MERGES_SKIPPED_CL, 1);
+        return SQLITE_OK;
+    }
+    
+    // check if the operation is a delete by examining the causal length
+    // even causal lengths typically signify delete operations
+    bool is_delete = (insert_cl % 2 == 0);
+    if (is_delete) {
+        // if it's a delete, check if the local state is at the same causal length
+        // if it is, no further action is needed
+        if (local_cl == insert_cl) {
+            TABLE_STATS_ADD(table, CLOUDSYNC_STAT_MERGES_SKIPPED_CL, 1);
+            return SQLITE_OK;
+        }
+        
+        // perform a delete merge if the causal length is newer than the local one
+        int rc = merge_delete(data, table, insert_pk, insert_pk_len, insert_name, insert_col_version,
+                              insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
+        if (rc != SQLITE_OK) cloudsync_vtab_set_error(vtab, "Unable to perform merge_delete: %s", err);
+        else TABLE_STATS_ADD(table, CLOUDSYNC_STAT_MERGES_WON, 1);
+        return rc;
+    }
+    
+    // if the operation is a sentinel-only insert (indicating a new row or resurrected row with no column update), handle it separately.
+    bool is_sentinel_only = (strcmp(insert_name, CLOUDSYNC_TOMBSTONE_VALUE) == 0);
+    if (is_sentinel_only) {
+        if (local_cl == insert_cl) {
+            TABLE_STATS_ADD(table, CLOUDSYNC_STAT_MERGES_SKIPPED_CL, 1);
+            return SQLITE_OK;
+        }
+        
+        // perform a sentinel-only insert to track the existence of the row
+        int rc = merge_sentinel_only_insert(data, table, insert_pk, insert_pk_len, insert_col_version,
+                                            insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
+        if (rc != SQLITE_OK) cloudsync_vtab_set_error(vtab, "Unable to perform merge_sentinel_only_insert: %s", err);
+        else TABLE_STATS_ADD(table, CLOUDSYNC_STAT_MERGES_WON, 1);
+        return rc;
+    }
+    
+    // from this point I can be sure that insert_name is not sentinel
+    
+    // handle the case where a row is being resurrected (e.g., after a delete, a new insert for the same row)
+    // odd causal lengths can "resurrect" rows
+    bool needs_resurrect = (insert_cl > local_cl && insert_cl % 2 == 1);
+    bool row_exists_locally = local_cl != 0;
+   
+    // if a resurrection is needed, insert a sentinel to mark the row as alive
+    // this handles out-of-order deliveries where the row was deleted and is now being re-inserted
+    if (needs_resurrect && (row_exists_locally || (!row_exists_locally && insert_cl > 1))) {
+        int rc = merge_sentinel_only_insert(data, table, insert_pk, insert_pk_len, insert_cl,
+                                            insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
+        if (rc != SQLITE_OK) {
+            cloudsync_vtab_set_error(vtab, "Unable to perform merge_sentinel_only_insert: %s", err);
+            return rc;
+        }
+    }
+    
+    // at this point, we determine whether the incoming change wins based on causal length
+    // this can be due to a resurrection, a non-existent local row, or a conflict resolution
+    bool flag = false;
+    int rc = merge_did_cid_win(data, table, insert_pk, insert_pk_len, insert_value, insert_site_id, insert_site_id_len, insert_name, insert_col_version, &flag, &err);
+    if (rc != SQLITE_OK) {
+        cloudsync_vtab_set_error(vtab, "Unable to perform merge_did_cid_win: %s", err);
+        return rc;
+    }
+    
+    // check if the incoming change wins and should be applied
+    bool does_cid_win = ((needs_resurrect) || (!row_exists_locally) || (flag));
+    if (!does_cid_win) {
+        TABLE_STATS_ADD(table, CLOUDSYNC_STAT_MERGES_LOST, 1);
+        return SQLITE_OK;
+    }
+    
+    // perform the final column insert or update if the incoming change wins
+    rc = merge_insert_col(data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
+    if (rc != SQLITE_OK) cloudsync_vtab_set_error(vtab, "Unable to perform merge_insert_col: %s", err);
+    else TABLE_STATS_ADD(table, CLOUDSYNC_STAT_MERGES_WON, 1);
+    return rc;
+}
+
+// MARK: - Private -
+
+bool cloudsync_config_exists (sqlite3 *db) {
+    return dbutils_table_exists(db, CLOUDSYNC_SITEID_NAME) == true;
+}
+
+void *cloudsync_context_create (void) {
+    cloudsync_context *data = (cloudsync_context *)cloudsync_memory_zeroalloc((uint64_t)(sizeof(cloudsync_context)));
+    DEBUG_SETTINGS("cloudsync_context_create %p", data);
+    
+    data->libversion = CLOUDSYNC_VERSION;
+    data->pending_db_version = CLOUDSYNC_VALUE_NOTSET;
+    data->local_db_version = CLOUDSYNC_VALUE_NOTSET;
+    data->pending_local_db_version = CLOUDSYNC_VALUE_NOTSET;
+    data->apply_group_dbversions = 1;
+    cloudsync_arena_init(&data->arena, CLOUDSYNC_ARENA_BLOCK_SIZE);
+    data->stmt_cache.stats = data->stats.counters;
+    #if CLOUDSYNC_DEBUG
+    data->debug = 1;
+    #endif
+    
+    // allocate space for 128 tables (it can grow if needed)
+    data->tables = (cloudsync_table_context **)cloudsync_memory_zeroalloc((uint64_t)(CLOUDSYNC_INIT_NTABLES * sizeof(cloudsync_table_context *)));
+    if (!data->tables) {
+        cloudsync_memory_free(data);
+        return NULL;
+    }
+    data->tables_alloc = CLOUDSYNC_INIT_NTABLES;
+    data->tables_count = 0;
+        
+    return data;
+}
+
+void cloudsync_context_free (void *ptr) {
+    DEBUG_SETTINGS("cloudsync_context_free %p", ptr);
+    if (!ptr) return;
+        
+    cloudsync_context *data = (cloudsync_context*)ptr;
+    row_cache_clear(&data->row_cache);
+    packed_batch_end(data, false);
+    schema_shared_release(data->schema);
+    siteid_ords_reset(data);
+    cloudsync_arena_free(&data->arena);
+    cloudsync_memory_free(data->tables);
+    cloudsync_memory_free(data);
+}
+
+const char *cloudsync_context_init (sqlite3 *db, cloudsync_context *data, sqlite3_context *context) {
+    if (!data && context) data = (cloudsync_context *)sqlite3_user_data(context);
+
+    // perform init just the first time, if the site_id field is not set.
+    // The data->site_id value could exists while settings tables don't exists if the
+    // cloudsync_context_init was previously called in init transaction that was rolled back
+    // because of an error during the init process.
+    if (data->site_id[0] == 0 || !dbutils_table_exists(db, CLOUDSYNC_SITEID_NAME)) {
+        if (dbutils_settings_init(db, data, context) != SQLITE_OK) return NULL;
+        if (stmts_add_tocontext(db, data) != SQLITE_OK) return NULL;
+        if (cloudsync_load_siteid(db, data) != SQLITE_OK) return NULL;
+        
+        data->sqlite_ctx = context;
+        data->schema_hash = dbutils_schema_hash(db);
+    }
+    
+    return (const char *)data->site_id;
+}
+
+void cloudsync_sync_key(cloudsync_context *data, const char *key, const char *value) {
+    DEBUG_SETTINGS("cloudsync_sync_key key: %s value: %s", key, value);
+    
+    // sync data
+    if (strcmp(key, CLOUDSYNC_KEY_SCHEMAVERSION) == 0) {
+        data->schema_version = (int)strtol(value, NULL, 0);
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_DEBUG) == 0) {
+        data->debug = 0;
+        if (value && (value[0] != 0) && (value[0] != '0')) data->debug = 1;
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_SEND_DBVERSION) == 0) {
+        data->send_db_version = (value) ? strtoll(value, NULL, 0) : 0;
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_LOCAL_DBVERSION) == 0) {
+        data->local_db_version = (value) ? strtoll(value, NULL, 0) : CLOUDSYNC_VALUE_NOTSET;
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_APPLY_GROUP_DBVERSIONS) == 0) {
+        data->apply_group_dbversions = (value) ? (int)strtol(value, NULL, 0) : 1;
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_APPLY_GROUP_ROWS) == 0) {
+        data->apply_group_rows = (value) ? (int)strtol(value, NULL, 0) : 0;
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_APPLY_GROUP_MS) == 0) {
+        data->apply_group_ms = (value) ? (int)strtol(value, NULL, 0) : 0;
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_BACKFILL_BATCH) == 0) {
+        data->backfill_batch = (value) ? strtoll(value, NULL, 0) : 0;
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_SHARED_SCHEMA) == 0) {
+        data->shared_schema = (value) ? (strtol(value, NULL, 0) != 0) : false;
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_STMT_CACHE_SIZE) == 0) {
+        data->stmt_cache.limit = (value) ? (int)strtol(value, NULL, 0) : 0;
+        stmt_cache_trim(&data->stmt_cache, 0);
+        return;
+    }
+}
+
+#if 0
+void cloudsync_sync_table_key(cloudsync_context *data, const char *table, const char *column, const char *key, const char *value) {
+    DEBUG_SETTINGS("cloudsync_sync_table_key table: %s column: %s key: %s value: %s", table, column, key, value);
+    // Unused in this version
+    return;
+}
+#endif
+
+int cloudsync_commit_hook (void *ctx) {
+    cloudsync_context *data = (cloudsync_context *)ctx;
+    
+    data->db_version = data->pending_db_version;
+    data->pending_db_version = CLOUDSYNC_VALUE_NOTSET;
+    data->seq = 0;
+    siteid_ords_commit(data);
+    cloudsync_arena_reset(&data->arena);
+    
+    if (data->pending_local_db_version != CLOUDSYNC_VALUE_NOTSET) {
+        data->local_db_version = data->pending_local_db_version;
+        data->pending_local_db_version = CLOUDSYNC_VALUE_NOTSET;
+    }
+    
+    return SQLITE_OK;
+}
+
+void cloudsync_rollback_hook (void *ctx) {
+    cloudsync_context *data = (cloudsync_context *)ctx;
+    
+    data->pending_db_version = CLOUDSYNC_VALUE_NOTSET;
+    data->seq = 0;
+    siteid_ords_rollback(data);
+    cloudsync_arena_reset(&data->arena);
+    
+    // settings written in the rolled back transaction are gone too, so reload them on the next check
+    data->pending_local_db_version = CLOUDSYNC_VALUE_NOTSET;
+    data->local_db_version = CLOUDSYNC_VALUE_NOTSET;
+}
+
+int cloudsync_alter_rekey (sqlite3 *db, cloudsync_table_context *table, char **pk_names, int npks, bool *rekeyed, bool *refill) {
+    // the clocks of a table whose primary key changed are moved to the new primary key values, as long as
+    // the old primary key columns still exist and identify exactly one row each (otherwise rekeyed is false)
+    char *oldpk = NULL;
+    char *newpk = NULL;
+    char *cols = NULL;
+    char *mcols = NULL;
+    char *sql = NULL;
+    int rc = SQLITE_OK;
+    *rekeyed = false;
+    
+    if (npks == 0) return SQLITE_OK;
+    for (int i=0; i<table->npks; ++i) {
+        sql = cloudsync_memory_mprintf("SELECT count(*) FROM pragma_table_info('%q') WHERE name = '%q';", table->name, table->pk_name[i+1]);
+        if (!sql) return SQLITE_NOMEM;
+        sqlite3_int64 exists = dbutils_int_select(db, sql);
+        cloudsync_memory_free(sql);
+        sql = NULL;
+        if (exists != 1) return SQLITE_OK;
+    }
+    
+    // the same expressions used to compute the meta-table primary key before and after the alter
+    bool intpk = dbutils_table_has_rowid_pk(db, table->name);
+    oldpk = cloudsync_memory_mprintf("%s(", (table->intpk) ? "" : "cloudsync_pk_encode");
+    newpk = cloudsync_memory_mprintf("%s(", (intpk) ? "" : "cloudsync_pk_encode");
+    for (int i=0; i<table->npks && oldpk; ++i) {
+        char *s = cloudsync_memory_mprintf("%s%s\"%w\"", oldpk, (i) ? "," : "", table->pk_name[i+1]);
+        cloudsync_memory_free(oldpk);
+        oldpk = s;
+    }
+    for (int i=0; i<npks && newpk; ++i) {
+        char *s = cloudsync_memory_mprintf("%s%s\"%w\"", newpk, (i) ? "," : "", pk_names[i+1]);
+        cloudsync_memory_free(newpk);
+        newpk = s;
+    }
+    if (!oldpk || !newpk) {rc = SQLITE_NOMEM; goto cleanup;}
+    
+    // the mapping is 1:1 only if the old primary key values are still unique
+    sql = cloudsync_memory_mprintf("CREATE TEMP TABLE cloudsync_rekey (oldpk NOT NULL PRIMARY KEY, newpk) WITHOUT ROWID; INSERT INTO temp.cloudsync_rekey (oldpk, newpk) SELECT %s), %s) FROM \"%w\";", oldpk, newpk, table->name);
+    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+    rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    cloudsync_memory_free(sql);
+    sql = NULL;
+    if (rc == SQLITE_CONSTRAINT) {
+        rc = sqlite3_exec(db, "DROP TABLE IF EXISTS temp.cloudsync_rekey;", NULL, NULL, NULL);
+        goto cleanup;
+    }
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    // the meta-table is created again because its layout depends on the primary key, then the clocks of the
+    // existing rows are copied (the tombstones of the deleted rows cannot be mapped, so they are dropped)
+    sql = cloudsync_memory_mprintf("ALTER TABLE \"%w_cloudsync\" RENAME TO \"%w_cloudsync_rekey\"; DROP INDEX IF EXISTS \"%w_cloudsync_db_idx\";", table->name, table->name, table->name);
+    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+    rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = dbutils_check_metatable(db, table->name, table->algo);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    cloudsync_memory_free(sql);
+    sql = cloudsync_memory_mprintf("SELECT group_concat('\"' || format('%%w', name) || '\"', ',') FROM pragma_table_info('%q_cloudsync') WHERE name != 'pk';", table->name);
+    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+    cols = dbutils_text_select(db, sql);
+    cloudsync_memory_free(sql);
+    sql = cloudsync_memory_mprintf("SELECT group_concat('m.\"' || format('%%w', name) || '\"', ',') FROM pragma_table_info('%q_cloudsync') WHERE name != 'pk';", table->name);
+    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+    mcols = dbutils_text_select(db, sql);
+    if (!cols || !mcols) {rc = SQLITE_ERROR; goto cleanup;}
+    
+    cloudsync_memory_free(sql);
+    sql = cloudsync_memory_mprintf("INSERT INTO \"%w_cloudsync\" (pk, %s) SELECT r.newpk, %s FROM temp.cloudsync_rekey AS r JOIN \"%w_cloudsync_rekey\" AS m ON m.pk = r.oldpk;", table->name, cols, mcols, table->name);
+    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+    rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    // rows without clocks (inserted while the triggers were dropped) must be backfilled
+    cloudsync_memory_free(sql);
+    sql = cloudsync_memory_mprintf("SELECT EXISTS (SELECT 1 FROM temp.cloudsync_rekey AS r WHERE NOT EXISTS (SELECT 1 FROM \"%w_cloudsync\" WHERE pk = r.newpk));", table->name);
+    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+    if (dbutils_int_select(db, sql) != 0) *refill = true;
+    
+    cloudsync_memory_free(sql);
+    sql = cloudsync_memory_mprintf("DROP TABLE \"%w_cloudsync_rekey\"; DROP TABLE temp.cloudsync_rekey;", table->name);
+    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+    rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    if (rc == SQLITE_OK) *rekeyed = true;
+    
+cleanup:
+    DEBUG_SQLITE_ERROR(rc, "cloudsync_alter_rekey", db);
+    if (oldpk) cloudsync_memory_free(oldpk);
+    if (newpk) cloudsync_memory_free(newpk);
+    if (cols) cloudsync_memory_free(cols);
+    if (mcols) cloudsync_memory_free(mcols);
+    if (sql) cloudsync_memory_free(sql);
+    return rc;
+}
+
+int cloudsync_alter_columns_diff (sqlite3 *db, cloudsync_table_context *table, bool *removed, bool *added) {
+    // compare the columns known by the table context with the non primary key columns after the alter
+    char **result = NULL;
+    int nrows = 0, ncols = 0;
+    char *sql = cloudsync_memory_mprintf("SELECT name FROM pragma_table_info('%q') WHERE pk=0;", table->name);
+    if (!sql) return SQLITE_NOMEM;
+    int rc = sqlite3_get_table(db, sql, &result, &nrows, &ncols, NULL);
+    cloudsync_memory_free(sql);
+    if (rc != SQLITE_OK) return rc;
+    
+    int found = 0;
+    for (int i=0; i<table->ncols; ++i) {
+        bool exists = false;
+        for (int j=1; j<=nrows; ++j) {
+            if (sqlite3_stricmp(table->col_name[i], result[j]) == 0) {exists = true; break;}
+        }
+        if (exists) ++found;
+        else *removed = true;
+    }
+    if (nrows > found) *added = true;
+    
+    sqlite3_free_table(result);
+    return SQLITE_OK;
+}
+
+int cloudsync_finalize_alter (sqlite3_context *context, cloudsync_context *data, cloudsync_table_context *table, bool *refill) {
+    int rc = SQLITE_OK;
+    sqlite3 *db = sqlite3_context_db_handle(context);
+
+    db_version_check_uptodate(db, data);
+
+    // Only the parts of the meta-table affected by the alter are updated:
+    // * a change in pk columns means a change in all identities of all rows, so the clocks are re-keyed
+    //   (or, if the old primary key values cannot be mapped to the new ones, the meta-table is rebuilt from scratch)
+    // * the clocks of the removed columns are deleted, added columns don't need clocks until they are updated
+    // * rows inserted or deleted while the triggers were dropped (detected by sqlite3_total_changes64,
+    //   an ALTER TABLE doesn't change it) require a scan of the table and of the meta-table
+    // We can determine a pk change by comparing the pks saved by cloudsync_begin_alter vs pks on source table
+    char *errmsg = NULL;
+    char **result = NULL;
+    char buf[256];
+    int nrows, ncols;
+    char *sql = cloudsync_memory_mprintf("SELECT name FROM pragma_table_info('%q') WHERE pk>0 ORDER BY pk;", table->name);
+    rc = sqlite3_get_table(db, sql, &result, &nrows, &ncols, NULL);
+    cloudsync_memory_free(sql);
+    if (rc != SQLITE_OK) {
+        DEBUG_SQLITE_ERROR(rc, "cloudsync_finalize_alter", db);
+        goto finalize;
+    } else if (errmsg || ncols != 1) {
+        rc = SQLITE_MISUSE;
+        goto finalize;
+    }
+    
+    bool data_changed = (sqlite3_total_changes64(db) != table->alter_changes);
+    *refill = data_changed;
+    
+    // a pending backfill must restart, its cursor could refer to the old primary key
+    sql = cloudsync_memory_mprintf("SELECT count(*) FROM " CLOUDSYNC_TABLE_SETTINGS_NAME " WHERE tbl_name = '%q' AND key = '" CLOUDSYNC_KEY_BACKFILL_CURSOR "';", table->name);
+    if (!sql) {rc = SQLITE_NOMEM; goto finalize;}
+    if (dbutils_int_select(db, sql) != 0) *refill = true;
+    cloudsync_memory_free(sql);
+    
+    // a meta-table keyed by integers must be rebuilt also when the primary key is no longer the rowid (and vice versa),
+    // the table before the alter is compared (not table->intpk) so that a BLOB meta-table created before the integer
+    // layout was introduced is not rebuilt by every alter of a table whose primary key is still the rowid
+    bool pk_diff = false;
+    bool intpk_diff = (table->alter_rowid_pk != dbutils_table_has_rowid_pk(db, table->name));
+    if (nrows != table->npks || intpk_diff) {
+        pk_diff = true;
+    } else {
+        for (int i=0; i<nrows; ++i) {
+            if (strcmp(table->pk_name[i+1], result[i+1]) != 0) {
+                pk_diff = true;
+                break;
+            }
+        }
+    }
+    
+    // renaming primary key columns (the only pk change without writing rows) keeps the encoded values
+    if (pk_diff && !data_changed && nrows == table->npks && !intpk_diff) pk_diff = false;
+    
+    if (pk_diff) {
+        bool rekeyed = false;
+        rc = cloudsync_alter_rekey(db, table, result, nrows, &rekeyed, refill);
+        if (rc != SQLITE_OK) {
+            DEBUG_SQLITE_ERROR(rc, "cloudsync_finalize_alter", db);
+            goto finalize;
+        }
+        
+        if (!rekeyed) {
+            // drop meta-table, it will be recreated and filled again
+            char *sql = cloudsync_memory_mprintf("DROP TABLE IF EXISTS \"%w_cloudsync\";", table->name);
+            rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+            cloudsync_memory_free(sql);
+            if (rc != SQLITE_OK) {
+                DEBUG_SQLITE_ERROR(rc, "cloudsync_finalize_alter", db);
+                goto finalize;
+            }
+            *refill = true;
+            goto done;
+        }
+    }
+    
+    // compact meta-table
+    // delete entries for removed columns (a packed row also makes the clocks inherited from its insert clock explicit when columns are added)
+    bool removed = false, added = false;
+    rc = cloudsync_alter_columns_diff(db, table, &removed, &added);
+    if (rc == SQLITE_OK && table->packed && (removed || added)) {
+        rc = packed_compact(db, table);
+    } else if (rc == SQLITE_OK && removed) {
+        char *sql = cloudsync_memory_mprintf("DELETE FROM \"%w_cloudsync\" WHERE col_id != %d AND col_id NOT IN ("
+                                             "SELECT col_id FROM cloudsync_columns WHERE tbl_name = '%q' AND col_name IN (SELECT name FROM pragma_table_info('%q') WHERE pk=0)"
+                                             ")", table->name, CLOUDSYNC_TOMBSTONE_COLID, table->name, table->name);
+        rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        cloudsync_memory_free(sql);
+    }
+    if (rc != SQLITE_OK) {
+        DEBUG_SQLITE_ERROR(rc, "cloudsync_finalize_alter", db);
+        goto finalize;
+    }
+    
+    // re-keyed meta-tables contain only existing rows
+    if (data_changed && !pk_diff) {
+        char *singlequote_escaped_table_name = cloudsync_memory_mprintf("%q", table->name);
+        sql = cloudsync_memory_mprintf("SELECT group_concat('\"%w\".\"' || format('%%w', name) || '\"', ',') FROM pragma_table_info('%s') WHERE pk>0 ORDER BY pk;", singlequote_escaped_table_name, singlequote_escaped_table_name);
+        cloudsync_memory_free(singlequote_escaped_table_name);
+        if (!sql) {
+            rc = SQLITE_NOMEM;
+            goto finalize;
+        }
+        char *pkclause = dbutils_text_select(db, sql);
+        char *pkvalues = (pkclause) ? pkclause : "rowid";
+        cloudsync_memory_free(sql);
+        
+        // delete entries related to rows that no longer exist in the original table, but preserve tombstone
+        // (a packed row contains only the tombstone once deleted, so it is removed if its causal length is odd)
+        const char *pkencode = (table->intpk) ? "" : "cloudsync_pk_encode";
+        if (table->packed) sql = cloudsync_memory_mprintf("DELETE FROM \"%w_cloudsync\" WHERE IFNULL((SELECT c.cl FROM cloudsync_clocks('%q', \"%w_cloudsync\".pk, \"%w_cloudsync\".clocks) AS c LIMIT 1), 1) %% 2 != 0 AND NOT EXISTS (SELECT 1 FROM \"%w\" WHERE \"%w_cloudsync\".pk = %s(%s) LIMIT 1);", table->name, table->name, table->name, table->name, table->name, table->name, pkencode, pkvalues);
+        else sql = cloudsync_memory_mprintf("DELETE FROM \"%w_cloudsync\" WHERE (col_id != %d OR (col_id = %d AND col_version %% 2 != 0)) AND NOT EXISTS (SELECT 1 FROM \"%w\" WHERE \"%w_cloudsync\".pk = %s(%s) LIMIT 1);", table->name, CLOUDSYNC_TOMBSTONE_COLID, CLOUDSYNC_TOMBSTONE_COLID, table->name, table->name, pkencode, pkvalues);
+        rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        if (pkclause) cloudsync_memory_free(pkclause);
+        cloudsync_memory_free(sql);
+        if (rc != SQLITE_OK) {
+            DEBUG_SQLITE_ERROR(rc, "cloudsync_finalize_alter", db);
+            goto finalize;
+        }
+
+    }
+    
+done:
+    snprintf(buf, sizeof(buf), "%lld", data->db_version);
+    dbutils_settings_set_key_value(db, context, "pre_alter_dbversion", buf);
+    
+finalize:
+    sqlite3_free_table(result);
+    sqlite3_free(errmsg);
+    
+    return rc;
+}
+
+// MARK: - Backfill -
+
+// the meta-table of a table with existing rows is filled with set-based statements, in batches of backfill_batch rows
+// taken in primary key order (0 means all the rows at once); while the backfill of a table is pending its
+// cloudsync_table_settings contain a backfill_cursor row whose value is the encoded primary key of the last
+// backfilled row (NULL if none), so that the remaining batches can be processed later by cloudsync_backfill
+
+int backfill_cursor_set (sqlite3 *db, const char *table_name, const char *cursor, int cursor_len, bool pending) {
+    const char *sql = (pending) ? "REPLACE INTO " CLOUDSYNC_TABLE_SETTINGS_NAME " (tbl_name, col_name, key, value) VALUES (?1, '*', '" CLOUDSYNC_KEY_BACKFILL_CURSOR "', ?2);" :
+                                  "DELETE FROM " CLOUDSYNC_TABLE_SETTINGS_NAME " WHERE tbl_name=?1 AND key='" CLOUDSYNC_KEY_BACKFILL_CURSOR "';";
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_text(vm, 1, table_name, -1, SQLITE_STATIC);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    if (pending) {
+        rc = (cursor) ? sqlite3_bind_blob(vm, 2, cursor, cursor_len, SQLITE_STATIC) : sqlite3_bind_null(vm, 2);
+        if (rc != SQLITE_OK) goto cleanup;
+    }
+    
+    rc = sqlite3_step(vm);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    
+cleanup:
+    DEBUG_SQLITE_ERROR(rc, "backfill_cursor_set", db);
+    if (vm) sqlite3_finalize(vm);
+    return rc;
+}
+
+int backfill_cursor_get (sqlite3 *db, const char *table_name, sqlite3_stmt **vm, bool *pending) {
+    // on return the cursor (if any) is the first column of vm, that must be finalized by the caller
+    const char *sql = "SELECT value FROM " CLOUDSYNC_TABLE_SETTINGS_NAME " WHERE tbl_name=?1 AND key='" CLOUDSYNC_KEY_BACKFILL_CURSOR "';";
+    int rc = sqlite3_prepare_v2(db, sql, -1, vm, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(*vm, 1, table_name, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_step(*vm);
+    
+    *pending = (rc == SQLITE_ROW);
+    return (rc == SQLITE_ROW || rc == SQLITE_DONE) ? SQLITE_OK : rc;
+}
+
+char *backfill_range (sqlite3 *db, cloudsync_table_context *table, bool lower, bool upper, char **pkvalues) {
+    // the rows after the cursor (bound to ?1) up to the last row of the batch (bound to ?2), compared as row values
+    char *sql = cloudsync_memory_mprintf("SELECT group_concat('\"' || format('%%w', name) || '\"', ',') FROM pragma_table_info('%q') WHERE pk>0 ORDER BY pk;", table->name);
+    char *identifiers = dbutils_text_select(db, sql);
+    cloudsync_memory_free(sql);
+    *pkvalues = (identifiers) ? identifiers : cloudsync_string_dup("rowid", false);
+    if (!*pkvalues) return NULL;
+    
+    char *decode1 = cloudsync_memory_mprintf("%s", "");
+    char *decode2 = cloudsync_memory_mprintf("%s", "");
+    for (int i=0; i<table->npks && decode1 && decode2; ++i) {
+        char *s1 = cloudsync_memory_mprintf("%s%scloudsync_pk_decode(?1, %d)", decode1, (i) ? "," : "", i+1);
+        char *s2 = cloudsync_memory_mprintf("%s%scloudsync_pk_decode(?2, %d)", decode2, (i) ? "," : "", i+1);
+        cloudsync_memory_free(decode1);
+        cloudsync_memory_free(decode2);
+        decode1 = s1;
+        decode2 = s2;
+    }
+    
+    char *range = NULL;
+    if (decode1 && decode2) {
+        char *lower_clause = (lower) ? cloudsync_memory_mprintf("(%s) > (%s)", *pkvalues, decode1) : cloudsync_memory_mprintf("1");
+        char *upper_clause = (upper) ? cloudsync_memory_mprintf("(%s) <= (%s)", *pkvalues, decode2) : cloudsync_memory_mprintf("1");
+        if (lower_clause && upper_clause) range = cloudsync_memory_mprintf("%s AND %s", lower_clause, upper_clause);
+        if (lower_clause) cloudsync_memory_free(lower_clause);
+        if (upper_clause) cloudsync_memory_free(upper_clause);
+    }
+    
+    if (decode1) cloudsync_memory_free(decode1);
+    if (decode2) cloudsync_memory_free(decode2);
+    return range;
+}
+
+int backfill_bind_range (sqlite3_stmt *vm, sqlite3_stmt *lower, sqlite3_stmt *upper) {
+    int rc = SQLITE_OK;
+    if (lower && sqlite3_bind_parameter_index(vm, "?1")) rc = sqlite3_bind_value(vm, 1, sqlite3_column_value(lower, 0));
+    if (rc == SQLITE_OK && upper && sqlite3_bind_parameter_index(vm, "?2")) rc = sqlite3_bind_value(vm, 2, sqlite3_column_value(upper, 0));
+    return rc;
+}
+
+int backfill_exec (sqlite3 *db, const char *sql, sqlite3_stmt *lower, sqlite3_stmt *upper, sqlite3_int64 db_version, sqlite3_int64 seq, sqlite3_int64 *value) {
+    // ?1 and ?2 are the bounds of the batch, ?3 its db_version and ?4 its first seq
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = backfill_bind_range(vm, lower, upper);
+    if (rc == SQLITE_OK && sqlite3_bind_parameter_index(vm, "?3")) rc = sqlite3_bind_int64(vm, 3, db_version);
+    if (rc == SQLITE_OK && sqlite3_bind_parameter_index(vm, "?4")) rc = sqlite3_bind_int64(vm, 4, seq);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_step(vm);
+    if (rc == SQLITE_ROW) {
+        if (value) *value = sqlite3_column_int64(vm, 0);
+        rc = SQLITE_OK;
+    } else if (rc == SQLITE_DONE) {
+        if (value) *value = sqlite3_changes64(db);
+        rc = SQLITE_OK;
+    }
+    
+cleanup:
+    if (vm) sqlite3_finalize(vm);
+    return rc;
+}
+
+void cloudsync_backfill_clocks (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_backfill_clocks");
+    
+    // argv[0] -> table name
+    // argv[1] -> current clock vector of the row (NULL if the row has no clocks)
+    // argv[2] -> db_version of the batch
+    // argv[3] -> first seq reserved for the row
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    cloudsync_table_context *table = table_lookup(data, (const char *)sqlite3_value_text(argv[0]));
+    if (!table) {
+        dbutils_context_result_error(context, "Unable to retrieve table name %s in cloudsync_backfill_clocks.", sqlite3_value_text(argv[0]));
+        return;
+    }
+    
+    clock_vector v;
+    if (clock_vector_decode(&v, (const char *)sqlite3_value_blob(argv[1]), (size_t)sqlite3_value_bytes(argv[1])) != 0) {
+        sqlite3_result_error_code(context, SQLITE_CORRUPT);
+        return;
+    }
+    
+    // same clocks of packed_mark_insert for a row without clocks, otherwise the missing columns
+    // get their own entry (just like the per-column layout), NULL means that nothing is missing
+    sqlite3_int64 db_version = sqlite3_value_int64(argv[2]);
+    sqlite3_int64 seq = sqlite3_value_int64(argv[3]);
+    int added = 0;
+    
+    if (table->ncols == 0 || v.count == 0) {
+        int64_t col_id = (table->ncols == 0) ? CLOUDSYNC_TOMBSTONE_COLID : CLOCK_INSERT_COLID;
+        if (!clock_vector_find(&v, col_id)) {
+            clock_entry *e = clock_vector_set(&v, col_id);
+            if (!e) goto abort_nomem;
+            e->col_version = 1;
+            e->db_version = db_version;
+            e->seq = seq;
+            ++added;
+        }
+    } else if (!clock_vector_find(&v, CLOCK_INSERT_COLID)) {
+        for (int i=0; i<table->ncols; ++i) {
+            if (clock_vector_find(&v, table->col_id[i])) continue;
+            clock_entry *e = clock_vector_set(&v, table->col_id[i]);
+            if (!e) goto abort_nomem;
+            e->col_version = 1;
+            e->db_version = db_version;
+            e->seq = seq + i;
+            ++added;
+        }
+    }
+    
+    if (added == 0) {
+        sqlite3_result_null(context);
+        clock_vector_free(&v);
+        return;
+    }
+    
+    size_t blen = 0;
+    char *buffer = clock_vector_encode(&v, &blen);
+    clock_vector_free(&v);
+    if (!buffer) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    
+    sqlite3_result_blob(context, buffer, (int)blen, SQLITE_TRANSIENT);
+    cloudsync_memory_free(buffer);
+    return;
+    
+abort_nomem:
+    clock_vector_free(&v);
+    sqlite3_result_error_nomem(context);
+}
+
+int backfill_batch (sqlite3 *db, cloudsync_context *data, cloudsync_table_context *table, sqlite3_int64 limit, sqlite3_int64 *nrows) {
+    // backfill up to limit rows (all the remaining rows if limit is 0) after the cursor,
+    // nrows is the number of rows of the batch (0 means that the backfill of the table is completed)
+    sqlite3_stmt *lower = NULL;
+    sqlite3_stmt *upper = NULL;
+    char *pkvalues = NULL;
+    char *range = NULL;
+    char *sql = NULL;
+    char *colids = NULL;
+    bool pending = false;
+    *nrows = 0;
+    
+    TRACE_BEGIN(db, CLOUDSYNC_TRACE_BACKFILL);
+    int rc = backfill_cursor_get(db, table->name, &lower, &pending);
+    if (rc != SQLITE_OK || !pending) goto finalize;
+    if (sqlite3_column_type(lower, 0) == SQLITE_NULL) {
+        sqlite3_finalize(lower);
+        lower = NULL;
+    }
+    
+    // the last row of the batch, none means that the batch contains all the remaining rows
+    range = backfill_range(db, table, (lower != NULL), false, &pkvalues);
+    if (!range) {rc = SQLITE_NOMEM; goto finalize;}
+    if (limit > 0) {
+        sql = cloudsync_memory_mprintf("SELECT cloudsync_pk_encode(%s) FROM \"%w\" WHERE %s ORDER BY %s LIMIT 1 OFFSET %lld;", pkvalues, table->name, range, pkvalues, (long long)(limit - 1));
+        if (!sql) {rc = SQLITE_NOMEM; goto finalize;}
+        rc = sqlite3_prepare_v2(db, sql, -1, &upper, NULL);
+        if (rc == SQLITE_OK) rc = backfill_bind_range(upper, lower, NULL);
+        if (rc == SQLITE_OK) rc = sqlite3_step(upper);
+        if (rc == SQLITE_DONE) {
+            sqlite3_finalize(upper);
+            upper = NULL;
+        } else if (rc != SQLITE_ROW) {
+            goto finalize;
+        }
+        rc = SQLITE_OK;
+        
+        cloudsync_memory_free(sql);
+        cloudsync_memory_free(range);
+        cloudsync_memory_free(pkvalues);
+        range = backfill_range(db, table, (lower != NULL), (upper != NULL), &pkvalues);
+        if (!range) {rc = SQLITE_NOMEM; goto finalize;}
+    }
+    
+    sql = cloudsync_memory_mprintf("SELECT count(*) FROM \"%w\" WHERE %s;", table->name, range);
+    if (!sql) {rc = SQLITE_NOMEM; goto finalize;}
+    rc = backfill_exec(db, sql, lower, upper, 0, 0, nrows);
+    if (rc != SQLITE_OK) goto finalize;
+    cloudsync_memory_free(sql);
+    sql = NULL;
+    
+    if (*nrows > 0) {
+        // each row of the batch reserves the same seq values of a local insert (one for each column, or one for the sentinel)
+        sqlite3_int64 db_version = db_version_next(db, data, CLOUDSYNC_VALUE_NOTSET);
+        int stride = (table->ncols > 0) ? table->ncols : 1;
+        sqlite3_int64 seq = data->seq;
+        data->seq += (int)(*nrows * stride);
+        
+        const char *pkencode = (table->intpk) ? "" : "cloudsync_pk_encode";
+        if (table->packed) {
+            // cloudsync_backfill_clocks returns NULL for the rows that already have all their clocks
+            sql = cloudsync_memory_mprintf("INSERT INTO \"%w_cloudsync\" (pk, db_version, clocks) SELECT pk, ?3, clocks FROM (SELECT _cstemp1.pk AS pk, cloudsync_backfill_clocks('%q', (SELECT clocks FROM \"%w_cloudsync\" WHERE pk = _cstemp1.pk), ?3, ?4 + _cstemp1.n * %d) AS clocks FROM (SELECT %s(%s) AS pk, row_number() OVER (ORDER BY %s) - 1 AS n FROM \"%w\" WHERE %s) AS _cstemp1) WHERE clocks IS NOT NULL ON CONFLICT (pk) DO UPDATE SET db_version = excluded.db_version, clocks = excluded.clocks;", table->name, table->name, table->name, stride, pkencode, pkvalues, pkvalues, table->name, range);
+        } else {
+            // one clock for each column (just the sentinel for a table without columns), the existing ones are kept
+            colids = cloudsync_memory_mprintf("SELECT %d AS col_id, 0 AS idx", (table->ncols > 0) ? table->col_id[0] : CLOUDSYNC_TOMBSTONE_COLID);
+            for (int i=1; i<table->ncols && colids; ++i) {
+                char *s = cloudsync_memory_mprintf("%s UNION ALL SELECT %d, %d", colids, table->col_id[i], i);
+                cloudsync_memory_free(colids);
+                colids = s;
+            }
+            if (!colids) {rc = SQLITE_NOMEM; goto finalize;}
+            sql = cloudsync_memory_mprintf("INSERT OR IGNORE INTO \"%w_cloudsync\" (pk, col_id, col_version, db_version, seq, site_id) SELECT _cstemp1.pk, _cstemp2.col_id, 1, ?3, ?4 + _cstemp1.n * %d + _cstemp2.idx, 0 FROM (SELECT %s(%s) AS pk, row_number() OVER (ORDER BY %s) - 1 AS n FROM \"%w\" WHERE %s) AS _cstemp1, (%s) AS _cstemp2;", table->name, stride, pkencode, pkvalues, pkvalues, table->name, range, colids);
+        }
+        if (!sql) {rc = SQLITE_NOMEM; goto finalize;}
+        
+        sqlite3_int64 changes = 0;
+        rc = backfill_exec(db, sql, lower, upper, db_version, seq, &changes);
+        if (rc == SQLITE_OK && changes > 0) rc = local_update_version(db, data, db_version);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // move the cursor to the last row of the batch, or mark the backfill as completed
+    // (the previous cursor is released first because its row is replaced)
+    if (lower) sqlite3_finalize(lower);
+    lower = NULL;
+    if (upper) rc = backfill_cursor_set(db, table->name, (const char *)sqlite3_column_blob(upper, 0), sqlite3_column_bytes(upper, 0), true);
+    else rc = backfill_cursor_set(db, table->name, NULL, 0, false);
+    
+finalize:
+    if (rc != SQLITE_OK) DEBUG_ALWAYS("backfill_batch error: %s", sqlite3_errmsg(db));
+    TRACE_END(db, CLOUDSYNC_TRACE_BACKFILL, table->name, *nrows, -1);
+    if (lower) sqlite3_finalize(lower);
+    if (upper) sqlite3_finalize(upper);
+    if (pkvalues) cloudsync_memory_free(pkvalues);
+    if (range) cloudsync_memory_free(range);
+    if (colids) cloudsync_memory_free(colids);
+    if (sql) cloudsync_memory_free(sql);
+    return rc;
+}
+
+int cloudsync_refill_metatable (sqlite3 *db, cloudsync_context *data, const char *table_name) {
+    cloudsync_table_context *table = table_lookup(data, table_name);
+    if (!table) return SQLITE_INTERNAL;
+    
+    // the backfill always restarts from the first row, clocks that already exist are never overwritten
+    int rc = backfill_cursor_set(db, table->name, NULL, 0, true);
+    if (rc != SQLITE_OK) return rc;
+    
+    // only the first batch is processed here (all the rows without a batch limit), the other ones by cloudsync_backfill
+    sqlite3_int64 nrows = 0;
+    return backfill_batch(db, data, table, data->backfill_batch, &nrows);
+}
+
+// MARK: - Local -
+
+int local_update_sentinel (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, sqlite3_int64 db_version, int seq) {
+    if (table->packed) return packed_update_sentinel(table, pk, pklen, db_version, seq, false);
+    
+    sqlite3_stmt *vm = table_stmt(table, TABLE_STMT_META_SENTINEL_UPDATE);
+    if (!vm) return -1;
+    
+    int rc = sqlite3_bind_int64(vm, 1, db_version);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int(vm, 2, seq);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = table_bind_pk(table, vm, 3, pk, pklen);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = meta_step(table, vm);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    
+cleanup:
+    DEBUG_SQLITE_ERROR(rc, "local_update_sentinel", db);
+    sqlite3_reset(vm);
+    return rc;
+}
+
+int local_mark_insert_sentinel_meta (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, sqlite3_int64 db_version, int seq) {
+    if (table->packed) return packed_update_sentinel(table, pk, pklen, db_version, seq, true);
+    
+    sqlite3_stmt *vm = table_stmt(table, TABLE_STMT_META_SENTINEL_INSERT);
+    if (!vm) return -1;
+    
+    int rc = table_bind_pk(table, vm, 1, pk, pklen);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int64(vm, 2, db_version);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int(vm, 3, seq);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int64(vm, 4, db_version);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int(vm, 5, seq);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = meta_step(table, vm);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    
+cleanup:
+    DEBUG_SQLITE_ERROR(rc, "local_insert_sentinel", db);
+    sqlite3_reset(vm);
+    return rc;
+}
+
+int local_mark_insert_or_update_meta_impl (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, int col_id, int col_version, sqlite3_int64 db_version, int seq) {
+    if (table->packed) return packed_mark_column(table, pk, pklen, col_id, col_version, db_version, seq);
+    
+    sqlite3_stmt *vm = table_stmt(table, TABLE_STMT_META_ROW_INSERT_UPDATE);
+    if (!vm) return -1;
+    
+    int rc = table_bind_pk(table, vm, 1, pk, pklen);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int(vm, 2, col_id);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int(vm, 3, col_version);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int64(vm, 4, db_version);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int(vm, 5, seq);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int64(vm, 6, db_version);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int(vm, 7, seq);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = meta_step(table, vm);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    
+cleanup:
+    DEBUG_SQLITE_ERROR(rc, "local_insert_or_update", db);
+    sqlite3_reset(vm);
+    return rc;
+}
+
+int local_mark_insert_or_update_meta (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, int col_id, sqlite3_int64 db_version, int seq) {
+    return local_mark_insert_or_update_meta_impl(db, table, pk, pklen, col_id, 1, db_version, seq);
+}
+
+int local_mark_delete_meta (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, sqlite3_int64 db_version, int seq) {
+    return local_mark_insert_or_update_meta_impl(db, table, pk, pklen, CLOUDSYNC_TOMBSTONE_COLID, 2, db_version, seq);
+}
+
+int local_drop_meta (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen) {
+    if (table->packed) return packed_drop_columns(table, pk, pklen);
+    
+    sqlite3_stmt *vm = table_stmt(table, TABLE_STMT_META_ROW_DROP);
+    if (!vm) return -1;
+    
+    int rc = table_bind_pk(table, vm, 1, pk, pklen);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = meta_step(table, vm);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    
+cleanup:
+    DEBUG_SQLITE_ERROR(rc, "local_drop_meta", db);
+    sqlite3_reset(vm);
+    return rc;
+}
+
+int local_update_move_meta (sqlite3 *db, cloudsync_context *data, cloudsync_table_context *table, const char *pk, size_t pklen, const char *pk2, size_t pklen2, sqlite3_int64 db_version) {
+    /*
+      * This function moves non-sentinel metadata entries from an old primary key (OLD.pk)
+      * to a new primary key (NEW.pk) when a primary key change occurs.
+      *
+      * To ensure consistency and proper conflict resolution in a CRDT (Conflict-free Replicated Data Type) system,
+      * each non-sentinel metadata entry involved in the move must have a unique sequence value (seq).
+      *
+      * The `seq` is crucial for tracking the order of operations and for detecting and resolving conflicts
+      * during synchronization between replicas. Without a unique `seq` for each entry, concurrent updates
+      * may be applied incorrectly, leading to data inconsistency.
+      *
+      * When performing the update, a unique `seq` must be assigned to each metadata row. This can be achieved
+      * by either incrementing the maximum sequence value in the table or using a function (e.g., `bump_seq(data)`)
+      * that generates a unique sequence for each row. The update query should ensure that each row moved
+      * from OLD.pk to NEW.pk gets a distinct `seq` to maintain proper versioning and ordering of changes.
+     */
+    
+    // see https://github.com/sqliteai/sqlite-sync/blob/main/docs/PriKey.md for more details
+    // pk2 is the old pk
+    
+    if (table->packed) return packed_update_move(data, table, pk, pklen, pk2, pklen2, db_version);
+    
+    sqlite3_stmt *vm = table_stmt(table, TABLE_STMT_META_UPDATE_MOVE);
+    if (!vm) return -1;
+    
+    // new primary key
+    int rc = table_bind_pk(table, vm, 1, pk, pklen);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    // new db_version
+    rc = sqlite3_bind_int64(vm, 2, db_version);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    // old primary key
+    rc = table_bind_pk(table, vm, 3, pk2, pklen2);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = meta_step(table, vm);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    
+cleanup:
+    DEBUG_SQLITE_ERROR(rc, "local_update_move_meta", db);
+    sqlite3_reset(vm);
+    return rc;
+}
+
+int local_update_version (sqlite3 *db, cloudsync_context *data, sqlite3_int64 db_version) {
+    // persist the db_version of the last local change, the statement writes the row only once per transaction,
+    // but it is executed for each change because a ROLLBACK TO (or a failed statement) can undo the write
+    // without the connection being notified
+    sqlite3_stmt *vm = data->local_version_stmt;
+    if (!vm) return SQLITE_OK;
+    
+    int rc = sqlite3_bind_int64(vm, 1, db_version);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_step(vm);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    
+cleanup:
+    DEBUG_SQLITE_ERROR(rc, "local_update_version", db);
+    stmt_reset(vm);
+    if (rc == SQLITE_OK) data->pending_local_db_version = db_version;
+    return rc;
+}
+
+// MARK: - Payload Encode / Decode -
+
+bool cloudsync_buffer_free (cloudsync_data_payload *payload) {
+    if (payload) {
+        if (payload->buffer) cloudsync_memory_free(payload->buffer);
+        memset(payload, 0, sizeof(cloudsync_data_payload));
+    }
+        
+    return false;
+}
+
+bool cloudsync_buffer_check (cloudsync_data_payload *payload, size_t needed) {
+    if (payload->nrows == 0) needed += sizeof(cloudsync_payload_header);
+    
+    // alloc/resize buffer
+    if (payload->bused + needed > payload->balloc) {
+        if (needed < CLOUDSYNC_PAYLOAD_MINBUF_SIZE) needed = CLOUDSYNC_PAYLOAD_MINBUF_SIZE;
+        size_t balloc = payload->balloc + needed;
+        
+        char *buffer = cloudsync_memory_realloc(payload->buffer, balloc);
+        if (!buffer) return cloudsync_buffer_free(payload);
+        
+        payload->buffer = buffer;
+        payload->balloc = balloc;
+        if (payload->nrows == 0) payload->bused = sizeof(cloudsync_payload_header);
+    }
+    
+    return true;
+}
+
+void cloudsync_payload_header_init (cloudsync_payload_header *header, uint32_t expanded_size, uint16_t ncols, uint32_t nrows, uint64_t hash, const uint8_t *site_id) {
+    memset(header, 0, sizeof(cloudsync_payload_header));
+    assert(sizeof(cloudsync_payload_header)==32);
+    
+    int major, minor, patch;
+    sscanf(CLOUDSYNC_VERSION, "%d.%d.%d", &major, &minor, &patch);
+    
+    header->signature = htonl(CLOUDSYNC_PAYLOAD_SIGNATURE);
+    header->version = CLOUDSYNC_PAYLOAD_VERSION;
+    header->libversion[0] = major;
+    header->libversion[1] = minor;
+    header->libversion[2] = patch;
+    header->expanded_size = htonl(expanded_size);
+    header->ncols = htons(ncols);
+    header->nrows = htonl(nrows);
+    header->schema_hash = htonll(hash);
+    if (site_id) memcpy(header->sender, site_id + (UUID_LEN - sizeof(header->sender)), sizeof(header->sender));
+}
+
+void cloudsync_payload_encode_step (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_payload_encode_step");
+    // debug_values(argc, argv);
+    
+    // allocate/get the session context
+    cloudsync_data_payload *payload = (cloudsync_data_payload *)sqlite3_aggregate_context(context, sizeof(cloudsync_data_payload));
+    if (!payload) return;
+    
+    // check if the step function is called for the first time
+    if (payload->nrows == 0) {
+        payload->ncols = argc;
+        if (payload->start_us == 0) {
+            payload->start_us = cloudsync_time_us();
+            TRACE_BEGIN(sqlite3_context_db_handle(context), CLOUDSYNC_TRACE_ENCODE);
+        }
+    }
+    
+    size_t breq = pk_encode_size(argv, argc, 0);
+    if (cloudsync_buffer_check(payload, breq) == false) return;
+    
+    char *buffer = payload->buffer + payload->bused;
+    char *ptr = pk_encode(argv, argc, buffer, false, NULL);
+    assert(buffer == ptr);
+    
+    // update buffer
+    payload->bused += breq;
+    
+    // increment row counter
+    ++payload->nrows;
+}
+
+void cloudsync_payload_encode_final (sqlite3_context *context) {
+    DEBUG_FUNCTION("cloudsync_payload_encode_final");
+
+    // get the session context
+    cloudsync_data_payload *payload = (cloudsync_data_payload *)sqlite3_aggregate_context(context, sizeof(cloudsync_data_payload));
+    if (!payload) return;
+    
+    if (payload->nrows == 0) {
+        sqlite3_result_null(context);
+        return;
+    }
+    
+    // encode payload
+    int header_size = (int)sizeof(cloudsync_payload_header);
+    int real_buffer_size = (int)(payload->bused - header_size);
+    int zbound = LZ4_compressBound(real_buffer_size);
+    char *buffer = cloudsync_memory_alloc(zbound + header_size);
+    if (!buffer) {
+        TRACE_END(sqlite3_context_db_handle(context), CLOUDSYNC_TRACE_ENCODE, NULL, -1, -1);
+        cloudsync_buffer_free(payload);
+        sqlite3_result_error_code(context, SQLITE_NOMEM);
+        return;
+    }
+    
+    // adjust buffer to compress to skip the reserved header
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    char *src_buffer = payload->buffer + sizeof(cloudsync_payload_header);
+    TRACE_BEGIN(db, CLOUDSYNC_TRACE_COMPRESS);
+    int zused = LZ4_compress_default(src_buffer, buffer+header_size, real_buffer_size, zbound);
+    TRACE_END(db, CLOUDSYNC_TRACE_COMPRESS, NULL, -1, real_buffer_size);
+    bool use_uncompressed_buffer = (!zused || zused > real_buffer_size);
+    CHECK_FORCE_UNCOMPRESSED_BUFFER();
+    
+    // setup payload header
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    cloudsync_payload_header header;
+    cloudsync_payload_header_init(&header, (use_uncompressed_buffer) ? 0 : real_buffer_size, payload->ncols, (uint32_t)payload->nrows, data->schema_hash, data->site_id);
+    
+    // if compression fails or if compressed size is bigger than original buffer, then use the uncompressed buffer
+    if (use_uncompressed_buffer) {
+        cloudsync_memory_free(buffer);
+        buffer = payload->buffer;
+        zused = real_buffer_size;
+    }
+    
+    // copy header and data to SQLite BLOB
+    memcpy(buffer, &header, sizeof(cloudsync_payload_header));
+    int blob_size = zused+sizeof(cloudsync_payload_header);
+    sqlite3_result_blob(context, buffer, blob_size, SQLITE_TRANSIENT);
+    
+    STATS_ADD(&data->stats, CLOUDSYNC_STAT_ROWS_ENCODED, payload->nrows);
+    STATS_ADD(&data->stats, CLOUDSYNC_STAT_PAYLOAD_BYTES_RAW, real_buffer_size);
+    STATS_ADD(&data->stats, CLOUDSYNC_STAT_PAYLOAD_BYTES_COMPRESSED, zused);
+    stats_latency_add(&data->stats, CLOUDSYNC_LATENCY_ENCODE, payload->start_us);
+    TRACE_END(db, CLOUDSYNC_TRACE_ENCODE, NULL, (int64_t)payload->nrows, blob_size);
+    
+    // cleanup memory
+    cloudsync_buffer_free(payload);
+    if (!use_uncompressed_buffer) cloudsync_memory_free(buffer);
+}
+
+cloudsync_payload_apply_callback_t cloudsync_get_payload_apply_callback(sqlite3 *db) {
+    return (sqlite3_libversion_number() >= 3044000) ? sqlite3_get_clientdata(db, CLOUDSYNC_PAYLOAD_APPLY_CALLBACK_KEY) : NULL;
+}
+
+void cloudsync_set_payload_apply_callback(sqlite3 *db, cloudsync_payload_apply_callback_t callback) {
+    if (sqlite3_libversion_number() >= 3044000) {
+        sqlite3_set_clientdata(db, CLOUDSYNC_PAYLOAD_APPLY_CALLBACK_KEY, (void*)callback, NULL);
+    }
+}
+
+int cloudsync_pk_decode_bind_callback (void *xdata, int index, int type, int64_t ival, double dval, char *pval) {
+    cloudsync_pk_decode_bind_context *decode_context = (cloudsync_pk_decode_bind_context*)xdata;
+    int rc = pk_decode_bind_callback(decode_context->vm, index, type, ival, dval, pval);
+    
+    if (rc == SQLITE_OK) {
+        // the dbversion index is smaller than seq index, so it is processed first
+        // when processing the dbversion column: save the value to the tmp_dbversion field
+        // when processing the seq column: update the dbversion and seq fields only if the current dbversion is greater than the last max value
+        switch (index) {
+            case CLOUDSYNC_PK_INDEX_TBL:
+                if (type == SQLITE_TEXT) {
+                    decode_context->tbl = pval;
+                    decode_context->tbl_len = ival;
+                }
+                break;
+            case CLOUDSYNC_PK_INDEX_PK:
+                if (type == SQLITE_BLOB) {
+                    decode_context->pk = pval;
+                    decode_context->pk_len = ival;
+                }
+                break;
+            case CLOUDSYNC_PK_INDEX_COLNAME:
+                if (type == SQLITE_TEXT) {
+                    decode_context->col_name = pval;
+                    decode_context->col_name_len = ival;
+                }
+                break;
+            case CLOUDSYNC_PK_INDEX_COLVERSION:
+                if (type == SQLITE_INTEGER) decode_context->col_version = ival;
+                break;
+            case CLOUDSYNC_PK_INDEX_DBVERSION:
+                if (type == SQLITE_INTEGER) decode_context->db_version = ival;
+                break;
+            case CLOUDSYNC_PK_INDEX_SITEID:
+                if (type == SQLITE_BLOB) {
+                    decode_context->site_id = pval;
+                    decode_context->site_id_len = ival;
+                }
+                break;
+            case CLOUDSYNC_PK_INDEX_CL:
+                if (type == SQLITE_INTEGER) decode_context->cl = ival;
+                break;
+            case CLOUDSYNC_PK_INDEX_SEQ:
+                if (type == SQLITE_INTEGER) decode_context->seq = ival;
+                break;
+        }
+    }
+        
+    return rc;
+}
+
+// MARK: - Site Versions -
+
+// The site version vector stores, for each origin site (identified by its ordinal in cloudsync_site_id),
+// the highest (db_version, seq) pair already applied from a given sender. The (db_version, seq) values
+// carried by a payload belong to the sender that generated it, so the vector is keyed by (origin, sender)
+// and it is not used at all when the payload does not identify its sender (old payloads).
+// Rows below the mark are skipped right after decode, so replayed or overlapping payloads cost only the decode time.
+
+sqlite3_int64 site_vector_sender (const uint8_t sender[6]) {
+    sqlite3_int64 value = 0;
+    for (int i=0; i<6; ++i) value = (value << 8) | sender[i];
+    return value;
+}
+
+void site_vector_free (cloudsync_site_vector *v) {
+    if (v->items) cloudsync_memory_free(v->items);
+    memset(v, 0, sizeof(cloudsync_site_vector));
+}
+
+cloudsync_site_version *site_vector_lookup (cloudsync_site_vector *v, const void *site_id, int64_t site_len, bool create) {
+    if (!site_id || site_len != UUID_LEN) return NULL;
+    
+    for (int i=0; i<v->count; ++i) {
+        if (memcmp(v->items[i].site_id, site_id, UUID_LEN) == 0) return &v->items[i];
+    }
+    if (!create) return NULL;
+    
+    if (v->count >= v->alloc) {
+        int alloc = (v->alloc) ? v->alloc * 2 : 16;
+        cloudsync_site_version *items = cloudsync_memory_realloc(v->items, (uint64_t)(sizeof(cloudsync_site_version) * alloc));
+        if (!items) return NULL;
+        v->items = items;
+        v->alloc = alloc;
+    }
+    
+    cloudsync_site_version *item = &v->items[v->count++];
+    memset(item, 0, sizeof(cloudsync_site_version));
+    memcpy(item->site_id, site_id, UUID_LEN);
+    item->db_version = -1;
+    item->seq = -1;
+    return item;
+}
+
+int site_vector_load (sqlite3 *db, cloudsync_site_vector *v) {
+    if (v->sender == 0) return SQLITE_OK;
+    
+    const char *sql = "SELECT s.site_id, v.db_version, v.seq FROM cloudsync_site_versions AS v JOIN cloudsync_site_id AS s ON s.rowid = v.site_ord WHERE v.sender = ?;";
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_bind_int64(vm, 1, v->sender);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    while ((rc = sqlite3_step(vm)) == SQLITE_ROW) {
+        cloudsync_site_version *item = site_vector_lookup(v, sqlite3_column_blob(vm, 0), sqlite3_column_bytes(vm, 0), true);
+        if (!item) continue;
+        item->db_version = sqlite3_column_int64(vm, 1);
+        item->seq = sqlite3_column_int64(vm, 2);
+    }
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    
+cleanup:
+    DEBUG_SQLITE_ERROR(rc, "site_vector_load", db);
+    if (vm) sqlite3_finalize(vm);
+    return rc;
+}
+
+bool site_vector_applied (cloudsync_site_vector *v, cloudsync_pk_decode_bind_context *decoded) {
+    if (v->sender == 0) return false;
+    
+    cloudsync_site_version *item = site_vector_lookup(v, decoded->site_id, decoded->site_id_len, false);
+    if (!item) return false;
+    
+    // merged rows keep the seq of their origin, so different rows can share the same (db_version, seq) pair
+    // in the sender: the row exactly at the mark is not skipped because it could be a different change
+    if (decoded->db_version < item->db_version) return true;
+    return ((decoded->db_version == item->db_version) && (decoded->seq < item->seq));
+}
+
+void site_vector_advance (cloudsync_site_vector *v, cloudsync_pk_decode_bind_context *decoded, bool applied) {
+    if (v->sender == 0) return;
+    
+    cloudsync_site_version *item = site_vector_lookup(v, decoded->site_id, decoded->site_id_len, true);
+    if (!item || item->frozen) return;
+    
+    // once a row is not applied (error or rejected by the apply callback), later rows from the same origin
+    // must not move the mark past it, otherwise the missing row would be skipped on the next attempt
+    if (!applied) {
+        item->frozen = true;
+        return;
+    }
+    
+    if ((decoded->db_version > item->db_version) || (decoded->db_version == item->db_version && decoded->seq > item->seq)) {
+        item->db_version = decoded->db_version;
+        item->seq = decoded->seq;
+        item->dirty = true;
+    }
+}
+
+int site_vector_save (sqlite3 *db, cloudsync_context *data, cloudsync_site_vector *v) {
+    if (v->sender == 0) return SQLITE_OK;
+    
+    const char *sql = "INSERT INTO cloudsync_site_versions (site_ord, sender, db_version, seq) VALUES (?, ?, ?, ?) "
+                      "ON CONFLICT(site_ord, sender) DO UPDATE SET db_version = excluded.db_version, seq = excluded.seq;";
+    sqlite3_stmt *vm = NULL;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<v->count; ++i) {
+        cloudsync_site_version *item = &v->items[i];
+        if (!item->dirty) continue;
+        
+        if (!vm) {
+            rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+            if (rc != SQLITE_OK) goto cleanup;
+        }
+        
+        // get/set the ordinal of the origin site_id
+        sqlite3_int64 ord = siteid_ord_get(data, (const char *)item->site_id, UUID_LEN);
+        if (ord < 0) {rc = sqlite3_errcode(db); goto cleanup;}
+        
+        rc = sqlite3_bind_int64(vm, 1, ord);
+        if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 2, v->sender);
+        if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 3, item->db_version);
+        if (rc == SQLITE_OK) rc = sqlite3_bind_int64(vm, 4, item->seq);
+        if (rc == SQLITE_OK) rc = sqlite3_step(vm);
+        stmt_reset(vm);
+        if (rc != SQLITE_DONE) goto cleanup;
+        
+        rc = SQLITE_OK;
+        item->dirty = false;
+    }
+    
+cleanup:
+    if (rc == SQLITE_ROW || rc == SQLITE_DONE) rc = SQLITE_OK;
+    DEBUG_SQLITE_ERROR(rc, "site_vector_save", db);
+    if (vm) sqlite3_finalize(vm);
+    return rc;
+}
+
+// #ifndef CLOUDSYNC_OMIT_RLS_VALIDATION
+
+bool payload_apply_group_full (cloudsync_context *data, int ndbversions, int nrows, uint64_t start) {
+    // a group is closed only before the first row of the next db_version, so each db_version is always applied atomically
+    if (data->apply_group_dbversions > 0 && ndbversions >= data->apply_group_dbversions) return true;
+    if (data->apply_group_rows > 0 && nrows >= data->apply_group_rows) return true;
+    if (data->apply_group_ms > 0 && cloudsync_time_ms() - start >= (uint64_t)data->apply_group_ms) return true;
+    return false;
+}
+
+int payload_apply_exec (sqlite3 *db, sqlite3_stmt **vm, const char *sql) {
+    // SAVEPOINT and RELEASE are compiled once and executed for each group of db_versions
+    if (*vm == NULL) {
+        int rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, vm, NULL);
+        if (rc != SQLITE_OK) return rc;
+    }
+    
+    int rc = sqlite3_step(*vm);
+    sqlite3_reset(*vm);
+    return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+}
+
+int payload_apply_release (sqlite3 *db, cloudsync_context *data, cloudsync_site_vector *site_vector) {
+    // the high-water marks of the db_versions applied by the group are stored in the same transaction
+    // (like at the end of the apply, failing to store them only means that some rows could be applied again)
+    site_vector_save(db, data, site_vector);
+    return payload_apply_exec(db, &data->apply_release_stmt, "RELEASE cloudsync_payload_apply;");
+}
+
+int payload_apply (sqlite3_context *context, const char *payload, int blen) {
+    uint64_t start_us = cloudsync_time_us();
+    
+    // decode header
+    cloudsync_payload_header header;
+    memcpy(&header, payload, sizeof(cloudsync_payload_header));
+
+    header.signature = ntohl(header.signature);
+    header.expanded_size = ntohl(header.expanded_size);
+    header.ncols = ntohs(header.ncols);
+    header.nrows = ntohl(header.nrows);
+    header.schema_hash = ntohll(header.schema_hash);
+    
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    if (!data || header.schema_hash != data->schema_hash) {
+        sqlite3 *db = sqlite3_context_db_handle(context);
+        if (!dbutils_check_schema_hash(db, header.schema_hash)) {
+            dbutils_context_result_error(context, "Cannot apply the received payload because the schema hash is unknown %llu.", header.schema_hash);
+            sqlite3_result_error_code(context, SQLITE_MISMATCH);
+            return -1;
+        }
+    }
+    
+    // sanity check header
+    if ((header.signature != CLOUDSYNC_PAYLOAD_SIGNATURE) || (header.ncols == 0)) {
+        dbutils_context_result_error(context, "Error on cloudsync_payload_apply: invalid signature or column size.");
+        sqlite3_result_error_code(context, SQLITE_MISUSE);
+        return -1;
+    }
+    
+    const char *buffer = payload + sizeof(cloudsync_payload_header);
+    blen -= sizeof(cloudsync_payload_header);
+    
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    if (!data) {
+        dbutils_context_result_error(context, "Error on cloudsync_payload_apply: unable to retrieve the cloudsync context.");
+        return -1;
+    }
+    
+    // check if payload is compressed (the expanded buffer lives in the arena scope opened by cloudsync_payload_apply)
+    char *clone = NULL;
+    if (header.expanded_size != 0) {
+        clone = (char *)cloudsync_arena_alloc(&data->arena, header.expanded_size);
+        if (!clone) {sqlite3_result_error_code(context, SQLITE_NOMEM); return -1;}
+        
+        TRACE_BEGIN(sqlite3_context_db_handle(context), CLOUDSYNC_TRACE_DECOMPRESS);
+        uint32_t rc = LZ4_decompress_safe(buffer, clone, blen, header.expanded_size);
+        TRACE_END(sqlite3_context_db_handle(context), CLOUDSYNC_TRACE_DECOMPRESS, NULL, -1, header.expanded_size);
+        if (rc <= 0 || rc != header.expanded_size) {
+            dbutils_context_result_error(context, "Error on cloudsync_payload_apply: unable to decompress BLOB (%d).", rc);
+            sqlite3_result_error_code(context, SQLITE_MISUSE);
+            return -1;
+        }
+        
+        buffer = (const char *)clone;
+    }
+    
+    STATS_ADD(&data->stats, CLOUDSYNC_STAT_PAYLOAD_BYTES_RAW, (header.expanded_size) ? header.expanded_size : (uint32_t)blen);
+    STATS_ADD(&data->stats, CLOUDSYNC_STAT_PAYLOAD_BYTES_COMPRESSED, blen);
+    
+    // the insert statement is compiled once and kept in the context
+    // (a payload applied from the apply callback while another one is being applied uses its own statement)
+    sqlite3_stmt *vm = NULL;
+    bool shared_vm = !data->apply_in_use;
+    const char *sql = "INSERT INTO cloudsync_changes(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) VALUES (?,?,?,?,?,?,?,?,?);";
+    int rc = SQLITE_OK;
+    if (shared_vm && data->apply_stmt) vm = data->apply_stmt;
+    else rc = sqlite3_prepare_v3(db, sql, -1, (shared_vm) ? SQLITE_PREPARE_PERSISTENT : 0, &vm, NULL);
+    if (rc != SQLITE_OK) {
+        dbutils_context_result_error(context, "Error on cloudsync_payload_apply: error while compiling SQL statement (%s).", sqlite3_errmsg(db));
+        return -1;
+    }
+    if (shared_vm) {
+        data->apply_stmt = vm;
+        data->apply_in_use = true;
+    }
+    
+    // process buffer, one row at a time
+    uint16_t ncols = header.ncols;
+    uint32_t nrows = header.nrows;
+    int64_t last_payload_db_version = -1;
+    bool in_savepoint = false;
+    int group_dbversions = 0;
+    int group_rows = 0;
+    uint64_t group_start = 0;
+    int dbversion = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_CHECK_DBVERSION);
+    int seq = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_CHECK_SEQ);
+    cloudsync_pk_decode_bind_context decoded_context = {.vm = vm};
+    void *payload_apply_xdata = NULL;
+    cloudsync_payload_apply_callback_t payload_apply_callback = cloudsync_get_payload_apply_callback(db);
+    
+    // the changes of a packed row are merged into its buffered clock vector, which is written back before the next row
+    // (the apply callback can execute any statement between two changes, so in that case each change is written)
+    bool batch = (!payload_apply_callback && packed_batch_begin(data));
+    
+    // load the high-water marks of the sender of this payload
+    cloudsync_site_vector site_vector = {.sender = site_vector_sender(header.sender)};
+    if (site_vector_load(db, &site_vector) != SQLITE_OK) site_vector.sender = 0;
+    
+    TRACE_BEGIN(db, CLOUDSYNC_TRACE_MERGE);
+    for (uint32_t i=0; i<nrows; ++i) {
+        size_t seek = 0;
+        pk_decode((char *)buffer, blen, ncols, &seek, cloudsync_pk_decode_bind_callback, &decoded_context);
+        // n is the pk_decode return value, I don't think I should assert here because in any case the next sqlite3_step would fail
+        // assert(n == ncols);
+        
+        // skip rows already applied from the same origin (replayed or overlapping payloads)
+        if (site_vector_applied(&site_vector, &decoded_context)) {
+            buffer += seek;
+            blen -= seek;
+            stmt_reset(vm);
+            continue;
+        }
+        
+        // a db_version change can release the savepoint, so the buffered row is written first
+        if (batch) {
+            rc = packed_batch_next(data, decoded_context.tbl, (size_t)decoded_context.tbl_len, (const char *)decoded_context.pk, (size_t)decoded_context.pk_len, (last_payload_db_version != decoded_context.db_version));
+            if (rc != SQLITE_OK) {
+                dbutils_context_result_error(context, "Error on cloudsync_payload_apply: unable to store the clocks of a row (%s).", sqlite3_errmsg(db));
+                goto abort_apply;
+            }
+        }
+        
+        bool approved = true;
+        if (payload_apply_callback) approved = payload_apply_callback(&payload_apply_xdata, &decoded_context, db, data, CLOUDSYNC_PAYLOAD_APPLY_WILL_APPLY, SQLITE_OK);
+        
+        // Apply consecutive rows with the same db_version inside a transaction if no
+        // transaction has already been opened.
+        // The user may have already opened a transaction before applying the payload,
+        // and the `payload_apply_callback` may have already opened a savepoint.
+        // Nested savepoints work, but overlapping savepoints could alter the expected behavior.
+        // This savepoint ensures that the db_version value remains consistent for all
+        // rows with the same original db_version in the payload.
+        // Consecutive db_versions can be grouped in the same transaction (see the apply_group_* settings),
+        // a db_version is never split between two transactions.
+
+        bool db_version_changed = (last_payload_db_version != decoded_context.db_version);
+
+        // Release existing savepoint if db_version changed and the group is complete
+        if (in_savepoint && db_version_changed && payload_apply_group_full(data, group_dbversions, group_rows, group_start)) {
+            rc = payload_apply_release(db, data, &site_vector);
+            if (rc != SQLITE_OK) {
+                dbutils_context_result_error(context, "Error on cloudsync_payload_apply: unable to release a savepoint (%s).", sqlite3_errmsg(db));
+                goto abort_apply;
+            }
+            in_savepoint = false;
+        }
+
+        // Start new savepoint if needed
+        bool in_transaction = sqlite3_get_autocommit(db) != true;
+        if (!in_transaction && db_version_changed) {
+            rc = payload_apply_exec(db, &data->apply_savepoint_stmt, "SAVEPOINT cloudsync_payload_apply;");
+            if (rc != SQLITE_OK) {
+                dbutils_context_result_error(context, "Error on cloudsync_payload_apply: unable to start a transaction (%s).", sqlite3_errmsg(db));
+                goto abort_apply;
+            }
+            in_savepoint = true;
+            group_dbversions = 0;
+            group_rows = 0;
+            if (data->apply_group_ms > 0) group_start = cloudsync_time_ms();
+        }
+        if (db_version_changed) {
+            last_payload_db_version = decoded_context.db_version;
+            ++group_dbversions;
+        }
+        ++group_rows;
+        
+        if (approved) {
+            rc = sqlite3_step(vm);
+            if (rc != SQLITE_DONE) {
+                // don't "break;", the error can be due to a RLS policy.
+                // in case of error we try to apply the following changes
+                printf("cloudsync_payload_apply error on db_version %lld/%lld: (%d) %s\n", decoded_context.db_version, decoded_context.seq, rc, sqlite3_errmsg(db));
+                if (batch) packed_batch_failed(data);
+            }
+        }
+        
+        // the apply callback can later roll back rows it approved, so marks advance only without it
+        site_vector_advance(&site_vector, &decoded_context, (approved && rc == SQLITE_DONE && !payload_apply_callback));
+        
+        if (payload_apply_callback) payload_apply_callback(&payload_apply_xdata, &decoded_context, db, data, CLOUDSYNC_PAYLOAD_APPLY_DID_APPLY, rc);
+        
+        buffer += seek;
+        blen -= seek;
+        stmt_reset(vm);
+    }
+    
+    if (batch) {
+        int rc1 = packed_batch_end(data, true);
+        if (rc1 != SQLITE_OK) rc = rc1;
+    }
+    if (in_savepoint) {
+        int rc1 = payload_apply_exec(db, &data->apply_release_stmt, "RELEASE cloudsync_payload_apply;");
+        if (rc1 != SQLITE_OK) rc = rc1;
+    }
+    TRACE_END(db, CLOUDSYNC_TRACE_MERGE, NULL, nrows, -1);
+
+    char *lasterr = (rc != SQLITE_OK && rc != SQLITE_DONE) ? cloudsync_arena_strdup(&data->arena, sqlite3_errmsg(db)) : NULL;
+    
+    if (payload_apply_callback) {
+        payload_apply_callback(&payload_apply_xdata, &decoded_context, db, data, CLOUDSYNC_PAYLOAD_APPLY_CLEANUP, rc);
+    }
+
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    if (rc == SQLITE_OK) {
+        char buf[256];
+        if (decoded_context.db_version >= dbversion) {
+            snprintf(buf, sizeof(buf), "%lld", decoded_context.db_version);
+            dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_CHECK_DBVERSION, buf);
+            
+            if (decoded_context.seq != seq) {
+                snprintf(buf, sizeof(buf), "%lld", decoded_context.seq);
+                dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_CHECK_SEQ, buf);
+            }
+        }
+    }
+    site_vector_save(db, data, &site_vector);
+    site_vector_free(&site_vector);
+
+    // cleanup vm
+    if (shared_vm) {
+        sqlite3_clear_bindings(vm);
+        data->apply_in_use = false;
+    } else {
+        sqlite3_finalize(vm);
+    }
     
-    rc = sqlite3_bind_int(vm, 7, seq);
-    if (rc != SQLITE_OK) goto cleanup;
+    STATS_ADD(&data->stats, CLOUDSYNC_STAT_ROWS_DECODED, nrows);
+    stats_latency_add(&data->stats, CLOUDSYNC_LATENCY_APPLY, start_us);
     
-    rc = sqlite3_step(vm);
-    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(context, lasterr, -1);
+        sqlite3_result_error_code(context, SQLITE_MISUSE);
+        return -1;
+    }
     
-cleanup:
-    DEBUG_SQLITE_ERROR(rc, "local_insert_or_update", db);
-    sqlite3_reset(vm);
-    return rc;
-}
-
-int local_mark_insert_or_update_meta (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, const char *col_name, sqlite3_int64 db_version, int seq) {
-    return local_mark_insert_or_update_meta_impl(db, table, pk, pklen, col_name, 1, db_version, seq);
-}
-
-int local_mark_delete_meta (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, sqlite3_int64 db_version, int seq) {
-    return local_mark_insert_or_update_meta_impl(db, table, pk, pklen, NULL, 2, db_version, seq);
+    // return the number of processed rows
+    sqlite3_result_int(context, nrows);
+    return nrows;
+    
+abort_apply:
+    TRACE_END(db, CLOUDSYNC_TRACE_MERGE, NULL, -1, -1);
+    if (batch) packed_batch_end(data, false);
+    if (in_savepoint) sqlite3_exec(db, "ROLLBACK TO cloudsync_payload_apply; RELEASE cloudsync_payload_apply;", NULL, NULL, NULL);
+    stmt_reset(vm);
+    if (shared_vm) data->apply_in_use = false;
+    else sqlite3_finalize(vm);
+    site_vector_free(&site_vector);
+    return -1;
 }
 
-int local_drop_meta (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen) {
-    sqlite3_stmt *vm = table->meta_row_drop_stmt;
-    if (!vm) return -1;
+int cloudsync_payload_apply (sqlite3_context *context, const char *payload, int blen) {
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
     
-    int rc = sqlite3_bind_blob(vm, 1, pk, (int)pklen, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup;
+    // the transient allocations of the apply are released at its end, even if it spans several transactions
+    cloudsync_arena_mark mark = {0};
+    if (data) mark = cloudsync_arena_begin(&data->arena);
     
-    rc = sqlite3_step(vm);
-    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    TRACE_BEGIN(db, CLOUDSYNC_TRACE_APPLY);
+    int nrows = payload_apply(context, payload, blen);
+    TRACE_END(db, CLOUDSYNC_TRACE_APPLY, NULL, (nrows >= 0) ? nrows : -1, blen);
     
-cleanup:
-    DEBUG_SQLITE_ERROR(rc, "local_drop_meta", db);
-    sqlite3_reset(vm);
-    return rc;
+    if (data) cloudsync_arena_end(&data->arena, mark);
+    return nrows;
 }
 
-int local_update_move_meta (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, const char *pk2, size_t pklen2, sqlite3_int64 db_version) {
-    /*
-      * This function moves non-sentinel metadata entries from an old primary key (OLD.pk)
-      * to a new primary key (NEW.pk) when a primary key change occurs.
-      *
-      * To ensure consistency and proper conflict resolution in a CRDT (Conflict-free Replicated Data Type) system,
-      * each non-sentinel metadata entry involved in the move must have a unique sequence value (seq).
-      *
-      * The `seq` is crucial for tracking the order of operations and for detecting and resolving conflicts
-      * during synchronization between replicas. Without a unique `seq` for each entry, concurrent updates
-      * may be applied incorrectly, leading to data inconsistency.
-      *
-      * When performing the update, a unique `seq` must be assigned to each metadata row. This can be achieved
-      * by either incrementing the maximum sequence value in the table or using a function (e.g., `bump_seq(data)`)
-      * that generates a unique sequence for each row. The update query should ensure that each row moved
-      * from OLD.pk to NEW.pk gets a distinct `seq` to maintain proper versioning and ordering of changes.
-     */
+void cloudsync_payload_decode (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_payload_decode");
+    //debug_values(argc, argv);
     
-    // see https://github.com/sqliteai/sqlite-sync/blob/main/docs/PriKey.md for more details
-    // pk2 is the old pk
+    // sanity check payload type
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        dbutils_context_result_error(context, "Error on cloudsync_payload_decode: value must be a BLOB.");
+        sqlite3_result_error_code(context, SQLITE_MISUSE);
+        return;
+    }
     
-    sqlite3_stmt *vm = table->meta_update_move_stmt;
-    if (!vm) return -1;
+    // sanity check payload size
+    int blen = sqlite3_value_bytes(argv[0]);
+    if (blen < (int)sizeof(cloudsync_payload_header)) {
+        dbutils_context_result_error(context, "Error on cloudsync_payload_decode: invalid input size.");
+        sqlite3_result_error_code(context, SQLITE_MISUSE);
+        return;
+    }
     
-    // new primary key
-    int rc = sqlite3_bind_blob(vm, 1, pk, (int)pklen, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup;
+    // obtain payload
+    const char *payload = (const char *)sqlite3_value_blob(argv[0]);
     
-    // new db_version
-    rc = sqlite3_bind_int64(vm, 2, db_version);
-    if (rc != SQLITE_OK) goto cleanup;
+    // apply changes
+    cloudsync_payload_apply(context, payload, blen);
+}
+
+// MARK: - Payload load/store -
+
+int cloudsync_payload_get (sqlite3_context *context, char **blob, int *blob_size, int *db_version, int *seq, sqlite3_int64 *new_db_version, sqlite3_int64 *new_seq) {
+    sqlite3 *db = sqlite3_context_db_handle(context);
+
+    *db_version = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_SEND_DBVERSION);
+    if (*db_version < 0) {sqlite3_result_error(context, "Unable to retrieve db_version.", -1); return SQLITE_ERROR;}
+
+    *seq = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_SEND_SEQ);
+    if (*seq < 0) {sqlite3_result_error(context, "Unable to retrieve seq.", -1); return SQLITE_ERROR;}
     
-    // old primary key
-    rc = sqlite3_bind_blob(vm, 3, pk2, (int)pklen2, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup;
+    // retrieve BLOB
+    char sql[1024];
+    snprintf(sql, sizeof(sql), "WITH max_db_version AS (SELECT MAX(db_version) AS max_db_version FROM cloudsync_changes) "
+                               "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq), max_db_version AS max_db_version, MAX(IIF(db_version = max_db_version, seq, NULL)) FROM cloudsync_changes, max_db_version WHERE site_id=cloudsync_siteid() AND (db_version>%d OR (db_version=%d AND seq>%d))", *db_version, *db_version, *seq);
     
-    rc = sqlite3_step(vm);
-    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    TRACE_BEGIN(db, CLOUDSYNC_TRACE_PAYLOAD_GET);
+    int rc = dbutils_blob_int_int_select(db, sql, blob, blob_size, new_db_version, new_seq);
+    TRACE_END(db, CLOUDSYNC_TRACE_PAYLOAD_GET, NULL, -1, (rc == SQLITE_OK) ? *blob_size : -1);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error(context, "cloudsync_network_send_changes unable to get changes", -1);
+        sqlite3_result_error_code(context, rc);
+        return rc;
+    }
     
-cleanup:
-    DEBUG_SQLITE_ERROR(rc, "local_update_move_meta", db);
-    sqlite3_reset(vm);
+    // exit if there is no data to send
+    if (blob == NULL || blob_size == 0) return SQLITE_OK;
     return rc;
 }
 
-// MARK: - Payload Encode / Decode -
-
-bool cloudsync_buffer_free (cloudsync_data_payload *payload) {
-    if (payload) {
-        if (payload->buffer) cloudsync_memory_free(payload->buffer);
-        memset(payload, 0, sizeof(cloudsync_data_payload));
+int cloudsync_has_unsent_changes (sqlite3_context *context) {
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    
+    // both values are kept in memory, they are reloaded from the settings only if another connection wrote to the database
+    // data_version_stmt is stepped directly so the data->data_version value used by db_version_check_uptodate is not consumed
+    int version = -1;
+    sqlite3_stmt *vm = data->data_version_stmt;
+    if (vm) {
+        if (sqlite3_step(vm) == SQLITE_ROW) version = sqlite3_column_int(vm, 0);
+        sqlite3_reset(vm);
     }
-        
-    return false;
-}
-
-bool cloudsync_buffer_check (cloudsync_data_payload *payload, size_t needed) {
-    if (payload->nrows == 0) needed += sizeof(cloudsync_payload_header);
     
-    // alloc/resize buffer
-    if (payload->bused + needed > payload->balloc) {
-        if (needed < CLOUDSYNC_PAYLOAD_MINBUF_SIZE) needed = CLOUDSYNC_PAYLOAD_MINBUF_SIZE;
-        size_t balloc = payload->balloc + needed;
-        
-        char *buffer = cloudsync_memory_realloc(payload->buffer, balloc);
-        if (!buffer) return cloudsync_buffer_free(payload);
+    if (version == -1 || version != data->local_data_version || data->local_db_version == CLOUDSYNC_VALUE_NOTSET) {
+        int send_db_version = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_SEND_DBVERSION);
+        data->send_db_version = (send_db_version < 0) ? 0 : send_db_version;
         
-        payload->buffer = buffer;
-        payload->balloc = balloc;
-        if (payload->nrows == 0) payload->bused = sizeof(cloudsync_payload_header);
+        char buffer[256];
+        if (dbutils_settings_get_value(db, CLOUDSYNC_KEY_LOCAL_DBVERSION, buffer, sizeof(buffer))) {
+            data->local_db_version = strtoll(buffer, NULL, 0);
+        } else {
+            // database created by a previous version of the library, compute the value just once
+            const char *sql = "SELECT IFNULL(max(db_version), 0) FROM cloudsync_changes WHERE site_id == (SELECT site_id FROM cloudsync_site_id WHERE rowid=0)";
+            sqlite3_int64 value = dbutils_int_select(db, sql);
+            if (value < 0) return -1;
+            data->local_db_version = value;
+            
+            snprintf(buffer, sizeof(buffer), "%lld", value);
+            dbutils_settings_set_key_value(db, NULL, CLOUDSYNC_KEY_LOCAL_DBVERSION, buffer);
+        }
+        data->local_data_version = version;
     }
     
-    return true;
+    if (data->local_db_version == 0) return 0;
+    return (data->send_db_version < data->local_db_version);
 }
 
-void cloudsync_payload_header_init (cloudsync_payload_header *header, uint32_t expanded_size, uint16_t ncols, uint32_t nrows, uint64_t hash) {
-    memset(header, 0, sizeof(cloudsync_payload_header));
-    assert(sizeof(cloudsync_payload_header)==32);
-    
-    int major, minor, patch;
-    sscanf(CLOUDSYNC_VERSION, "%d.%d.%d", &major, &minor, &patch);
-    
-    header->signature = htonl(CLOUDSYNC_PAYLOAD_SIGNATURE);
-    header->version = CLOUDSYNC_PAYLOAD_VERSION;
-    header->libversion[0] = major;
-    header->libversion[1] = minor;
-    header->libversion[2] = patch;
-    header->expanded_size = htonl(expanded_size);
-    header->ncols = htons(ncols);
-    header->nrows = htonl(nrows);
-    header->schema_hash = htonll(hash);
-}
+#ifdef CLOUDSYNC_DESKTOP_OS
 
-void cloudsync_payload_encode_step (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    DEBUG_FUNCTION("cloudsync_payload_encode_step");
-    // debug_values(argc, argv);
-    
-    // allocate/get the session context
-    cloudsync_data_payload *payload = (cloudsync_data_payload *)sqlite3_aggregate_context(context, sizeof(cloudsync_data_payload));
-    if (!payload) return;
+void cloudsync_payload_save (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_payload_save");
     
-    // check if the step function is called for the first time
-    if (payload->nrows == 0) payload->ncols = argc;
+    // sanity check argument
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        sqlite3_result_error(context, "Unable to retrieve file path.", -1);
+        return;
+    }
     
-    size_t breq = pk_encode_size(argv, argc, 0);
-    if (cloudsync_buffer_check(payload, breq) == false) return;
+    // retrieve full path to file
+    const char *path = (const char *)sqlite3_value_text(argv[0]);
+    cloudsync_file_delete(path);
     
-    char *buffer = payload->buffer + payload->bused;
-    char *ptr = pk_encode(argv, argc, buffer, false, NULL);
-    assert(buffer == ptr);
+    // retrieve payload
+    char *blob = NULL;
+    int blob_size = 0, db_version = 0, seq = 0;
+    sqlite3_int64 new_db_version = 0, new_seq = 0;
+    int rc = cloudsync_payload_get(context, &blob, &blob_size, &db_version, &seq, &new_db_version, &new_seq);
+    if (rc != SQLITE_OK) return;
     
-    // update buffer
-    payload->bused += breq;
+    // exit if there is no data to send
+    if (blob == NULL || blob_size == 0) return;
     
-    // increment row counter
-    ++payload->nrows;
-}
-
-void cloudsync_payload_encode_final (sqlite3_context *context) {
-    DEBUG_FUNCTION("cloudsync_payload_encode_final");
-
-    // get the session context
-    cloudsync_data_payload *payload = (cloudsync_data_payload *)sqlite3_aggregate_context(context, sizeof(cloudsync_data_payload));
-    if (!payload) return;
+    // write payload to file
+    bool res = cloudsync_file_write(path, blob, (size_t)blob_size);
+    sqlite3_free(blob);
     
-    if (payload->nrows == 0) {
-        sqlite3_result_null(context);
+    if (res == false) {
+        sqlite3_result_error(context, "Unable to write payload to file path.", -1);
         return;
     }
     
-    // encode payload
-    int header_size = (int)sizeof(cloudsync_payload_header);
-    int real_buffer_size = (int)(payload->bused - header_size);
-    int zbound = LZ4_compressBound(real_buffer_size);
-    char *buffer = cloudsync_memory_alloc(zbound + header_size);
-    if (!buffer) {
-        cloudsync_buffer_free(payload);
-        sqlite3_result_error_code(context, SQLITE_NOMEM);
-        return;
+    // update db_version and seq
+    char buf[256];
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    if (new_db_version != db_version) {
+        snprintf(buf, sizeof(buf), "%lld", new_db_version);
+        dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_SEND_DBVERSION, buf);
+    }
+    if (new_seq != seq) {
+        snprintf(buf, sizeof(buf), "%lld", new_seq);
+        dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_SEND_SEQ, buf);
     }
     
-    // adjust buffer to compress to skip the reserved header
-    char *src_buffer = payload->buffer + sizeof(cloudsync_payload_header);
-    int zused = LZ4_compress_default(src_buffer, buffer+header_size, real_buffer_size, zbound);
-    bool use_uncompressed_buffer = (!zused || zused > real_buffer_size);
-    CHECK_FORCE_UNCOMPRESSED_BUFFER();
+    // returns blob size
+    sqlite3_result_int64(context, (sqlite3_int64)blob_size);
+}
+
+void cloudsync_payload_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_payload_load");
     
-    // setup payload header
-    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
-    cloudsync_payload_header header;
-    cloudsync_payload_header_init(&header, (use_uncompressed_buffer) ? 0 : real_buffer_size, payload->ncols, (uint32_t)payload->nrows, data->schema_hash);
+    // sanity check argument
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        sqlite3_result_error(context, "Unable to retrieve file path.", -1);
+        return;
+    }
     
-    // if compression fails or if compressed size is bigger than original buffer, then use the uncompressed buffer
-    if (use_uncompressed_buffer) {
-        cloudsync_memory_free(buffer);
-        buffer = payload->buffer;
-        zused = real_buffer_size;
+    // retrieve full path to file
+    const char *path = (const char *)sqlite3_value_text(argv[0]);
+    
+    sqlite3_int64 payload_size = 0;
+    char *payload = cloudsync_file_read(path, &payload_size);
+    if (!payload) {
+        if (payload_size == -1) sqlite3_result_error(context, "Unable to read payload from file path.", -1);
+        if (payload) cloudsync_memory_free(payload);
+        return;
     }
     
-    // copy header and data to SQLite BLOB
-    memcpy(buffer, &header, sizeof(cloudsync_payload_header));
-    int blob_size = zused+sizeof(cloudsync_payload_header);
-    sqlite3_result_blob(context, buffer, blob_size, SQLITE_TRANSIENT);
+    int nrows = (payload_size) ? cloudsync_payload_apply (context, payload, (int)payload_size) : 0;
+    if (payload) cloudsync_memory_free(payload);
     
-    // cleanup memory
-    cloudsync_buffer_free(payload);
-    if (!use_uncompressed_buffer) cloudsync_memory_free(buffer);
+    // returns number of applied rows
+    if (nrows != -1) sqlite3_result_int(context, nrows);
 }
 
-cloudsync_payload_apply_callback_t cloudsync_get_payload_apply_callback(sqlite3 *db) {
-    return (sqlite3_libversion_number() >= 3044000) ? sqlite3_get_clientdata(db, CLOUDSYNC_PAYLOAD_APPLY_CALLBACK_KEY) : NULL;
+void cloudsync_trace_file (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_trace_file");
+    
+    // a NULL path stops tracing and completes the current file
+    const char *path = (sqlite3_value_type(argv[0]) == SQLITE_NULL) ? NULL : (const char *)sqlite3_value_text(argv[0]);
+    if (!trace_file_open(sqlite3_context_db_handle(context), path)) {
+        if (path) dbutils_context_result_error(context, "Unable to open trace file %s (SQLite 3.44.0 or later is required).", path);
+        else dbutils_context_result_error(context, "Unable to stop tracing (SQLite 3.44.0 or later is required).");
+        return;
+    }
+    
+    sqlite3_result_int(context, 1);
 }
 
-void cloudsync_set_payload_apply_callback(sqlite3 *db, cloudsync_payload_apply_callback_t callback) {
-    if (sqlite3_libversion_number() >= 3044000) {
-        sqlite3_set_clientdata(db, CLOUDSYNC_PAYLOAD_APPLY_CALLBACK_KEY, (void*)callback, NULL);
-    }
+#endif
+
+// MARK: - Attached Sync -
+
+// cloudsync_sync_attached exchanges the changes with a database attached to this connection without encoding them
+// into a payload. The attached file is opened by a second connection with its own cloudsync context (its site_id,
+// db_version and table contexts drive the merge on that side), then the rows read from cloudsync_changes of one side
+// are bound as they are to the INSERT INTO cloudsync_changes statement of the other side, in both directions.
+// Each side stores the last db_version received from the other one (CLOUDSYNC_KEY_ATTACHED_DBVERSION setting, followed
+// by the site_id of the other side) and skips the rows already applied from the same origin through the site vector.
+// The rows received by the main database in the first direction are not sent back to the attached one: when the pull
+// owns its transaction, it holds the write lock so the db_versions assigned to those rows form a range that is
+// excluded by the second direction.
+
+int attached_exec (sqlite3 *db, const char *sql) {
+    return sqlite3_exec(db, sql, NULL, NULL, NULL);
 }
 
-int cloudsync_pk_decode_bind_callback (void *xdata, int index, int type, int64_t ival, double dval, char *pval) {
-    cloudsync_pk_decode_bind_context *decode_context = (cloudsync_pk_decode_bind_context*)xdata;
-    int rc = pk_decode_bind_callback(decode_context->vm, index, type, ival, dval, pval);
+int attached_pull (sqlite3 *dst, cloudsync_context *dst_data, sqlite3 *src, uint8_t src_site_id[UUID_LEN], const sqlite3_int64 skip_range[2], sqlite3_int64 applied_range[2], sqlite3_int64 *nrows, char **errmsg) {
+    sqlite3_stmt *src_vm = NULL;
+    sqlite3_stmt *dst_vm = NULL;
+    bool in_transaction = false;
+    bool complete = true;
+    void *payload_apply_xdata = NULL;
+    cloudsync_payload_apply_callback_t payload_apply_callback = cloudsync_get_payload_apply_callback(dst);
+    bool batch = false;
+    cloudsync_pk_decode_bind_context decoded_context = {0};
+    cloudsync_site_vector site_vector = {.sender = site_vector_sender(src_site_id + (UUID_LEN - 6))};
+    *nrows = 0;
+    applied_range[0] = applied_range[1] = -1;
+    
+    // changes from a schema not (yet) known by the destination cannot be merged, like for payloads
+    sqlite3_uint64 hash = dbutils_schema_hash(src);
+    if (!dbutils_check_schema_hash(dst, hash)) {
+        *errmsg = cloudsync_memory_mprintf("Cannot sync the attached database because the schema hash is unknown %llu.", hash);
+        return SQLITE_MISMATCH;
+    }
+    
+    // last db_version of the source already received by the destination
+    char key[64], buffer[256] = {0};
+    char site_id[UUID_STR_MAXLEN];
+    snprintf(key, sizeof(key), "%s%s", CLOUDSYNC_KEY_ATTACHED_DBVERSION, cloudsync_uuid_v7_stringify(src_site_id, site_id, false));
+    sqlite3_int64 last_db_version = (dbutils_settings_get_value(dst, key, buffer, sizeof(buffer))) ? strtoll(buffer, NULL, 0) : 0;
+    sqlite3_int64 max_db_version = last_db_version;
+    
+    // the changes that originated in the destination are never sent back to it
+    const char *sql = "SELECT tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq FROM cloudsync_changes WHERE db_version > ?1 AND site_id != ?2 AND db_version NOT BETWEEN ?3 AND ?4 ORDER BY db_version, seq;";
+    int rc = sqlite3_prepare_v2(src, sql, -1, &src_vm, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
     
-    if (rc == SQLITE_OK) {
-        // the dbversion index is smaller than seq index, so it is processed first
-        // when processing the dbversion column: save the value to the tmp_dbversion field
-        // when processing the seq column: update the dbversion and seq fields only if the current dbversion is greater than the last max value
-        switch (index) {
-            case CLOUDSYNC_PK_INDEX_TBL:
-                if (type == SQLITE_TEXT) {
-                    decode_context->tbl = pval;
-                    decode_context->tbl_len = ival;
-                }
-                break;
-            case CLOUDSYNC_PK_INDEX_PK:
-                if (type == SQLITE_BLOB) {
-                    decode_context->pk = pval;
-                    decode_context->pk_len = ival;
-                }
-                break;
-            case CLOUDSYNC_PK_INDEX_COLNAME:
-                if (type == SQLITE_TEXT) {
-                    decode_context->col_name = pval;
-                    decode_context->col_name_len = ival;
-                }
-                break;
-            case CLOUDSYNC_PK_INDEX_COLVERSION:
-                if (type == SQLITE_INTEGER) decode_context->col_version = ival;
-                break;
-            case CLOUDSYNC_PK_INDEX_DBVERSION:
-                if (type == SQLITE_INTEGER) decode_context->db_version = ival;
-                break;
-            case CLOUDSYNC_PK_INDEX_SITEID:
-                if (type == SQLITE_BLOB) {
-                    decode_context->site_id = pval;
-                    decode_context->site_id_len = ival;
-                }
-                break;
-            case CLOUDSYNC_PK_INDEX_CL:
-                if (type == SQLITE_INTEGER) decode_context->cl = ival;
-                break;
-            case CLOUDSYNC_PK_INDEX_SEQ:
-                if (type == SQLITE_INTEGER) decode_context->seq = ival;
-                break;
+    rc = sqlite3_bind_int64(src_vm, 1, last_db_version);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_blob(src_vm, 2, dst_data->site_id, UUID_LEN, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int64(src_vm, 3, skip_range[0]);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int64(src_vm, 4, skip_range[1]);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    sql = "INSERT INTO cloudsync_changes(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) VALUES (?,?,?,?,?,?,?,?,?);";
+    rc = sqlite3_prepare_v2(dst, sql, -1, &dst_vm, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    decoded_context.vm = dst_vm;
+    
+    if (site_vector_load(dst, &site_vector) != SQLITE_OK) site_vector.sender = 0;
+    
+    // all the rows received from the source are applied in the same transaction, the write lock is taken
+    // immediately so that no other connection can commit a db_version in the range assigned to these rows
+    sqlite3_int64 start_db_version = -1;
+    if (sqlite3_get_autocommit(dst)) {
+        rc = attached_exec(dst, "BEGIN IMMEDIATE;");
+        if (rc != SQLITE_OK) goto cleanup;
+        in_transaction = true;
+        
+        rc = db_version_check_uptodate(dst, dst_data);
+        if (rc != SQLITE_OK) goto cleanup;
+        start_db_version = dst_data->db_version;
+    }
+    
+    // the clock vector of a packed row is written back before the next row (like in payload_apply)
+    batch = (!payload_apply_callback && packed_batch_begin(dst_data));
+    
+    TRACE_BEGIN(dst, CLOUDSYNC_TRACE_MERGE);
+    while ((rc = sqlite3_step(src_vm)) == SQLITE_ROW) {
+        decoded_context.tbl = (char *)sqlite3_column_text(src_vm, CLOUDSYNC_PK_INDEX_TBL);
+        decoded_context.tbl_len = sqlite3_column_bytes(src_vm, CLOUDSYNC_PK_INDEX_TBL);
+        decoded_context.pk = sqlite3_column_blob(src_vm, CLOUDSYNC_PK_INDEX_PK);
+        decoded_context.pk_len = sqlite3_column_bytes(src_vm, CLOUDSYNC_PK_INDEX_PK);
+        decoded_context.col_name = (char *)sqlite3_column_text(src_vm, CLOUDSYNC_PK_INDEX_COLNAME);
+        decoded_context.col_name_len = sqlite3_column_bytes(src_vm, CLOUDSYNC_PK_INDEX_COLNAME);
+        decoded_context.col_version = sqlite3_column_int64(src_vm, CLOUDSYNC_PK_INDEX_COLVERSION);
+        decoded_context.db_version = sqlite3_column_int64(src_vm, CLOUDSYNC_PK_INDEX_DBVERSION);
+        decoded_context.site_id = sqlite3_column_blob(src_vm, CLOUDSYNC_PK_INDEX_SITEID);
+        decoded_context.site_id_len = sqlite3_column_bytes(src_vm, CLOUDSYNC_PK_INDEX_SITEID);
+        decoded_context.cl = sqlite3_column_int64(src_vm, CLOUDSYNC_PK_INDEX_CL);
+        decoded_context.seq = sqlite3_column_int64(src_vm, CLOUDSYNC_PK_INDEX_SEQ);
+        if (decoded_context.db_version > max_db_version) max_db_version = decoded_context.db_version;
+        
+        if (site_vector_applied(&site_vector, &decoded_context)) continue;
+        
+        if (batch) {
+            rc = packed_batch_next(dst_data, decoded_context.tbl, (size_t)decoded_context.tbl_len, (const char *)decoded_context.pk, (size_t)decoded_context.pk_len, false);
+            if (rc != SQLITE_OK) break;
+        }
+        
+        // values are bound as they are read, no encoding step is involved
+        for (int i=0; i<CLOUDSYNC_PK_INDEX_SEQ + 1; ++i) sqlite3_bind_value(dst_vm, i + 1, sqlite3_column_value(src_vm, i));
+        
+        bool approved = true;
+        if (payload_apply_callback) approved = payload_apply_callback(&payload_apply_xdata, &decoded_context, dst, dst_data, CLOUDSYNC_PAYLOAD_APPLY_WILL_APPLY, SQLITE_OK);
+        
+        int step_rc = SQLITE_DONE;
+        if (approved) {
+            step_rc = sqlite3_step(dst_vm);
+            if (step_rc == SQLITE_DONE) ++(*nrows);
+            else if (batch) packed_batch_failed(dst_data);
         }
-    }
         
+        // a row not applied keeps the last exchanged db_version, so it is read again by the next sync
+        if (!approved || step_rc != SQLITE_DONE) complete = false;
+        site_vector_advance(&site_vector, &decoded_context, (approved && step_rc == SQLITE_DONE && !payload_apply_callback));
+        
+        if (payload_apply_callback) payload_apply_callback(&payload_apply_xdata, &decoded_context, dst, dst_data, CLOUDSYNC_PAYLOAD_APPLY_DID_APPLY, step_rc);
+        stmt_reset(dst_vm);
+    }
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    if (batch) {
+        batch = false;
+        int rc1 = packed_batch_end(dst_data, rc == SQLITE_OK);
+        if (rc == SQLITE_OK) rc = rc1;
+    }
+    TRACE_END(dst, CLOUDSYNC_TRACE_MERGE, NULL, (rc == SQLITE_OK) ? *nrows : -1, -1);
+    
+    if (payload_apply_callback) payload_apply_callback(&payload_apply_xdata, &decoded_context, dst, dst_data, CLOUDSYNC_PAYLOAD_APPLY_CLEANUP, rc);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    // the skipped range contains only rows received from the destination, so it counts as exchanged
+    if (complete && skip_range[1] > max_db_version) max_db_version = skip_range[1];
+    if (complete && max_db_version > last_db_version) {
+        snprintf(buffer, sizeof(buffer), "%lld", max_db_version);
+        rc = dbutils_settings_set_key_value(dst, NULL, key, buffer);
+        if (rc != SQLITE_OK) goto cleanup;
+    }
+    
+    rc = site_vector_save(dst, dst_data, &site_vector);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    if (in_transaction) {
+        if (*nrows > 0 && start_db_version >= 0 && dst_data->pending_db_version != CLOUDSYNC_VALUE_NOTSET) {
+            applied_range[0] = start_db_version + 1;
+            applied_range[1] = dst_data->pending_db_version;
+        }
+        rc = attached_exec(dst, "COMMIT;");
+        in_transaction = false;
+    }
+    
+cleanup:
+    if (rc != SQLITE_OK && *errmsg == NULL) *errmsg = cloudsync_string_dup(sqlite3_errmsg((src_vm && sqlite3_errcode(src) != SQLITE_OK) ? src : dst), false);
+    if (in_transaction) attached_exec(dst, "ROLLBACK;");
+    if (src_vm) sqlite3_finalize(src_vm);
+    if (dst_vm) sqlite3_finalize(dst_vm);
+    site_vector_free(&site_vector);
     return rc;
 }
 
-// #ifndef CLOUDSYNC_OMIT_RLS_VALIDATION
-
-int cloudsync_payload_apply (sqlite3_context *context, const char *payload, int blen) {
-    // decode header
-    cloudsync_payload_header header;
-    memcpy(&header, payload, sizeof(cloudsync_payload_header));
-
-    header.signature = ntohl(header.signature);
-    header.expanded_size = ntohl(header.expanded_size);
-    header.ncols = ntohs(header.ncols);
-    header.nrows = ntohl(header.nrows);
-    header.schema_hash = ntohll(header.schema_hash);
+void cloudsync_sync_attached (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_sync_attached");
     
+    sqlite3 *db = sqlite3_context_db_handle(context);
     cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
-    if (!data || header.schema_hash != data->schema_hash) {
-        sqlite3 *db = sqlite3_context_db_handle(context);
-        if (!dbutils_check_schema_hash(db, header.schema_hash)) {
-            dbutils_context_result_error(context, "Cannot apply the received payload because the schema hash is unknown %llu.", header.schema_hash);
-            sqlite3_result_error_code(context, SQLITE_MISMATCH);
-            return -1;
-        }
+    sqlite3 *peer = NULL;
+    char *errmsg = NULL;
+    int rc = SQLITE_OK;
+    
+    // sanity check arguments
+    const char *schema = (const char *)sqlite3_value_text(argv[0]);
+    if (!schema || strcasecmp(schema, "main") == 0 || strcasecmp(schema, "temp") == 0) {
+        sqlite3_result_error(context, "cloudsync_sync_attached requires the name of an attached database.", -1);
+        return;
     }
     
-    // sanity check header
-    if ((header.signature != CLOUDSYNC_PAYLOAD_SIGNATURE) || (header.ncols == 0)) {
-        dbutils_context_result_error(context, "Error on cloudsync_payload_apply: invalid signature or column size.");
-        sqlite3_result_error_code(context, SQLITE_MISUSE);
-        return -1;
+    // the attached database is opened by a second connection, so it must be a file
+    const char *path = sqlite3_db_filename(db, schema);
+    if (!path) {
+        dbutils_context_result_error(context, "Unknown attached database %s.", schema);
+        return;
+    }
+    if (path[0] == 0) {
+        dbutils_context_result_error(context, "The attached database %s must be a file database.", schema);
+        return;
     }
     
-    const char *buffer = payload + sizeof(cloudsync_payload_header);
-    blen -= sizeof(cloudsync_payload_header);
+    if (cloudsync_context_init(db, data, context) == NULL) {
+        sqlite3_result_error(context, "Unable to initialize cloudsync context.", -1);
+        return;
+    }
     
-    // check if payload is compressed
-    char *clone = NULL;
-    if (header.expanded_size != 0) {
-        clone = (char *)cloudsync_memory_alloc(header.expanded_size);
-        if (!clone) {sqlite3_result_error_code(context, SQLITE_NOMEM); return -1;}
-        
-        uint32_t rc = LZ4_decompress_safe(buffer, clone, blen, header.expanded_size);
-        if (rc <= 0 || rc != header.expanded_size) {
-            dbutils_context_result_error(context, "Error on cloudsync_payload_apply: unable to decompress BLOB (%d).", rc);
-            sqlite3_result_error_code(context, SQLITE_MISUSE);
-            return -1;
-        }
-        
-        buffer = (const char *)clone;
+    // open and register the other side
+    cloudsync_context *peer_data = NULL;
+    rc = sqlite3_open_v2(path, &peer, SQLITE_OPEN_READWRITE, NULL);
+    if (rc == SQLITE_OK) rc = cloudsync_register(peer, NULL, &peer_data);
+    if (rc != SQLITE_OK) {
+        errmsg = cloudsync_memory_mprintf("Unable to open the attached database %s (%s).", schema, (peer) ? sqlite3_errmsg(peer) : "out of memory");
+        goto cleanup;
+    }
+    if (!peer_data || !cloudsync_config_exists(peer) || peer_data->site_id[0] == 0) {
+        rc = SQLITE_MISUSE;
+        errmsg = cloudsync_memory_mprintf("The attached database %s is not initialized by cloudsync.", schema);
+        goto cleanup;
     }
     
-    sqlite3 *db = sqlite3_context_db_handle(context);
+    // a copy of the same database file would share the site_id, its changes would be indistinguishable
+    if (memcmp(peer_data->site_id, data->site_id, UUID_LEN) == 0) {
+        rc = SQLITE_MISUSE;
+        errmsg = cloudsync_memory_mprintf("The attached database %s has the same site_id of the main database.", schema);
+        goto cleanup;
+    }
     
-    // precompile the insert statement
-    sqlite3_stmt *vm = NULL;
-    const char *sql = "INSERT INTO cloudsync_changes(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) VALUES (?,?,?,?,?,?,?,?,?);";
-    int rc = sqlite3_prepare(db, sql, -1, &vm, NULL);
+    // the db_versions of the rows received by the main database are excluded when sending its changes back
+    sqlite3_int64 received = 0, sent = 0;
+    sqlite3_int64 received_range[2] = {-1, -1}, sent_range[2] = {-1, -1};
+    const sqlite3_int64 no_range[2] = {-1, -1};
+    rc = attached_pull(db, data, peer, peer_data->site_id, no_range, received_range, &received, &errmsg);
+    if (rc == SQLITE_OK) rc = attached_pull(peer, peer_data, db, data->site_id, received_range, sent_range, &sent, &errmsg);
+    
+    // returns the number of rows applied in both directions
+    if (rc == SQLITE_OK) sqlite3_result_int64(context, received + sent);
+    
+cleanup:
     if (rc != SQLITE_OK) {
-        dbutils_context_result_error(context, "Error on cloudsync_payload_apply: error while compiling SQL statement (%s).", sqlite3_errmsg(db));
-        if (clone) cloudsync_memory_free(clone);
-        return -1;
+        sqlite3_result_error(context, (errmsg) ? errmsg : sqlite3_errstr(rc), -1);
+        sqlite3_result_error_code(context, rc);
     }
+    if (errmsg) cloudsync_memory_free(errmsg);
     
-    // process buffer, one row at a time
-    uint16_t ncols = header.ncols;
-    uint32_t nrows = header.nrows;
-    int64_t last_payload_db_version = -1;
-    bool in_savepoint = false;
-    int dbversion = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_CHECK_DBVERSION);
-    int seq = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_CHECK_SEQ);
-    cloudsync_pk_decode_bind_context decoded_context = {.vm = vm};
-    void *payload_apply_xdata = NULL;
-    cloudsync_payload_apply_callback_t payload_apply_callback = cloudsync_get_payload_apply_callback(db);
+    // the statements of the peer context must be finalized before closing its connection
+    if (peer_data) attached_exec(peer, "SELECT cloudsync_terminate();");
+    if (peer) sqlite3_close(peer);
+}
+
+// MARK: - Snapshot -
+
+// A snapshot is a self-contained SQLite database with a copy of the synced tables and of their meta-tables at a
+// given db_version, so that a new device can install the whole dataset with one INSERT ... SELECT per table instead
+// of merging the change history one column at a time. It is built and read through the CLOUDSYNC_SNAPSHOT_SCHEMA
+// attached database (a file, or an in-memory database serialized to a BLOB).
+// Site_id ordinals are rebased so that the ordinal 0 of the producer becomes a regular ordinal: once installed,
+// the snapshot doesn't use the ordinal 0 that each device reserves to its own site_id.
+
+int snapshot_exec (sqlite3 *db, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    char *sql = cloudsync_memory_vmprintf(format, args);
+    va_end(args);
+    if (!sql) return SQLITE_NOMEM;
     
-    for (uint32_t i=0; i<nrows; ++i) {
-        size_t seek = 0;
-        pk_decode((char *)buffer, blen, ncols, &seek, cloudsync_pk_decode_bind_callback, &decoded_context);
-        // n is the pk_decode return value, I don't think I should assert here because in any case the next sqlite3_step would fail
-        // assert(n == ncols);
-                
-        bool approved = true;
-        if (payload_apply_callback) approved = payload_apply_callback(&payload_apply_xdata, &decoded_context, db, data, CLOUDSYNC_PAYLOAD_APPLY_WILL_APPLY, SQLITE_OK);
-        
-        // Apply consecutive rows with the same db_version inside a transaction if no
-        // transaction has already been opened.
-        // The user may have already opened a transaction before applying the payload,
-        // and the `payload_apply_callback` may have already opened a savepoint.
-        // Nested savepoints work, but overlapping savepoints could alter the expected behavior.
-        // This savepoint ensures that the db_version value remains consistent for all
-        // rows with the same original db_version in the payload.
+    int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    DEBUG_SQL("snapshot: %s", sql);
+    cloudsync_memory_free(sql);
+    return rc;
+}
 
-        bool db_version_changed = (last_payload_db_version != decoded_context.db_version);
+bool snapshot_table_rowid_only (cloudsync_table_context *table) {
+    #if !CLOUDSYNC_DISABLE_ROWIDONLY_TABLES
+    return table->rowid_only;
+    #else
+    return false;
+    #endif
+}
 
-        // Release existing savepoint if db_version changed
-        if (in_savepoint && db_version_changed) {
-            rc = sqlite3_exec(db, "RELEASE cloudsync_payload_apply;", NULL, NULL, NULL);
-            if (rc != SQLITE_OK) {
-                dbutils_context_result_error(context, "Error on cloudsync_payload_apply: unable to release a savepoint (%s).", sqlite3_errmsg(db));
-                if (clone) cloudsync_memory_free(clone);
-                return -1;
-            }
-            in_savepoint = false;
-        }
+int snapshot_attach (sqlite3 *db, const char *path) {
+    // ATTACH is not allowed inside a transaction, so snapshots are built and installed from autocommit mode
+    if (sqlite3_get_autocommit(db) == 0) return SQLITE_MISUSE;
+    return snapshot_exec(db, "ATTACH DATABASE %Q AS " CLOUDSYNC_SNAPSHOT_SCHEMA ";", path);
+}
 
-        // Start new savepoint if needed
-        bool in_transaction = sqlite3_get_autocommit(db) != true;
-        if (!in_transaction && db_version_changed) {
-            rc = sqlite3_exec(db, "SAVEPOINT cloudsync_payload_apply;", NULL, NULL, NULL);
-            if (rc != SQLITE_OK) {
-                dbutils_context_result_error(context, "Error on cloudsync_payload_apply: unable to start a transaction (%s).", sqlite3_errmsg(db));
-                if (clone) cloudsync_memory_free(clone);
-                return -1;
-            }
-            last_payload_db_version = decoded_context.db_version;
-            in_savepoint = true;
+void snapshot_detach (sqlite3 *db) {
+    sqlite3_exec(db, "DETACH DATABASE " CLOUDSYNC_SNAPSHOT_SCHEMA ";", NULL, NULL, NULL);
+}
+
+int snapshot_build_packed (sqlite3 *db, cloudsync_table_context *table, sqlite3_int64 local_ord) {
+    // site_id ordinals are stored inside the clock vectors, so packed meta-tables are rebased one row at a time
+    sqlite3_stmt *select_vm = NULL;
+    sqlite3_stmt *insert_vm = NULL;
+    
+    char *sql = cloudsync_memory_mprintf("SELECT pk, db_version, clocks FROM main.\"%w_cloudsync\";", table->name);
+    if (!sql) return SQLITE_NOMEM;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &select_vm, NULL);
+    cloudsync_memory_free(sql);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    sql = cloudsync_memory_mprintf("INSERT INTO " CLOUDSYNC_SNAPSHOT_SCHEMA ".\"%w_cloudsync\" (pk, db_version, clocks) VALUES (?, ?, ?);", table->name);
+    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+    rc = sqlite3_prepare_v2(db, sql, -1, &insert_vm, NULL);
+    cloudsync_memory_free(sql);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    while ((rc = sqlite3_step(select_vm)) == SQLITE_ROW) {
+        clock_vector v;
+        if (clock_vector_decode(&v, (const char *)sqlite3_column_blob(select_vm, 2), (size_t)sqlite3_column_bytes(select_vm, 2)) != 0) {
+            clock_vector_free(&v);
+            rc = SQLITE_CORRUPT;
+            goto cleanup;
         }
-        
-        if (approved) {
-            rc = sqlite3_step(vm);
-            if (rc != SQLITE_DONE) {
-                // don't "break;", the error can be due to a RLS policy.
-                // in case of error we try to apply the following changes
-                printf("cloudsync_payload_apply error on db_version %lld/%lld: (%d) %s\n", decoded_context.db_version, decoded_context.seq, rc, sqlite3_errmsg(db));
-            }
+        for (int i=0; i<v.count; ++i) {
+            if (v.entries[i].site_id == 0) v.entries[i].site_id = local_ord;
         }
         
-        if (payload_apply_callback) payload_apply_callback(&payload_apply_xdata, &decoded_context, db, data, CLOUDSYNC_PAYLOAD_APPLY_DID_APPLY, rc);
+        size_t blen = 0;
+        char *buffer = clock_vector_encode(&v, &blen);
+        clock_vector_free(&v);
+        if (!buffer) {rc = SQLITE_NOMEM; goto cleanup;}
         
-        buffer += seek;
-        blen -= seek;
-        stmt_reset(vm);
+        sqlite3_bind_value(insert_vm, 1, sqlite3_column_value(select_vm, 0));
+        sqlite3_bind_value(insert_vm, 2, sqlite3_column_value(select_vm, 1));
+        sqlite3_bind_blob(insert_vm, 3, buffer, (int)blen, SQLITE_STATIC);
+        rc = sqlite3_step(insert_vm);
+        sqlite3_reset(insert_vm);
+        cloudsync_memory_free(buffer);
+        if (rc != SQLITE_DONE) goto cleanup;
     }
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
     
-    if (in_savepoint) {
-        sql = "RELEASE cloudsync_payload_apply;";
-        int rc1 = sqlite3_exec(db, sql, NULL, NULL, NULL);
-        if (rc1 != SQLITE_OK) rc = rc1;
+cleanup:
+    if (select_vm) sqlite3_finalize(select_vm);
+    if (insert_vm) sqlite3_finalize(insert_vm);
+    return rc;
+}
+
+int snapshot_build_table (sqlite3 *db, cloudsync_table_context *table, sqlite3_int64 local_ord) {
+    bool rowid_only = snapshot_table_rowid_only(table);
+    int rc = snapshot_exec(db, "INSERT INTO " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_snapshot_tables (tbl_name, algo, packed, intpk, rowid_only) VALUES ('%q', '%q', %d, %d, %d);", table->name, crdt_algo_name(table->algo), table->packed, table->intpk, rowid_only);
+    if (rc != SQLITE_OK) return rc;
+    
+    // the primary key of a table without primary keys is its rowid, so it must be preserved too
+    rc = snapshot_exec(db, "CREATE TABLE " CLOUDSYNC_SNAPSHOT_SCHEMA ".\"%w\" AS SELECT %s* FROM main.\"%w\";", table->name, (rowid_only) ? "rowid AS cloudsync_rowid, " : "", table->name);
+    if (rc != SQLITE_OK) return rc;
+    
+    if (table->packed) {
+        rc = snapshot_exec(db, "CREATE TABLE " CLOUDSYNC_SNAPSHOT_SCHEMA ".\"%w_cloudsync\" AS SELECT pk, db_version, clocks FROM main.\"%w_cloudsync\" WHERE 0;", table->name, table->name);
+        if (rc != SQLITE_OK) return rc;
+        return snapshot_build_packed(db, table, local_ord);
     }
+    
+    return snapshot_exec(db, "CREATE TABLE " CLOUDSYNC_SNAPSHOT_SCHEMA ".\"%w_cloudsync\" AS SELECT pk, col_id, col_version, db_version, CASE site_id WHEN 0 THEN %lld ELSE site_id END AS site_id, seq FROM main.\"%w_cloudsync\";", table->name, local_ord, table->name);
+}
 
-    char *lasterr = (rc != SQLITE_OK && rc != SQLITE_DONE) ? cloudsync_string_dup(sqlite3_errmsg(db), false) : NULL;
+int snapshot_build (sqlite3 *db, cloudsync_context *data, sqlite3_int64 *db_version) {
+    // everything is read in the same transaction, so the snapshot is consistent even if other connections write
+    int rc = sqlite3_exec(db, "SAVEPOINT cloudsync_snapshot;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) return rc;
     
-    if (payload_apply_callback) {
-        payload_apply_callback(&payload_apply_xdata, &decoded_context, db, data, CLOUDSYNC_PAYLOAD_APPLY_CLEANUP, rc);
+    rc = db_version_check_uptodate(db, data);
+    if (rc != SQLITE_OK) goto abort_build;
+    *db_version = data->db_version;
+    
+    char sql[256];
+    snprintf(sql, sizeof(sql), "SELECT IFNULL(MAX(seq), 0) FROM cloudsync_changes WHERE db_version = %lld;", data->db_version);
+    sqlite3_int64 seq = dbutils_int_select(db, sql);
+    sqlite3_int64 local_ord = dbutils_int_select(db, "SELECT IFNULL(MAX(rowid), 0) + 1 FROM main.cloudsync_site_id;");
+    if (seq < 0 || local_ord < 0) {rc = SQLITE_ERROR; goto abort_build;}
+    
+    rc = snapshot_exec(db, "CREATE TABLE " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_snapshot_info (key TEXT PRIMARY KEY NOT NULL, value);"
+                           "INSERT INTO " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_snapshot_info (key, value) VALUES ('version', %d), ('libversion', '%q'), ('site_id', (SELECT site_id FROM main.cloudsync_site_id WHERE rowid = 0)), ('db_version', %lld), ('seq', %lld);"
+                           "CREATE TABLE " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_snapshot_tables (tbl_name TEXT PRIMARY KEY NOT NULL, algo TEXT, packed INTEGER, intpk INTEGER, rowid_only INTEGER);"
+                           "CREATE TABLE " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_site_id (site_id BLOB UNIQUE NOT NULL);"
+                           "INSERT INTO " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_site_id (rowid, site_id) SELECT CASE rowid WHEN 0 THEN %lld ELSE rowid END, site_id FROM main.cloudsync_site_id;"
+                           "CREATE TABLE " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_site_versions AS SELECT CASE site_ord WHEN 0 THEN %lld ELSE site_ord END AS site_ord, sender, db_version, seq FROM main.cloudsync_site_versions;"
+                           "CREATE TABLE " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_columns AS SELECT tbl_name, col_id, col_name FROM main.cloudsync_columns;",
+                       CLOUDSYNC_SNAPSHOT_VERSION, CLOUDSYNC_VERSION, *db_version, seq, local_ord, local_ord);
+    if (rc != SQLITE_OK) goto abort_build;
+    
+    for (int i=0; i<data->tables_count; ++i) {
+        cloudsync_table_context *table = data->tables[i];
+        if (!table) continue;
+        rc = snapshot_build_table(db, table, local_ord);
+        if (rc != SQLITE_OK) goto abort_build;
     }
+    
+    return sqlite3_exec(db, "RELEASE cloudsync_snapshot;", NULL, NULL, NULL);
+    
+abort_build:
+    sqlite3_exec(db, "ROLLBACK TO cloudsync_snapshot; RELEASE cloudsync_snapshot;", NULL, NULL, NULL);
+    return rc;
+}
 
-    if (rc == SQLITE_DONE) rc = SQLITE_OK;
-    if (rc == SQLITE_OK) {
-        char buf[256];
-        if (decoded_context.db_version >= dbversion) {
-            snprintf(buf, sizeof(buf), "%lld", decoded_context.db_version);
-            dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_CHECK_DBVERSION, buf);
-            
-            if (decoded_context.seq != seq) {
-                snprintf(buf, sizeof(buf), "%lld", decoded_context.seq);
-                dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_CHECK_SEQ, buf);
-            }
+int snapshot_check (sqlite3_context *context, sqlite3 *db, cloudsync_context *data) {
+    // a snapshot can only be installed in a database that doesn't contain synced data yet, with the same tables
+    // already initialized with the same options
+    if (dbutils_int_select(db, "SELECT value FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_snapshot_info WHERE key = 'version';") != CLOUDSYNC_SNAPSHOT_VERSION) {
+        dbutils_context_result_error(context, "Invalid or unsupported snapshot.");
+        return SQLITE_MISUSE;
+    }
+    
+    if (dbutils_int_select(db, "SELECT count(*) FROM main.cloudsync_site_id WHERE rowid != 0 OR site_id IN (SELECT site_id FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_site_id);") != 0) {
+        dbutils_context_result_error(context, "A snapshot can only be installed in a database without synced changes.");
+        return SQLITE_MISUSE;
+    }
+    
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, "SELECT tbl_name, algo, packed, intpk FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_snapshot_tables;", -1, &vm, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    while ((rc = sqlite3_step(vm)) == SQLITE_ROW) {
+        const char *name = (const char *)sqlite3_column_text(vm, 0);
+        cloudsync_table_context *table = table_lookup(data, name);
+        if (!table || strcasecmp(crdt_algo_name(table->algo), (const char *)sqlite3_column_text(vm, 1)) != 0 || table->packed != sqlite3_column_int(vm, 2) || table->intpk != sqlite3_column_int(vm, 3)) {
+            dbutils_context_result_error(context, "Table %s must be initialized with the same options of the snapshot.", name);
+            rc = SQLITE_MISUSE;
+            break;
+        }
+        
+        char *sql = cloudsync_memory_mprintf("SELECT EXISTS (SELECT 1 FROM main.\"%w\") OR EXISTS (SELECT 1 FROM main.\"%w_cloudsync\");", name, name);
+        sqlite3_int64 not_empty = (sql) ? dbutils_int_select(db, sql) : -1;
+        cloudsync_memory_free(sql);
+        if (not_empty != 0) {
+            dbutils_context_result_error(context, "Table %s must be empty to install the snapshot.", name);
+            rc = SQLITE_MISUSE;
+            break;
         }
     }
+    
+    sqlite3_finalize(vm);
+    return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+}
 
-    // cleanup vm
-    if (vm) sqlite3_finalize(vm);
+int snapshot_install_table (sqlite3 *db, cloudsync_context *data, const char *name, bool rowid_only, sqlite3_int64 *nrows) {
+    // meta-tables of the snapshot refer to its column dictionary, and the local one is still unused
+    int rc = snapshot_exec(db, "DELETE FROM main.cloudsync_columns WHERE tbl_name = '%q';"
+                               "INSERT INTO main.cloudsync_columns (tbl_name, col_id, col_name) SELECT tbl_name, col_id, col_name FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_columns WHERE tbl_name = '%q';", name, name);
+    if (rc != SQLITE_OK) return rc;
     
-    // cleanup memory
-    if (clone) cloudsync_memory_free(clone);
+    // columns are copied by name, so the local table can have a different column order
+    char *sql = cloudsync_memory_mprintf("SELECT group_concat(format('\"%%w\"', name), ',') FROM pragma_table_info('%q', 'main') WHERE name IN (SELECT name FROM pragma_table_info('%q', '" CLOUDSYNC_SNAPSHOT_SCHEMA "'));", name, name);
+    if (!sql) return SQLITE_NOMEM;
+    char *columns = dbutils_text_select(db, sql);
+    cloudsync_memory_free(sql);
+    if (!columns) return SQLITE_ERROR;
     
-    if (rc != SQLITE_OK) {
-        sqlite3_result_error(context, lasterr, -1);
-        sqlite3_result_error_code(context, SQLITE_MISUSE);
-        cloudsync_memory_free(lasterr);
-        return -1;
+    // rows are copied without firing the triggers, their clocks are copied from the snapshot meta-table
+    SYNCBIT_SET(data);
+    rc = snapshot_exec(db, "INSERT INTO main.\"%w\" (%s%s) SELECT %s%s FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".\"%w\";", name, (rowid_only) ? "rowid, " : "", columns, (rowid_only) ? "cloudsync_rowid, " : "", columns, name);
+    SYNCBIT_RESET(data);
+    cloudsync_memory_free(columns);
+    if (rc != SQLITE_OK) return rc;
+    *nrows += sqlite3_changes64(db);
+    
+    cloudsync_table_context *table = table_lookup(data, name);
+    if (table->packed) return snapshot_exec(db, "INSERT INTO main.\"%w_cloudsync\" (pk, db_version, clocks) SELECT pk, db_version, clocks FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".\"%w_cloudsync\";", name, name);
+    return snapshot_exec(db, "INSERT INTO main.\"%w_cloudsync\" (pk, col_id, col_version, db_version, site_id, seq) SELECT pk, col_id, col_version, db_version, site_id, seq FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".\"%w_cloudsync\";", name, name);
+}
+
+int snapshot_reload_tables (sqlite3 *db, cloudsync_context *data) {
+    // the table contexts cache the col_ids of the column dictionary, replaced by the snapshot
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, "SELECT tbl_name FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_snapshot_tables;", -1, &vm, NULL);
+    if (rc != SQLITE_OK) return rc;
+    cloudsync_schema_detach(db, data);
+    
+    while ((rc = sqlite3_step(vm)) == SQLITE_ROW) {
+        cloudsync_table_context *table = table_lookup(data, (const char *)sqlite3_column_text(vm, 0));
+        if (!table) continue;
+        
+        char *name = cloudsync_string_dup(table->name, false);
+        table_algo algo = table->algo;
+        bool enabled = table->enabled;
+        table_remove(data, name);
+        table_free(table);
+        
+        bool added = (name) ? table_add_to_context(db, data, algo, name) : false;
+        table = (name) ? table_lookup(data, name) : NULL;
+        if (table) table->enabled = enabled;
+        cloudsync_memory_free(name);
+        if (!added) {rc = SQLITE_ERROR; break;}
     }
     
-    // return the number of processed rows
-    sqlite3_result_int(context, nrows);
-    return nrows;
+    sqlite3_finalize(vm);
+    return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
 }
 
-void cloudsync_payload_decode (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    DEBUG_FUNCTION("cloudsync_payload_decode");
-    //debug_values(argc, argv);
+sqlite3_int64 snapshot_install (sqlite3_context *context, sqlite3 *db, cloudsync_context *data) {
+    sqlite3_stmt *vm = NULL;
+    sqlite3_int64 nrows = 0;
     
-    // sanity check payload type
-    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
-        dbutils_context_result_error(context, "Error on cloudsync_payload_decode: value must be a BLOB.");
-        sqlite3_result_error_code(context, SQLITE_MISUSE);
-        return;
+    int rc = snapshot_check(context, db, data);
+    if (rc != SQLITE_OK) return -1;
+    
+    rc = sqlite3_exec(db, "SAVEPOINT cloudsync_snapshot;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto abort_install;
+    
+    rc = sqlite3_prepare_v2(db, "SELECT tbl_name, rowid_only FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_snapshot_tables;", -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto rollback_install;
+    while ((rc = sqlite3_step(vm)) == SQLITE_ROW) {
+        rc = snapshot_install_table(db, data, (const char *)sqlite3_column_text(vm, 0), (sqlite3_column_int(vm, 1) != 0), &nrows);
+        if (rc != SQLITE_OK) goto rollback_install;
     }
+    if (rc != SQLITE_DONE) goto rollback_install;
     
-    // sanity check payload size
-    int blen = sqlite3_value_bytes(argv[0]);
-    if (blen < (int)sizeof(cloudsync_payload_header)) {
-        dbutils_context_result_error(context, "Error on cloudsync_payload_decode: invalid input size.");
-        sqlite3_result_error_code(context, SQLITE_MISUSE);
-        return;
+    // the producer site_id included, the ordinals of the snapshot are all free because the local database has no synced changes
+    rc = snapshot_exec(db, "INSERT INTO main.cloudsync_site_id (rowid, site_id) SELECT rowid, site_id FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_site_id;"
+                           "INSERT OR REPLACE INTO main.cloudsync_site_versions (site_ord, sender, db_version, seq) SELECT site_ord, sender, db_version, seq FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_site_versions;");
+    if (rc != SQLITE_OK) goto rollback_install;
+    
+    // incremental sync continues from the db_version of the snapshot
+    sqlite3_int64 db_version = dbutils_int_select(db, "SELECT value FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_snapshot_info WHERE key = 'db_version';");
+    sqlite3_int64 seq = dbutils_int_select(db, "SELECT value FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".cloudsync_snapshot_info WHERE key = 'seq';");
+    if (db_version > dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_CHECK_DBVERSION)) {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%lld", db_version);
+        dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_CHECK_DBVERSION, buf);
+        snprintf(buf, sizeof(buf), "%lld", seq);
+        dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_CHECK_SEQ, buf);
     }
     
-    // obtain payload
-    const char *payload = (const char *)sqlite3_value_blob(argv[0]);
+    // the next local change must get a db_version greater than the ones installed
+    if (data->pending_db_version < db_version) data->pending_db_version = db_version;
     
-    // apply changes
-    cloudsync_payload_apply(context, payload, blen);
+    rc = sqlite3_exec(db, "RELEASE cloudsync_snapshot;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto rollback_install;
+    sqlite3_finalize(vm);
+    vm = NULL;
+    
+    rc = snapshot_reload_tables(db, data);
+    if (rc != SQLITE_OK) goto abort_install;
+    return nrows;
+    
+rollback_install:
+    sqlite3_exec(db, "ROLLBACK TO cloudsync_snapshot; RELEASE cloudsync_snapshot;", NULL, NULL, NULL);
+    
+abort_install:
+    if (vm) sqlite3_finalize(vm);
+    dbutils_context_result_error(context, "Unable to install the snapshot (%s).", sqlite3_errmsg(db));
+    return -1;
 }
 
-// MARK: - Payload load/store -
-
-int cloudsync_payload_get (sqlite3_context *context, char **blob, int *blob_size, int *db_version, int *seq, sqlite3_int64 *new_db_version, sqlite3_int64 *new_seq) {
+void cloudsync_snapshot_result (sqlite3_context *context, const char *path, const void *blob, int blen, bool install) {
+    // path is the snapshot file, or NULL for an in-memory snapshot (returned as a BLOB or read from blob)
     sqlite3 *db = sqlite3_context_db_handle(context);
-
-    *db_version = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_SEND_DBVERSION);
-    if (*db_version < 0) {sqlite3_result_error(context, "Unable to retrieve db_version.", -1); return SQLITE_ERROR;}
-
-    *seq = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_SEND_SEQ);
-    if (*seq < 0) {sqlite3_result_error(context, "Unable to retrieve seq.", -1); return SQLITE_ERROR;}
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
     
-    // retrieve BLOB
-    char sql[1024];
-    snprintf(sql, sizeof(sql), "WITH max_db_version AS (SELECT MAX(db_version) AS max_db_version FROM cloudsync_changes) "
-                               "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq), max_db_version AS max_db_version, MAX(IIF(db_version = max_db_version, seq, NULL)) FROM cloudsync_changes, max_db_version WHERE site_id=cloudsync_siteid() AND (db_version>%d OR (db_version=%d AND seq>%d))", *db_version, *db_version, *seq);
+    if (cloudsync_context_init(db, data, context) == NULL) {
+        dbutils_context_result_error(context, "Unable to init the cloudsync context.");
+        sqlite3_result_error_code(context, SQLITE_MISUSE);
+        return;
+    }
     
-    int rc = dbutils_blob_int_int_select(db, sql, blob, blob_size, new_db_version, new_seq);
+    int rc = snapshot_attach(db, (path) ? path : ":memory:");
     if (rc != SQLITE_OK) {
-        sqlite3_result_error(context, "cloudsync_network_send_changes unable to get changes", -1);
+        if (rc == SQLITE_MISUSE) dbutils_context_result_error(context, "Snapshots cannot be used inside a transaction.");
+        else dbutils_context_result_error(context, "Unable to attach the snapshot database (%s).", sqlite3_errmsg(db));
         sqlite3_result_error_code(context, rc);
-        return rc;
-    }
-    
-    // exit if there is no data to send
-    if (blob == NULL || blob_size == 0) return SQLITE_OK;
-    return rc;
-}
-
-#ifdef CLOUDSYNC_DESKTOP_OS
-
-void cloudsync_payload_save (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    DEBUG_FUNCTION("cloudsync_payload_save");
-    
-    // sanity check argument
-    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
-        sqlite3_result_error(context, "Unable to retrieve file path.", -1);
         return;
     }
     
-    // retrieve full path to file
-    const char *path = (const char *)sqlite3_value_text(argv[0]);
-    cloudsync_file_delete(path);
+    if (install) {
+        if (!path) {
+            // the buffer is owned by the caller, so the attached database is read-only
+            rc = sqlite3_deserialize(db, CLOUDSYNC_SNAPSHOT_SCHEMA, (unsigned char *)blob, blen, blen, SQLITE_DESERIALIZE_READONLY);
+            if (rc != SQLITE_OK) {
+                dbutils_context_result_error(context, "Unable to read the snapshot (%s).", sqlite3_errmsg(db));
+                goto cleanup;
+            }
+        }
+        sqlite3_int64 nrows = snapshot_install(context, db, data);
+        if (nrows >= 0) sqlite3_result_int64(context, nrows);
+        goto cleanup;
+    }
     
-    // retrieve payload
-    char *blob = NULL;
-    int blob_size = 0, db_version = 0, seq = 0;
-    sqlite3_int64 new_db_version = 0, new_seq = 0;
-    int rc = cloudsync_payload_get(context, &blob, &blob_size, &db_version, &seq, &new_db_version, &new_seq);
-    if (rc != SQLITE_OK) return;
+    if (dbutils_int_select(db, "SELECT count(*) FROM " CLOUDSYNC_SNAPSHOT_SCHEMA ".sqlite_master;") != 0) {
+        dbutils_context_result_error(context, "The snapshot file already exists.");
+        goto cleanup;
+    }
     
-    // exit if there is no data to send
-    if (blob == NULL || blob_size == 0) return;
+    // rows not yet backfilled have no clocks, so they would never be sent by the devices bootstrapped from the snapshot
+    if (dbutils_int_select(db, "SELECT count(*) FROM main." CLOUDSYNC_TABLE_SETTINGS_NAME " WHERE key='" CLOUDSYNC_KEY_BACKFILL_CURSOR "';") != 0) {
+        dbutils_context_result_error(context, "The backfill of some tables is not completed (see cloudsync_backfill).");
+        goto cleanup;
+    }
     
-    // write payload to file
-    bool res = cloudsync_file_write(path, blob, (size_t)blob_size);
-    sqlite3_free(blob);
+    // the snapshot file is not usable until it is complete, so it doesn't need a rollback journal
+    sqlite3_exec(db, "PRAGMA " CLOUDSYNC_SNAPSHOT_SCHEMA ".journal_mode = OFF;", NULL, NULL, NULL);
     
-    if (res == false) {
-        sqlite3_result_error(context, "Unable to write payload to file path.", -1);
-        return;
+    sqlite3_int64 db_version = 0;
+    rc = snapshot_build(db, data, &db_version);
+    if (rc != SQLITE_OK) {
+        dbutils_context_result_error(context, "Unable to build the snapshot (%s).", sqlite3_errmsg(db));
+        goto cleanup;
     }
     
-    // update db_version and seq
-    char buf[256];
-    sqlite3 *db = sqlite3_context_db_handle(context);
-    if (new_db_version != db_version) {
-        snprintf(buf, sizeof(buf), "%lld", new_db_version);
-        dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_SEND_DBVERSION, buf);
+    if (path) {
+        sqlite3_result_int64(context, db_version);
+    } else {
+        sqlite3_int64 size = 0;
+        unsigned char *buffer = sqlite3_serialize(db, CLOUDSYNC_SNAPSHOT_SCHEMA, &size, 0);
+        if (buffer) sqlite3_result_blob64(context, buffer, (sqlite3_uint64)size, sqlite3_free);
+        else sqlite3_result_error_nomem(context);
     }
-    if (new_seq != seq) {
-        snprintf(buf, sizeof(buf), "%lld", new_seq);
-        dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_SEND_SEQ, buf);
+    
+cleanup:
+    snapshot_detach(db);
+}
+
+void cloudsync_snapshot_encode (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_snapshot_encode");
+    cloudsync_snapshot_result(context, NULL, NULL, 0, false);
+}
+
+void cloudsync_snapshot_decode (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_snapshot_decode");
+    
+    // sanity check snapshot type
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_error(context, "Error on cloudsync_snapshot_decode: value must be a BLOB.", -1);
+        sqlite3_result_error_code(context, SQLITE_MISUSE);
+        return;
     }
     
-    // returns blob size
-    sqlite3_result_int64(context, (sqlite3_int64)blob_size);
+    cloudsync_snapshot_result(context, NULL, sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]), true);
 }
 
-void cloudsync_payload_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    DEBUG_FUNCTION("cloudsync_payload_load");
+void cloudsync_snapshot_save (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_snapshot_save");
     
     // sanity check argument
     if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
@@ -2388,26 +4844,21 @@ void cloudsync_payload_load (sqlite3_context *context, int argc, sqlite3_value *
         return;
     }
     
-    // retrieve full path to file
-    const char *path = (const char *)sqlite3_value_text(argv[0]);
+    cloudsync_snapshot_result(context, (const char *)sqlite3_value_text(argv[0]), NULL, 0, false);
+}
+
+void cloudsync_snapshot_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_snapshot_load");
     
-    sqlite3_int64 payload_size = 0;
-    char *payload = cloudsync_file_read(path, &payload_size);
-    if (!payload) {
-        if (payload_size == -1) sqlite3_result_error(context, "Unable to read payload from file path.", -1);
-        if (payload) cloudsync_memory_free(payload);
+    // sanity check argument
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
+        sqlite3_result_error(context, "Unable to retrieve file path.", -1);
         return;
     }
     
-    int nrows = (payload_size) ? cloudsync_payload_apply (context, payload, (int)payload_size) : 0;
-    if (payload) cloudsync_memory_free(payload);
-    
-    // returns number of applied rows
-    if (nrows != -1) sqlite3_result_int(context, nrows);
+    cloudsync_snapshot_result(context, (const char *)sqlite3_value_text(argv[0]), NULL, 0, true);
 }
 
-#endif
-
 // MARK: - Public -
 
 void cloudsync_version (sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -2489,7 +4940,9 @@ void cloudsync_set (sqlite3_context *context, int argc, sqlite3_value **argv) {
     // silently fails
     if (key == NULL) return;
     
+    // settings can be configured before the first cloudsync_init (backfill_batch must be)
     sqlite3 *db = sqlite3_context_db_handle(context);
+    if (cloudsync_context_init(db, NULL, context) == NULL) return;
     dbutils_settings_set_key_value(db, context, key, value);
 }
 
@@ -2506,32 +4959,140 @@ void cloudsync_set_column (sqlite3_context *context, int argc, sqlite3_value **a
 void cloudsync_set_table (sqlite3_context *context, int argc, sqlite3_value **argv) {
     DEBUG_FUNCTION("cloudsync_set_table");
     
-    const char *tbl = (const char *)sqlite3_value_text(argv[0]);
-    const char *key = (const char *)sqlite3_value_text(argv[1]);
-    const char *value = (const char *)sqlite3_value_text(argv[2]);
-    dbutils_table_settings_set_key_value(NULL, context, tbl, "*", key, value);
+    const char *tbl = (const char *)sqlite3_value_text(argv[0]);
+    const char *key = (const char *)sqlite3_value_text(argv[1]);
+    const char *value = (const char *)sqlite3_value_text(argv[2]);
+    dbutils_table_settings_set_key_value(NULL, context, tbl, "*", key, value);
+}
+
+void cloudsync_is_sync (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_is_sync");
+    
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    if (data->insync) {
+        sqlite3_result_int(context, 1);
+        return;
+    }
+    
+    const char *table_name = (const char *)sqlite3_value_text(argv[0]);
+    cloudsync_table_context *table = table_lookup(data, table_name);
+    sqlite3_result_int(context, (table) ? (table->enabled == 0) : 0);
+}
+
+// MARK: - Row Cache -
+
+// The changes virtual table calls cloudsync_col_value once for each changed column, so when a row has many
+// changed columns the same base row would be decoded, bound and stepped once per column. While a cloudsync_changes
+// scan is active the values of the last row read through real_col_values_stmt are instead kept in a one-row cache
+// keyed by (table, pk). Meta-tables are scanned in (pk, col_id) or (db_version, pk, col_id) order, so the columns
+// of a row are usually requested one after the other.
+
+void row_cache_clear (cloudsync_row_cache *cache) {
+    if (cache->values) {
+        for (int i=0; i<cache->nvalues; ++i) {
+            if (cache->values[i]) sqlite3_value_free(cache->values[i]);
+        }
+        cloudsync_memory_free(cache->values);
+    }
+    if (cache->pk) sqlite3_value_free(cache->pk);
+    memset(cache, 0, sizeof(cloudsync_row_cache));
+}
+
+bool row_cache_match (cloudsync_row_cache *cache, sqlite3 *db, cloudsync_table_context *table, sqlite3_value *pk) {
+    if (cache->table != table || cache->nvalues != table->ncols || !cache->pk) return false;
+    
+    // any change performed by this connection after the row was loaded could have modified it
+    if (cache->total_changes != sqlite3_total_changes64(db)) return false;
+    
+    return (dbutils_value_compare(cache->pk, pk) == 0);
+}
+
+int row_cache_load (cloudsync_row_cache *cache, sqlite3 *db, cloudsync_table_context *table, sqlite3_value *pk) {
+    row_cache_clear(cache);
+    
+    sqlite3_stmt *vm = table_stmt(table, TABLE_STMT_REAL_COL_VALUES);
+    if (!vm) return SQLITE_ERROR;
+    int rc = SQLITE_OK;
+    
+    // bind primary key values
+    if (sqlite3_value_type(pk) == SQLITE_INTEGER) {
+        rc = sqlite3_bind_int64(vm, 1, sqlite3_value_int64(pk));
+        if (rc != SQLITE_OK) goto cleanup;
+    } else {
+        rc = pk_decode_prikey((char *)sqlite3_value_blob(pk), (size_t)sqlite3_value_bytes(pk), pk_decode_bind_callback, (void *)vm);
+        if (rc < 0) {rc = SQLITE_ERROR; goto cleanup;}
+        rc = SQLITE_OK;
+    }
+    
+    cache->values = (sqlite3_value **)cloudsync_memory_zeroalloc((uint64_t)(table->ncols * sizeof(sqlite3_value *)));
+    if (!cache->values) {rc = SQLITE_NOMEM; goto cleanup;}
+    cache->nvalues = table->ncols;
+    
+    rc = sqlite3_step(vm);
+    if (rc == SQLITE_ROW) {
+        for (int i=0; i<table->ncols; ++i) {
+            sqlite3_value *value = sqlite3_column_value(vm, i);
+            cache->values[i] = sqlite3_value_dup(value);
+            if (!cache->values[i] && sqlite3_value_type(value) != SQLITE_NULL) {rc = SQLITE_NOMEM; goto cleanup;}
+        }
+        cache->exists = true;
+        rc = SQLITE_OK;
+    } else if (rc == SQLITE_DONE) {
+        cache->exists = false;
+        rc = SQLITE_OK;
+    } else {
+        goto cleanup;
+    }
+    
+    cache->pk = sqlite3_value_dup(pk);
+    if (!cache->pk) {rc = SQLITE_NOMEM; goto cleanup;}
+    cache->table = table;
+    cache->total_changes = sqlite3_total_changes64(db);
+    
+cleanup:
+    if (rc != SQLITE_OK) row_cache_clear(cache);
+    sqlite3_reset(vm);
+    return rc;
 }
 
-void cloudsync_is_sync (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    DEBUG_FUNCTION("cloudsync_is_sync");
+bool row_cache_value (sqlite3_context *context, cloudsync_context *data, cloudsync_table_context *table, int index, sqlite3_value *pk) {
+    // returns false if the cache cannot be used, so that the value is retrieved with the col_value_stmt of the column
+    // (outside a changes scan nothing guarantees that the row did not change, and a single column is better served by its own statement)
+    if (data->changes_scans == 0 || table->ncols < 2 || index < 0) return false;
     
-    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
-    if (data->insync) {
-        sqlite3_result_int(context, 1);
-        return;
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    cloudsync_row_cache *cache = &data->row_cache;
+    if (!row_cache_match(cache, db, table, pk)) {
+        int rc = row_cache_load(cache, db, table, pk);
+        if (rc != SQLITE_OK) {
+            sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+            return true;
+        }
     }
     
-    const char *table_name = (const char *)sqlite3_value_text(argv[0]);
-    cloudsync_table_context *table = table_lookup(data, table_name);
-    sqlite3_result_int(context, (table) ? (table->enabled == 0) : 0);
+    if (cache->exists) sqlite3_result_value(context, cache->values[index]);
+    else sqlite3_result_text(context, CLOUDSYNC_RLS_RESTRICTED_VALUE, -1, SQLITE_STATIC);
+    return true;
+}
+
+void cloudsync_row_cache_open (cloudsync_context *data) {
+    data->changes_scans += 1;
+}
+
+void cloudsync_row_cache_close (cloudsync_context *data) {
+    // the cached row is never reused by a scan that starts after all the cursors have been closed
+    data->changes_scans -= 1;
+    if (data->changes_scans == 0) row_cache_clear(&data->row_cache);
 }
 
+// MARK: -
+
 void cloudsync_col_value (sqlite3_context *context, int argc, sqlite3_value **argv) {
     // DEBUG_FUNCTION("cloudsync_col_value");
     
     // argv[0] -> table name
-    // argv[1] -> column name
-    // argv[2] -> encoded pk
+    // argv[1] -> column name (or col_id as stored in the meta-table)
+    // argv[2] -> encoded pk (or the integer pk stored in an integer keyed meta-table)
     
     // lookup table
     const char *table_name = (const char *)sqlite3_value_text(argv[0]);
@@ -2542,25 +5103,49 @@ void cloudsync_col_value (sqlite3_context *context, int argc, sqlite3_value **ar
         return;
     }
     
-    // retrieve column name
-    const char *col_name = (const char *)sqlite3_value_text(argv[1]);
-    
-    // check for special tombstone value
-    if (strcmp(col_name, CLOUDSYNC_TOMBSTONE_VALUE) == 0) {
-        sqlite3_result_null(context);
-        return;
+    sqlite3_stmt *vm = NULL;
+    int index = -1;
+    if (sqlite3_value_type(argv[1]) == SQLITE_INTEGER) {
+        // check for special tombstone value
+        sqlite3_int64 col_id = sqlite3_value_int64(argv[1]);
+        if (col_id == CLOUDSYNC_TOMBSTONE_COLID) {
+            sqlite3_result_null(context);
+            return;
+        }
+        
+        // extract the right col_value vm associated to the column id
+        index = table_column_index(table, col_id);
+        if (index >= 0) vm = table_column_stmt(table, index, false);
+    } else {
+        // retrieve column name
+        const char *col_name = (const char *)sqlite3_value_text(argv[1]);
+        
+        // check for special tombstone value
+        if (strcmp(col_name, CLOUDSYNC_TOMBSTONE_VALUE) == 0) {
+            sqlite3_result_null(context);
+            return;
+        }
+        
+        // extract the right col_value vm associated to the column name
+        vm = table_column_lookup(table, col_name, false, &index);
     }
-    
-    // extract the right col_value vm associated to the column name
-    sqlite3_stmt *vm = table_column_lookup(table, col_name, false, NULL);
     if (!vm) {
         sqlite3_result_error(context, "Unable to retrieve column value precompiled statement in clousdsync_colvalue.", -1);
         return;
     }
     
+    // serve the value from the one-row cache when the other columns of the row are likely to be requested next
+    if (row_cache_value(context, data, table, index, argv[2])) return;
+    
     // bind primary key values
-    int rc = pk_decode_prikey((char *)sqlite3_value_blob(argv[2]), (size_t)sqlite3_value_bytes(argv[2]), pk_decode_bind_callback, (void *)vm);
-    if (rc < 0) goto cleanup;
+    int rc = SQLITE_OK;
+    if (sqlite3_value_type(argv[2]) == SQLITE_INTEGER) {
+        rc = sqlite3_bind_int64(vm, 1, sqlite3_value_int64(argv[2]));
+        if (rc != SQLITE_OK) goto cleanup;
+    } else {
+        rc = pk_decode_prikey((char *)sqlite3_value_blob(argv[2]), (size_t)sqlite3_value_bytes(argv[2]), pk_decode_bind_callback, (void *)vm);
+        if (rc < 0) goto cleanup;
+    }
     
     // execute vm
     rc = sqlite3_step(vm);
@@ -2636,6 +5221,17 @@ void cloudsync_pk_decode (sqlite3_context *context, int argc, sqlite3_value **ar
 
 // MARK: -
 
+char *arena_encode_prikey (cloudsync_context *data, sqlite3_value **argv, int argc, char *buffer, size_t *bsize) {
+    // primary keys that don't fit in the stack buffer of the caller are encoded in the arena
+    size_t blen = pk_encode_size(argv, argc, 1);
+    if (blen > *bsize) {
+        buffer = (char *)cloudsync_arena_alloc(&data->arena, blen);
+        if (!buffer) return NULL;
+        *bsize = blen;
+    }
+    return pk_encode_prikey(argv, argc, buffer, bsize);
+}
+
 void cloudsync_insert (sqlite3_context *context, int argc, sqlite3_value **argv) {
     DEBUG_FUNCTION("cloudsync_insert %s", sqlite3_value_text(argv[0]));
     // debug_values(argc-1, &argv[1]);
@@ -2666,8 +5262,10 @@ void cloudsync_insert (sqlite3_context *context, int argc, sqlite3_value **argv)
     // encode the primary key values into a buffer
     char buffer[1024];
     size_t pklen = sizeof(buffer);
-    char *pk = pk_encode_prikey(&argv[1], table->npks, buffer, &pklen);
+    cloudsync_arena_mark mark = cloudsync_arena_begin(&data->arena);
+    char *pk = arena_encode_prikey(data, &argv[1], table->npks, buffer, &pklen);
     if (!pk) {
+        cloudsync_arena_end(&data->arena, mark);
         sqlite3_result_error(context, "Not enough memory to encode the primary key(s).", -1);
         return;
     }
@@ -2677,9 +5275,15 @@ void cloudsync_insert (sqlite3_context *context, int argc, sqlite3_value **argv)
     
     // check if a row with the same primary key already exists
     // if so, this means the row might have been previously deleted (sentinel)
-    bool pk_exists = (bool)stmt_count(table->meta_pkexists_stmt, pk, pklen, SQLITE_BLOB);
+    bool pk_exists = false;
+    TABLE_STATS_ADD(table, CLOUDSYNC_STAT_META_STATEMENTS, 1);
+    sqlite3_stmt *vm = table_stmt(table, TABLE_STMT_META_PKEXISTS);
+    if (vm && table_bind_pk(table, vm, 1, pk, pklen) == SQLITE_OK) pk_exists = (bool)stmt_count(vm, NULL, 0, 0);
     int rc = SQLITE_OK;
     
+    // the sentinel and the insert clock of a packed row are written together
+    bool batch = (table->packed && packed_batch_begin(data));
+    
     if (table->ncols == 0) {
         // if there are no columns other than primary keys, insert a sentinel record
         rc = local_mark_insert_sentinel_meta(db, table, pk, pklen, db_version, BUMP_SEQ(data));
@@ -2690,17 +5294,33 @@ void cloudsync_insert (sqlite3_context *context, int argc, sqlite3_value **argv)
         if (rc != SQLITE_OK) goto cleanup;
     }
     
-    // process each non-primary key column for insert or update
-    for (int i=0; i<table->ncols; ++i) {
-        // mark the column as inserted or updated in the metadata
-        rc = local_mark_insert_or_update_meta(db, table, pk, pklen, table->col_name[i], db_version, BUMP_SEQ(data));
+    if (table->packed) {
+        // a packed table records a single insert clock inherited by all the columns
+        if (table->ncols > 0) rc = packed_mark_insert(data, table, pk, pklen, db_version);
+        if (rc != SQLITE_OK) goto cleanup;
+    } else {
+        // process each non-primary key column for insert or update
+        for (int i=0; i<table->ncols; ++i) {
+            // mark the column as inserted or updated in the metadata
+            rc = local_mark_insert_or_update_meta(db, table, pk, pklen, table->col_id[i], db_version, BUMP_SEQ(data));
+            if (rc != SQLITE_OK) goto cleanup;
+        }
+    }
+    
+    if (batch) {
+        batch = false;
+        rc = packed_batch_end(data, true);
         if (rc != SQLITE_OK) goto cleanup;
     }
     
+    rc = local_update_version(db, data, db_version);
+    if (rc == SQLITE_OK) TABLE_STATS_ADD(table, CLOUDSYNC_STAT_LOCAL_INSERTS, 1);
+    
 cleanup:
+    if (batch) packed_batch_end(data, false);
     if (rc != SQLITE_OK) sqlite3_result_error(context, sqlite3_errmsg(db), -1);
-    // free memory if the primary key was dynamically allocated
-    if (pk != buffer) cloudsync_memory_free(pk);
+    // release the primary key if it was allocated in the arena
+    cloudsync_arena_end(&data->arena, mark);
 }
 
 void cloudsync_delete (sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -2726,8 +5346,10 @@ void cloudsync_delete (sqlite3_context *context, int argc, sqlite3_value **argv)
     // encode the primary key values into a buffer
     char buffer[1024];
     size_t pklen = sizeof(buffer);
-    char *pk = pk_encode_prikey(&argv[1], table->npks, buffer, &pklen);
+    cloudsync_arena_mark mark = cloudsync_arena_begin(&data->arena);
+    char *pk = arena_encode_prikey(data, &argv[1], table->npks, buffer, &pklen);
     if (!pk) {
+        cloudsync_arena_end(&data->arena, mark);
         sqlite3_result_error(context, "Not enough memory to encode the primary key(s).", -1);
         return;
     }
@@ -2740,21 +5362,25 @@ void cloudsync_delete (sqlite3_context *context, int argc, sqlite3_value **argv)
     rc = local_drop_meta(db, table, pk, pklen);
     if (rc != SQLITE_OK) goto cleanup;
     
+    rc = local_update_version(db, data, db_version);
+    if (rc == SQLITE_OK) TABLE_STATS_ADD(table, CLOUDSYNC_STAT_LOCAL_DELETES, 1);
+    
 cleanup:
     if (rc != SQLITE_OK) sqlite3_result_error(context, sqlite3_errmsg(db), -1);
-    // free memory if the primary key was dynamically allocated
-    if (pk != buffer) cloudsync_memory_free(pk);
+    // release the primary key if it was allocated in the arena
+    cloudsync_arena_end(&data->arena, mark);
 }
 
 // MARK: -
 
-void cloudsync_update_payload_free (cloudsync_update_payload *payload) {
+void cloudsync_update_payload_free (cloudsync_arena *arena, cloudsync_update_payload *payload) {
     for (int i=0; i<payload->count; i++) {
         sqlite3_value_free(payload->new_values[i]);
         sqlite3_value_free(payload->old_values[i]);
     }
-    cloudsync_memory_free(payload->new_values);
-    cloudsync_memory_free(payload->old_values);
+    // the arrays (and the primary keys encoded by cloudsync_update_final) are released with the arena scope
+    if (payload->in_arena) cloudsync_arena_end(arena, payload->mark);
+    payload->in_arena = false;
     sqlite3_value_free(payload->table_name);
     payload->new_values = NULL;
     payload->old_values = NULL;
@@ -2763,15 +5389,21 @@ void cloudsync_update_payload_free (cloudsync_update_payload *payload) {
     payload->capacity = 0;
 }
 
-int cloudsync_update_payload_append (cloudsync_update_payload *payload, sqlite3_value *v1, sqlite3_value *v2, sqlite3_value *v3) {
+int cloudsync_update_payload_append (cloudsync_arena *arena, cloudsync_update_payload *payload, sqlite3_value *v1, sqlite3_value *v2, sqlite3_value *v3) {
+    if (!payload->in_arena) {
+        payload->mark = cloudsync_arena_begin(arena);
+        payload->in_arena = true;
+    }
+    
     if (payload->count >= payload->capacity) {
         int newcap = payload->capacity ? payload->capacity * 2 : 128;
+        size_t oldsize = (size_t)payload->capacity * sizeof(sqlite3_value *);
         
-        sqlite3_value **new_values_2 = (sqlite3_value **)cloudsync_memory_realloc(payload->new_values, newcap * sizeof(*new_values_2));
+        sqlite3_value **new_values_2 = (sqlite3_value **)cloudsync_arena_realloc(arena, payload->new_values, oldsize, newcap * sizeof(*new_values_2));
         if (!new_values_2) return SQLITE_NOMEM;
         payload->new_values = new_values_2;
         
-        sqlite3_value **old_values_2 = (sqlite3_value **)cloudsync_memory_realloc(payload->old_values, newcap * sizeof(*old_values_2));
+        sqlite3_value **old_values_2 = (sqlite3_value **)cloudsync_arena_realloc(arena, payload->old_values, oldsize, newcap * sizeof(*old_values_2));
         if (!old_values_2) return SQLITE_NOMEM;
         payload->old_values = old_values_2;
         
@@ -2806,30 +5438,37 @@ void cloudsync_update_step (sqlite3_context *context, int argc, sqlite3_value **
     cloudsync_update_payload *payload = (cloudsync_update_payload *)sqlite3_aggregate_context(context, sizeof(cloudsync_update_payload));
     if (!payload) {sqlite3_result_error_nomem(context); return;}
     
-    if (cloudsync_update_payload_append(payload, argv[0], argv[1], argv[2]) != SQLITE_OK) {
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    if (cloudsync_update_payload_append(&data->arena, payload, argv[0], argv[1], argv[2]) != SQLITE_OK) {
         sqlite3_result_error_nomem(context);
     }
 }
 
 void cloudsync_update_final (sqlite3_context *context) {
-    cloudsync_update_payload *payload = (cloudsync_update_payload *)sqlite3_aggregate_context(context, sizeof(cloudsync_update_payload));
-    if (!payload || payload->count == 0) return;
+    cloudsync_update_payload *payload = (cloudsync_update_payload *)sqlite3_aggregate_context(context, 0);
+    if (!payload) return;
     
     // retrieve context
     sqlite3 *db = sqlite3_context_db_handle(context);
     cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    if (payload->count == 0) {
+        cloudsync_update_payload_free(&data->arena, payload);
+        return;
+    }
     
     // lookup table
     const char *table_name = (const char *)sqlite3_value_text(payload->table_name);
     cloudsync_table_context *table = table_lookup(data, table_name);
     if (!table) {
         dbutils_context_result_error(context, "Unable to retrieve table name %s in cloudsync_update.", table_name);
+        cloudsync_update_payload_free(&data->arena, payload);
         return;
     }
 
     // compute the next database version for tracking changes
     sqlite3_int64 db_version = db_version_next(db, data, CLOUDSYNC_VALUE_NOTSET);
     int rc = SQLITE_OK;
+    bool batch = false;
     
     // Check if the primary key(s) have changed
     bool prikey_changed = false;
@@ -2847,9 +5486,10 @@ void cloudsync_update_final (sqlite3_context *context) {
     size_t oldpklen = sizeof(buffer2);
     char *oldpk = NULL;
     
-    char *pk = pk_encode_prikey(payload->new_values, table->npks, buffer, &pklen);
+    char *pk = arena_encode_prikey(data, payload->new_values, table->npks, buffer, &pklen);
     if (!pk) {
         sqlite3_result_error(context, "Not enough memory to encode the primary key(s).", -1);
+        cloudsync_update_payload_free(&data->arena, payload);
         return;
     }
     
@@ -2859,10 +5499,10 @@ void cloudsync_update_final (sqlite3_context *context) {
         // 2. create a new row (NEW primary key)
         
         // encode the OLD primary key into a buffer
-        oldpk = pk_encode_prikey(payload->old_values, table->npks, buffer2, &oldpklen);
+        oldpk = arena_encode_prikey(data, payload->old_values, table->npks, buffer2, &oldpklen);
         if (!oldpk) {
-            if (pk != buffer) cloudsync_memory_free(pk);
             sqlite3_result_error(context, "Not enough memory to encode the primary key(s).", -1);
+            cloudsync_update_payload_free(&data->arena, payload);
             return;
         }
         
@@ -2873,36 +5513,44 @@ void cloudsync_update_final (sqlite3_context *context) {
         // move non-sentinel metadata entries from OLD primary key to NEW primary key
         // handles the case where some metadata is retained across primary key change
         // see https://github.com/sqliteai/sqlite-sync/blob/main/docs/PriKey.md for more details
-        rc = local_update_move_meta(db, table, pk, pklen, oldpk, oldpklen, db_version);
+        rc = local_update_move_meta(db, data, table, pk, pklen, oldpk, oldpklen, db_version);
         if (rc != SQLITE_OK) goto cleanup;
         
         // mark a new sentinel row with the new primary key in the metadata
         rc = local_mark_insert_sentinel_meta(db, table, pk, pklen, db_version, BUMP_SEQ(data));
         if (rc != SQLITE_OK) goto cleanup;
-        
-        // free memory if the OLD primary key was dynamically allocated
-        if (oldpk != buffer2) cloudsync_memory_free(oldpk);
-        oldpk = NULL;
     }
     
+    // the clock vector of a packed row is loaded and stored once for all the updated columns
+    batch = (table->packed && packed_batch_begin(data));
+    
     // compare NEW and OLD values (excluding primary keys) to handle column updates
+    bool changed = prikey_changed;
     for (int i=0; i<table->ncols; i++) {
         int col_index = table->npks + i;  // Regular columns start after primary keys
 
         if (dbutils_value_compare(payload->old_values[col_index], payload->new_values[col_index]) != 0) {
             // if a column value has changed, mark it as updated in the metadata
             // columns are in cid order
-            rc = local_mark_insert_or_update_meta(db, table, pk, pklen, table->col_name[i], db_version, BUMP_SEQ(data));
+            rc = local_mark_insert_or_update_meta(db, table, pk, pklen, table->col_id[i], db_version, BUMP_SEQ(data));
             if (rc != SQLITE_OK) goto cleanup;
+            changed = true;
         }
     }
     
+    if (batch) {
+        batch = false;
+        rc = packed_batch_end(data, true);
+        if (rc != SQLITE_OK) goto cleanup;
+    }
+    
+    if (changed) rc = local_update_version(db, data, db_version);
+    if (changed && rc == SQLITE_OK) TABLE_STATS_ADD(table, CLOUDSYNC_STAT_LOCAL_UPDATES, 1);
+    
 cleanup:
+    if (batch) packed_batch_end(data, false);
     if (rc != SQLITE_OK) sqlite3_result_error(context, sqlite3_errmsg(db), -1);
-    if (pk != buffer) cloudsync_memory_free(pk);
-    if (oldpk && (oldpk != buffer2)) cloudsync_memory_free(oldpk);
-    
-    cloudsync_update_payload_free(payload);
+    cloudsync_update_payload_free(&data->arena, payload);
 }
 
 // MARK: -
@@ -2919,6 +5567,7 @@ int cloudsync_cleanup_internal (sqlite3_context *context, const char *table_name
     cloudsync_table_context *table = table_lookup(data, table_name);
     if (!table) return SQLITE_OK;
     
+    cloudsync_schema_detach(db, data);
     table_remove_from_context(data, table);
     table_free(table);
         
@@ -2968,6 +5617,7 @@ void cloudsync_cleanup_all (sqlite3_context *context) {
     if (rc == SQLITE_OK) {
         cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
         data->site_id[0] = 0;
+        siteid_ords_reset(data);
         dbutils_settings_cleanup(db);
     }
     
@@ -2989,6 +5639,256 @@ void cloudsync_cleanup (sqlite3_context *context, int argc, sqlite3_value **argv
     if (dbutils_table_exists(db, CLOUDSYNC_TABLE_SETTINGS_NAME) == true) dbutils_update_schema_hash(db, &data->schema_hash);
 }
 
+// MARK: - Garbage Collection -
+
+// A delete is recorded as a sentinel with an even causal length (the tombstone), and it must be kept so that an older
+// insert or update of the same row received later cannot resurrect it. Once every peer has applied all the local changes
+// up to a db_version (the horizon), the tombstones older than that are no longer needed and they can be dropped together
+// with the cloudsync_site_id rows that nothing references anymore.
+
+int cloudsync_gc_table (sqlite3 *db, cloudsync_table_context *table, sqlite3_int64 horizon, sqlite3_int64 *rows) {
+    // only the tombstones are collected, the clocks of the live rows are kept as they are (they are still needed to
+    // resolve concurrent updates and to send the rows to a new peer)
+    // a deleted packed row contains only the sentinel, so its db_version is the one of the tombstone
+    char *sql = NULL;
+    if (table->packed) sql = cloudsync_memory_mprintf("DELETE FROM \"%w_cloudsync\" WHERE db_version <= %lld AND (SELECT c.cl FROM cloudsync_clocks('%q', \"%w_cloudsync\".pk, \"%w_cloudsync\".clocks) AS c LIMIT 1) %% 2 = 0;", table->name, (long long)horizon, table->name, table->name, table->name);
+    else sql = cloudsync_memory_mprintf("DELETE FROM \"%w_cloudsync\" WHERE pk IN (SELECT pk FROM \"%w_cloudsync\" WHERE db_version <= %lld AND col_id = %d AND col_version %% 2 = 0);", table->name, table->name, (long long)horizon, CLOUDSYNC_TOMBSTONE_COLID);
+    if (!sql) return SQLITE_NOMEM;
+    
+    int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    cloudsync_memory_free(sql);
+    if (rc == SQLITE_OK) *rows += sqlite3_changes64(db);
+    return rc;
+}
+
+int cloudsync_gc_site_ids (sqlite3 *db, cloudsync_context *data, sqlite3_int64 *rows) {
+    // the local site (rowid 0) is always kept, the others only if they are referenced by a clock or by the site versions
+    char *sql = cloudsync_memory_mprintf("DELETE FROM cloudsync_site_id WHERE rowid > 0 AND rowid NOT IN (SELECT site_ord FROM cloudsync_site_versions");
+    for (int i=0; i<data->tables_count && sql; ++i) {
+        cloudsync_table_context *table = data->tables[i];
+        if (!table) continue;
+        
+        char *sql2 = NULL;
+        if (table->packed) sql2 = cloudsync_memory_mprintf("%s UNION SELECT c.site_id FROM \"%w_cloudsync\" AS r, cloudsync_clocks('%q', r.pk, r.clocks) AS c", sql, table->name, table->name);
+        else sql2 = cloudsync_memory_mprintf("%s UNION SELECT site_id FROM \"%w_cloudsync\"", sql, table->name);
+        cloudsync_memory_free(sql);
+        sql = sql2;
+    }
+    if (!sql) return SQLITE_NOMEM;
+    
+    char *sql2 = cloudsync_memory_mprintf("%s);", sql);
+    cloudsync_memory_free(sql);
+    if (!sql2) return SQLITE_NOMEM;
+    
+    // remember the highest ordinal ever assigned, so that the ordinals of the deleted rows are never reused
+    // (a clock received later could still refer to them, and it must not be attributed to another site)
+    int rc = sqlite3_exec(db, "INSERT INTO cloudsync_settings (key, value) SELECT '" CLOUDSYNC_KEY_SITEID_HWM "', max(rowid) FROM cloudsync_site_id WHERE true ON CONFLICT(key) DO UPDATE SET value = excluded.value WHERE CAST(value AS INTEGER) < CAST(excluded.value AS INTEGER);", NULL, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(db, sql2, NULL, NULL, NULL);
+    cloudsync_memory_free(sql2);
+    if (rc == SQLITE_OK) *rows += sqlite3_changes64(db);
+    
+    // the cached ordinals may refer to the deleted rows
+    siteid_ords_reset(data);
+    return rc;
+}
+
+int cloudsync_gc_internal (sqlite3_context *context, const char *table_name, sqlite3_int64 horizon, sqlite3_int64 *rows, sqlite3_int64 *bytes) {
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    int rc = SQLITE_OK;
+    
+    if (cloudsync_context_init(db, data, context) == NULL) return SQLITE_MISUSE;
+    
+    cloudsync_table_context *table = NULL;
+    bool all_tables = dbutils_is_star_table(table_name);
+    if (!all_tables) {
+        table = table_lookup(data, table_name);
+        if (!table) {
+            dbutils_context_result_error(context, "Unable to find table %s in cloudsync_gc.", table_name);
+            return SQLITE_MISUSE;
+        }
+    }
+    
+    // the db_version of the database is the max db_version stored in the meta-tables, so it is saved
+    // as a lower bound before dropping the rows that could contain it
+    if (db_version_check_uptodate(db, data) != SQLITE_OK) return SQLITE_ERROR;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%lld", data->db_version);
+    rc = dbutils_settings_set_key_value(db, context, "pre_alter_dbversion", buf);
+    if (rc != SQLITE_OK) return rc;
+    
+    // reclaimed bytes are the pages released to the freelist
+    sqlite3_int64 page_size = dbutils_int_select(db, "PRAGMA page_size;");
+    sqlite3_int64 freelist = dbutils_int_select(db, "PRAGMA freelist_count;");
+    
+    for (int i=0; i<data->tables_count; ++i) {
+        cloudsync_table_context *t = data->tables[i];
+        if (!t || (table && t != table)) continue;
+        rc = cloudsync_gc_table(db, t, horizon, rows);
+        if (rc != SQLITE_OK) return rc;
+    }
+    
+    rc = cloudsync_gc_site_ids(db, data, rows);
+    if (rc != SQLITE_OK) return rc;
+    
+    sqlite3_int64 freelist2 = dbutils_int_select(db, "PRAGMA freelist_count;");
+    *bytes = (freelist2 > freelist) ? (freelist2 - freelist) * page_size : 0;
+    return rc;
+}
+
+void cloudsync_gc (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_gc");
+    
+    // argv[0] -> table name (or * for all the tables)
+    // argv[1] -> horizon db_version (optional, the one acknowledged by the server is used by default)
+    const char *table = (const char *)sqlite3_value_text(argv[0]);
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    
+    sqlite3_int64 horizon = 0;
+    if (argc > 1 && sqlite3_value_type(argv[1]) != SQLITE_NULL) horizon = sqlite3_value_int64(argv[1]);
+    else horizon = dbutils_int_select(db, "SELECT CAST(value AS INTEGER) FROM cloudsync_settings WHERE key='" CLOUDSYNC_KEY_GC_HORIZON "';");
+    
+    sqlite3_int64 rows = 0;
+    sqlite3_int64 bytes = 0;
+    if (horizon > 0) {
+        int rc = sqlite3_exec(db, "SAVEPOINT cloudsync_gc;", NULL, NULL, NULL);
+        if (rc == SQLITE_OK) {
+            rc = cloudsync_gc_internal(context, table, horizon, &rows, &bytes);
+            if (rc == SQLITE_OK) rc = sqlite3_exec(db, "RELEASE cloudsync_gc;", NULL, NULL, NULL);
+            else sqlite3_exec(db, "ROLLBACK TO cloudsync_gc; RELEASE cloudsync_gc;", NULL, NULL, NULL);
+        }
+        if (rc != SQLITE_OK) {
+            if (rc != SQLITE_MISUSE) dbutils_context_result_error(context, "cloudsync_gc error: %s", sqlite3_errmsg(db));
+            sqlite3_result_error_code(context, rc);
+            return;
+        }
+    }
+    
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "{\"rows\":%lld,\"bytes\":%lld}", (long long)rows, (long long)bytes);
+    sqlite3_result_text(context, buffer, -1, SQLITE_TRANSIENT);
+}
+
+// MARK: - Backfill -
+
+void cloudsync_backfill (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_backfill");
+    
+    // argv[0] -> table name
+    // argv[1] -> max number of rows to backfill (optional, the backfill_batch setting is used by default, 0 means all)
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    const char *table_name = (const char *)sqlite3_value_text(argv[0]);
+    
+    if (cloudsync_context_init(db, data, context) == NULL) {
+        sqlite3_result_error_code(context, SQLITE_MISUSE);
+        return;
+    }
+    
+    cloudsync_table_context *table = table_lookup(data, table_name);
+    if (!table) {
+        dbutils_context_result_error(context, "Unable to find table %s in cloudsync_backfill.", table_name);
+        sqlite3_result_error_code(context, SQLITE_MISUSE);
+        return;
+    }
+    
+    sqlite3_int64 limit = data->backfill_batch;
+    if (argc > 1 && sqlite3_value_type(argv[1]) != SQLITE_NULL) limit = sqlite3_value_int64(argv[1]);
+    
+    sqlite3_int64 nrows = 0;
+    int rc = sqlite3_exec(db, "SAVEPOINT cloudsync_backfill;", NULL, NULL, NULL);
+    if (rc == SQLITE_OK) {
+        rc = backfill_batch(db, data, table, (limit > 0) ? limit : 0, &nrows);
+        if (rc == SQLITE_OK) rc = sqlite3_exec(db, "RELEASE cloudsync_backfill;", NULL, NULL, NULL);
+        else sqlite3_exec(db, "ROLLBACK TO cloudsync_backfill; RELEASE cloudsync_backfill;", NULL, NULL, NULL);
+    }
+    if (rc != SQLITE_OK) {
+        dbutils_context_result_error(context, "cloudsync_backfill error: %s", sqlite3_errmsg(db));
+        sqlite3_result_error_code(context, rc);
+        return;
+    }
+    
+    sqlite3_result_int64(context, nrows);
+}
+
+void cloudsync_backfill_progress (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_backfill_progress");
+    
+    // argv[0] -> table name
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    const char *table_name = (const char *)sqlite3_value_text(argv[0]);
+    
+    cloudsync_table_context *table = table_lookup(data, table_name);
+    if (!table) {
+        dbutils_context_result_error(context, "Unable to find table %s in cloudsync_backfill_progress.", table_name);
+        sqlite3_result_error_code(context, SQLITE_MISUSE);
+        return;
+    }
+    
+    // rows are backfilled in primary key order, so the backfilled ones are the rows up to the cursor
+    sqlite3_stmt *cursor = NULL;
+    char *pkvalues = NULL;
+    char *range = NULL;
+    char *sql = NULL;
+    sqlite3_int64 rows = 0;
+    sqlite3_int64 total = 0;
+    bool pending = false;
+    
+    int rc = backfill_cursor_get(db, table->name, &cursor, &pending);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    sql = cloudsync_memory_mprintf("SELECT count(*) FROM \"%w\";", table->name);
+    if (!sql) {rc = SQLITE_NOMEM; goto finalize;}
+    rc = backfill_exec(db, sql, NULL, NULL, 0, 0, &total);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    rows = total;
+    if (pending) {
+        rows = 0;
+        if (sqlite3_column_type(cursor, 0) != SQLITE_NULL) {
+            range = backfill_range(db, table, false, true, &pkvalues);
+            if (!range) {rc = SQLITE_NOMEM; goto finalize;}
+            cloudsync_memory_free(sql);
+            sql = cloudsync_memory_mprintf("SELECT count(*) FROM \"%w\" WHERE %s;", table->name, range);
+            if (!sql) {rc = SQLITE_NOMEM; goto finalize;}
+            rc = backfill_exec(db, sql, NULL, cursor, 0, 0, &rows);
+            if (rc != SQLITE_OK) goto finalize;
+        }
+    }
+    
+finalize:
+    if (cursor) sqlite3_finalize(cursor);
+    if (pkvalues) cloudsync_memory_free(pkvalues);
+    if (range) cloudsync_memory_free(range);
+    if (sql) cloudsync_memory_free(sql);
+    if (rc != SQLITE_OK) {
+        dbutils_context_result_error(context, "cloudsync_backfill_progress error: %s", sqlite3_errmsg(db));
+        sqlite3_result_error_code(context, rc);
+        return;
+    }
+    
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "{\"rows\":%lld,\"total\":%lld,\"completed\":%s}", (long long)rows, (long long)total, (pending) ? "false" : "true");
+    sqlite3_result_text(context, buffer, -1, SQLITE_TRANSIENT);
+}
+
+// MARK: - Stats -
+
+void cloudsync_stats_reset (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_stats_reset");
+    
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    stats_clear(&data->stats);
+    for (int i=0; i<data->tables_count; ++i) {
+        memset(data->tables[i]->stats, 0, sizeof(data->tables[i]->stats));
+    }
+    
+    sqlite3_result_int(context, 1);
+}
+
+// MARK: -
+
 void cloudsync_enable_disable (sqlite3_context *context, const char *table_name, bool value) {
     DEBUG_FUNCTION("cloudsync_enable_disable");
     
@@ -3061,16 +5961,31 @@ void cloudsync_terminate (sqlite3_context *context, int argc, sqlite3_value **ar
         if (data->tables[i]) table_free(data->tables[i]);
         data->tables[i] = NULL;
     }
+    schema_shared_release(data->schema);
+    data->schema = NULL;
     
     if (data->schema_version_stmt) sqlite3_finalize(data->schema_version_stmt);
     if (data->data_version_stmt) sqlite3_finalize(data->data_version_stmt);
     if (data->db_version_stmt) sqlite3_finalize(data->db_version_stmt);
     if (data->getset_siteid_stmt) sqlite3_finalize(data->getset_siteid_stmt);
+    if (data->get_siteid_stmt) sqlite3_finalize(data->get_siteid_stmt);
+    if (data->local_version_stmt) sqlite3_finalize(data->local_version_stmt);
+    if (data->apply_stmt) sqlite3_finalize(data->apply_stmt);
+    if (data->apply_savepoint_stmt) sqlite3_finalize(data->apply_savepoint_stmt);
+    if (data->apply_release_stmt) sqlite3_finalize(data->apply_release_stmt);
     
     data->schema_version_stmt = NULL;
     data->data_version_stmt = NULL;
     data->db_version_stmt = NULL;
     data->getset_siteid_stmt = NULL;
+    data->get_siteid_stmt = NULL;
+    data->local_version_stmt = NULL;
+    data->apply_stmt = NULL;
+    data->apply_savepoint_stmt = NULL;
+    data->apply_release_stmt = NULL;
+    
+    row_cache_clear(&data->row_cache);
+    siteid_ords_reset(data);
     
     // reset the site_id so the cloudsync_context_init will be executed again
     // if any other cloudsync function is called after terminate
@@ -3097,7 +6012,7 @@ int cloudsync_load_siteid (sqlite3 *db, cloudsync_context *data) {
     return SQLITE_OK;
 }
 
-int cloudsync_init_internal (sqlite3_context *context, const char *table_name, const char *algo_name, bool skip_int_pk_check) {
+int cloudsync_init_internal (sqlite3_context *context, const char *table_name, const char *algo_name, const char *storage, bool skip_int_pk_check, bool refill) {
     DEBUG_FUNCTION("cloudsync_init_internal");
     
     // get database reference
@@ -3126,9 +6041,26 @@ int cloudsync_init_internal (sqlite3_context *context, const char *table_name, c
         return SQLITE_MISUSE;
     }
     
+    // sanity check storage mode (if exists)
+    if (storage && strcasecmp(storage, CLOUDSYNC_STORAGE_ROWS) != 0 && strcasecmp(storage, CLOUDSYNC_STORAGE_PACKED) != 0) {
+        dbutils_context_result_error(context, "storage mode %s does not exist", storage);
+        return SQLITE_MISUSE;
+    }
+    
     // check if table name was already augmented
     table_algo algo_current = dbutils_table_settings_get_algo(db, table_name);
     
+    // the storage mode is chosen when the table is augmented, a NULL storage keeps the current one
+    if (storage) {
+        bool packed_new = (strcasecmp(storage, CLOUDSYNC_STORAGE_PACKED) == 0);
+        if (algo_current == table_algo_none) {
+            if (packed_new) dbutils_table_settings_set_key_value(NULL, context, table_name, "*", CLOUDSYNC_KEY_STORAGE, CLOUDSYNC_STORAGE_PACKED);
+        } else if (packed_new != dbutils_table_settings_is_packed(db, table_name)) {
+            dbutils_context_result_error(context, "%s", "Before changing a table storage you must call cloudsync_cleanup(table_name)");
+            return SQLITE_MISUSE;
+        }
+    }
+    
     // sanity check algorithm
     if ((algo_new == algo_current) && (algo_current != table_algo_none)) {
         // if table algorithms and the same and not none, do nothing
@@ -3174,13 +6106,15 @@ int cloudsync_init_internal (sqlite3_context *context, const char *table_name, c
         return SQLITE_MISUSE;
     }
     
-    // add table to in-memory data context
+    // add table to in-memory data context (a table not loaded yet changes the schema shared with other connections)
+    if (table_lookup(data, table_name) == NULL) cloudsync_schema_detach(db, data);
     if (table_add_to_context(db, data, algo_new, table_name) == false) {
         dbutils_context_result_error(context, "An error occurred while adding %s table information to global context", table_name);
         return SQLITE_MISUSE;
     }
     
-    if (cloudsync_refill_metatable(db, data, table_name) != SQLITE_OK) {
+    // the meta-table of a table just altered is already up to date unless rows were changed without triggers
+    if (refill && cloudsync_refill_metatable(db, data, table_name) != SQLITE_OK) {
         dbutils_context_result_error(context, "%s", "An error occurred while trying to fill the augmented table.");
         return SQLITE_MISUSE;
     }
@@ -3188,7 +6122,7 @@ int cloudsync_init_internal (sqlite3_context *context, const char *table_name, c
     return SQLITE_OK;
 }
 
-int cloudsync_init_all (sqlite3_context *context, const char *algo_name, bool skip_int_pk_check) {
+int cloudsync_init_all (sqlite3_context *context, const char *algo_name, const char *storage, bool skip_int_pk_check) {
     char sql[1024];
     snprintf(sql, sizeof(sql), "SELECT name, '%s' FROM sqlite_master WHERE type='table' and name NOT LIKE 'sqlite_%%' AND name NOT LIKE 'cloudsync_%%' AND name NOT LIKE '%%_cloudsync';", (algo_name) ? algo_name : CLOUDSYNC_DEFAULT_ALGO);
     
@@ -3204,7 +6138,7 @@ int cloudsync_init_all (sqlite3_context *context, const char *algo_name, bool sk
         
         const char *table = (const char *)sqlite3_column_text(vm, 0);
         const char *algo = (const char *)sqlite3_column_text(vm, 1);
-        rc = cloudsync_init_internal(context, table, algo, skip_int_pk_check);
+        rc = cloudsync_init_internal(context, table, algo, storage, skip_int_pk_check, true);
         if (rc != SQLITE_OK) {cloudsync_cleanup_internal(context, table); goto abort_init_all;}
     }
     rc = SQLITE_OK;
@@ -3214,7 +6148,7 @@ abort_init_all:
     return rc;
 }
 
-void cloudsync_init (sqlite3_context *context, const char *table, const char *algo, bool skip_int_pk_check) {
+void cloudsync_init (sqlite3_context *context, const char *table, const char *algo, const char *storage, bool skip_int_pk_check) {
     cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
     data->sqlite_ctx = context;
     
@@ -3226,8 +6160,8 @@ void cloudsync_init (sqlite3_context *context, const char *table, const char *al
         return;
     }
     
-    if (dbutils_is_star_table(table)) rc = cloudsync_init_all(context, algo, skip_int_pk_check);
-    else rc = cloudsync_init_internal(context, table, algo, skip_int_pk_check);
+    if (dbutils_is_star_table(table)) rc = cloudsync_init_all(context, algo, storage, skip_int_pk_check);
+    else rc = cloudsync_init_internal(context, table, algo, storage, skip_int_pk_check, true);
     
     if (rc == SQLITE_OK) {
         rc = sqlite3_exec(db, "RELEASE cloudsync_init", NULL, NULL, NULL);
@@ -3251,6 +6185,17 @@ void cloudsync_init (sqlite3_context *context, const char *table, const char *al
     sqlite3_result_text(context, buffer, -1, NULL);
 }
 
+void cloudsync_init4 (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_init4");
+    
+    const char *table = (const char *)sqlite3_value_text(argv[0]);
+    const char *algo = (const char *)sqlite3_value_text(argv[1]);
+    bool skip_int_pk_check = (bool)sqlite3_value_int(argv[2]);
+    const char *storage = (const char *)sqlite3_value_text(argv[3]);
+    
+    cloudsync_init(context, table, algo, storage, skip_int_pk_check);
+}
+
 void cloudsync_init3 (sqlite3_context *context, int argc, sqlite3_value **argv) {
     DEBUG_FUNCTION("cloudsync_init2");
     
@@ -3258,7 +6203,7 @@ void cloudsync_init3 (sqlite3_context *context, int argc, sqlite3_value **argv)
     const char *algo = (const char *)sqlite3_value_text(argv[1]);
     bool skip_int_pk_check = (bool)sqlite3_value_int(argv[2]);
 
-    cloudsync_init(context, table, algo, skip_int_pk_check);
+    cloudsync_init(context, table, algo, NULL, skip_int_pk_check);
 }
 
 void cloudsync_init2 (sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -3267,7 +6212,7 @@ void cloudsync_init2 (sqlite3_context *context, int argc, sqlite3_value **argv)
     const char *table = (const char *)sqlite3_value_text(argv[0]);
     const char *algo = (const char *)sqlite3_value_text(argv[1]);
     
-    cloudsync_init(context, table, algo, false);
+    cloudsync_init(context, table, algo, NULL, false);
 }
 
 void cloudsync_init1 (sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -3275,7 +6220,7 @@ void cloudsync_init1 (sqlite3_context *context, int argc, sqlite3_value **argv)
     
     const char *table = (const char *)sqlite3_value_text(argv[0]);
     
-    cloudsync_init(context, table, NULL, false);
+    cloudsync_init(context, table, NULL, NULL, false);
 }
 
 // MARK: -
@@ -3335,6 +6280,8 @@ void cloudsync_begin_alter (sqlite3_context *context, int argc, sqlite3_value **
     
     if (table->pk_name) sqlite3_free_table(table->pk_name);
     table->pk_name = result;
+    table->alter_changes = sqlite3_total_changes64(db);
+    table->alter_rowid_pk = dbutils_table_has_rowid_pk(db, table_name);
     return;
     
 rollback_begin_alter:
@@ -3371,7 +6318,8 @@ void cloudsync_commit_alter (sqlite3_context *context, int argc, sqlite3_value *
         goto rollback_finalize_alter;
     }
     
-    int rc = cloudsync_finalize_alter(context, data, table);
+    bool refill = false;
+    int rc = cloudsync_finalize_alter(context, data, table, &refill);
     if (rc != SQLITE_OK) goto rollback_finalize_alter;
     
     // the table is outdated, delete it and it will be reloaded in the cloudsync_init_internal
@@ -3382,7 +6330,7 @@ void cloudsync_commit_alter (sqlite3_context *context, int argc, sqlite3_value *
     // init again cloudsync for the table
     table_algo algo_current = dbutils_table_settings_get_algo(db, table_name);
     if (algo_current == table_algo_none) algo_current = dbutils_table_settings_get_algo(db, "*");
-    rc = cloudsync_init_internal(context, table_name, crdt_algo_name(algo_current), true);
+    rc = cloudsync_init_internal(context, table_name, crdt_algo_name(algo_current), NULL, true, refill);
     if (rc != SQLITE_OK) goto rollback_finalize_alter;
 
     // release savepoint
@@ -3407,7 +6355,7 @@ rollback_finalize_alter:
     
 // MARK: - Main Entrypoint -
 
-int cloudsync_register (sqlite3 *db, char **pzErrMsg) {
+int cloudsync_register (sqlite3 *db, char **pzErrMsg, cloudsync_context **context) {
     int rc = SQLITE_OK;
     
     // there's no built-in way to verify if sqlite3_cloudsync_init has already been called
@@ -3418,6 +6366,9 @@ int cloudsync_register (sqlite3 *db, char **pzErrMsg) {
     // init memory debugger (NOOP in production)
     cloudsync_memory_init(1);
     
+    // init the lock of the metadata shared between connections (see schema.c)
+    schema_init();
+    
     // init context
     void *ctx = cloudsync_context_create();
     if (!ctx) {
@@ -3439,6 +6390,9 @@ int cloudsync_register (sqlite3 *db, char **pzErrMsg) {
     
     rc = dbutils_register_function(db, "cloudsync_init", cloudsync_init3, 3, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
+    
+    rc = dbutils_register_function(db, "cloudsync_init", cloudsync_init4, 4, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
 
     
     rc = dbutils_register_function(db, "cloudsync_enable", cloudsync_enable, 1, pzErrMsg, ctx, NULL);
@@ -3453,6 +6407,24 @@ int cloudsync_register (sqlite3 *db, char **pzErrMsg) {
     rc = dbutils_register_function(db, "cloudsync_cleanup", cloudsync_cleanup, 1, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
     
+    rc = dbutils_register_function(db, "cloudsync_gc", cloudsync_gc, 1, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = dbutils_register_function(db, "cloudsync_gc", cloudsync_gc, 2, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = dbutils_register_function(db, "cloudsync_backfill", cloudsync_backfill, 1, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = dbutils_register_function(db, "cloudsync_backfill", cloudsync_backfill, 2, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = dbutils_register_function(db, "cloudsync_backfill_progress", cloudsync_backfill_progress, 1, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = dbutils_register_function(db, "cloudsync_stats_reset", cloudsync_stats_reset, 0, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
     rc = dbutils_register_function(db, "cloudsync_terminate", cloudsync_terminate, 0, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
     
@@ -3499,8 +6471,26 @@ int cloudsync_register (sqlite3 *db, char **pzErrMsg) {
     
     rc = dbutils_register_function(db, "cloudsync_payload_load", cloudsync_payload_load, 1, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
+    
+    rc = dbutils_register_function(db, "cloudsync_trace_file", cloudsync_trace_file, 1, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
     #endif
     
+    rc = dbutils_register_function(db, "cloudsync_snapshot_encode", cloudsync_snapshot_encode, 0, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = dbutils_register_function(db, "cloudsync_snapshot_decode", cloudsync_snapshot_decode, 1, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = dbutils_register_function(db, "cloudsync_snapshot_save", cloudsync_snapshot_save, 1, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = dbutils_register_function(db, "cloudsync_snapshot_load", cloudsync_snapshot_load, 1, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = dbutils_register_function(db, "cloudsync_sync_attached", cloudsync_sync_attached, 1, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
     // PRIVATE functions
     rc = dbutils_register_function(db, "cloudsync_is_sync", cloudsync_is_sync, 1, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
@@ -3525,6 +6515,9 @@ int cloudsync_register (sqlite3 *db, char **pzErrMsg) {
     
     rc = dbutils_register_function(db, "cloudsync_seq", cloudsync_seq, 0, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
+    
+    rc = dbutils_register_function(db, "cloudsync_backfill_clocks", cloudsync_backfill_clocks, 4, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
 
     // NETWORK LAYER
     #ifndef CLOUDSYNC_OMIT_NETWORK
@@ -3533,6 +6526,7 @@ int cloudsync_register (sqlite3 *db, char **pzErrMsg) {
     #endif
     
     cloudsync_context *data = (cloudsync_context *)ctx;
+    if (context) *context = data;
     sqlite3_commit_hook(db, cloudsync_commit_hook, ctx);
     sqlite3_rollback_hook(db, cloudsync_rollback_hook, ctx);
     
@@ -3540,6 +6534,14 @@ int cloudsync_register (sqlite3 *db, char **pzErrMsg) {
     rc = cloudsync_vtab_register_changes (db, data);
     if (rc != SQLITE_OK) return rc;
     
+    // register eponymous only clocks table-valued function (used by the tables with packed storage)
+    rc = cloudsync_vtab_register_clocks (db, data);
+    if (rc != SQLITE_OK) return rc;
+    
+    // register eponymous only stats virtual table
+    rc = cloudsync_vtab_register_stats (db, data);
+    if (rc != SQLITE_OK) return rc;
+    
     // load config, if exists
     if (cloudsync_config_exists(db)) {
         cloudsync_context_init(db, ctx, NULL);
@@ -3558,5 +6560,5 @@ APIEXPORT int sqlite3_cloudsync_init (sqlite3 *db, char **pzErrMsg, const sqlite
     SQLITE_EXTENSION_INIT2(pApi);
     #endif
     
-    return cloudsync_register(db, pzErrMsg);
+    return cloudsync_register(db, pzErrMsg, NULL);
 }
@@ -14,9 +14,12 @@
 #else
 #include "sqlite3.h"
 #endif
+#include "stats.h"
+#include "trace.h"
 
 
 #define CLOUDSYNC_TOMBSTONE_VALUE               "__[RIP]__"
+#define CLOUDSYNC_TOMBSTONE_COLID               0
 #define CLOUDSYNC_RLS_RESTRICTED_VALUE          "__[RLS]__"
 #define CLOUDSYNC_DISABLE_ROWIDONLY_TABLES      1
 
@@ -38,6 +41,8 @@ void *cloudsync_get_auxdata (sqlite3_context *context);
 void cloudsync_set_auxdata (sqlite3_context *context, void *xdata);
 int cloudsync_payload_apply (sqlite3_context *context, const char *payload, int blen);
 int cloudsync_payload_get (sqlite3_context *context, char **blob, int *blob_size, int *db_version, int *seq, sqlite3_int64 *new_db_version, sqlite3_int64 *new_seq);
+int cloudsync_has_unsent_changes (sqlite3_context *context);
+cloudsync_stats *cloudsync_get_stats (sqlite3_context *context);
 
 // used by core
 typedef bool (*cloudsync_payload_apply_callback_t)(void **xdata, cloudsync_pk_decode_bind_context *decoded_change, sqlite3 *db, cloudsync_context *data, int step, int rc);
@@ -45,11 +50,17 @@ void cloudsync_set_payload_apply_callback(sqlite3 *db, cloudsync_payload_apply_c
 
 bool cloudsync_config_exists (sqlite3 *db);
 sqlite3_stmt *cloudsync_colvalue_stmt (sqlite3 *db, cloudsync_context *data, const char *tbl_name, bool *persistent);
+const int *cloudsync_table_col_ids (cloudsync_context *data, const char *table_name, int *ncols);
 char *cloudsync_pk_context_tbl (cloudsync_pk_decode_bind_context *ctx, int64_t *tbl_len);
 void *cloudsync_pk_context_pk (cloudsync_pk_decode_bind_context *ctx, int64_t *pk_len);
 char *cloudsync_pk_context_colname (cloudsync_pk_decode_bind_context *ctx, int64_t *colname_len);
 int64_t cloudsync_pk_context_cl (cloudsync_pk_decode_bind_context *ctx);
 int64_t cloudsync_pk_context_dbversion (cloudsync_pk_decode_bind_context *ctx);
+void cloudsync_row_cache_open (cloudsync_context *data);
+void cloudsync_row_cache_close (cloudsync_context *data);
+void cloudsync_siteid_rollback (cloudsync_context *data);
+cloudsync_stats *cloudsync_context_stats (cloudsync_context *data);
+const uint64_t *cloudsync_table_stats (cloudsync_context *data, int index, const char **tbl_name);
 
 
 #endif
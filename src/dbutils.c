@@ -681,11 +681,65 @@ finalize:
     return rc;
 }
 
+int dbutils_migrate_metatable (sqlite3 *db, const char *table) {
+    DEBUG_DBFUNCTION("dbutils_migrate_metatable %s", table);
+    
+    // meta-tables created by previous versions store the column name as TEXT in col_name,
+    // so register every name in the column dictionary and copy the clocks using the col_id instead
+    char *sql = cloudsync_memory_mprintf("SAVEPOINT cloudsync_migrate_metatable;"
+                                         "INSERT INTO cloudsync_columns (tbl_name, col_id, col_name) "
+                                         "SELECT '%q', (SELECT IFNULL(MAX(col_id), 0) FROM cloudsync_columns WHERE tbl_name = '%q') + row_number() OVER (ORDER BY col_name), col_name "
+                                         "FROM (SELECT DISTINCT col_name FROM \"%w_cloudsync\" WHERE col_name != '%s' AND col_name NOT IN (SELECT col_name FROM cloudsync_columns WHERE tbl_name = '%q'));"
+                                         "CREATE TABLE \"%w_cloudsync_migrate\" (pk BLOB NOT NULL, col_id INTEGER NOT NULL, col_version INTEGER, db_version INTEGER, site_id INTEGER DEFAULT 0, seq INTEGER, PRIMARY KEY (pk, col_id)) WITHOUT ROWID;"
+                                         "INSERT INTO \"%w_cloudsync_migrate\" (pk, col_id, col_version, db_version, site_id, seq) "
+                                         "SELECT m.pk, IIF(m.col_name = '%s', %d, c.col_id), m.col_version, m.db_version, m.site_id, m.seq FROM \"%w_cloudsync\" AS m LEFT JOIN cloudsync_columns AS c ON c.tbl_name = '%q' AND c.col_name = m.col_name;"
+                                         "DROP TABLE \"%w_cloudsync\";"
+                                         "ALTER TABLE \"%w_cloudsync_migrate\" RENAME TO \"%w_cloudsync\";"
+                                         "RELEASE cloudsync_migrate_metatable;",
+                                         table, table, table, CLOUDSYNC_TOMBSTONE_VALUE, table,
+                                         table,
+                                         table, CLOUDSYNC_TOMBSTONE_VALUE, CLOUDSYNC_TOMBSTONE_COLID, table, table,
+                                         table,
+                                         table, table);
+    if (!sql) return SQLITE_NOMEM;
+    
+    int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    DEBUG_SQL("\n%s", sql);
+    cloudsync_memory_free(sql);
+    
+    if (rc != SQLITE_OK) {
+        DEBUG_ALWAYS("dbutils_migrate_metatable error: %s", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK TO cloudsync_migrate_metatable; RELEASE cloudsync_migrate_metatable;", NULL, NULL, NULL);
+    }
+    return rc;
+}
+
 int dbutils_check_metatable (sqlite3 *db, const char *table, table_algo algo) {
     DEBUG_DBFUNCTION("dbutils_check_metatable %s", table);
-        
+    
+    // check if the meta-table uses the old layout with a TEXT col_name column
+    char *sql = cloudsync_memory_mprintf("SELECT count(*) FROM pragma_table_info('%q_cloudsync') WHERE name = 'col_name';", table);
+    if (!sql) return SQLITE_NOMEM;
+    sqlite3_int64 old_layout = dbutils_int_select(db, sql);
+    cloudsync_memory_free(sql);
+    if (old_layout > 0) {
+        int rc = dbutils_migrate_metatable(db, table);
+        if (rc != SQLITE_OK) return rc;
+    }
+    
     // WITHOUT ROWID is available starting from SQLite version 3.8.2 (2013-12-06) and later
-    char *sql = cloudsync_memory_mprintf("CREATE TABLE IF NOT EXISTS \"%w_cloudsync\" (pk BLOB NOT NULL, col_name TEXT NOT NULL, col_version INTEGER, db_version INTEGER, site_id INTEGER DEFAULT 0, seq INTEGER, PRIMARY KEY (pk, col_name)) WITHOUT ROWID; CREATE INDEX IF NOT EXISTS \"%w_cloudsync_db_idx\" ON \"%w_cloudsync\" (db_version);", table, table, table);
+    // col_id is the id of the column in the cloudsync_columns dictionary (CLOUDSYNC_TOMBSTONE_COLID for the tombstone)
+    // with the packed storage mode all the clocks of a row are stored in a single clock vector (see clock.c)
+    // and db_version is the greatest db_version in the vector
+    // when the primary key of the table is its rowid, pk is the integer value itself instead of the encoded pk
+    // (the packed layout then becomes a rowid table keyed by the same integer)
+    bool intpk = dbutils_table_has_rowid_pk(db, table);
+    if (dbutils_table_settings_is_packed(db, table)) {
+        if (intpk) sql = cloudsync_memory_mprintf("CREATE TABLE IF NOT EXISTS \"%w_cloudsync\" (pk INTEGER PRIMARY KEY, db_version INTEGER, clocks BLOB); CREATE INDEX IF NOT EXISTS \"%w_cloudsync_db_idx\" ON \"%w_cloudsync\" (db_version);", table, table, table);
+        else sql = cloudsync_memory_mprintf("CREATE TABLE IF NOT EXISTS \"%w_cloudsync\" (pk BLOB NOT NULL PRIMARY KEY, db_version INTEGER, clocks BLOB) WITHOUT ROWID; CREATE INDEX IF NOT EXISTS \"%w_cloudsync_db_idx\" ON \"%w_cloudsync\" (db_version);", table, table, table);
+    } else {
+        sql = cloudsync_memory_mprintf("CREATE TABLE IF NOT EXISTS \"%w_cloudsync\" (pk %s NOT NULL, col_id INTEGER NOT NULL, col_version INTEGER, db_version INTEGER, site_id INTEGER DEFAULT 0, seq INTEGER, PRIMARY KEY (pk, col_id)) WITHOUT ROWID; CREATE INDEX IF NOT EXISTS \"%w_cloudsync_db_idx\" ON \"%w_cloudsync\" (db_version);", table, (intpk) ? "INTEGER" : "BLOB", table, table);
+    }
     if (!sql) return SQLITE_NOMEM;
     
     int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
@@ -696,6 +750,42 @@ int dbutils_check_metatable (sqlite3 *db, const char *table, table_algo algo) {
 }
 
 
+bool dbutils_table_has_rowid_pk (sqlite3 *db, const char *table) {
+    DEBUG_DBFUNCTION("dbutils_table_has_rowid_pk %s", table);
+    
+    // a single column declared as INTEGER PRIMARY KEY is an alias for the rowid only when no index
+    // is needed to enforce the primary key (WITHOUT ROWID tables and the INTEGER PRIMARY KEY DESC quirk have one)
+    char *sql = cloudsync_memory_mprintf("SELECT (SELECT count(*) FROM pragma_table_info('%q') WHERE pk>0) = 1 "
+                                         "AND EXISTS (SELECT 1 FROM pragma_table_info('%q') WHERE pk=1 AND upper(\"type\") = 'INTEGER') "
+                                         "AND NOT EXISTS (SELECT 1 FROM pragma_index_list('%q') WHERE origin = 'pk');", table, table, table);
+    if (!sql) return false;
+    sqlite3_int64 value = dbutils_int_select(db, sql);
+    cloudsync_memory_free(sql);
+    if (value == 1) return true;
+    
+    #if !CLOUDSYNC_DISABLE_ROWIDONLY_TABLES
+    // rowid only tables are keyed by their implicit rowid
+    sql = cloudsync_memory_mprintf("SELECT count(*) FROM pragma_table_info('%q') WHERE pk>0;", table);
+    if (!sql) return false;
+    value = dbutils_int_select(db, sql);
+    cloudsync_memory_free(sql);
+    if (value == 0) return true;
+    #endif
+    
+    return false;
+}
+
+bool dbutils_metatable_is_intpk (sqlite3 *db, const char *table) {
+    DEBUG_DBFUNCTION("dbutils_metatable_is_intpk %s", table);
+    
+    // meta-tables created before the integer layout was introduced keep their BLOB pk column
+    char *sql = cloudsync_memory_mprintf("SELECT count(*) FROM pragma_table_info('%q_cloudsync') WHERE name = 'pk' AND \"type\" = 'INTEGER';", table);
+    if (!sql) return false;
+    sqlite3_int64 value = dbutils_int_select(db, sql);
+    cloudsync_memory_free(sql);
+    return (value == 1);
+}
+
 sqlite3_int64 dbutils_schema_version (sqlite3 *db) {
     DEBUG_DBFUNCTION("dbutils_schema_version");
     
@@ -944,6 +1034,16 @@ table_algo dbutils_table_settings_get_algo (sqlite3 *db, const char *table_name)
     return (value) ? crdt_algo_from_name(value) : table_algo_none;
 }
 
+bool dbutils_table_settings_is_packed (sqlite3 *db, const char *table_name) {
+    DEBUG_SETTINGS("dbutils_table_settings_is_packed %s", table_name);
+    
+    char buffer[512];
+    char *value = dbutils_table_settings_get_value(db, table_name, "*", CLOUDSYNC_KEY_STORAGE, buffer, sizeof(buffer));
+    bool packed = (value && strcasecmp(value, CLOUDSYNC_STORAGE_PACKED) == 0);
+    if (value && value != buffer) cloudsync_memory_free(value);
+    return packed;
+}
+
 int dbutils_settings_load_callback (void *xdata, int ncols, char **values, char **names) {
     cloudsync_context *data = (cloudsync_context *)xdata;
     
@@ -958,6 +1058,7 @@ int dbutils_settings_load_callback (void *xdata, int ncols, char **values, char
 }
 
 bool table_add_to_context (sqlite3 *db, cloudsync_context *data, table_algo algo, const char *table_name);
+void cloudsync_schema_attach (sqlite3 *db, cloudsync_context *data);
 
 int dbutils_settings_table_load_callback (void *xdata, int ncols, char **values, char **names) {
     dbutils_settings_table_context *context = (dbutils_settings_table_context *)xdata;
@@ -972,6 +1073,7 @@ int dbutils_settings_table_load_callback (void *xdata, int ncols, char **values,
         if (strcmp(key, "algo")!=0) continue;
         
         if (dbutils_check_triggers(db, table_name, crdt_algo_from_name(value)) != SQLITE_OK) return SQLITE_MISUSE;
+        if (dbutils_check_metatable(db, table_name, crdt_algo_from_name(value)) != SQLITE_OK) return SQLITE_MISUSE;
         if (table_add_to_context(db, data, crdt_algo_from_name(value), table_name)  == false) return SQLITE_MISUSE;
         
         DEBUG_SETTINGS("load tbl_name: %s value: %s", key, value);
@@ -986,6 +1088,22 @@ bool dbutils_migrate (sqlite3 *db) {
     return true;
 }
 
+int dbutils_migrate_metatables (sqlite3 *db) {
+    // meta-tables cannot be rebuilt while cloudsync_table_settings is being iterated,
+    // so tables still using the TEXT col_name layout are migrated one at a time before loading them
+    const char *sql = "SELECT SUBSTR(m.name, 1, LENGTH(m.name) - 10) FROM sqlite_master AS m WHERE m.type = 'table' AND m.name LIKE '%_cloudsync' "
+                      "AND EXISTS (SELECT 1 FROM pragma_table_info(m.name) AS p WHERE p.name = 'col_name') LIMIT 1;";
+    
+    char *table = NULL;
+    while ((table = dbutils_text_select(db, sql)) != NULL) {
+        int rc = dbutils_migrate_metatable(db, table);
+        cloudsync_memory_free(table);
+        if (rc != SQLITE_OK) return rc;
+    }
+    
+    return SQLITE_OK;
+}
+
 int dbutils_settings_load (sqlite3 *db, cloudsync_context *data) {
     DEBUG_SETTINGS("dbutils_settings_load %p", data);
     
@@ -994,7 +1112,12 @@ int dbutils_settings_load (sqlite3 *db, cloudsync_context *data) {
     int rc = sqlite3_exec(db, sql, dbutils_settings_load_callback, data, NULL);
     if (rc != SQLITE_OK) DEBUG_ALWAYS("cloudsync_load_settings error: %s", sqlite3_errmsg(db));
     
-    // load table-specific settings
+    // upgrade meta-tables created by previous versions
+    rc = dbutils_migrate_metatables(db);
+    if (rc != SQLITE_OK) DEBUG_ALWAYS("cloudsync_load_settings error: %s", sqlite3_errmsg(db));
+    
+    // load table-specific settings (reusing the metadata of the other connections when shared_schema is enabled)
+    cloudsync_schema_attach(db, data);
     dbutils_settings_table_context xdata = {.db = db, .data = data};
     sql = "SELECT lower(tbl_name), lower(col_name), key, value FROM cloudsync_table_settings ORDER BY tbl_name;";
     rc = sqlite3_exec(db, sql, dbutils_settings_table_load_callback, &xdata, NULL);
@@ -1078,6 +1201,28 @@ int dbutils_settings_init (sqlite3 *db, void *cloudsync_data, sqlite3_context *c
         if (rc != SQLITE_OK) {if (context) sqlite3_result_error(context, sqlite3_errmsg(db), -1); return rc;}
     }
     
+    // check if cloudsync_site_versions table exists
+    if (dbutils_table_exists(db, CLOUDSYNC_SITE_VERSIONS_NAME) == false) {
+        DEBUG_SETTINGS("cloudsync_site_versions does not exist (creating a new one)");
+        
+        // per-origin high-water mark of the applied changes
+        // site_ord is the rowid of the origin in cloudsync_site_id, sender identifies the stream the (db_version, seq) pair belongs to
+        char *sql = "CREATE TABLE IF NOT EXISTS cloudsync_site_versions (site_ord INTEGER NOT NULL, sender INTEGER NOT NULL, db_version INTEGER NOT NULL, seq INTEGER NOT NULL, PRIMARY KEY(site_ord, sender)) WITHOUT ROWID;";
+        int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        if (rc != SQLITE_OK) {if (context) sqlite3_result_error(context, sqlite3_errmsg(db), -1); return rc;}
+    }
+    
+    // check if cloudsync_columns table exists
+    if (dbutils_table_exists(db, CLOUDSYNC_COLUMNS_NAME) == false) {
+        DEBUG_SETTINGS("cloudsync_columns does not exist (creating a new one)");
+        
+        // per-table column dictionary, meta-tables store col_id instead of the column name
+        // col_id 0 is reserved to the tombstone and ids are never reused, so they survive ALTER TABLE
+        char *sql = "CREATE TABLE IF NOT EXISTS cloudsync_columns (tbl_name TEXT NOT NULL COLLATE NOCASE, col_id INTEGER NOT NULL, col_name TEXT NOT NULL COLLATE NOCASE, PRIMARY KEY(tbl_name, col_id), UNIQUE(tbl_name, col_name));";
+        int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        if (rc != SQLITE_OK) {if (context) sqlite3_result_error(context, sqlite3_errmsg(db), -1); return rc;}
+    }
+    
     // cloudsync_settings table exists so load it
     dbutils_settings_load(db, data);
     
@@ -1136,6 +1281,6 @@ bool dbutils_check_schema_hash (sqlite3 *db, sqlite3_uint64 hash) {
 
 
 int dbutils_settings_cleanup (sqlite3 *db) {
-    const char *sql = "DROP TABLE IF EXISTS cloudsync_settings; DROP TABLE IF EXISTS cloudsync_site_id; DROP TABLE IF EXISTS cloudsync_table_settings; DROP TABLE IF EXISTS cloudsync_schema_versions; ";
+    const char *sql = "DROP TABLE IF EXISTS cloudsync_settings; DROP TABLE IF EXISTS cloudsync_site_id; DROP TABLE IF EXISTS cloudsync_table_settings; DROP TABLE IF EXISTS cloudsync_schema_versions; DROP TABLE IF EXISTS cloudsync_site_versions; DROP TABLE IF EXISTS cloudsync_columns; ";
     return sqlite3_exec(db, sql, NULL, NULL, NULL);
 }
@@ -16,6 +16,8 @@
 #define CLOUDSYNC_SITEID_NAME               "cloudsync_site_id"
 #define CLOUDSYNC_TABLE_SETTINGS_NAME       "cloudsync_table_settings"
 #define CLOUDSYNC_SCHEMA_VERSIONS_NAME      "cloudsync_schema_versions"
+#define CLOUDSYNC_SITE_VERSIONS_NAME        "cloudsync_site_versions"
+#define CLOUDSYNC_COLUMNS_NAME              "cloudsync_columns"
 
 #define CLOUDSYNC_KEY_LIBVERSION            "version"
 #define CLOUDSYNC_KEY_SCHEMAVERSION         "schemaversion"
@@ -23,8 +25,24 @@
 #define CLOUDSYNC_KEY_CHECK_SEQ             "check_seq"
 #define CLOUDSYNC_KEY_SEND_DBVERSION        "send_dbversion"
 #define CLOUDSYNC_KEY_SEND_SEQ              "send_seq"
+#define CLOUDSYNC_KEY_LOCAL_DBVERSION       "local_dbversion"
 #define CLOUDSYNC_KEY_DEBUG                 "debug"
 #define CLOUDSYNC_KEY_ALGO                  "algo"
+#define CLOUDSYNC_KEY_STORAGE               "storage"
+#define CLOUDSYNC_KEY_GC_HORIZON            "gc_horizon"
+#define CLOUDSYNC_KEY_GC_AUTO               "gc_auto"
+#define CLOUDSYNC_KEY_APPLY_GROUP_DBVERSIONS "apply_group_dbversions"
+#define CLOUDSYNC_KEY_APPLY_GROUP_ROWS      "apply_group_rows"
+#define CLOUDSYNC_KEY_APPLY_GROUP_MS        "apply_group_ms"
+#define CLOUDSYNC_KEY_BACKFILL_BATCH        "backfill_batch"
+#define CLOUDSYNC_KEY_STMT_CACHE_SIZE       "stmt_cache_size"
+#define CLOUDSYNC_KEY_SHARED_SCHEMA         "shared_schema"
+#define CLOUDSYNC_KEY_BACKFILL_CURSOR       "backfill_cursor"
+#define CLOUDSYNC_KEY_ATTACHED_DBVERSION    "attached_dbversion_"
+#define CLOUDSYNC_KEY_SITEID_HWM            "siteid_hwm"
+
+#define CLOUDSYNC_STORAGE_ROWS              "rows"
+#define CLOUDSYNC_STORAGE_PACKED            "packed"
 
 // general
 int dbutils_write_simple (sqlite3 *db, const char *sql);
@@ -53,6 +71,8 @@ bool dbutils_is_star_table (const char *table_name);
 int dbutils_delete_triggers (sqlite3 *db, const char *table);
 int dbutils_check_triggers (sqlite3 *db, const char *table, table_algo algo);
 int dbutils_check_metatable (sqlite3 *db, const char *table, table_algo algo);
+bool dbutils_table_has_rowid_pk (sqlite3 *db, const char *table);
+bool dbutils_metatable_is_intpk (sqlite3 *db, const char *table);
 sqlite3_int64 dbutils_schema_version (sqlite3 *db);
 
 // settings
@@ -65,6 +85,7 @@ int dbutils_table_settings_set_key_value (sqlite3 *db, sqlite3_context *context,
 sqlite3_int64 dbutils_table_settings_count_tables (sqlite3 *db);
 char *dbutils_table_settings_get_value (sqlite3 *db, const char *table, const char *column, const char *key, char *buffer, size_t blen);
 table_algo dbutils_table_settings_get_algo (sqlite3 *db, const char *table_name);
+bool dbutils_table_settings_is_packed (sqlite3 *db, const char *table_name);
 int dbutils_update_schema_hash(sqlite3 *db, uint64_t *hash);
 sqlite3_uint64 dbutils_schema_hash (sqlite3 *db);
 bool dbutils_check_schema_hash (sqlite3 *db, sqlite3_uint64 hash);
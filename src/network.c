@@ -8,6 +8,7 @@
 #ifndef CLOUDSYNC_OMIT_NETWORK
 
 #include <stdint.h>
+#include <stdlib.h>
 #include "network.h"
 #include "dbutils.h"
 #include "utils.h"
@@ -299,6 +300,15 @@ cleanup:
 }
 #endif
 
+void network_stats_request (sqlite3_context *context, size_t sent, NETWORK_RESULT *result) {
+    cloudsync_stats *stats = cloudsync_get_stats(context);
+    if (!stats) return;
+    
+    STATS_ADD(stats, CLOUDSYNC_STAT_NETWORK_REQUESTS, 1);
+    STATS_ADD(stats, CLOUDSYNC_STAT_NETWORK_BYTES_SENT, sent);
+    if (result && result->code == CLOUDSYNC_NETWORK_BUFFER) STATS_ADD(stats, CLOUDSYNC_STAT_NETWORK_BYTES_RECEIVED, result->blen);
+}
+
 int network_set_sqlite_result (sqlite3_context *context, NETWORK_RESULT *result) {
     int rc = 0;
     switch (result->code) {
@@ -334,7 +344,11 @@ int network_download_changes (sqlite3_context *context, const char *download_url
         return -1;
     }
     
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    TRACE_BEGIN(db, CLOUDSYNC_TRACE_DOWNLOAD);
     NETWORK_RESULT result = network_receive_buffer(data, download_url, NULL, false, false, NULL, NULL);
+    network_stats_request(context, 0, &result);
+    TRACE_END(db, CLOUDSYNC_TRACE_DOWNLOAD, NULL, -1, (result.code == CLOUDSYNC_NETWORK_BUFFER) ? (int64_t)result.blen : -1);
     
     int rc = SQLITE_OK;
     if (result.code == CLOUDSYNC_NETWORK_BUFFER) {
@@ -674,21 +688,35 @@ void cloudsync_network_set_apikey (sqlite3_context *context, int argc, sqlite3_v
 // MARK: -
 
 void cloudsync_network_has_unsent_changes (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    sqlite3 *db = sqlite3_context_db_handle(context);
-    
-    char *sql = "SELECT max(db_version), hex(site_id) FROM cloudsync_changes WHERE site_id == (SELECT site_id FROM cloudsync_site_id WHERE rowid=0)";
-    int last_local_change = (int)dbutils_int_select(db, sql);
-    if (last_local_change == 0) {
-        sqlite3_result_int(context, 0);
+    int result = cloudsync_has_unsent_changes(context);
+    if (result < 0) {
+        sqlite3_result_error(context, "Unable to retrieve the last local change.", -1);
         return;
     }
     
-    int sent_db_version = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_SEND_DBVERSION);
-    sqlite3_result_int(context, (sent_db_version < last_local_change));
+    sqlite3_result_int(context, result);
 }
 
-int cloudsync_network_send_changes_internal (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    DEBUG_FUNCTION("cloudsync_network_send_changes");
+void network_update_gc_horizon (sqlite3_context *context, const char *response) {
+    // the server can reply to the upload notification with the db_version of this site acknowledged by all the peers
+    // ({"horizon": N}), the tombstones older than that can be garbage collected (automatically if gc_auto is set)
+    const char *key = strstr(response, "\"horizon\"");
+    if (!key) return;
+    key = strchr(key, ':');
+    if (!key) return;
+    
+    long long horizon = strtoll(key + 1, NULL, 10);
+    if (horizon <= 0) return;
+    
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%lld", horizon);
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    if (dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_GC_HORIZON, buf) != SQLITE_OK) return;
+    
+    if (dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_GC_AUTO) == 1) sqlite3_exec(db, "SELECT cloudsync_gc('*');", NULL, NULL, NULL);
+}
+
+int network_send_changes (sqlite3_context *context, int argc, sqlite3_value **argv) {
     
     network_data *data = (network_data *)cloudsync_get_auxdata(context);
     if (!data) {sqlite3_result_error(context, "Unable to retrieve CloudSync context.", -1); return SQLITE_ERROR;}
@@ -703,7 +731,11 @@ int cloudsync_network_send_changes_internal (sqlite3_context *context, int argc,
     // exit if there is no data to send
     if (blob == NULL || blob_size == 0) return SQLITE_OK;
     
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    TRACE_BEGIN(db, CLOUDSYNC_TRACE_UPLOAD_URL);
     NETWORK_RESULT res = network_receive_buffer(data, data->upload_endpoint, data->authentication, true, false, NULL, CLOUDSYNC_HEADER_SQLITECLOUD);
+    network_stats_request(context, 0, &res);
+    TRACE_END(db, CLOUDSYNC_TRACE_UPLOAD_URL, NULL, -1, -1);
     if (res.code != CLOUDSYNC_NETWORK_BUFFER) {
         cloudsync_memory_free(blob);
         network_result_to_sqlite_error(context, res, "cloudsync_network_send_changes unable to receive upload URL");
@@ -711,7 +743,10 @@ int cloudsync_network_send_changes_internal (sqlite3_context *context, int argc,
     }
     
     const char *s3_url = res.buffer;
+    TRACE_BEGIN(db, CLOUDSYNC_TRACE_UPLOAD);
     bool sent = network_send_buffer(data, s3_url, NULL, blob, blob_size);
+    network_stats_request(context, (sent) ? (size_t)blob_size : 0, NULL);
+    TRACE_END(db, CLOUDSYNC_TRACE_UPLOAD, NULL, -1, blob_size);
     cloudsync_memory_free(blob);
     if (sent == false) {
         network_result_to_sqlite_error(context, res, "cloudsync_network_send_changes unable to upload BLOB changes to remote host.");
@@ -726,8 +761,11 @@ int cloudsync_network_send_changes_internal (sqlite3_context *context, int argc,
     network_result_cleanup(&res);
     
     // notify remote host that we succesfully uploaded changes
+    TRACE_BEGIN(db, CLOUDSYNC_TRACE_NOTIFY);
     res = network_receive_buffer(data, data->upload_endpoint, data->authentication, true, true, json_payload, CLOUDSYNC_HEADER_SQLITECLOUD);
-    if (res.code != CLOUDSYNC_NETWORK_OK) {
+    network_stats_request(context, strlen(json_payload), &res);
+    TRACE_END(db, CLOUDSYNC_TRACE_NOTIFY, NULL, -1, -1);
+    if (res.code != CLOUDSYNC_NETWORK_OK && res.code != CLOUDSYNC_NETWORK_BUFFER) {
         network_result_to_sqlite_error(context, res, "cloudsync_network_send_changes unable to notify BLOB upload to remote host.");
         network_result_cleanup(&res);
         return SQLITE_ERROR;
@@ -735,7 +773,7 @@ int cloudsync_network_send_changes_internal (sqlite3_context *context, int argc,
     
     // update db_version and seq
     char buf[256];
-    sqlite3 *db = sqlite3_context_db_handle(context);
+    if (res.code == CLOUDSYNC_NETWORK_BUFFER) network_update_gc_horizon(context, res.buffer);
     if (new_db_version != db_version) {
         snprintf(buf, sizeof(buf), "%lld", new_db_version);
         dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_SEND_DBVERSION, buf);
@@ -749,13 +787,27 @@ int cloudsync_network_send_changes_internal (sqlite3_context *context, int argc,
     return SQLITE_OK;
 }
 
+int cloudsync_network_send_changes_internal (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_network_send_changes");
+    
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    uint64_t start_us = cloudsync_time_us();
+    TRACE_BEGIN(db, CLOUDSYNC_TRACE_SEND);
+    int rc = network_send_changes(context, argc, argv);
+    TRACE_END(db, CLOUDSYNC_TRACE_SEND, NULL, -1, -1);
+    
+    cloudsync_stats *stats = cloudsync_get_stats(context);
+    if (stats) stats_latency_add(stats, CLOUDSYNC_LATENCY_SEND, start_us);
+    return rc;
+}
+
 void cloudsync_network_send_changes (sqlite3_context *context, int argc, sqlite3_value **argv) {
     DEBUG_FUNCTION("cloudsync_network_send_changes");
     
     cloudsync_network_send_changes_internal(context, argc, argv);
 }
 
-int cloudsync_network_check_internal(sqlite3_context *context) {
+int network_check_changes (sqlite3_context *context) {
     network_data *data = (network_data *)cloudsync_get_auxdata(context);
     if (!data) {sqlite3_result_error(context, "Unable to retrieve CloudSync context.", -1); return -1;}
      
@@ -772,7 +824,10 @@ int cloudsync_network_check_internal(sqlite3_context *context) {
     char endpoint[2024];
     snprintf(endpoint, sizeof(endpoint), "%s/%lld/%d/%s", data->check_endpoint, (long long)db_version, seq, CLOUDSYNC_ENDPOINT_CHECK);
     
+    TRACE_BEGIN(db, CLOUDSYNC_TRACE_CHECK_REQUEST);
     NETWORK_RESULT result = network_receive_buffer(data, endpoint, data->authentication, true, true, NULL, CLOUDSYNC_HEADER_SQLITECLOUD);
+    network_stats_request(context, 0, &result);
+    TRACE_END(db, CLOUDSYNC_TRACE_CHECK_REQUEST, NULL, -1, -1);
     int rc = SQLITE_OK;
     if (result.code == CLOUDSYNC_NETWORK_BUFFER) {
         rc = network_download_changes(context, result.buffer);
@@ -783,14 +838,38 @@ int cloudsync_network_check_internal(sqlite3_context *context) {
     return rc;
 }
 
+int cloudsync_network_check_internal (sqlite3_context *context) {
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    uint64_t start_us = cloudsync_time_us();
+    TRACE_BEGIN(db, CLOUDSYNC_TRACE_CHECK);
+    int rc = network_check_changes(context);
+    TRACE_END(db, CLOUDSYNC_TRACE_CHECK, NULL, (rc >= 0) ? rc : -1, -1);
+    
+    cloudsync_stats *stats = cloudsync_get_stats(context);
+    if (stats) stats_latency_add(stats, CLOUDSYNC_LATENCY_CHECK, start_us);
+    return rc;
+}
+
 void cloudsync_network_sync (sqlite3_context *context, int wait_ms, int max_retries) {
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    TRACE_BEGIN(db, CLOUDSYNC_TRACE_SYNC);
+    
     int rc = cloudsync_network_send_changes_internal(context, 0, NULL);
-    if (rc != SQLITE_OK) return;
+    if (rc != SQLITE_OK) {
+        TRACE_END(db, CLOUDSYNC_TRACE_SYNC, NULL, -1, -1);
+        return;
+    }
     
     int ntries = 0;
     int nrows = 0;
     while (ntries < max_retries) {
-        if (ntries > 0) sqlite3_sleep(wait_ms);
+        if (ntries > 0) {
+            TRACE_BEGIN(db, CLOUDSYNC_TRACE_WAIT);
+            sqlite3_sleep(wait_ms);
+            TRACE_END(db, CLOUDSYNC_TRACE_WAIT, NULL, -1, -1);
+            cloudsync_stats *stats = cloudsync_get_stats(context);
+            if (stats) STATS_ADD(stats, CLOUDSYNC_STAT_NETWORK_RETRIES, 1);
+        }
         nrows = cloudsync_network_check_internal(context);
         if (nrows > 0) break;
         ntries++;
@@ -832,6 +911,9 @@ void cloudsync_network_reset_sync_version (sqlite3_context *context, int argc, s
     dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_CHECK_SEQ, buf);
     dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_SEND_DBVERSION, buf);
     dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_SEND_SEQ, buf);
+    
+    // the server could have been reset too, so forget the per-origin high-water marks of the applied changes
+    dbutils_write_simple(db, "DELETE FROM cloudsync_site_versions;");
 }
 
 /**
@@ -848,8 +930,8 @@ void cloudsync_network_logout (sqlite3_context *context, int argc, sqlite3_value
     // if the network layer is enabled, remove the token or apikey
     sqlite3_exec(db, "SELECT cloudsync_network_set_token('');", NULL, NULL, NULL);
     
-    // get the list of cloudsync-enabled tables
-    char *sql = "SELECT tbl_name, key, value FROM cloudsync_table_settings;";
+    // get the list of cloudsync-enabled tables (and their storage mode)
+    char *sql = "SELECT t.tbl_name, t.key, t.value, IFNULL((SELECT s.value FROM cloudsync_table_settings AS s WHERE s.tbl_name = t.tbl_name AND s.key = '" CLOUDSYNC_KEY_STORAGE "'), '" CLOUDSYNC_STORAGE_ROWS "') FROM cloudsync_table_settings AS t;";
     char **result = NULL;
     int nrows, ncols;
     int rc = sqlite3_get_table(db, sql, &result, &nrows, &ncols, NULL);
@@ -878,6 +960,7 @@ void cloudsync_network_logout (sqlite3_context *context, int argc, sqlite3_value
         char *tbl_name  = result[i * ncols + 0];
         char *key       = result[i * ncols + 1];
         char *value     = result[i * ncols + 2];
+        char *storage   = result[i * ncols + 3];
         
         if (strcmp(key, "algo") != 0) continue;
         
@@ -889,7 +972,7 @@ void cloudsync_network_logout (sqlite3_context *context, int argc, sqlite3_value
             goto finalize;
         }
         
-        sql = cloudsync_memory_mprintf("SELECT cloudsync_init('%q', '%q', 1);", tbl_name, value);
+        sql = cloudsync_memory_mprintf("SELECT cloudsync_init('%q', '%q', 1, '%q');", tbl_name, value, storage);
         rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
         cloudsync_memory_free(sql);
         if (rc != SQLITE_OK) {
@@ -229,6 +229,25 @@ int pk_decode_prikey (char *buffer, size_t blen, int (*cb) (void *xdata, int ind
     return pk_decode(buffer, blen, count, &bseek, cb, xdata);
 }
 
+bool pk_decode_prikey_int64 (char *buffer, size_t blen, int64_t *value) {
+    // fast path for a primary key that contains a single integer value (no callback involved)
+    size_t bseek = 0;
+    if (blen < 2 || pk_decode_u8(buffer, &bseek) != 1) return false;
+    
+    uint8_t type_byte = pk_decode_u8(buffer, &bseek);
+    int type = (int)(type_byte & 0x07);
+    size_t nbytes = (type_byte >> 3) & 0x1F;
+    if (bseek + nbytes != blen) return false;
+    
+    switch (type) {
+        case SQLITE_MAX_NEGATIVE_INTEGER: *value = INT64_MIN; return true;
+        case SQLITE_INTEGER: *value = pk_decode_int64(buffer, &bseek, nbytes); return true;
+        case SQLITE_NEGATIVE_INTEGER: *value = -pk_decode_int64(buffer, &bseek, nbytes); return true;
+    }
+    
+    return false;
+}
+
 // MARK: - Encoding -
 
 size_t pk_encode_nbytes_needed (int64_t value) {
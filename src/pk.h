@@ -22,6 +22,7 @@
 char *pk_encode_prikey (sqlite3_value **argv, int argc, char *b, size_t *bsize);
 char *pk_encode (sqlite3_value **argv, int argc, char *b, bool is_prikey, size_t *bsize);
 int pk_decode_prikey (char *buffer, size_t blen, int (*cb) (void *xdata, int index, int type, int64_t ival, double dval, char *pval), void *xdata);
+bool pk_decode_prikey_int64 (char *buffer, size_t blen, int64_t *value);
 int pk_decode(char *buffer, size_t blen, int count, size_t *seek, int (*cb) (void *xdata, int index, int type, int64_t ival, double dval, char *pval), void *xdata);
 int pk_decode_bind_callback (void *xdata, int index, int type, int64_t ival, double dval, char *pval);
 int pk_decode_print_callback (void *xdata, int index, int type, int64_t ival, double dval, char *pval);
@@ -0,0 +1,229 @@
+//
+//  schema.c
+//  cloudsync
+//
+
+#include "schema.h"
+
+#ifndef SQLITE_CORE
+SQLITE_EXTENSION_INIT3
+#endif
+
+/*
+
+ Process-wide metadata of the synced tables (enabled by the shared_schema setting).
+
+ Every connection builds its table contexts from pragma_table_info and from the cloudsync_columns dictionary,
+ with many connections to the same database that work is repeated on each open and its result is duplicated.
+ The metadata is instead published in an entry identified by the database (its path and its site_id, so that a
+ file replaced by another database is not confused with the previous one) and by its schema hash, and the
+ connections opened later on the same database reuse it as long as the schema hash doesn't change.
+
+ Published metadata is never modified, so it is read without locks. The list of entries and the tables of each
+ entry are protected by a mutex owned by the extension (the static application mutexes of SQLite are left to the
+ application that embeds it), allocated once by schema_init. An entry is reference counted (by the connection that acquired it
+ and by each table context that uses its metadata) and it is freed with its last reference. An invalidated entry
+ is removed from the list, so it is no longer acquired, but it stays valid for the connections that use it.
+
+ */
+
+struct schema_shared {
+    char            *path;
+    uint8_t         site_id[UUID_LEN];
+    uint64_t        hash;
+    int             refcount;
+    schema_table    **tables;
+    int             ntables;
+    int             nalloc;
+    schema_shared   *next;                          // NULL also once invalidated
+};
+
+static schema_shared *schema_list = NULL;
+static sqlite3_mutex *schema_mutex = NULL;          // never freed, NULL if SQLite is built without mutexes
+
+#define SCHEMA_LOCK()                       sqlite3_mutex_enter(schema_mutex)
+#define SCHEMA_UNLOCK()                     sqlite3_mutex_leave(schema_mutex)
+
+// MARK: -
+
+void schema_init (void) {
+    // called by every connection before it uses the shared metadata, the static main mutex serializes the allocation
+    sqlite3_mutex *main_mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_MAIN);
+    sqlite3_mutex_enter(main_mutex);
+    if (!schema_mutex) schema_mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+    sqlite3_mutex_leave(main_mutex);
+}
+
+void schema_finalize (void) {
+    // frees the mutex once no entry is left, only when no connection can still use it (before sqlite3_shutdown)
+    if (schema_list || !schema_mutex) return;
+    sqlite3_mutex_free(schema_mutex);
+    schema_mutex = NULL;
+}
+
+void schema_table_free (schema_table *table) {
+    if (!table) return;
+    
+    if (table->col_name) {
+        for (int i=0; i<table->ncols; ++i) {
+            if (table->col_name[i]) cloudsync_memory_free(table->col_name[i]);
+        }
+        cloudsync_memory_free(table->col_name);
+    }
+    if (table->col_id) cloudsync_memory_free(table->col_id);
+    if (table->name) cloudsync_memory_free(table->name);
+    cloudsync_memory_free(table);
+}
+
+static void schema_shared_free (schema_shared *schema) {
+    for (int i=0; i<schema->ntables; ++i) {
+        schema_table_free(schema->tables[i]);
+    }
+    if (schema->tables) cloudsync_memory_free(schema->tables);
+    if (schema->path) cloudsync_memory_free(schema->path);
+    cloudsync_memory_free(schema);
+}
+
+static void schema_shared_unlink (schema_shared *schema) {
+    // must be called with the lock held
+    schema_shared **p = &schema_list;
+    while (*p) {
+        if (*p == schema) {
+            *p = schema->next;
+            schema->next = NULL;
+            return;
+        }
+        p = &(*p)->next;
+    }
+}
+
+// MARK: -
+
+schema_shared *schema_shared_acquire (const char *path, const uint8_t site_id[UUID_LEN], uint64_t hash) {
+    // an in-memory or temporary database cannot be opened by another connection
+    if (!path || path[0] == 0) return NULL;
+    
+    SCHEMA_LOCK();
+    schema_shared *schema = schema_list;
+    while (schema) {
+        if (schema->hash == hash && memcmp(schema->site_id, site_id, UUID_LEN) == 0 && strcmp(schema->path, path) == 0) break;
+        schema = schema->next;
+    }
+    
+    if (!schema) {
+        schema = (schema_shared *)cloudsync_memory_zeroalloc(sizeof(schema_shared));
+        if (schema) schema->path = cloudsync_string_dup(path, false);
+        if (schema && !schema->path) {
+            cloudsync_memory_free(schema);
+            schema = NULL;
+        }
+        if (schema) {
+            memcpy(schema->site_id, site_id, UUID_LEN);
+            schema->hash = hash;
+            schema->next = schema_list;
+            schema_list = schema;
+        }
+    }
+    
+    if (schema) schema->refcount++;
+    SCHEMA_UNLOCK();
+    return schema;
+}
+
+void schema_shared_retain (schema_shared *schema) {
+    SCHEMA_LOCK();
+    schema->refcount++;
+    SCHEMA_UNLOCK();
+}
+
+void schema_shared_release (schema_shared *schema) {
+    if (!schema) return;
+    
+    SCHEMA_LOCK();
+    bool last = (--schema->refcount == 0);
+    if (last) schema_shared_unlink(schema);
+    SCHEMA_UNLOCK();
+    
+    if (last) schema_shared_free(schema);
+}
+
+void schema_shared_invalidate (const char *path) {
+    // called before the schema of the database is changed, the connections opened later build a new entry
+    if (!path || path[0] == 0) return;
+    
+    SCHEMA_LOCK();
+    schema_shared **p = &schema_list;
+    while (*p) {
+        schema_shared *schema = *p;
+        if (strcmp(schema->path, path) == 0) {
+            *p = schema->next;
+            schema->next = NULL;
+        } else {
+            p = &schema->next;
+        }
+    }
+    SCHEMA_UNLOCK();
+}
+
+const schema_table *schema_shared_lookup (schema_shared *schema, const char *name) {
+    const schema_table *table = NULL;
+    
+    SCHEMA_LOCK();
+    for (int i=0; i<schema->ntables; ++i) {
+        if (strcasecmp(schema->tables[i]->name, name) == 0) {
+            table = schema->tables[i];
+            break;
+        }
+    }
+    SCHEMA_UNLOCK();
+    return table;
+}
+
+const schema_table *schema_shared_publish (schema_shared *schema, schema_table *table) {
+    // returns the published metadata (table itself, or the one published in the meantime by another connection
+    // in which case table is freed), NULL if it cannot be published and table is still owned by the caller
+    const schema_table *result = NULL;
+    bool duplicated = false;
+    
+    SCHEMA_LOCK();
+    for (int i=0; i<schema->ntables; ++i) {
+        if (strcasecmp(schema->tables[i]->name, table->name) == 0) {
+            result = schema->tables[i];
+            duplicated = true;
+            break;
+        }
+    }
+    
+    if (!result && schema->ntables == schema->nalloc) {
+        int nalloc = (schema->nalloc) ? schema->nalloc * 2 : 16;
+        schema_table **clone = (schema_table **)cloudsync_memory_realloc(schema->tables, (uint64_t)(sizeof(schema_table *) * nalloc));
+        if (clone) {
+            schema->tables = clone;
+            schema->nalloc = nalloc;
+        }
+    }
+    
+    if (!result && schema->ntables < schema->nalloc) {
+        schema->tables[schema->ntables++] = table;
+        result = table;
+    }
+    SCHEMA_UNLOCK();
+    
+    if (duplicated) schema_table_free(table);
+    return result;
+}
+
+void schema_shared_info (int *nschemas, int *nrefs) {
+    // number of entries that can be acquired and sum of their references
+    int count = 0, refs = 0;
+    
+    SCHEMA_LOCK();
+    for (schema_shared *schema = schema_list; schema; schema = schema->next) {
+        count++;
+        refs += schema->refcount;
+    }
+    SCHEMA_UNLOCK();
+    
+    if (nschemas) *nschemas = count;
+    if (nrefs) *nrefs = refs;
+}
@@ -0,0 +1,38 @@
+//
+//  schema.h
+//  cloudsync
+//
+
+#ifndef __CLOUDSYNC_SCHEMA__
+#define __CLOUDSYNC_SCHEMA__
+
+#include "utils.h"
+
+// metadata of a synced table discovered from its schema, read-only once published
+typedef struct {
+    char            *name;
+    char            **col_name;                     // non primary key columns (in cid order)
+    int             *col_id;                        // id of each column in the cloudsync_columns dictionary
+    int             ncols;
+    int             npks;
+    bool            rowid_only;
+} schema_table;
+
+// the metadata shared by all the connections to the same database with the same schema
+typedef struct schema_shared schema_shared;
+
+void schema_init (void);
+void schema_finalize (void);
+
+schema_shared *schema_shared_acquire (const char *path, const uint8_t site_id[UUID_LEN], uint64_t hash);
+void schema_shared_retain (schema_shared *schema);
+void schema_shared_release (schema_shared *schema);
+void schema_shared_invalidate (const char *path);
+
+const schema_table *schema_shared_lookup (schema_shared *schema, const char *name);
+const schema_table *schema_shared_publish (schema_shared *schema, schema_table *table);
+void schema_table_free (schema_table *table);
+
+void schema_shared_info (int *nschemas, int *nrefs);
+
+#endif
@@ -0,0 +1,79 @@
+//
+//  stats.c
+//  cloudsync
+//
+
+#include <string.h>
+#include "stats.h"
+#include "utils.h"
+
+/*
+
+ Counters and latency histograms exposed by the cloudsync_stats virtual table.
+
+ The collection is always enabled, so it must stay cheap: counters are plain (non atomic) increments because
+ a cloudsync context is owned by a single connection, latencies are recorded once per payload or network
+ request (never per row) into log2 buckets of microseconds.
+
+ */
+
+static const char *stats_names[CLOUDSYNC_STAT_COUNT] = {
+    "local_inserts",
+    "local_updates",
+    "local_deletes",
+    "meta_statements",
+    "merges_attempted",
+    "merges_won",
+    "merges_lost",
+    "merges_skipped_cl",
+    "payload_bytes_raw",
+    "payload_bytes_compressed",
+    "rows_encoded",
+    "rows_decoded",
+    "network_requests",
+    "network_bytes_sent",
+    "network_bytes_received",
+    "network_retries",
+    "stmt_cache_hits",
+    "stmt_cache_misses",
+    "stmt_cache_evictions"
+};
+
+static const char *stats_latency_names[CLOUDSYNC_LATENCY_COUNT] = {
+    "encode_latency_us",
+    "apply_latency_us",
+    "send_latency_us",
+    "check_latency_us"
+};
+
+// MARK: -
+
+const char *stats_name (int stat) {
+    return (stat >= 0 && stat < CLOUDSYNC_STAT_COUNT) ? stats_names[stat] : NULL;
+}
+
+const char *stats_latency_name (int latency) {
+    return (latency >= 0 && latency < CLOUDSYNC_LATENCY_COUNT) ? stats_latency_names[latency] : NULL;
+}
+
+uint64_t stats_bucket_limit (int bucket) {
+    // exclusive upper bound (in us) of the durations counted by bucket
+    return ((uint64_t)1) << bucket;
+}
+
+void stats_latency_add (cloudsync_stats *stats, cloudsync_latency latency, uint64_t start_us) {
+    uint64_t now = cloudsync_time_us();
+    uint64_t elapsed = (now > start_us) ? now - start_us : 0;
+    
+    int bucket = 0;
+    while (elapsed && bucket < CLOUDSYNC_LATENCY_BUCKETS - 1) {
+        elapsed >>= 1;
+        ++bucket;
+    }
+    
+    stats->latency[latency][bucket] += 1;
+}
+
+void stats_clear (cloudsync_stats *stats) {
+    memset(stats, 0, sizeof(cloudsync_stats));
+}
@@ -0,0 +1,63 @@
+//
+//  stats.h
+//  cloudsync
+//
+
+#ifndef __CLOUDSYNC_STATS__
+#define __CLOUDSYNC_STATS__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// counters collected per connection (the first CLOUDSYNC_STAT_TABLE_COUNT are also collected per table)
+typedef enum {
+    CLOUDSYNC_STAT_LOCAL_INSERTS            = 0,
+    CLOUDSYNC_STAT_LOCAL_UPDATES,
+    CLOUDSYNC_STAT_LOCAL_DELETES,
+    CLOUDSYNC_STAT_META_STATEMENTS,
+    CLOUDSYNC_STAT_MERGES_ATTEMPTED,
+    CLOUDSYNC_STAT_MERGES_WON,
+    CLOUDSYNC_STAT_MERGES_LOST,
+    CLOUDSYNC_STAT_MERGES_SKIPPED_CL,
+    CLOUDSYNC_STAT_PAYLOAD_BYTES_RAW,
+    CLOUDSYNC_STAT_PAYLOAD_BYTES_COMPRESSED,
+    CLOUDSYNC_STAT_ROWS_ENCODED,
+    CLOUDSYNC_STAT_ROWS_DECODED,
+    CLOUDSYNC_STAT_NETWORK_REQUESTS,
+    CLOUDSYNC_STAT_NETWORK_BYTES_SENT,
+    CLOUDSYNC_STAT_NETWORK_BYTES_RECEIVED,
+    CLOUDSYNC_STAT_NETWORK_RETRIES,
+    CLOUDSYNC_STAT_STMT_CACHE_HITS,
+    CLOUDSYNC_STAT_STMT_CACHE_MISSES,
+    CLOUDSYNC_STAT_STMT_CACHE_EVICTIONS,
+    CLOUDSYNC_STAT_COUNT
+} cloudsync_stat;
+
+#define CLOUDSYNC_STAT_TABLE_COUNT          (CLOUDSYNC_STAT_MERGES_SKIPPED_CL + 1)
+
+typedef enum {
+    CLOUDSYNC_LATENCY_ENCODE                = 0,
+    CLOUDSYNC_LATENCY_APPLY,
+    CLOUDSYNC_LATENCY_SEND,
+    CLOUDSYNC_LATENCY_CHECK,
+    CLOUDSYNC_LATENCY_COUNT
+} cloudsync_latency;
+
+// bucket 0 counts the durations under 1us, bucket i (i > 0) the durations in [2^(i-1), 2^i) us,
+// the last bucket also counts everything longer
+#define CLOUDSYNC_LATENCY_BUCKETS           32
+
+typedef struct {
+    uint64_t    counters[CLOUDSYNC_STAT_COUNT];
+    uint64_t    latency[CLOUDSYNC_LATENCY_COUNT][CLOUDSYNC_LATENCY_BUCKETS];
+} cloudsync_stats;
+
+#define STATS_ADD(_stats, _stat, _n)                ((_stats)->counters[_stat] += (uint64_t)(_n))
+
+const char *stats_name (int stat);
+const char *stats_latency_name (int latency);
+uint64_t stats_bucket_limit (int bucket);
+void stats_latency_add (cloudsync_stats *stats, cloudsync_latency latency, uint64_t start_us);
+void stats_clear (cloudsync_stats *stats);
+
+#endif
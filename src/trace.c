@@ -0,0 +1,140 @@
+//
+//  trace.c
+//  cloudsync
+//
+
+#include <stdlib.h>
+#include "trace.h"
+
+#ifndef SQLITE_CORE
+SQLITE_EXTENSION_INIT3
+#endif
+
+/*
+
+ Tracing reports a begin and an end event for each phase of encode, apply, send, check and sync
+ (see the CLOUDSYNC_TRACE_* phases), nested phases are reported inside the phase that contains them.
+
+ The tracer is stored as connection client data, so nothing is computed when no tracer is registered.
+ The file sink writes the events in the Chrome trace event format (a JSON array of "B"/"E" events with
+ ts in us) that can be loaded by chrome://tracing or Perfetto.
+
+ */
+
+#define CLOUDSYNC_TRACE_KEY             "cloudsync_trace_callback"
+
+typedef struct {
+    cloudsync_trace_callback_t  callback;
+    void                        *xdata;
+    void                        (*xdestroy)(void *);
+} cloudsync_tracer;
+
+// MARK: - Tracer -
+
+static void trace_tracer_free (void *ptr) {
+    cloudsync_tracer *tracer = (cloudsync_tracer *)ptr;
+    if (tracer->xdestroy) tracer->xdestroy(tracer->xdata);
+    cloudsync_memory_free(tracer);
+}
+
+bool cloudsync_set_trace_callback (sqlite3 *db, cloudsync_trace_callback_t callback, void *xdata, void (*xdestroy)(void *)) {
+    // client data requires SQLite 3.44.0 or later
+    if (sqlite3_libversion_number() < 3044000) {
+        if (xdestroy) xdestroy(xdata);
+        return false;
+    }
+    
+    cloudsync_tracer *tracer = NULL;
+    if (callback) {
+        tracer = (cloudsync_tracer *)cloudsync_memory_zeroalloc(sizeof(cloudsync_tracer));
+        if (!tracer) {
+            if (xdestroy) xdestroy(xdata);
+            return false;
+        }
+        tracer->callback = callback;
+        tracer->xdata = xdata;
+        tracer->xdestroy = xdestroy;
+    }
+    
+    // the previous tracer (if any) is released by SQLite
+    return (sqlite3_set_clientdata(db, CLOUDSYNC_TRACE_KEY, tracer, (tracer) ? trace_tracer_free : NULL) == SQLITE_OK);
+}
+
+void trace_event (sqlite3 *db, cloudsync_trace_event event, const char *phase, const char *table, int64_t rows, int64_t bytes) {
+    if (!db || sqlite3_libversion_number() < 3044000) return;
+    
+    cloudsync_tracer *tracer = (cloudsync_tracer *)sqlite3_get_clientdata(db, CLOUDSYNC_TRACE_KEY);
+    if (!tracer) return;
+    
+    cloudsync_trace_attrs attrs = {.table = table, .rows = rows, .bytes = bytes};
+    tracer->callback(tracer->xdata, event, phase, cloudsync_time_us(), &attrs);
+}
+
+// MARK: - File Sink -
+
+#ifdef CLOUDSYNC_DESKTOP_OS
+
+typedef struct {
+    FILE        *file;
+    bool        empty;
+} trace_file;
+
+static void trace_file_string (FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void trace_file_callback (void *xdata, cloudsync_trace_event event, const char *phase, uint64_t ts_us, const cloudsync_trace_attrs *attrs) {
+    trace_file *sink = (trace_file *)xdata;
+    FILE *f = sink->file;
+    
+    fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"cloudsync\",\"ph\":\"%s\",\"ts\":%llu,\"pid\":1,\"tid\":1", (sink->empty) ? "" : ",\n",
+            phase, (event == CLOUDSYNC_TRACE_BEGIN) ? "B" : "E", (unsigned long long)ts_us);
+    sink->empty = false;
+    
+    if (attrs->table || attrs->rows >= 0 || attrs->bytes >= 0) {
+        const char *sep = "";
+        fputs(",\"args\":{", f);
+        if (attrs->table) {fputs("\"table\":", f); trace_file_string(f, attrs->table); sep = ",";}
+        if (attrs->rows >= 0) {fprintf(f, "%s\"rows\":%lld", sep, (long long)attrs->rows); sep = ",";}
+        if (attrs->bytes >= 0) fprintf(f, "%s\"bytes\":%lld", sep, (long long)attrs->bytes);
+        fputc('}', f);
+    }
+    fputc('}', f);
+    
+    // each phase is flushed when it ends, so the file is readable while the connection is still open
+    if (event == CLOUDSYNC_TRACE_END) fflush(f);
+}
+
+static void trace_file_close (void *xdata) {
+    trace_file *sink = (trace_file *)xdata;
+    fputs("\n]\n", sink->file);
+    fclose(sink->file);
+    cloudsync_memory_free(sink);
+}
+
+bool trace_file_open (sqlite3 *db, const char *path) {
+    // a NULL path closes the current sink
+    if (!path) return cloudsync_set_trace_callback(db, NULL, NULL, NULL);
+    
+    trace_file *sink = (trace_file *)cloudsync_memory_zeroalloc(sizeof(trace_file));
+    if (!sink) return false;
+    
+    sink->file = fopen(path, "w");
+    if (!sink->file) {
+        cloudsync_memory_free(sink);
+        return false;
+    }
+    sink->empty = true;
+    fputs("[\n", sink->file);
+    
+    return cloudsync_set_trace_callback(db, trace_file_callback, sink, trace_file_close);
+}
+
+#endif
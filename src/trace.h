@@ -0,0 +1,55 @@
+//
+//  trace.h
+//  cloudsync
+//
+
+#ifndef __CLOUDSYNC_TRACE__
+#define __CLOUDSYNC_TRACE__
+
+#include "utils.h"
+
+typedef enum {
+    CLOUDSYNC_TRACE_BEGIN   = 0,
+    CLOUDSYNC_TRACE_END     = 1
+} cloudsync_trace_event;
+
+typedef struct {
+    const char      *table;             // NULL if the phase is not about a single table
+    int64_t         rows;               // -1 if unknown
+    int64_t         bytes;              // -1 if unknown
+} cloudsync_trace_attrs;
+
+// ts_us is a monotonic timestamp in us, the attributes are usually known only by the CLOUDSYNC_TRACE_END event
+typedef void (*cloudsync_trace_callback_t)(void *xdata, cloudsync_trace_event event, const char *phase, uint64_t ts_us, const cloudsync_trace_attrs *attrs);
+
+// phases
+#define CLOUDSYNC_TRACE_ENCODE          "encode"
+#define CLOUDSYNC_TRACE_COMPRESS        "compress"
+#define CLOUDSYNC_TRACE_APPLY           "apply"
+#define CLOUDSYNC_TRACE_DECOMPRESS      "decompress"
+#define CLOUDSYNC_TRACE_MERGE           "merge"
+#define CLOUDSYNC_TRACE_PAYLOAD_GET     "payload_get"
+#define CLOUDSYNC_TRACE_SEND            "send"
+#define CLOUDSYNC_TRACE_UPLOAD_URL      "upload_url"
+#define CLOUDSYNC_TRACE_UPLOAD          "upload"
+#define CLOUDSYNC_TRACE_NOTIFY          "notify"
+#define CLOUDSYNC_TRACE_CHECK           "check"
+#define CLOUDSYNC_TRACE_CHECK_REQUEST   "check_request"
+#define CLOUDSYNC_TRACE_DOWNLOAD        "download"
+#define CLOUDSYNC_TRACE_SYNC            "sync"
+#define CLOUDSYNC_TRACE_WAIT            "wait"
+#define CLOUDSYNC_TRACE_BACKFILL        "backfill"
+
+// a NULL callback removes the current one (xdestroy, if any, is called with xdata when the callback is removed or the connection closed)
+bool cloudsync_set_trace_callback (sqlite3 *db, cloudsync_trace_callback_t callback, void *xdata, void (*xdestroy)(void *));
+
+void trace_event (sqlite3 *db, cloudsync_trace_event event, const char *phase, const char *table, int64_t rows, int64_t bytes);
+#define TRACE_BEGIN(_db, _phase)                            trace_event(_db, CLOUDSYNC_TRACE_BEGIN, _phase, NULL, -1, -1)
+#define TRACE_END(_db, _phase, _table, _rows, _bytes)       trace_event(_db, CLOUDSYNC_TRACE_END, _phase, _table, _rows, _bytes)
+
+// available only on Desktop OS
+#ifdef CLOUDSYNC_DESKTOP_OS
+bool trace_file_open (sqlite3 *db, const char *path);
+#endif
+
+#endif
@@ -129,6 +129,34 @@ int cloudsync_uuid_v7_compare (uint8_t value1[UUID_LEN], uint8_t value2[UUID_LEN
 
 // MARK: - General -
 
+uint64_t cloudsync_time_ms (void) {
+    // wall clock time in ms (0 if it cannot be retrieved), used only to measure elapsed intervals
+    struct timespec ts;
+    #ifdef __ANDROID__
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) return 0;
+    #else
+    if (timespec_get(&ts, TIME_UTC) == 0) return 0;
+    #endif
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+uint64_t cloudsync_time_us (void) {
+    // monotonic time in us (0 if it cannot be retrieved), used to measure latencies and to timestamp trace events
+    #ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    if (!QueryPerformanceFrequency(&freq) || !QueryPerformanceCounter(&count)) return 0;
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / (uint64_t)freq.QuadPart;
+    #else
+    struct timespec ts;
+    #ifdef CLOCK_MONOTONIC
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) return 0;
+    #else
+    if (timespec_get(&ts, TIME_UTC) == 0) return 0;
+    #endif
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+    #endif
+}
+
 void *cloudsync_memory_zeroalloc (uint64_t size) {
     void *ptr = (void *)cloudsync_memory_alloc((sqlite3_uint64)size);
     if (!ptr) return NULL;
@@ -291,6 +319,142 @@ uint64_t fnv1a_hash (const char *data, size_t len) {
     return h_final;
 }
 
+// MARK: - Arena -
+
+// sqlite3_malloc guarantees an 8 bytes alignment, the arena keeps the same one
+#define CLOUDSYNC_ARENA_ALIGN(_n)           (((_n) + 7) & ~((size_t)7))
+
+struct cloudsync_arena_block {
+    cloudsync_arena_block   *next;
+    size_t                  size;
+    size_t                  used;
+    char                    data[];
+};
+
+#if CLOUDSYNC_DEBUG_MEMORY
+static uint64_t arena_nalloc, arena_current, arena_max;
+#endif
+
+static void arena_block_free (cloudsync_arena *arena, cloudsync_arena_block *block) {
+    arena->allocated -= block->size;
+    #if CLOUDSYNC_DEBUG_MEMORY
+    arena_current -= block->size;
+    #endif
+    cloudsync_memory_free(block);
+}
+
+void cloudsync_arena_init (cloudsync_arena *arena, size_t block_size) {
+    memset(arena, 0, sizeof(cloudsync_arena));
+    arena->block_size = CLOUDSYNC_ARENA_ALIGN(block_size);
+}
+
+void *cloudsync_arena_alloc (cloudsync_arena *arena, size_t size) {
+    size_t asize = CLOUDSYNC_ARENA_ALIGN((size) ? size : 1);
+    cloudsync_arena_block *block = arena->head;
+    
+    // with the memory debugger each allocation gets its own block, so leaks and overflows are reported with the
+    // call stack of the allocation instead of the one of the block
+    #if CLOUDSYNC_DEBUG_MEMORY
+    block = NULL;
+    size_t bsize = asize;
+    #else
+    size_t bsize = (asize > arena->block_size) ? asize : arena->block_size;
+    #endif
+    
+    if (!block || block->size - block->used < asize) {
+        block = (cloudsync_arena_block *)cloudsync_memory_alloc((sqlite3_uint64)(sizeof(cloudsync_arena_block) + bsize));
+        if (!block) return NULL;
+        
+        block->next = arena->head;
+        block->size = bsize;
+        block->used = 0;
+        arena->head = block;
+        arena->nblocks++;
+        arena->allocated += bsize;
+        if (arena->allocated > arena->peak) arena->peak = arena->allocated;
+        #if CLOUDSYNC_DEBUG_MEMORY
+        arena_current += bsize;
+        if (arena_current > arena_max) arena_max = arena_current;
+        #endif
+    }
+    
+    void *ptr = block->data + block->used;
+    block->used += asize;
+    arena->nalloc++;
+    #if CLOUDSYNC_DEBUG_MEMORY
+    arena_nalloc++;
+    #endif
+    return ptr;
+}
+
+void *cloudsync_arena_realloc (cloudsync_arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (!ptr) return cloudsync_arena_alloc(arena, new_size);
+    
+    // the last allocation of the current block grows (or shrinks) in place
+    cloudsync_arena_block *block = arena->head;
+    size_t old_asize = CLOUDSYNC_ARENA_ALIGN((old_size) ? old_size : 1);
+    size_t new_asize = CLOUDSYNC_ARENA_ALIGN((new_size) ? new_size : 1);
+    if (block && (char *)ptr + old_asize == block->data + block->used && block->size - block->used + old_asize >= new_asize) {
+        block->used = block->used - old_asize + new_asize;
+        return ptr;
+    }
+    
+    // otherwise the old memory is released by the end of the scope
+    void *new_ptr = cloudsync_arena_alloc(arena, new_size);
+    if (new_ptr) memcpy(new_ptr, ptr, (old_size < new_size) ? old_size : new_size);
+    return new_ptr;
+}
+
+char *cloudsync_arena_strdup (cloudsync_arena *arena, const char *str) {
+    if (!str) return NULL;
+    
+    size_t len = strlen(str);
+    char *s = (char *)cloudsync_arena_alloc(arena, len + 1);
+    if (s) memcpy(s, str, len + 1);
+    return s;
+}
+
+cloudsync_arena_mark cloudsync_arena_begin (cloudsync_arena *arena) {
+    cloudsync_arena_mark mark = {.block = arena->head, .used = (arena->head) ? arena->head->used : 0};
+    arena->nscopes++;
+    return mark;
+}
+
+void cloudsync_arena_end (cloudsync_arena *arena, cloudsync_arena_mark mark) {
+    // scopes are nested, so ending a scope releases everything allocated after its mark
+    while (arena->head && arena->head != mark.block) {
+        cloudsync_arena_block *block = arena->head;
+        
+        // the first block is kept for the next scopes (unless it was a large allocation)
+        if (!block->next && !mark.block && block->size == arena->block_size) {
+            block->used = 0;
+            break;
+        }
+        
+        arena->head = block->next;
+        arena_block_free(arena, block);
+    }
+    if (arena->head && arena->head == mark.block) arena->head->used = mark.used;
+    if (arena->nscopes > 0) arena->nscopes--;
+}
+
+void cloudsync_arena_reset (cloudsync_arena *arena) {
+    // memory still used by an open scope (an apply that spans several transactions) is released when it ends
+    if (arena->nscopes > 0) return;
+    
+    arena->nscopes++;
+    cloudsync_arena_end(arena, (cloudsync_arena_mark){0});
+}
+
+void cloudsync_arena_free (cloudsync_arena *arena) {
+    while (arena->head) {
+        cloudsync_arena_block *block = arena->head;
+        arena->head = block->next;
+        arena_block_free(arena, block);
+    }
+    arena->nscopes = 0;
+}
+
 // MARK: - Files -
 
 #ifdef CLOUDSYNC_DESKTOP_OS
@@ -596,6 +760,9 @@ void memdebug_finalize (void) {
     printf("Free count: %" PRIu64 "\n", nfree);
     printf("Leaked: %" PRIu64 " (bytes)\n", mem_current);
     printf("Max memory usage: %" PRIu64 " (bytes)\n", mem_max);
+    printf("Arena allocations count: %" PRIu64 "\n", arena_nalloc);
+    printf("Arena leaked: %" PRIu64 " (bytes)\n", arena_current);
+    printf("Arena max memory usage: %" PRIu64 " (bytes)\n", arena_max);
     printf("==================================\n\n");
 
     if (mem_current > 0) {
@@ -140,6 +140,8 @@ char *cloudsync_uuid_v7_string (char value[UUID_STR_MAXLEN], bool dash_format);
 char *cloudsync_uuid_v7_stringify (uint8_t uuid[UUID_LEN], char value[UUID_STR_MAXLEN], bool dash_format);
 char *cloudsync_string_replace_prefix(const char *input, char *prefix, char *replacement);
 uint64_t fnv1a_hash(const char *data, size_t len);
+uint64_t cloudsync_time_ms (void);
+uint64_t cloudsync_time_us (void);
 
 void *cloudsync_memory_zeroalloc (uint64_t size);
 char *cloudsync_string_ndup (const char *str, size_t len, bool lowercase);
@@ -148,6 +150,36 @@ int cloudsync_blob_compare(const char *blob1, size_t size1, const char *blob2, s
 
 void cloudsync_rowid_decode (sqlite3_int64 rowid, sqlite3_int64 *db_version, sqlite3_int64 *seq);
 
+// bump allocator for the transient allocations of the tracking and apply paths: memory is released all at once
+// when a scope ends (cloudsync_arena_end) or when the arena is reset at the end of each transaction
+typedef struct cloudsync_arena_block cloudsync_arena_block;
+
+typedef struct {
+    cloudsync_arena_block   *head;          // most recent block, blocks are chained to the previous ones
+    size_t                  block_size;
+    int                     nscopes;        // number of open scopes, the arena cannot be reset while a scope is open
+    
+    // usage counters
+    uint64_t                nalloc;
+    uint64_t                nblocks;
+    uint64_t                allocated;      // bytes currently allocated for the blocks
+    uint64_t                peak;
+} cloudsync_arena;
+
+typedef struct {
+    cloudsync_arena_block   *block;
+    size_t                  used;
+} cloudsync_arena_mark;
+
+void cloudsync_arena_init (cloudsync_arena *arena, size_t block_size);
+void *cloudsync_arena_alloc (cloudsync_arena *arena, size_t size);
+void *cloudsync_arena_realloc (cloudsync_arena *arena, void *ptr, size_t old_size, size_t new_size);
+char *cloudsync_arena_strdup (cloudsync_arena *arena, const char *str);
+cloudsync_arena_mark cloudsync_arena_begin (cloudsync_arena *arena);
+void cloudsync_arena_end (cloudsync_arena *arena, cloudsync_arena_mark mark);
+void cloudsync_arena_reset (cloudsync_arena *arena);
+void cloudsync_arena_free (cloudsync_arena *arena);
+
 // available only on Desktop OS
 #ifdef CLOUDSYNC_DESKTOP_OS
 bool cloudsync_file_delete (const char *path);
@@ -6,11 +6,13 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "vtab.h"
 #include "utils.h"
 #include "dbutils.h"
 #include "cloudsync.h"
+#include "clock.h"
 
 #ifndef SQLITE_CORE
 SQLITE_EXTENSION_INIT3
@@ -40,6 +42,35 @@ char *cloudsync_changes_columns[] = {"tbl", "pk", "col_name", "col_value", "col_
 #define COL_CL_INDEX                7
 #define COL_SEQ_INDEX               8
 
+// separates the outer clause, the per-branch predicates and the packed meta-tables predicates inside idxStr
+#define CHANGES_IDXSTR_SEPARATOR    '|'
+
+// used in place of the UNION ALL when no meta-table is selected
+#define CHANGES_EMPTY_QUERY         "SELECT NULL AS tbl, NULL AS pk, NULL AS col_name, NULL AS col_value, NULL AS col_version, NULL AS db_version, NULL AS site_id, NULL AS seq, NULL AS cl WHERE 0"
+
+// idxNum bits (bit 1 and bit 2 flag db_version and site_id constraints)
+#define CHANGES_IDXNUM_TBL          8       // argv[0] is the table name used to prune branches
+#define CHANGES_IDXNUM_TBL_IN       16      // argv[0] is an IN list of table names
+#define CHANGES_IDXNUM_LIMIT        32
+#define CHANGES_IDXNUM_DBVERSION_EQ 64
+#define CHANGES_IDXNUM_NO_VALUE     128     // col_value is not used by the statement
+#define CHANGES_IDXNUM_NO_CL        256     // cl is not used by the statement
+#define CHANGES_IDXNUM_NO_SITEID    512     // site_id is not used by the statement
+#define CHANGES_IDXNUM_NO_COLNAME   1024    // col_name is not used by the statement
+
+// CLOUDSYNC_TOMBSTONE_COLID as embedded into the generated SQL
+#define CHANGES_TOMBSTONE_COLID     "0"
+
+// defaults used by the cost estimate when sqlite_stat1 has no row for a meta-table
+#define CHANGES_DEFAULT_NROWS       100000
+#define CHANGES_DEFAULT_NVERSION    10
+
+typedef struct {
+    sqlite3_int64           nrows;      // rows in the meta-tables
+    sqlite3_int64           nversion;   // rows sharing the same db_version (summed across meta-tables)
+    int                     ntables;    // number of meta-tables
+} changes_stats;
+
 #if CLOUDSYNC_UNITTEST
 bool force_vtab_filter_abort = false;
 #define CHECK_VFILTERTEST_ABORT()   if (force_vtab_filter_abort) rc = SQLITE_ERROR
@@ -88,7 +119,87 @@ int colname_is_legal (const char *name) {
     return 0;
 }
 
-char *build_changes_sql (sqlite3 *db, const char *idxs) {
+bool changes_constraint_pushable (int idx, int op) {
+    // db_version and seq are stored as is in every meta-table, so any comparison can be evaluated by each branch
+    // (and db_version comparisons can use the <table>_cloudsync_db_idx index)
+    if (idx == COL_DBVERSION_INDEX || idx == COL_SEQ_INDEX) {
+        return (op == SQLITE_INDEX_CONSTRAINT_EQ || op == SQLITE_INDEX_CONSTRAINT_GT || op == SQLITE_INDEX_CONSTRAINT_GE ||
+                op == SQLITE_INDEX_CONSTRAINT_LT || op == SQLITE_INDEX_CONSTRAINT_LE);
+    }
+    
+    // site_id is stored as an ordinal in the meta-tables, so only equality can be translated
+    // (an unknown site_id translates to NULL and the branch returns no rows, exactly like the original filter)
+    if (idx == COL_SITEID_INDEX) return (op == SQLITE_INDEX_CONSTRAINT_EQ);
+    
+    return false;
+}
+
+void changes_estimate_stats (sqlite3 *db, const char *tbl, changes_stats *stats) {
+    memset(stats, 0, sizeof(changes_stats));
+    
+    // the first two numbers of the sqlite_stat1 row of <table>_cloudsync_db_idx are
+    // the number of rows in the meta-table and the average number of rows per db_version
+    const char *sql = (dbutils_table_exists(db, "sqlite_stat1")) ?
+    "SELECT m.tbl_name, s.stat FROM sqlite_master AS m LEFT JOIN sqlite_stat1 AS s ON s.idx = m.tbl_name || '_db_idx' WHERE m.type = 'table' AND m.tbl_name LIKE '%_cloudsync' AND (?1 IS NULL OR m.tbl_name = ?1 || '_cloudsync');" :
+    "SELECT tbl_name, NULL FROM sqlite_master WHERE type = 'table' AND tbl_name LIKE '%_cloudsync' AND (?1 IS NULL OR tbl_name = ?1 || '_cloudsync');";
+    
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = (tbl) ? sqlite3_bind_text(vm, 1, tbl, -1, SQLITE_STATIC) : sqlite3_bind_null(vm, 1);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    while (sqlite3_step(vm) == SQLITE_ROW) {
+        sqlite3_int64 nrows = CHANGES_DEFAULT_NROWS;
+        sqlite3_int64 nversion = CHANGES_DEFAULT_NVERSION;
+        
+        const char *stat = (const char *)sqlite3_column_text(vm, 1);
+        if (stat) {
+            char *end = NULL;
+            nrows = strtoll(stat, &end, 10);
+            nversion = (end && *end == ' ') ? strtoll(end + 1, NULL, 10) : 1;
+        }
+        
+        stats->nrows += nrows;
+        stats->nversion += nversion;
+        stats->ntables++;
+    }
+    
+cleanup:
+    if (vm) sqlite3_finalize(vm);
+}
+
+char *tables_filter_append (char *filter, sqlite3_value *value) {
+    // values that are not text can never be equal to a tbl value
+    if (sqlite3_value_type(value) != SQLITE_TEXT) return filter;
+    
+    bool first = (filter[strlen(filter) - 1] == '(');
+    char *result = cloudsync_memory_mprintf("%s%s%Q", filter, (first) ? "" : ", ", (const char *)sqlite3_value_text(value));
+    cloudsync_memory_free(filter);
+    return result;
+}
+
+char *build_tables_filter (sqlite3_value *value, bool in_list) {
+    // build the condition used by build_changes_sql to select only some meta-tables
+    char *filter = cloudsync_memory_mprintf(" AND SUBSTR(tbl_name, 1, LENGTH(tbl_name) - 10) IN (");
+    
+    if (in_list) {
+        sqlite3_value *item = NULL;
+        for (int rc = sqlite3_vtab_in_first(value, &item); filter && rc == SQLITE_OK; rc = sqlite3_vtab_in_next(value, &item)) {
+            filter = tables_filter_append(filter, item);
+        }
+    } else if (filter) {
+        filter = tables_filter_append(filter, value);
+    }
+    if (!filter) return NULL;
+    
+    char *result = cloudsync_memory_mprintf("%s)", filter);
+    cloudsync_memory_free(filter);
+    return result;
+}
+
+char *build_changes_sql (sqlite3 *db, int idxn, const char *idxs, const char *tbl_filter) {
     DEBUG_VTAB("build_changes_sql");
     
     /*
@@ -102,7 +213,8 @@ char *build_changes_sql (sqlite3 *db, const char *idxs) {
      *
      * 2. `changes_query` CTE: Constructs individual SELECT statements for each
      *    cloud sync table, fetching data about changes in columns:
-     *      - `pk`: Primary key of the table.
+     *      - `pk`: Primary key of the table (meta-tables keyed by the rowid store
+     *        the integer value, so it is encoded here).
      *      - `col_name`: Name of the changed column.
      *      - `col_version`: Version of the changed column.
      *      - `db_version`: Database version when the change was recorded.
@@ -111,7 +223,8 @@ char *build_changes_sql (sqlite3 *db, const char *idxs) {
      *      - `seq`: Sequence number of the change.
      *    Each query is constructed by joining the table with `cloudsync_site_id`
      *    for resolving the site ID and performing a LEFT JOIN with itself to
-     *    identify columns with NULL values in `t2.col_name`.
+     *    identify the tombstone row (`t2.col_id` 0). Column names are resolved
+     *    through the `cloudsync_columns` dictionary.
      *
      * 3. `union_query` CTE: Combines all the constructed SELECT statements
      *    from `changes_query` into a single query using `UNION ALL`.
@@ -121,7 +234,9 @@ char *build_changes_sql (sqlite3 *db, const char *idxs) {
      *
      * 5. Final SELECT: Adds a WHERE clause to filter records with `db_version`
      *    greater than a specified value (using a placeholder `?`), and orders
-     *    the results by `db_version` and `seq`.
+     *    the results by `db_version` and `seq`. Constraints on `db_version`, `seq`
+     *    and `site_id` are also appended to the WHERE clause of each branch in step 2
+     *    so that each meta-table is range scanned instead of fully materialized.
      *
      * The overall result is a consolidated view of changes across all
      * cloud sync tables, filtered and ordered based on the `db_version` and
@@ -130,26 +245,46 @@ char *build_changes_sql (sqlite3 *db, const char *idxs) {
     
     const char *query =
     "WITH table_names AS ( "
-    "    SELECT format('%q',SUBSTR(tbl_name, 1, LENGTH(tbl_name) - 10)) AS table_name_literal, format('%w',SUBSTR(tbl_name, 1, LENGTH(tbl_name) - 10)) AS table_name_identifier, format('%w',tbl_name) AS table_meta "
+    "    SELECT format('%q',SUBSTR(tbl_name, 1, LENGTH(tbl_name) - 10)) AS table_name_literal, format('%w',SUBSTR(tbl_name, 1, LENGTH(tbl_name) - 10)) AS table_name_identifier, format('%w',tbl_name) AS table_meta, "
+    "    EXISTS (SELECT 1 FROM pragma_table_info(sqlite_master.tbl_name) AS p WHERE p.name = 'clocks') AS packed, "
+    "    EXISTS (SELECT 1 FROM pragma_table_info(sqlite_master.tbl_name) AS p WHERE p.name = 'pk' AND p.type = 'INTEGER') AS intpk, "
+    "    EXISTS (SELECT 1 FROM sqlite_master AS m WHERE m.type = 'table' AND m.name = SUBSTR(sqlite_master.tbl_name, 1, LENGTH(sqlite_master.tbl_name) - 10)) AS base_exists, "
+    "    (SELECT GROUP_CONCAT(format('\"%w\" = cloudsync_pk_decode(t1.pk, %d)', p.name, p.pk), ' AND ') FROM pragma_table_info(SUBSTR(sqlite_master.tbl_name, 1, LENGTH(sqlite_master.tbl_name) - 10)) AS p WHERE p.pk > 0) AS pk_match "
     "    FROM sqlite_master "
-    "    WHERE type = 'table' AND tbl_name LIKE '%_cloudsync' "
-    "), "
+    "    WHERE type = 'table' AND tbl_name LIKE '%_cloudsync' ";
+    const char *query_tables_end = "), "
     "changes_query AS ( "
     "    SELECT "
     "        'SELECT "
     "        ''' || \"table_name_literal\" || ''' AS tbl, "
-    "        t1.pk AS pk, "
-    "        t1.col_name AS col_name, "
-    "        cloudsync_col_value(''' || \"table_name_literal\" || ''', t1.col_name, t1.pk) AS col_value, "
-    "        t1.col_version AS col_version, "
-    "        t1.db_version AS db_version, "
-    "        site_tbl.site_id AS site_id, "
-    "        t1.seq AS seq, "
-    "        COALESCE(t2.col_version, 1) AS cl "
-    "     FROM \"' || \"table_meta\" || '\" AS t1 "
-    "     LEFT JOIN cloudsync_site_id AS site_tbl ON t1.site_id = site_tbl.rowid "
-    "     LEFT JOIN \"' || \"table_meta\" || '\" AS t2 ON t1.pk = t2.pk AND t2.col_name = ''" CLOUDSYNC_TOMBSTONE_VALUE "'' "
-    "     WHERE col_value IS NOT ''" CLOUDSYNC_RLS_RESTRICTED_VALUE "''' "
+    "        ' || IIF(\"intpk\", 'cloudsync_pk_encode(t1.pk)', 't1.pk') || ' AS pk, ";
+    
+    // columns not referenced by the statement are replaced by NULL, so that a query that reads only
+    // metadata columns never calls cloudsync_col_value (and never touches the user tables) nor performs the joins
+    // meta-tables store the col_id of each column, its name is resolved through the cloudsync_columns dictionary
+    const char *query_col_name = (idxn & CHANGES_IDXNUM_NO_COLNAME) ? "NULL AS col_name, " :
+    "        IIF(t1.col_id = " CHANGES_TOMBSTONE_COLID ", ''" CLOUDSYNC_TOMBSTONE_VALUE "'', cols.col_name) AS col_name, ";
+    // values are computed while each meta-table is scanned (before the final ORDER BY), in (pk, col_id) or (db_version, pk, col_id)
+    // order, so the columns of a row are requested together and served by the row cache of cloudsync_col_value
+    const char *query_value = (idxn & CHANGES_IDXNUM_NO_VALUE) ? "NULL AS col_value, " :
+    "        cloudsync_col_value(''' || \"table_name_literal\" || ''', t1.col_id, t1.pk) AS col_value, ";
+    const char *query_site_id = (idxn & CHANGES_IDXNUM_NO_SITEID) ? "NULL AS site_id, " : "site_tbl.site_id AS site_id, ";
+    const char *query_cl = (idxn & CHANGES_IDXNUM_NO_CL) ? "NULL AS cl " : "COALESCE(t2.col_version, 1) AS cl ";
+    const char *query_packed_cl = (idxn & CHANGES_IDXNUM_NO_CL) ? "NULL AS cl " : "t1.cl AS cl ";
+    const char *query_col_name_join = (idxn & CHANGES_IDXNUM_NO_COLNAME) ? "" :
+    "     LEFT JOIN cloudsync_columns AS cols ON cols.tbl_name = ''' || \"table_name_literal\" || ''' AND cols.col_id = t1.col_id ";
+    const char *query_site_join = (idxn & CHANGES_IDXNUM_NO_SITEID) ? "" :
+    "     LEFT JOIN cloudsync_site_id AS site_tbl ON t1.site_id = site_tbl.rowid ";
+    const char *query_cl_join = (idxn & CHANGES_IDXNUM_NO_CL) ? "" :
+    "     LEFT JOIN \"' || \"table_meta\" || '\" AS t2 ON t1.pk = t2.pk AND t2.col_id = " CHANGES_TOMBSTONE_COLID " ";
+    // rows whose value is restricted (the user row cannot be read) are skipped, so when col_value is not computed
+    // the same rows are selected by checking that the user row exists (tombstones are never restricted)
+    const char *query_where = (idxn & CHANGES_IDXNUM_NO_VALUE) ?
+    "     WHERE ' || IIF(\"base_exists\", '(t1.col_id = " CHANGES_TOMBSTONE_COLID " OR EXISTS (SELECT 1 FROM \"' || \"table_name_identifier\" || '\" WHERE ' || "
+    "IIF(\"intpk\", 'rowid = t1.pk', COALESCE(\"pk_match\", 'rowid = cloudsync_pk_decode(t1.pk, 1)')) || '))', '1') || '" :
+    "     WHERE col_value IS NOT ''" CLOUDSYNC_RLS_RESTRICTED_VALUE "''";
+    
+    const char *query_branch_end = "' "
     "    AS query_string FROM table_names "
     "), "
     "union_query AS ( "
@@ -157,27 +292,40 @@ char *build_changes_sql (sqlite3 *db, const char *idxs) {
     "), "
     "final_query AS ( "
     "    SELECT "
-    "        'SELECT tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq FROM (' || union_query || ')' "
+    "        'SELECT tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq FROM (' || COALESCE(union_query, '" CHANGES_EMPTY_QUERY "') || ')' "
     "    AS final_string FROM union_query "
     ") "
     "SELECT final_string || ' ";
     const char *final_query = ";' FROM final_query;";
     
-    static size_t query_len = 0;
-    static size_t final_query_len = 0;
-    if (query_len == 0) query_len = strlen(query);
-    if (final_query_len == 0) final_query_len = strlen(final_query);
-    
-    size_t idx_len = strlen(idxs);
-    size_t blen = query_len + idx_len + final_query_len + 128;
-    char *sql = (char *)cloudsync_memory_alloc((sqlite3_uint64)blen);
+    // idxs contains the outer clause and, after the separators, the predicates to be evaluated by each branch
+    // and the ones evaluated only by the branches of packed meta-tables
+    // (no part contains quotes so all of them can be safely embedded into the generating string literals)
+    const char *branch = strchr(idxs, CHANGES_IDXSTR_SEPARATOR);
+    int outer_len = (branch) ? (int)(branch - idxs) : (int)strlen(idxs);
+    if (branch) ++branch;
+    const char *packed = (branch) ? strchr(branch, CHANGES_IDXSTR_SEPARATOR) : NULL;
+    int branch_len = (packed) ? (int)(packed - branch) : ((branch) ? (int)strlen(branch) : 0);
+    if (packed) ++packed;
+
+    // a packed meta-table (see clock.c) has a single row per primary key whose clocks are expanded by cloudsync_clocks
+    // (its db_version is the max db_version of the row, so it can be used to skip whole rows but not to select clocks)
+    char *packed_where = (packed && packed[0]) ? cloudsync_memory_mprintf("' || IIF(\"packed\", '%s', '') || '", packed) : NULL;
+
+    // build final sql statement taking in account the dynamic idxs string provided by the user
+    char *sql = cloudsync_memory_mprintf("%s%s%s%s%s"
+                                         "t1.col_version AS col_version, t1.db_version AS db_version, %st1.seq AS seq, "
+                                         "' || IIF(\"packed\", '%sFROM \"' || \"table_meta\" || '\" AS r, cloudsync_clocks(''' || \"table_name_literal\" || ''', r.pk, r.clocks) AS t1 ', "
+                                         "'%sFROM \"' || \"table_meta\" || '\" AS t1 %s') || '"
+                                         "%s%s%s%s%.*s%s%.*s%s",
+                                         query, (tbl_filter) ? tbl_filter : "", query_tables_end, query_col_name, query_value,
+                                         query_site_id, query_packed_cl, query_cl, query_cl_join,
+                                         query_col_name_join, query_site_join, query_where, (packed_where) ? packed_where : "",
+                                         branch_len, (branch) ? branch : "", query_branch_end, outer_len, idxs, final_query);
+    if (packed_where) cloudsync_memory_free(packed_where);
     if (!sql) return NULL;
+
     
-    // build final sql statement taking in account the dynamic idxs string provided by the user
-    memcpy(sql, query, query_len);
-    memcpy(sql + (query_len), idxs, idx_len);
-    memcpy(sql + (query_len + idx_len), final_query, final_query_len+1);
-        
     char *value = dbutils_text_select(db, sql);
     cloudsync_memory_free(sql);
     
@@ -224,6 +372,9 @@ int cloudsync_changesvtab_open (sqlite3_vtab *vtab, sqlite3_vtab_cursor **pcurso
     memset(cursor, 0, sizeof(cloudsync_changes_cursor));
     cursor->vtab = (cloudsync_changes_vtab *)vtab;
     
+    // column values are served by a one-row cache while the cursor is open
+    cloudsync_row_cache_open((cloudsync_context *)cursor->vtab->aux);
+    
     *pcursor = (sqlite3_vtab_cursor *)cursor;
     return SQLITE_OK;
 }
@@ -237,6 +388,7 @@ int cloudsync_changesvtab_close (sqlite3_vtab_cursor *cursor) {
         c->vm = NULL;
     }
     
+    cloudsync_row_cache_close((cloudsync_context *)c->vtab->aux);
     cloudsync_memory_free(cursor);
     return SQLITE_OK;
 }
@@ -262,48 +414,104 @@ int cloudsync_changesvtab_best_index (sqlite3_vtab *vtab, sqlite3_index_info *id
     // +5 for space AND space
     // +512 for the extra space and for the WHERE and ORDER BY literals
     
+    // constraints on db_version, seq and site_id are also rewritten into each UNION ALL branch,
+    // where site_id becomes a lookup of the integer ordinal (site_id ordinal 0 is the local site)
+    // (SELECT rowid FROM cloudsync_site_id WHERE site_id = ?NNN) is the longest pushed down value (55)
+    
     // memory internally manager by SQLite, so I cannot use memory_alloc here
-    size_t slen = (count1 * (11 + 1 + 11 + 1 + 5)) + (count2 * 11 + 1 + 5) + 512;
-    char *s = (char *)sqlite3_malloc64((sqlite3_uint64)slen);
+    size_t slen = (count1 * (11 + 1 + 11 + 1 + 5 + 4)) + (count2 * 11 + 1 + 5) + 512;
+    size_t blen = (count1 * (12 + 1 + 2 + 1 + 55 + 5)) + 1;
+    
+    // constraints on db_version are also used to skip the rows of packed meta-tables
+    // " AND r.db_version >= ?NNN" is the longest packed predicate (28)
+    size_t plen = (count1 * 28) + 1;
+    char *s = (char *)sqlite3_malloc64((sqlite3_uint64)(slen + blen + plen));
     if (!s) return SQLITE_NOMEM;
-    size_t sindex= 0;
+    char *b = s + slen;
+    char *p = b + blen;
+    size_t sindex = 0;
+    size_t bindex = 0;
+    size_t pindex = 0;
+    b[0] = 0;
+    p[0] = 0;
 
     int idxnum = 0;
     int arg_index = 1;
     int orderconsumed = 1;
+    int nouter = 0;
+    int limit_index = -1;
+    int offset_index = -1;
+    int nrange = 0;
+    int nfilter = 0;
+    const char *tbl_value = NULL;
     
-    // is there a WHERE clause ?
-    if (count1 > 0) sindex += snprintf(s+sindex, slen-sindex, "WHERE ");
+    // an equality constraint on tbl (or an IN list processed all at once) is used to prune the UNION ALL branches,
+    // it is always assigned the first argv slot so xFilter can find it (it is never referenced by the generated SQL)
+    for (int i=0; i < count1; ++i) {
+        struct sqlite3_index_constraint *constraint = &idxinfo->aConstraint[i];
+        if (constraint->usable == false) continue;
+        if (constraint->iColumn != COL_TBL_INDEX || constraint->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        
+        bool in_list = false;
+        if (sqlite3_libversion_number() >= 3038000) {
+            in_list = (sqlite3_vtab_in(idxinfo, i, -1) != 0);
+            if (in_list) sqlite3_vtab_in(idxinfo, i, 1);
+            else {
+                sqlite3_value *value = NULL;
+                if (sqlite3_vtab_rhs_value(idxinfo, i, &value) == SQLITE_OK && sqlite3_value_type(value) == SQLITE_TEXT) tbl_value = (const char *)sqlite3_value_text(value);
+            }
+        }
+        
+        idxinfo->aConstraintUsage[i].argvIndex = arg_index++;
+        idxinfo->aConstraintUsage[i].omit = 1;
+        idxnum |= (in_list) ? CHANGES_IDXNUM_TBL_IN : CHANGES_IDXNUM_TBL;
+        break;
+    }
     
     // check constraints
     for (int i=0; i < count1; ++i) {
         // analyze only usable constraints
         struct sqlite3_index_constraint *constraint = &idxinfo->aConstraint[i];
         if (constraint->usable == false) continue;
+        if (idxinfo->aConstraintUsage[i].argvIndex > 0) continue;
         
         int idx = constraint->iColumn;
         uint8_t op = constraint->op;
         
-        const char *colname = (idx > 0) ? COLNAME_FROM_INDEX(idx) : "rowid";
+        // LIMIT and OFFSET have no column and are appended after the ORDER BY clause
+        if (op == SQLITE_INDEX_CONSTRAINT_LIMIT) {limit_index = i; continue;}
+        if (op == SQLITE_INDEX_CONSTRAINT_OFFSET) {offset_index = i; continue;}
+        
+        const char *colname = (idx >= 0) ? COLNAME_FROM_INDEX(idx) : "rowid";
         const char *opname = opname_from_value(op);
         if (!opname) continue;
         
-        // build next constraint
-        if (i > 0) sindex += snprintf(s+sindex, slen-sindex, " AND ");
-        
         // handle special case where value is not needed
         if ((op == SQLITE_INDEX_CONSTRAINT_ISNULL) || (op == SQLITE_INDEX_CONSTRAINT_ISNOTNULL)) {
-            sindex += snprintf(s+sindex, slen-sindex, "%s %s", colname, opname);
+            sindex += snprintf(s+sindex, slen-sindex, "%s%s %s", (nouter++) ? " AND " : "WHERE ", colname, opname);
             idxinfo->aConstraintUsage[i].argvIndex = 0;
+        } else if (changes_constraint_pushable(idx, op)) {
+            // numbered parameters let every branch reference the same argv value
+            if (idx == COL_SITEID_INDEX) bindex += snprintf(b+bindex, blen-bindex, " AND t1.site_id %s (SELECT rowid FROM cloudsync_site_id WHERE site_id = ?%d)", opname, arg_index);
+            else bindex += snprintf(b+bindex, blen-bindex, " AND t1.%s %s ?%d", colname, opname, arg_index);
+            if (idx == COL_DBVERSION_INDEX && (op == SQLITE_INDEX_CONSTRAINT_EQ || op == SQLITE_INDEX_CONSTRAINT_GT || op == SQLITE_INDEX_CONSTRAINT_GE)) {
+                pindex += snprintf(p+pindex, plen-pindex, " AND r.db_version >= ?%d", arg_index);
+            }
+            idxinfo->aConstraintUsage[i].argvIndex = arg_index++;
         } else {
-            sindex += snprintf(s+sindex, slen-sindex, "%s %s ?", colname, opname);
+            sindex += snprintf(s+sindex, slen-sindex, "%s%s %s ?%d", (nouter++) ? " AND " : "WHERE ", colname, opname, arg_index);
             idxinfo->aConstraintUsage[i].argvIndex = arg_index++;
         }
         idxinfo->aConstraintUsage[i].omit = 1;
         
         //a bitmask (idxnum) is built up based on which constraints are applied
-        if (idx == COL_DBVERSION_INDEX) idxnum |= 2;    // set bit 1
+        if (idx == COL_DBVERSION_INDEX) {
+            idxnum |= 2;    // set bit 1
+            if (op == SQLITE_INDEX_CONSTRAINT_EQ) idxnum |= CHANGES_IDXNUM_DBVERSION_EQ;
+            else ++nrange;
+        }
         else if (idx == COL_SITEID_INDEX) idxnum |= 4;  // set bit 2
+        else ++nfilter;
     }
     
     // is there an ORDER BY clause ?
@@ -318,12 +526,44 @@ int cloudsync_changesvtab_best_index (sqlite3_vtab *vtab, sqlite3_index_info *id
         if (i > 0) sindex += snprintf(s+sindex, slen-sindex, ", ");
         
         int idx = orderby->iColumn;
-        const char *colname = COLNAME_FROM_INDEX(idx);
+        const char *colname = (idx >= 0) ? COLNAME_FROM_INDEX(idx) : "rowid";
         if (!colname_is_legal(colname)) orderconsumed = 0;
         
         sindex += snprintf(s+sindex, slen-sindex, "%s %s", colname, orderby->desc ? " DESC" : " ASC");
     }
     
+    // LIMIT and OFFSET can be evaluated by the generated SQL only if its ORDER BY is the final one
+    // (the OFFSET constraint is omitted so that SQLite does not skip the same rows a second time)
+    sqlite3_int64 limit_value = -1;
+    if (limit_index >= 0 && orderconsumed) {
+        sindex += snprintf(s+sindex, slen-sindex, " LIMIT ?%d", arg_index);
+        idxinfo->aConstraintUsage[limit_index].argvIndex = arg_index++;
+        idxnum |= CHANGES_IDXNUM_LIMIT;
+        
+        sqlite3_value *value = NULL;
+        if (sqlite3_vtab_rhs_value(idxinfo, limit_index, &value) == SQLITE_OK && sqlite3_value_type(value) == SQLITE_INTEGER) limit_value = sqlite3_value_int64(value);
+        
+        if (offset_index >= 0) {
+            sindex += snprintf(s+sindex, slen-sindex, " OFFSET ?%d", arg_index);
+            idxinfo->aConstraintUsage[offset_index].argvIndex = arg_index++;
+            idxinfo->aConstraintUsage[offset_index].omit = 1;
+        }
+    }
+    
+    // idxStr is the outer clause followed by the per-branch predicates and by the packed meta-tables predicates
+    sindex += snprintf(s+sindex, slen-sindex, "%c", CHANGES_IDXSTR_SEPARATOR);
+    memmove(s+sindex, b, bindex);
+    sindex += bindex;
+    s[sindex++] = CHANGES_IDXSTR_SEPARATOR;
+    memmove(s+sindex, p, pindex+1);
+    
+    // columns not used by the statement don't need to be computed by the generated SQL
+    // (bit 63 of colUsed is set for any column beyond the 63rd, so it never matches the ones below)
+    if ((idxinfo->colUsed & ((sqlite3_uint64)1 << COL_VALUE_INDEX)) == 0) idxnum |= CHANGES_IDXNUM_NO_VALUE;
+    if ((idxinfo->colUsed & ((sqlite3_uint64)1 << COL_CL_INDEX)) == 0) idxnum |= CHANGES_IDXNUM_NO_CL;
+    if ((idxinfo->colUsed & ((sqlite3_uint64)1 << COL_SITEID_INDEX)) == 0) idxnum |= CHANGES_IDXNUM_NO_SITEID;
+    if ((idxinfo->colUsed & ((sqlite3_uint64)1 << COL_NAME_INDEX)) == 0) idxnum |= CHANGES_IDXNUM_NO_COLNAME;
+    
     idxinfo->idxNum = idxnum;
     idxinfo->idxStr = s;
     idxinfo->needToFreeIdxStr = 1;
@@ -333,7 +573,6 @@ int cloudsync_changesvtab_best_index (sqlite3_vtab *vtab, sqlite3_index_info *id
     // to execute a query on the virtual table. It does so by evaluating which constraints (filters) can be applied
     // and providing an estimate of the cost and number of rows that the query will return.
     
-    
     /*
      
      By commenting the following code we assume that the developer is using an SQLite library
@@ -354,29 +593,34 @@ int cloudsync_changesvtab_best_index (sqlite3_vtab *vtab, sqlite3_index_info *id
      
      */
     
-    // perform estimated cost and row count based on the constraints
-    if ((idxnum & 6) == 6) {
-        // both DbVrsn and SiteId constraints are present
-        // query is expected to be highly selective, returning only one row, with a very low execution cost
-        idxinfo->estimatedCost = 1.0;
-        idxinfo->estimatedRows = 1;
-    } else if ((idxnum & 2) == 2) {
-        // only DbVrsn constraint is present
-        // query is expected to return more rows (10) and take more time (cost of 10.0) than in the previous case
-        idxinfo->estimatedCost = 10.0;
-        idxinfo->estimatedRows = 10;
-    } else if ((idxnum & 4) == 4) {
-        // only SiteId constraint is present
-        // query is expected to be very inefficient, returning a large number of rows and taking a long time to execute
-        idxinfo->estimatedCost = (double)INT32_MAX;
-        idxinfo->estimatedRows = (sqlite3_int64)INT32_MAX;
-    } else {
-        // no constraints are present
-        // worst-case scenario, where the query returns all rows from the virtual table
-        idxinfo->estimatedCost = (double)INT64_MAX;
-        idxinfo->estimatedRows = (sqlite3_int64)INT64_MAX;
+    // real row counts come from sqlite_stat1 (when ANALYZE has been run), otherwise a default per table is assumed
+    changes_stats stats;
+    changes_estimate_stats(((cloudsync_changes_vtab *)vtab)->db, tbl_value, &stats);
+    
+    double scanned = (double)stats.nrows;
+    if ((idxnum & CHANGES_IDXNUM_TBL) && !tbl_value && stats.ntables > 0) scanned /= stats.ntables;
+    
+    // db_version constraints are evaluated by the <table>_cloudsync_db_idx index of each branch,
+    // a range is assumed to select a quarter of the rows (the same guess used by the SQLite planner)
+    if (idxnum & CHANGES_IDXNUM_DBVERSION_EQ) scanned = (double)stats.nversion;
+    for (int i=0; i<nrange && i<2; ++i) scanned /= 4.0;
+    
+    // site_id and the other constraints are evaluated on the scanned rows
+    double rows = scanned;
+    if (idxnum & 4) rows /= 2.0;
+    for (int i=0; i<nfilter && i<2; ++i) rows /= 4.0;
+    
+    if (scanned < 1.0) scanned = 1.0;
+    if (rows < 1.0) rows = 1.0;
+    if (limit_value >= 0 && rows > (double)limit_value) {
+        scanned = scanned * ((double)limit_value / rows);
+        rows = (double)limit_value;
     }
     
+    // each UNION ALL branch has a fixed setup cost
+    idxinfo->estimatedCost = scanned + (double)stats.ntables;
+    idxinfo->estimatedRows = (sqlite3_int64)rows;
+    
     return SQLITE_OK;
 }
 
@@ -386,7 +630,16 @@ int cloudsync_changesvtab_filter (sqlite3_vtab_cursor *cursor, int idxn, const c
     
     cloudsync_changes_cursor *c = (cloudsync_changes_cursor *)cursor;
     sqlite3 *db = c->vtab->db;
-    char *sql = build_changes_sql(db, idxs);
+    
+    // prune the meta-tables not selected by a tbl constraint
+    char *tbl_filter = NULL;
+    if (idxn & (CHANGES_IDXNUM_TBL | CHANGES_IDXNUM_TBL_IN)) {
+        tbl_filter = build_tables_filter(argv[0], (idxn & CHANGES_IDXNUM_TBL_IN) != 0);
+        if (tbl_filter == NULL) return SQLITE_NOMEM;
+    }
+    
+    char *sql = build_changes_sql(db, idxn, idxs, tbl_filter);
+    if (tbl_filter) cloudsync_memory_free(tbl_filter);
     if (sql == NULL) return SQLITE_NOMEM;
     
     // the xFilter method may be called multiple times on the same sqlite3_vtab_cursor*
@@ -397,7 +650,9 @@ int cloudsync_changesvtab_filter (sqlite3_vtab_cursor *cursor, int idxn, const c
     cloudsync_memory_free(sql);
     if (rc != SQLITE_OK) goto abort_filter;
     
-    for (int i=0; i<argc; ++i) {
+    // values not referenced by the generated SQL (like the table names used for pruning) are not bound
+    int nparams = sqlite3_bind_parameter_count(c->vm);
+    for (int i=0; i<argc && i<nparams; ++i) {
         rc = sqlite3_bind_value(c->vm, i+1, argv[i]);
         if (rc != SQLITE_OK) goto abort_filter;
     }
@@ -488,6 +743,364 @@ int cloudsync_changesvtab_update (sqlite3_vtab *vtab, int argc, sqlite3_value **
     return cloudsync_merge_insert(vtab, argc-2, &argv[2], rowid);
 }
 
+int cloudsync_changesvtab_begin (sqlite3_vtab *vtab) {
+    DEBUG_VTAB("cloudsync_changesvtab_begin");
+    
+    // nothing to do here, but without xBegin SQLite never calls xRollbackTo
+    return SQLITE_OK;
+}
+
+int cloudsync_changesvtab_rollbackto (sqlite3_vtab *vtab, int savepoint) {
+    DEBUG_VTAB("cloudsync_changesvtab_rollbackto");
+    
+    // the site_ids inserted by the merges that have been rolled back are gone
+    cloudsync_siteid_rollback(cloudsync_vtab_get_context(vtab));
+    return SQLITE_OK;
+}
+
+// MARK: - Clocks -
+
+// cloudsync_clocks(tbl, pk, clocks) is a table-valued function that expands the clock vector of a packed
+// meta-table row into the same rows stored by a per-column meta-table (see clock.c)
+
+typedef struct cloudsync_clocks_cursor {
+    sqlite3_vtab_cursor     base;       // base class, must be first
+    cloudsync_changes_vtab  *vtab;
+    clock_vector            clocks;     // expanded clock vector
+    sqlite3_int64           cl;         // causal length of the row
+    sqlite3_value           *tbl;
+    sqlite3_value           *pk;
+    int                     index;
+} cloudsync_clocks_cursor;
+
+#define CLOCKS_COL_ID_INDEX         0
+#define CLOCKS_COL_VERSION_INDEX    1
+#define CLOCKS_COL_DBVERSION_INDEX  2
+#define CLOCKS_COL_SEQ_INDEX        3
+#define CLOCKS_COL_SITEID_INDEX     4
+#define CLOCKS_COL_CL_INDEX         5
+#define CLOCKS_COL_TBL_INDEX        6
+#define CLOCKS_COL_PK_INDEX         7
+#define CLOCKS_COL_CLOCKS_INDEX     8
+#define CLOCKS_NARGS                3
+
+int cloudsync_clocksvtab_connect (sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab, char **err) {
+    DEBUG_VTAB("cloudsync_clocksvtab_connect");
+    
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x (col_id INTEGER, col_version INTEGER, db_version INTEGER, seq INTEGER, site_id INTEGER, cl INTEGER,"
+                                  "tbl HIDDEN, pk HIDDEN, clocks HIDDEN);");
+    if (rc == SQLITE_OK) {
+        // memory internally managed by SQLite, so I cannot use memory_alloc here
+        cloudsync_changes_vtab *vnew = sqlite3_malloc64(sizeof(cloudsync_changes_vtab));
+        if (vnew == NULL) return SQLITE_NOMEM;
+        
+        memset(vnew, 0, sizeof(cloudsync_changes_vtab));
+        vnew->db = db;
+        vnew->aux = aux;
+        
+        *vtab = (sqlite3_vtab *)vnew;
+    }
+    
+    return rc;
+}
+
+int cloudsync_clocksvtab_open (sqlite3_vtab *vtab, sqlite3_vtab_cursor **pcursor) {
+    DEBUG_VTAB("cloudsync_clocksvtab_open");
+    
+    cloudsync_clocks_cursor *cursor = cloudsync_memory_alloc(sizeof(cloudsync_clocks_cursor));
+    if (cursor == NULL) return SQLITE_NOMEM;
+    
+    memset(cursor, 0, sizeof(cloudsync_clocks_cursor));
+    cursor->vtab = (cloudsync_changes_vtab *)vtab;
+    
+    *pcursor = (sqlite3_vtab_cursor *)cursor;
+    return SQLITE_OK;
+}
+
+void cloudsync_clocksvtab_reset (cloudsync_clocks_cursor *c) {
+    clock_vector_free(&c->clocks);
+    if (c->tbl) sqlite3_value_free(c->tbl);
+    if (c->pk) sqlite3_value_free(c->pk);
+    c->tbl = NULL;
+    c->pk = NULL;
+    c->cl = 0;
+    c->index = 0;
+}
+
+int cloudsync_clocksvtab_close (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_clocksvtab_close");
+    
+    cloudsync_clocksvtab_reset((cloudsync_clocks_cursor *)cursor);
+    cloudsync_memory_free(cursor);
+    return SQLITE_OK;
+}
+
+int cloudsync_clocksvtab_best_index (sqlite3_vtab *vtab, sqlite3_index_info *idxinfo) {
+    DEBUG_VTAB("cloudsync_clocksvtab_best_index");
+    
+    // tbl, pk and clocks are all required and they must be equality constraints
+    int args[CLOCKS_NARGS] = {-1, -1, -1};
+    int unusable = 0;
+    
+    for (int i=0; i<idxinfo->nConstraint; ++i) {
+        struct sqlite3_index_constraint *constraint = &idxinfo->aConstraint[i];
+        if (constraint->iColumn < CLOCKS_COL_TBL_INDEX) continue;
+        
+        int n = constraint->iColumn - CLOCKS_COL_TBL_INDEX;
+        if (constraint->usable == false) {unusable |= (1 << n); continue;}
+        if (constraint->op == SQLITE_INDEX_CONSTRAINT_EQ) args[n] = i;
+    }
+    
+    // a correlated argument is not usable until the outer table has been visited
+    if (unusable) return SQLITE_CONSTRAINT;
+    
+    for (int n=0; n<CLOCKS_NARGS; ++n) {
+        if (args[n] < 0) {
+            cloudsync_vtab_set_error(vtab, "cloudsync_clocks requires the tbl, pk and clocks arguments");
+            return SQLITE_ERROR;
+        }
+        idxinfo->aConstraintUsage[args[n]].argvIndex = n + 1;
+        idxinfo->aConstraintUsage[args[n]].omit = 1;
+    }
+    
+    idxinfo->estimatedCost = 10.0;
+    idxinfo->estimatedRows = 10;
+    return SQLITE_OK;
+}
+
+int cloudsync_clocksvtab_filter (sqlite3_vtab_cursor *cursor, int idxn, const char *idxs, int argc, sqlite3_value **argv) {
+    DEBUG_VTAB("cloudsync_clocksvtab_filter");
+    
+    cloudsync_clocks_cursor *c = (cloudsync_clocks_cursor *)cursor;
+    cloudsync_clocksvtab_reset(c);
+    if (argc != CLOCKS_NARGS) return SQLITE_OK;
+    
+    c->tbl = sqlite3_value_dup(argv[0]);
+    c->pk = sqlite3_value_dup(argv[1]);
+    if (!c->tbl || !c->pk) return SQLITE_NOMEM;
+    
+    clock_vector v;
+    if (clock_vector_decode(&v, (const char *)sqlite3_value_blob(argv[2]), (size_t)sqlite3_value_bytes(argv[2])) != 0) {
+        clock_vector_free(&v);
+        return SQLITE_CORRUPT;
+    }
+    
+    // the columns of the table are needed to expand the insert clock,
+    // without them (table not loaded in this connection) only the clocks actually stored are returned
+    int ncols = 0;
+    const int *col_ids = NULL;
+    const char *tbl = (const char *)sqlite3_value_text(argv[0]);
+    if (tbl) col_ids = cloudsync_table_col_ids(cloudsync_vtab_get_context(&c->vtab->base), tbl, &ncols);
+    
+    c->cl = clock_vector_cl(&v);
+    int rc = (clock_vector_expand(&v, col_ids, ncols, &c->clocks) == 0) ? SQLITE_OK : SQLITE_NOMEM;
+    clock_vector_free(&v);
+    return rc;
+}
+
+int cloudsync_clocksvtab_next (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_clocksvtab_next");
+    
+    ((cloudsync_clocks_cursor *)cursor)->index++;
+    return SQLITE_OK;
+}
+
+int cloudsync_clocksvtab_eof (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_clocksvtab_eof");
+    
+    cloudsync_clocks_cursor *c = (cloudsync_clocks_cursor *)cursor;
+    return (c->index >= c->clocks.count);
+}
+
+int cloudsync_clocksvtab_column (sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int col) {
+    DEBUG_VTAB("cloudsync_clocksvtab_column %d\n", col);
+    
+    cloudsync_clocks_cursor *c = (cloudsync_clocks_cursor *)cursor;
+    clock_entry *e = &c->clocks.entries[c->index];
+    
+    switch (col) {
+        case CLOCKS_COL_ID_INDEX: sqlite3_result_int64(ctx, e->col_id); break;
+        case CLOCKS_COL_VERSION_INDEX: sqlite3_result_int64(ctx, e->col_version); break;
+        case CLOCKS_COL_DBVERSION_INDEX: sqlite3_result_int64(ctx, e->db_version); break;
+        case CLOCKS_COL_SEQ_INDEX: sqlite3_result_int64(ctx, e->seq); break;
+        case CLOCKS_COL_SITEID_INDEX: sqlite3_result_int64(ctx, e->site_id); break;
+        case CLOCKS_COL_CL_INDEX: sqlite3_result_int64(ctx, c->cl); break;
+        case CLOCKS_COL_TBL_INDEX: sqlite3_result_value(ctx, c->tbl); break;
+        case CLOCKS_COL_PK_INDEX: sqlite3_result_value(ctx, c->pk); break;
+        default: sqlite3_result_null(ctx); break;
+    }
+    
+    return SQLITE_OK;
+}
+
+int cloudsync_clocksvtab_rowid (sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    DEBUG_VTAB("cloudsync_clocksvtab_rowid");
+    
+    *rowid = ((cloudsync_clocks_cursor *)cursor)->index;
+    return SQLITE_OK;
+}
+
+// MARK: - Stats -
+
+// cloudsync_stats exposes the counters and latency histograms collected by this connection (see stats.h):
+// first all the counters of the connection (tbl is NULL), then its non empty latency buckets (bucket is the
+// exclusive upper bound in us of the bucket), then the counters of each augmented table
+
+typedef struct cloudsync_stats_cursor {
+    sqlite3_vtab_cursor     base;       // base class, must be first
+    cloudsync_changes_vtab  *vtab;
+    int                     table;      // -1 for the connection, then the index of the augmented table
+    int                     index;      // counter index (CLOUDSYNC_STAT_COUNT + n for the n-th latency bucket)
+    sqlite3_int64           rowid;
+} cloudsync_stats_cursor;
+
+#define STATS_COL_TBL_INDEX         0
+#define STATS_COL_NAME_INDEX        1
+#define STATS_COL_VALUE_INDEX       2
+#define STATS_COL_BUCKET_INDEX      3
+#define STATS_NBUCKETS              (CLOUDSYNC_LATENCY_COUNT * CLOUDSYNC_LATENCY_BUCKETS)
+
+int cloudsync_statsvtab_connect (sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab, char **err) {
+    DEBUG_VTAB("cloudsync_statsvtab_connect");
+    
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x (tbl TEXT, name TEXT, value INTEGER, bucket INTEGER);");
+    if (rc == SQLITE_OK) {
+        // memory internally managed by SQLite, so I cannot use memory_alloc here
+        cloudsync_changes_vtab *vnew = sqlite3_malloc64(sizeof(cloudsync_changes_vtab));
+        if (vnew == NULL) return SQLITE_NOMEM;
+        
+        memset(vnew, 0, sizeof(cloudsync_changes_vtab));
+        vnew->db = db;
+        vnew->aux = aux;
+        
+        *vtab = (sqlite3_vtab *)vnew;
+    }
+    
+    return rc;
+}
+
+int cloudsync_statsvtab_open (sqlite3_vtab *vtab, sqlite3_vtab_cursor **pcursor) {
+    DEBUG_VTAB("cloudsync_statsvtab_open");
+    
+    cloudsync_stats_cursor *cursor = cloudsync_memory_alloc(sizeof(cloudsync_stats_cursor));
+    if (cursor == NULL) return SQLITE_NOMEM;
+    
+    memset(cursor, 0, sizeof(cloudsync_stats_cursor));
+    cursor->vtab = (cloudsync_changes_vtab *)vtab;
+    
+    *pcursor = (sqlite3_vtab_cursor *)cursor;
+    return SQLITE_OK;
+}
+
+int cloudsync_statsvtab_close (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_statsvtab_close");
+    
+    cloudsync_memory_free(cursor);
+    return SQLITE_OK;
+}
+
+int cloudsync_statsvtab_best_index (sqlite3_vtab *vtab, sqlite3_index_info *idxinfo) {
+    DEBUG_VTAB("cloudsync_statsvtab_best_index");
+    
+    idxinfo->estimatedCost = 100.0;
+    idxinfo->estimatedRows = 100;
+    return SQLITE_OK;
+}
+
+void cloudsync_statsvtab_seek (cloudsync_stats_cursor *c) {
+    // move the cursor to the first row at or after its current position
+    if (c->table < 0) {
+        cloudsync_stats *stats = cloudsync_context_stats(cloudsync_vtab_get_context(&c->vtab->base));
+        for (; c->index < CLOUDSYNC_STAT_COUNT + STATS_NBUCKETS; ++c->index) {
+            if (c->index < CLOUDSYNC_STAT_COUNT) return;
+            
+            // empty latency buckets are skipped
+            int n = c->index - CLOUDSYNC_STAT_COUNT;
+            if (stats->latency[n / CLOUDSYNC_LATENCY_BUCKETS][n % CLOUDSYNC_LATENCY_BUCKETS]) return;
+        }
+        c->table = 0;
+        c->index = 0;
+    } else if (c->index >= CLOUDSYNC_STAT_TABLE_COUNT) {
+        c->table++;
+        c->index = 0;
+    }
+}
+
+int cloudsync_statsvtab_filter (sqlite3_vtab_cursor *cursor, int idxn, const char *idxs, int argc, sqlite3_value **argv) {
+    DEBUG_VTAB("cloudsync_statsvtab_filter");
+    
+    cloudsync_stats_cursor *c = (cloudsync_stats_cursor *)cursor;
+    c->table = -1;
+    c->index = 0;
+    c->rowid = 0;
+    cloudsync_statsvtab_seek(c);
+    return SQLITE_OK;
+}
+
+int cloudsync_statsvtab_next (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_statsvtab_next");
+    
+    cloudsync_stats_cursor *c = (cloudsync_stats_cursor *)cursor;
+    c->index++;
+    c->rowid++;
+    cloudsync_statsvtab_seek(c);
+    return SQLITE_OK;
+}
+
+int cloudsync_statsvtab_eof (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_statsvtab_eof");
+    
+    cloudsync_stats_cursor *c = (cloudsync_stats_cursor *)cursor;
+    if (c->table < 0) return 0;
+    return (cloudsync_table_stats(cloudsync_vtab_get_context(&c->vtab->base), c->table, NULL) == NULL);
+}
+
+int cloudsync_statsvtab_column (sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int col) {
+    DEBUG_VTAB("cloudsync_statsvtab_column %d\n", col);
+    
+    cloudsync_stats_cursor *c = (cloudsync_stats_cursor *)cursor;
+    cloudsync_context *data = cloudsync_vtab_get_context(&c->vtab->base);
+    
+    const char *tbl_name = NULL;
+    const uint64_t *counters = (c->table < 0) ? cloudsync_context_stats(data)->counters : cloudsync_table_stats(data, c->table, &tbl_name);
+    if (!counters) {
+        sqlite3_result_null(ctx);
+        return SQLITE_OK;
+    }
+    
+    // latency bucket of the connection
+    int n = (c->table < 0) ? c->index - CLOUDSYNC_STAT_COUNT : -1;
+    int latency = (n >= 0) ? n / CLOUDSYNC_LATENCY_BUCKETS : -1;
+    int bucket = (n >= 0) ? n % CLOUDSYNC_LATENCY_BUCKETS : -1;
+    
+    switch (col) {
+        case STATS_COL_TBL_INDEX:
+            if (tbl_name) sqlite3_result_text(ctx, tbl_name, -1, SQLITE_TRANSIENT);
+            else sqlite3_result_null(ctx);
+            break;
+        case STATS_COL_NAME_INDEX:
+            sqlite3_result_text(ctx, (n >= 0) ? stats_latency_name(latency) : stats_name(c->index), -1, SQLITE_STATIC);
+            break;
+        case STATS_COL_VALUE_INDEX:
+            sqlite3_result_int64(ctx, (sqlite3_int64)((n >= 0) ? cloudsync_context_stats(data)->latency[latency][bucket] : counters[c->index]));
+            break;
+        case STATS_COL_BUCKET_INDEX:
+            if (n >= 0) sqlite3_result_int64(ctx, (sqlite3_int64)stats_bucket_limit(bucket));
+            else sqlite3_result_null(ctx);
+            break;
+        default: sqlite3_result_null(ctx); break;
+    }
+    
+    return SQLITE_OK;
+}
+
+int cloudsync_statsvtab_rowid (sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    DEBUG_VTAB("cloudsync_statsvtab_rowid");
+    
+    *rowid = ((cloudsync_stats_cursor *)cursor)->rowid;
+    return SQLITE_OK;
+}
+
 // MARK: -
 
 cloudsync_context *cloudsync_vtab_get_context (sqlite3_vtab *vtab) {
@@ -507,7 +1120,7 @@ int cloudsync_vtab_set_error (sqlite3_vtab *vtab, const char *format, ...) {
 
 int cloudsync_vtab_register_changes (sqlite3 *db, cloudsync_context *xdata) {
     static sqlite3_module cloudsync_changes_module = {
-        /* iVersion    */ 0,
+        /* iVersion    */ 2,
         /* xCreate     */ 0, // Eponymous only virtual table
         /* xConnect    */ cloudsync_changesvtab_connect,
         /* xBestIndex  */ cloudsync_changesvtab_best_index,
@@ -521,6 +1134,38 @@ int cloudsync_vtab_register_changes (sqlite3 *db, cloudsync_context *xdata) {
         /* xColumn     */ cloudsync_changesvtab_column,
         /* xRowid      */ cloudsync_changesvtab_rowid,
         /* xUpdate     */ cloudsync_changesvtab_update,
+        /* xBegin      */ cloudsync_changesvtab_begin,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ 0,
+        /* xSavepoint  */ 0,
+        /* xRelease    */ 0,
+        /* xRollbackTo */ cloudsync_changesvtab_rollbackto,
+        /* xShadowName */ 0,
+        /* xIntegrity  */ 0
+    };
+    
+    return sqlite3_create_module(db, "cloudsync_changes", &cloudsync_changes_module, (void *)xdata);
+}
+
+int cloudsync_vtab_register_clocks (sqlite3 *db, cloudsync_context *xdata) {
+    static sqlite3_module cloudsync_clocks_module = {
+        /* iVersion    */ 0,
+        /* xCreate     */ 0, // Eponymous only virtual table
+        /* xConnect    */ cloudsync_clocksvtab_connect,
+        /* xBestIndex  */ cloudsync_clocksvtab_best_index,
+        /* xDisconnect */ cloudsync_changesvtab_disconnect,
+        /* xDestroy    */ 0,
+        /* xOpen       */ cloudsync_clocksvtab_open,
+        /* xClose      */ cloudsync_clocksvtab_close,
+        /* xFilter     */ cloudsync_clocksvtab_filter,
+        /* xNext       */ cloudsync_clocksvtab_next,
+        /* xEof        */ cloudsync_clocksvtab_eof,
+        /* xColumn     */ cloudsync_clocksvtab_column,
+        /* xRowid      */ cloudsync_clocksvtab_rowid,
+        /* xUpdate     */ 0,
         /* xBegin      */ 0,
         /* xSync       */ 0,
         /* xCommit     */ 0,
@@ -534,5 +1179,37 @@ int cloudsync_vtab_register_changes (sqlite3 *db, cloudsync_context *xdata) {
         /* xIntegrity  */ 0
     };
     
-    return sqlite3_create_module(db, "cloudsync_changes", &cloudsync_changes_module, (void *)xdata);
+    return sqlite3_create_module(db, "cloudsync_clocks", &cloudsync_clocks_module, (void *)xdata);
+}
+
+int cloudsync_vtab_register_stats (sqlite3 *db, cloudsync_context *xdata) {
+    static sqlite3_module cloudsync_stats_module = {
+        /* iVersion    */ 0,
+        /* xCreate     */ 0, // Eponymous only virtual table
+        /* xConnect    */ cloudsync_statsvtab_connect,
+        /* xBestIndex  */ cloudsync_statsvtab_best_index,
+        /* xDisconnect */ cloudsync_changesvtab_disconnect,
+        /* xDestroy    */ 0,
+        /* xOpen       */ cloudsync_statsvtab_open,
+        /* xClose      */ cloudsync_statsvtab_close,
+        /* xFilter     */ cloudsync_statsvtab_filter,
+        /* xNext       */ cloudsync_statsvtab_next,
+        /* xEof        */ cloudsync_statsvtab_eof,
+        /* xColumn     */ cloudsync_statsvtab_column,
+        /* xRowid      */ cloudsync_statsvtab_rowid,
+        /* xUpdate     */ 0,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ 0,
+        /* xSavepoint  */ 0,
+        /* xRelease    */ 0,
+        /* xRollbackTo */ 0,
+        /* xShadowName */ 0,
+        /* xIntegrity  */ 0
+    };
+    
+    return sqlite3_create_module(db, "cloudsync_stats", &cloudsync_stats_module, (void *)xdata);
 }
@@ -12,6 +12,8 @@
 #include "cloudsync_private.h"
 
 int cloudsync_vtab_register_changes (sqlite3 *db, cloudsync_context *xdata);
+int cloudsync_vtab_register_clocks (sqlite3 *db, cloudsync_context *xdata);
+int cloudsync_vtab_register_stats (sqlite3 *db, cloudsync_context *xdata);
 cloudsync_context *cloudsync_vtab_get_context (sqlite3_vtab *vtab);
 int cloudsync_vtab_set_error (sqlite3_vtab *vtab, const char *format, ...);
 
@@ -23,6 +23,7 @@
 #include "dbutils.h"
 #include "cloudsync.h"
 #include "cloudsync_private.h"
+#include "schema.h"
 
 // declared only if macro CLOUDSYNC_UNITTEST is defined 
 extern char *OUT_OF_MEMORY_BUFFER;
@@ -41,6 +42,7 @@ bool dbutils_migrate (sqlite3 *db);
 const char *opname_from_value (int value);
 int colname_is_legal (const char *name);
 int binary_comparison (int x, int y);
+int cloudsync_commit_hook (void *ctx);
 sqlite3 *do_create_database (void);
 
 static int stdout_backup = -1; // Backup file descriptor for stdout
@@ -5685,6 +5687,1601 @@ finalize:
     return result;
 }
 
+bool do_test_vtab_pushdown (void) {
+    bool result = false;
+    
+    sqlite3 *db = do_create_database();
+    if (!db) return false;
+    
+    int rc = sqlite3_exec(db, "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, value TEXT); CREATE TABLE bar (id INTEGER PRIMARY KEY NOT NULL, value TEXT);"
+                              "SELECT cloudsync_init('foo'); SELECT cloudsync_init('bar', 'cls', 1);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    for (int i=0; i<20; ++i) {
+        char sql[512];
+        snprintf(sql, sizeof(sql), "INSERT INTO foo VALUES ('id%d', 'value%d'); INSERT INTO bar VALUES (%d, 'value%d'); UPDATE foo SET value = 'new%d' WHERE id = 'id%d';", i, i, i, i, i, i/2);
+        rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // the unary + operator prevents the constraint from reaching xBestIndex, so the second query of each pair is evaluated by SQLite
+    const char *queries[][2] = {
+        {"SELECT printf('%d %d %d', count(*), total(db_version), total(seq)) FROM cloudsync_changes WHERE db_version > 7;",
+         "SELECT printf('%d %d %d', count(*), total(db_version), total(seq)) FROM cloudsync_changes WHERE +db_version > 7;"},
+        {"SELECT printf('%d %d %d', count(*), total(db_version), total(seq)) FROM cloudsync_changes WHERE db_version >= 3 AND db_version < 12 AND seq <= 1;",
+         "SELECT printf('%d %d %d', count(*), total(db_version), total(seq)) FROM cloudsync_changes WHERE +db_version >= 3 AND +db_version < 12 AND +seq <= 1;"},
+        {"SELECT printf('%d %d %d', count(*), total(db_version), total(seq)) FROM cloudsync_changes WHERE site_id = cloudsync_siteid() AND db_version = 5;",
+         "SELECT printf('%d %d %d', count(*), total(db_version), total(seq)) FROM cloudsync_changes WHERE +site_id = cloudsync_siteid() AND +db_version = 5;"},
+        {"SELECT printf('%d %d %d', count(*), total(db_version), total(seq)) FROM cloudsync_changes WHERE site_id = randomblob(16);",
+         "SELECT '0 0 0';"}
+    };
+    
+    for (size_t i=0; i<sizeof(queries)/sizeof(queries[0]); ++i) {
+        char *v1 = dbutils_text_select(db, queries[i][0]);
+        char *v2 = dbutils_text_select(db, queries[i][1]);
+        bool same = (v1 && v2 && strcmp(v1, v2) == 0);
+        if (v1) cloudsync_memory_free(v1);
+        if (v2) cloudsync_memory_free(v2);
+        if (!same) goto finalize;
+    }
+    
+    // tbl constraints prune branches, LIMIT and OFFSET are evaluated by the generated SQL
+    const char *queries2[][2] = {
+        {"SELECT printf('%d %d %d', count(*), total(db_version), total(seq)) FROM cloudsync_changes WHERE tbl = 'foo';",
+         "SELECT printf('%d %d %d', count(*), total(db_version), total(seq)) FROM cloudsync_changes WHERE +tbl = 'foo';"},
+        {"SELECT printf('%d %d %d', count(*), total(db_version), total(seq)) FROM cloudsync_changes WHERE tbl IN ('bar', 'foo', 'baz', 1) AND db_version > 4;",
+         "SELECT printf('%d %d %d', count(*), total(db_version), total(seq)) FROM cloudsync_changes WHERE +tbl IN ('bar', 'foo', 'baz', 1) AND +db_version > 4;"},
+        {"SELECT printf('%d', count(*)) FROM cloudsync_changes WHERE tbl = 'baz';", "SELECT '0';"},
+        {"SELECT group_concat(db_version || ':' || seq) FROM (SELECT db_version, seq FROM cloudsync_changes WHERE tbl = 'bar' ORDER BY db_version, seq LIMIT 5 OFFSET 3);",
+         "SELECT group_concat(db_version || ':' || seq) FROM (SELECT db_version, seq FROM cloudsync_changes WHERE +tbl = 'bar' ORDER BY +db_version, +seq LIMIT 5 OFFSET 3);"},
+        {"SELECT group_concat(db_version || ':' || seq) FROM (SELECT db_version, seq FROM cloudsync_changes WHERE db_version > 2 LIMIT 7 OFFSET 11);",
+         "SELECT group_concat(db_version || ':' || seq) FROM (SELECT db_version, seq FROM cloudsync_changes WHERE +db_version > 2 ORDER BY +db_version, +seq LIMIT 7 OFFSET 11);"}
+    };
+    
+    for (int round=0; round<2; ++round) {
+        for (size_t i=0; i<sizeof(queries2)/sizeof(queries2[0]); ++i) {
+            char *v1 = dbutils_text_select(db, queries2[i][0]);
+            char *v2 = dbutils_text_select(db, queries2[i][1]);
+            bool same = (v1 && v2 && strcmp(v1, v2) == 0);
+            if (v1) cloudsync_memory_free(v1);
+            if (v2) cloudsync_memory_free(v2);
+            if (!same) goto finalize;
+        }
+        
+        // second round with the cost estimates based on sqlite_stat1
+        rc = sqlite3_exec(db, "ANALYZE;", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // metadata-only queries must return the same rows without reading the user tables
+    char *v1 = dbutils_text_select(db, "SELECT printf('%d %d %d', count(*), total(db_version), total(seq)) FROM cloudsync_changes WHERE tbl = 'foo';");
+    char *v2 = dbutils_text_select(db, "SELECT printf('%d %d %d', count(col_value IS NULL AND cl IS NOT NULL AND site_id IS NOT NULL), total(db_version), total(seq)) FROM cloudsync_changes WHERE tbl = 'foo';");
+    bool same = (v1 && v2 && strcmp(v1, v2) == 0);
+    if (v1) cloudsync_memory_free(v1);
+    if (v2) cloudsync_memory_free(v2);
+    if (!same) goto finalize;
+    
+    // rows that cannot be read from the user tables are skipped regardless of the columns used by the query
+    int total = dbutils_int_select(db, "SELECT count(*) FROM cloudsync_changes;");
+    rc = sqlite3_exec(db, "SELECT cloudsync_disable('foo'); SELECT cloudsync_disable('bar'); DELETE FROM foo WHERE rowid IN (SELECT rowid FROM foo LIMIT 2); DELETE FROM bar WHERE id IN (SELECT id FROM bar LIMIT 3);"
+                          "SELECT cloudsync_enable('foo'); SELECT cloudsync_enable('bar');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    v1 = dbutils_text_select(db, "SELECT printf('%d %d %d', count(*), total(db_version), total(seq)) FROM cloudsync_changes;");
+    v2 = dbutils_text_select(db, "SELECT printf('%d %d %d', count(col_value IS NULL OR 1), total(db_version), total(seq)) FROM cloudsync_changes;");
+    same = (v1 && v2 && strcmp(v1, v2) == 0);
+    if (v1) cloudsync_memory_free(v1);
+    if (v2) cloudsync_memory_free(v2);
+    if (!same) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM cloudsync_changes;") >= total) goto finalize;
+    
+    rc = sqlite3_exec(db, "CREATE TABLE foo2 (id TEXT PRIMARY KEY NOT NULL, value TEXT); SELECT cloudsync_init('foo2'); INSERT INTO foo2 VALUES ('id1', 'value1');"
+                          "ALTER TABLE foo2 RENAME TO foo3;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, "SELECT max(db_version) FROM cloudsync_changes WHERE tbl = 'foo2' AND site_id = cloudsync_siteid();") <= 0) goto finalize;
+    rc = sqlite3_exec(db, "SELECT col_value FROM cloudsync_changes WHERE tbl = 'foo2';", NULL, NULL, NULL);
+    if (rc == SQLITE_OK) goto finalize;
+    
+    // the db_version constraint must be evaluated by each branch
+    sqlite3_stmt *stmt = NULL;
+    rc = sqlite3_prepare_v2(db, "EXPLAIN QUERY PLAN SELECT tbl FROM cloudsync_changes WHERE db_version > 7;", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    bool pushed = false;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *detail = (const char *)sqlite3_column_text(stmt, 3);
+        if (detail && strstr(detail, "t1.db_version > ?1")) pushed = true;
+    }
+    sqlite3_finalize(stmt);
+    if (!pushed) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (!result) printf("do_test_vtab_pushdown error: %s\n", sqlite3_errmsg(db));
+    close_db(db);
+    return result;
+}
+
+bool do_test_metatable_columns (bool cleanup_databases) {
+    bool result = false;
+
+    time_t timestamp = time(NULL);
+    int counter = test_counter++;
+    sqlite3 *db = do_create_database_file(0, timestamp, counter);
+    if (!db) return false;
+
+    const char *changes_sql = "SELECT group_concat(tbl || ':' || hex(pk) || ':' || col_name || ':' || IFNULL(col_value, 'NULL') || ':' || col_version || ':' || db_version || ':' || seq || ':' || cl, ',') FROM (SELECT * FROM cloudsync_changes ORDER BY db_version, seq);";
+    char *v1 = NULL;
+    char *v2 = NULL;
+
+    int rc = sqlite3_exec(db, "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT, b TEXT); SELECT cloudsync_init('foo');"
+                              "INSERT INTO foo VALUES ('id1', 'a1', 'b1'); INSERT INTO foo VALUES ('id2', 'a2', 'b2'); INSERT INTO foo VALUES ('id3', 'a3', 'b3');"
+                              "UPDATE foo SET b = 'b4' WHERE id = 'id1'; DELETE FROM foo WHERE id = 'id2';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+
+    // meta-tables store the col_id, names are resolved through the dictionary
+    if (dbutils_int_select(db, "SELECT count(*) FROM cloudsync_columns WHERE tbl_name = 'foo';") != 2) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM foo_cloudsync WHERE col_id = 0;") != 1) goto finalize;
+    v1 = dbutils_text_select(db, changes_sql);
+    if (!v1) goto finalize;
+
+    // rewrite the meta-table using the previous layout (TEXT col_name) and reopen the database
+    rc = sqlite3_exec(db, "CREATE TABLE foo_cloudsync_old (pk BLOB NOT NULL, col_name TEXT NOT NULL, col_version INTEGER, db_version INTEGER, site_id INTEGER DEFAULT 0, seq INTEGER, PRIMARY KEY (pk, col_name)) WITHOUT ROWID;"
+                          "INSERT INTO foo_cloudsync_old SELECT pk, IIF(col_id = 0, '" CLOUDSYNC_TOMBSTONE_VALUE "', (SELECT col_name FROM cloudsync_columns AS c WHERE c.tbl_name = 'foo' AND c.col_id = m.col_id)), col_version, db_version, site_id, seq FROM foo_cloudsync AS m;"
+                          "DROP TABLE foo_cloudsync; DELETE FROM cloudsync_columns; ALTER TABLE foo_cloudsync_old RENAME TO foo_cloudsync;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    db = close_db(db);
+
+    db = do_create_database_file(0, timestamp, counter);
+    if (!db) goto finalize;
+
+    // the meta-table must have been migrated without changing the content of cloudsync_changes
+    if (dbutils_int_select(db, "SELECT count(*) FROM pragma_table_info('foo_cloudsync') WHERE name = 'col_id';") != 1) goto finalize;
+    v2 = dbutils_text_select(db, changes_sql);
+    if (!v2 || strcmp(v1, v2) != 0) goto finalize;
+
+    // ids are stable across schema changes and never reused
+    sqlite3_int64 id_b = dbutils_int_select(db, "SELECT col_id FROM cloudsync_columns WHERE tbl_name = 'foo' AND col_name = 'b';");
+    rc = sqlite3_exec(db, "SELECT cloudsync_begin_alter('foo'); ALTER TABLE foo ADD COLUMN c TEXT; SELECT cloudsync_commit_alter('foo');"
+                          "UPDATE foo SET c = 'c1' WHERE id = 'id1';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, "SELECT col_id FROM cloudsync_columns WHERE tbl_name = 'foo' AND col_name = 'b';") != id_b) goto finalize;
+    if (dbutils_int_select(db, "SELECT col_id FROM cloudsync_columns WHERE tbl_name = 'foo' AND col_name = 'c';") <= id_b) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM cloudsync_changes WHERE col_name = 'c' AND col_value = 'c1';") != 1) goto finalize;
+
+    result = true;
+
+finalize:
+    if (!result && db) printf("do_test_metatable_columns error: %s\n", sqlite3_errmsg(db));
+    if (v1) cloudsync_memory_free(v1);
+    if (v2) cloudsync_memory_free(v2);
+    close_db(db);
+    if (cleanup_databases) {
+        char buf[256];
+        do_build_database_path(buf, 0, timestamp, counter);
+        file_delete_internal(buf);
+    }
+    return result;
+}
+
+bool do_test_packed_storage (bool cleanup_databases) {
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    bool result = false;
+    char *v[3] = {NULL, NULL, NULL};
+    
+    time_t timestamp = time(NULL);
+    int counter = test_counter++;
+    
+    const char *changes_sql = "SELECT group_concat(tbl || ':' || hex(pk) || ':' || col_name || ':' || IFNULL(col_value, 'NULL') || ':' || col_version || ':' || db_version || ':' || seq || ':' || cl, ',') FROM (SELECT * FROM cloudsync_changes ORDER BY db_version, seq);";
+    const char *values_sql = "SELECT group_concat(id || ':' || IFNULL(a, 'NULL') || ':' || IFNULL(b, 'NULL') || ':' || IFNULL(c, 'NULL'), ',') FROM (SELECT * FROM foo ORDER BY id);";
+    const char *ops_sql = "INSERT INTO foo VALUES ('id1', 'a1', 1, 1.5), ('id2', 'a2', 2, 2.5), ('id3', 'a3', 3, 3.5);"
+                          "UPDATE foo SET a = 'a4' WHERE id = 'id1'; UPDATE foo SET b = 20, c = 0 WHERE id = 'id2';"
+                          "DELETE FROM foo WHERE id = 'id3'; INSERT INTO foo VALUES ('id3', 'a5', 5, 5.5); DELETE FROM foo WHERE id = 'id1';";
+    
+    // db[0] uses the default per-column storage, db[1] the packed one
+    int rc = sqlite3_open(":memory:", &db[0]);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_cloudsync_init(db[0], NULL, NULL);
+    db[1] = do_create_database_file(0, timestamp, counter);
+    if (!db[1]) goto finalize;
+    
+    rc = sqlite3_exec(db[0], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER, c REAL); SELECT cloudsync_init('foo', 'cls', 0, 'rows');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[1], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER, c REAL); SELECT cloudsync_init('foo', 'cls', 0, 'packed');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // the storage mode cannot be changed without a cleanup, and an unknown mode is an error
+    if (sqlite3_exec(db[1], "SELECT cloudsync_init('foo', 'cls', 0, 'rows');", NULL, NULL, NULL) == SQLITE_OK) goto finalize;
+    if (sqlite3_exec(db[0], "SELECT cloudsync_init('foo', 'cls', 0, 'unknown');", NULL, NULL, NULL) == SQLITE_OK) goto finalize;
+    
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_exec(db[i], ops_sql, NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+        v[i] = dbutils_text_select(db[i], changes_sql);
+        if (!v[i]) goto finalize;
+    }
+    
+    // same changes, but a single meta-table row per primary key
+    if (strcmp(v[0], v[1]) != 0) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM foo_cloudsync;") != 3) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_changes WHERE db_version > 5;") != dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes WHERE db_version > 5;")) goto finalize;
+    
+    // the storage mode survives a reopen
+    db[1] = close_db(db[1]);
+    db[1] = do_create_database_file(0, timestamp, counter);
+    if (!db[1]) goto finalize;
+    cloudsync_memory_free(v[1]);
+    v[1] = dbutils_text_select(db[1], changes_sql);
+    if (!v[1] || strcmp(v[0], v[1]) != 0) goto finalize;
+    
+    // merge the packed table into a new per-column table and back
+    rc = sqlite3_open(":memory:", &db[2]);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_cloudsync_init(db[2], NULL, NULL);
+    rc = sqlite3_exec(db[2], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER, c REAL); SELECT cloudsync_init('foo');"
+                             "INSERT INTO foo VALUES ('id4', 'a6', 6, 6.5);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_using_payload(db[1], db[2], true, true) == false) goto finalize;
+    if (do_merge_using_payload(db[2], db[1], true, true) == false) goto finalize;
+    
+    cloudsync_memory_free(v[0]);
+    cloudsync_memory_free(v[1]);
+    v[0] = dbutils_text_select(db[1], values_sql);
+    v[1] = dbutils_text_select(db[2], values_sql);
+    if (!v[0] || !v[1] || strcmp(v[0], v[1]) != 0) goto finalize;
+    if (strcmp(v[0], "id2:a2:20:0.0,id3:a5:5:5.5,id4:a6:6:6.5") != 0) goto finalize;
+    
+    // a column added by an alter doesn't inherit the insert clocks, it gets its own clocks only when updated
+    rc = sqlite3_exec(db[1], "SELECT cloudsync_begin_alter('foo'); ALTER TABLE foo ADD COLUMN d TEXT DEFAULT 'd1'; SELECT cloudsync_commit_alter('foo');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_changes WHERE col_name = 'd';") != 0) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM foo_cloudsync;") != 4) goto finalize;
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<3; ++i) {
+        if (!result && db[i]) printf("do_test_packed_storage error: %s\n", sqlite3_errmsg(db[i]));
+        if (v[i]) cloudsync_memory_free(v[i]);
+        close_db(db[i]);
+    }
+    if (cleanup_databases) {
+        char buf[256];
+        do_build_database_path(buf, 0, timestamp, counter);
+        file_delete_internal(buf);
+    }
+    return result;
+}
+
+bool do_test_integer_pk_metatable (void) {
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    bool result = false;
+    char *v[3] = {NULL, NULL, NULL};
+    
+    const char *changes_sql = "SELECT group_concat(tbl || ':' || hex(pk) || ':' || col_name || ':' || IFNULL(col_value, 'NULL') || ':' || col_version || ':' || db_version || ':' || seq || ':' || cl, ',') FROM (SELECT * FROM cloudsync_changes ORDER BY db_version, seq);";
+    const char *values_sql = "SELECT group_concat(id || ':' || IFNULL(a, 'NULL') || ':' || IFNULL(b, 'NULL'), ',') FROM (SELECT * FROM foo ORDER BY id);";
+    const char *ops_sql = "INSERT INTO foo VALUES (0, 'a0', 0), (-5, 'a1', 1), (1, 'a2', 2), (300, 'a3', 3), (9223372036854775807, 'a4', 4);"
+                          "UPDATE foo SET a = 'a5' WHERE id = 0; UPDATE foo SET b = 20 WHERE id = -5;"
+                          "DELETE FROM foo WHERE id = 300; INSERT INTO foo VALUES (300, 'a6', 6); DELETE FROM foo WHERE id = 1;";
+    
+    // db[0] has a meta-table created with the BLOB pk layout, db[1] and db[2] use the integer one (db[2] packed)
+    for (int i=0; i<3; ++i) {
+        int rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        rc = sqlite3_exec(db[i], "CREATE TABLE foo (id INTEGER PRIMARY KEY NOT NULL, a TEXT, b INTEGER);", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    int rc = sqlite3_exec(db[0], "CREATE TABLE foo_cloudsync (pk BLOB NOT NULL, col_id INTEGER NOT NULL, col_version INTEGER, db_version INTEGER, site_id INTEGER DEFAULT 0, seq INTEGER, PRIMARY KEY (pk, col_id)) WITHOUT ROWID;"
+                                 "SELECT cloudsync_init('foo', 'cls', 1);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[1], "SELECT cloudsync_init('foo', 'cls', 1);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[2], "SELECT cloudsync_init('foo', 'cls', 1, 'packed');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    for (int i=0; i<3; ++i) {
+        rc = sqlite3_exec(db[i], ops_sql, NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+        v[i] = dbutils_text_select(db[i], changes_sql);
+        if (!v[i]) goto finalize;
+    }
+    
+    // the integer keys are encoded only by cloudsync_changes, so all the layouts report the same changes
+    if (strcmp(v[0], v[1]) != 0 || strcmp(v[0], v[2]) != 0) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM foo_cloudsync WHERE typeof(pk) != 'blob';") != 0) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM foo_cloudsync WHERE typeof(pk) != 'integer';") != 0) goto finalize;
+    if (dbutils_int_select(db[2], "SELECT count(*) FROM foo_cloudsync WHERE typeof(pk) != 'integer';") != 0) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_changes WHERE pk = cloudsync_pk_encode(-5);") != 2) goto finalize;
+    
+    // changes (including a primary key update) are merged between the layouts
+    rc = sqlite3_exec(db[1], "UPDATE foo SET id = 7 WHERE id = 0; INSERT INTO foo VALUES (8, 'a8', 8);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[0], "UPDATE foo SET b = 40 WHERE id = 300;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    for (int i=0; i<3; ++i) {
+        for (int j=0; j<3; ++j) {
+            if (i != j && do_merge_using_payload(db[i], db[j], true, true) == false) goto finalize;
+        }
+    }
+    
+    for (int i=0; i<3; ++i) {
+        cloudsync_memory_free(v[i]);
+        v[i] = dbutils_text_select(db[i], values_sql);
+        if (!v[i]) goto finalize;
+    }
+    if (strcmp(v[0], v[1]) != 0 || strcmp(v[0], v[2]) != 0) goto finalize;
+    if (strcmp(v[0], "-5:a1:20,7:a5:0,8:a8:8,300:a6:40,9223372036854775807:a4:4") != 0) goto finalize;
+    
+    // a column added by an alter has the same default on every peer, so it gets clocks only when updated
+    rc = sqlite3_exec(db[1], "SELECT cloudsync_begin_alter('foo'); ALTER TABLE foo ADD COLUMN c TEXT DEFAULT 'c1'; SELECT cloudsync_commit_alter('foo');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_changes WHERE col_name = 'c';") != 0) goto finalize;
+    rc = sqlite3_exec(db[1], "UPDATE foo SET c = 'c2' WHERE id = 8;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_changes WHERE col_name = 'c';") != 1) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM foo_cloudsync WHERE typeof(pk) != 'integer';") != 0) goto finalize;
+    
+    // the BLOB layout is kept by an alter that doesn't change the primary key (and so are the tombstones)
+    sqlite3_int64 nchanges = dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes;");
+    rc = sqlite3_exec(db[0], "SELECT cloudsync_begin_alter('foo'); ALTER TABLE foo ADD COLUMN c TEXT DEFAULT 'c1'; SELECT cloudsync_commit_alter('foo');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM foo_cloudsync WHERE typeof(pk) != 'blob';") != 0) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes;") != nchanges) goto finalize;
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<3; ++i) {
+        if (!result && db[i]) printf("do_test_integer_pk_metatable error: %s\n", sqlite3_errmsg(db[i]));
+        if (v[i]) cloudsync_memory_free(v[i]);
+        close_db(db[i]);
+    }
+    return result;
+}
+
+bool do_test_gc (void) {
+    sqlite3 *db = NULL;
+    bool result = false;
+    
+    int rc = sqlite3_open(":memory:", &db);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_cloudsync_init(db, NULL, NULL);
+    
+    rc = sqlite3_exec(db, "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT); SELECT cloudsync_init('foo');"
+                          "CREATE TABLE bar (id TEXT PRIMARY KEY NOT NULL, a TEXT, b TEXT); SELECT cloudsync_init('bar', 'cls', 0, 'packed');"
+                          "INSERT INTO foo VALUES ('id1', 'a1'), ('id2', 'a2'), ('id3', 'a3'); INSERT INTO bar VALUES ('id1', 'a1', 'b1'), ('id2', 'a2', 'b2');"
+                          "DELETE FROM foo WHERE id IN ('id1', 'id2'); DELETE FROM bar WHERE id = 'id1';"
+                          "INSERT INTO foo VALUES ('id4', 'a4'); DELETE FROM foo WHERE id = 'id4';"
+                          "INSERT INTO cloudsync_site_id (site_id) VALUES (randomblob(16));", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // without an horizon nothing is collected, and an unknown table is an error
+    if (dbutils_int_select(db, "SELECT json_extract(cloudsync_gc('*'), '$.rows');") != 0) goto finalize;
+    if (sqlite3_exec(db, "SELECT cloudsync_gc('unknown', 10);", NULL, NULL, NULL) == SQLITE_OK) goto finalize;
+    
+    // only the tombstones older than the horizon are dropped (and the site_id nobody references)
+    if (dbutils_int_select(db, "SELECT json_extract(cloudsync_gc('*', 4), '$.rows');") != 4) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM foo_cloudsync;") != 2) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM bar_cloudsync;") != 1) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM cloudsync_site_id;") != 1) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM cloudsync_changes WHERE pk = cloudsync_pk_encode('id4');") != 1) goto finalize;
+    
+    // the horizon acknowledged by the server is used by default and the db_version never goes back
+    sqlite3_int64 db_version = dbutils_int_select(db, "SELECT cloudsync_db_version();");
+    rc = sqlite3_exec(db, "SELECT cloudsync_set('" CLOUDSYNC_KEY_GC_HORIZON "', '6');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, "SELECT json_extract(cloudsync_gc('foo'), '$.rows');") != 1) goto finalize;
+    if (dbutils_int_select(db, "SELECT cloudsync_db_version();") != db_version) goto finalize;
+    rc = sqlite3_exec(db, "INSERT INTO foo VALUES ('id5', 'a5');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, "SELECT db_version FROM cloudsync_changes WHERE pk = cloudsync_pk_encode('id5');") != db_version + 1) goto finalize;
+    
+    // the collected rows are still deleted
+    if (dbutils_int_select(db, "SELECT count(*) FROM foo;") != 2) goto finalize;
+    
+    // the ordinal of the collected site_id (1) is not reused by the next site_id
+    rc = sqlite3_exec(db, "INSERT INTO cloudsync_changes (tbl,pk,col_name,col_value,col_version,db_version,site_id,cl,seq) VALUES ('foo',cloudsync_pk_encode('id6'),'a','a6',1,1,x'BBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBB',1,0);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, "SELECT rowid FROM cloudsync_site_id WHERE site_id = x'BBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBB';") != 2) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (!result && db) printf("do_test_gc error: %s\n", sqlite3_errmsg(db));
+    close_db(db);
+    return result;
+}
+
+bool do_test_gc_siteid_cache (void) {
+    sqlite3 *db[2] = {NULL, NULL};
+    char path[256] = {0};
+    bool result = false;
+    
+    do_build_database_path(path, 0, time(NULL), 42);
+    file_delete_internal(path);
+    for (int i=0; i<2; ++i) {
+        if (sqlite3_open(path, &db[i]) != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+    }
+    if (sqlite3_exec(db[0], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT); SELECT cloudsync_init('foo');", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    if (sqlite3_exec(db[1], "SELECT cloudsync_init('foo');", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    
+    // the first connection caches the ordinal of a remote site
+    if (sqlite3_exec(db[0], "INSERT INTO cloudsync_changes (tbl,pk,col_name,col_value,col_version,db_version,site_id,cl,seq) VALUES ('foo',cloudsync_pk_encode('id1'),'a','a1',1,1,x'CCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCC',1,0);", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    
+    // the second one overwrites its only clock and collects it
+    if (sqlite3_exec(db[1], "UPDATE foo SET a = 'a2' WHERE id = 'id1'; SELECT cloudsync_gc('*', 1000);", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_site_id WHERE site_id = x'CCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCC';") != 0) goto finalize;
+    
+    // a new change from the same site must not refer to the deleted ordinal
+    if (sqlite3_exec(db[0], "INSERT INTO cloudsync_changes (tbl,pk,col_name,col_value,col_version,db_version,site_id,cl,seq) VALUES ('foo',cloudsync_pk_encode('id2'),'a','b1',1,2,x'CCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCC',1,0);", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_site_id WHERE site_id = x'CCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCC';") != 1) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes WHERE pk = cloudsync_pk_encode('id2') AND site_id = x'CCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCC';") != 1) goto finalize;
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<2; ++i) {
+        if (!result && db[i]) printf("do_test_gc_siteid_cache error: %s\n", sqlite3_errmsg(db[i]));
+        close_db(db[i]);
+    }
+    if (path[0]) file_delete_internal(path);
+    return result;
+}
+
+bool do_test_row_cache (void) {
+    sqlite3 *db = NULL;
+    sqlite3_stmt *vm = NULL;
+    bool result = false;
+    
+    int rc = sqlite3_open(":memory:", &db);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_cloudsync_init(db, NULL, NULL);
+    
+    rc = sqlite3_exec(db, "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER, c BLOB, d REAL); SELECT cloudsync_init('foo');"
+                          "CREATE TABLE bar (id INTEGER PRIMARY KEY NOT NULL, a TEXT, b TEXT); SELECT cloudsync_init('bar', 'cls', 1);"
+                          "INSERT INTO foo VALUES ('id1', 'a1', 1, x'01', 1.5), ('id2', 'a2', NULL, x'02', 2.5), ('id3', 'a3', 3, NULL, 3.5);"
+                          "INSERT INTO bar VALUES (1, 'a1', 'b1'), (2, 'a2', 'b2');"
+                          "CREATE TABLE baz (id TEXT PRIMARY KEY NOT NULL, a INTEGER, b INTEGER); SELECT cloudsync_init('baz'); INSERT INTO baz VALUES ('id1', 1, 1);"
+                          "UPDATE foo SET b = 20, d = 20.5 WHERE id = 'id2';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // the values served by the cache are the ones of the base tables (cloudsync_col_value called outside a scan never uses the cache)
+    const char *sql = "SELECT count(*) FROM cloudsync_changes WHERE col_name != '" CLOUDSYNC_TOMBSTONE_VALUE "' AND col_value IS NOT cloudsync_col_value(tbl, col_name, pk);";
+    if (dbutils_int_select(db, sql) != 0) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM cloudsync_changes WHERE tbl = 'foo' AND col_name = 'b' AND col_value IS NULL;") != 0) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM cloudsync_changes WHERE tbl = 'foo' AND col_name = 'c' AND col_value IS NULL;") != 1) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM cloudsync_changes WHERE tbl = 'bar' AND col_value = 'b2';") != 1) goto finalize;
+    
+    // while a scan is in progress the cache outlives the statements, so a row changed in the meantime must be read again
+    rc = sqlite3_prepare_v2(db, "SELECT col_value FROM cloudsync_changes WHERE tbl = 'bar';", -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (sqlite3_step(vm) != SQLITE_ROW) goto finalize;
+    if (dbutils_int_select(db, "SELECT col_value FROM cloudsync_changes WHERE tbl = 'baz' AND col_name = 'b';") != 1) goto finalize;
+    rc = sqlite3_exec(db, "UPDATE baz SET b = 9 WHERE id = 'id1';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, "SELECT col_value FROM cloudsync_changes WHERE tbl = 'baz' AND col_name = 'b';") != 9) goto finalize;
+    if (dbutils_int_select(db, sql) != 0) goto finalize;
+    sqlite3_finalize(vm);
+    vm = NULL;
+    
+    // the values of a row deleted from the base table while its metadata still exists are not returned
+    rc = sqlite3_exec(db, "SELECT cloudsync_disable('foo'); DELETE FROM foo WHERE id = 'id3'; SELECT cloudsync_enable('foo');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(col_value) FROM cloudsync_changes WHERE pk = cloudsync_pk_encode('id3');") != 0) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(col_value) FROM cloudsync_changes WHERE pk = cloudsync_pk_encode('id2');") != 4) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (!result && db) printf("do_test_row_cache error: %s\n", sqlite3_errmsg(db));
+    if (vm) sqlite3_finalize(vm);
+    close_db(db);
+    return result;
+}
+
+bool do_test_arena (void) {
+    sqlite3 *db[2] = {NULL, NULL};
+    cloudsync_arena arena;
+    bool result = false;
+    
+    // allocations are aligned and the last one grows in place
+    cloudsync_arena_init(&arena, 1024);
+    char *p1 = cloudsync_arena_alloc(&arena, 10);
+    char *p2 = cloudsync_arena_alloc(&arena, 100);
+    if (!p1 || !p2 || ((uintptr_t)p2 % 8) != 0) goto finalize;
+    memset(p2, 'x', 100);
+    if (cloudsync_arena_realloc(&arena, p2, 100, 200) != p2) goto finalize;
+    char *p3 = cloudsync_arena_realloc(&arena, p1, 10, 20);
+    if (!p3 || p3 == p1) goto finalize;
+    char *s = cloudsync_arena_strdup(&arena, "cloudsync");
+    if (!s || strcmp(s, "cloudsync") != 0) goto finalize;
+    
+    // a scope releases everything allocated after its mark, including the blocks of large allocations
+    uint64_t allocated = arena.allocated;
+    cloudsync_arena_mark mark = cloudsync_arena_begin(&arena);
+    char *large = cloudsync_arena_alloc(&arena, 64 * 1024);
+    if (!large) goto finalize;
+    memset(large, 0, 64 * 1024);
+    
+    // the arena is not reset while a scope is open
+    cloudsync_arena_reset(&arena);
+    if (arena.allocated <= allocated || strcmp(s, "cloudsync") != 0) goto finalize;
+    cloudsync_arena_end(&arena, mark);
+    if (arena.allocated != allocated || arena.nscopes != 0) goto finalize;
+    
+    // a reset keeps the first block
+    cloudsync_arena_reset(&arena);
+    if (arena.allocated > 1024 || arena.peak < 64 * 1024) goto finalize;
+    cloudsync_arena_free(&arena);
+    if (arena.allocated != 0 || arena.head != NULL) goto finalize;
+    
+    // primary keys larger than the stack buffers are encoded in the context arena
+    for (int i=0; i<2; ++i) {
+        if (sqlite3_open(":memory:", &db[i]) != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        if (sqlite3_exec(db[i], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT); SELECT cloudsync_init('foo');", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    }
+    const char *sql = "WITH RECURSIVE n(value) AS (SELECT 1 UNION ALL SELECT value + 1 FROM n WHERE value < 50) "
+                      "INSERT INTO foo SELECT printf('%.*c', 3000, 'k') || value, 'a' || value FROM n;"
+                      "UPDATE foo SET a = 'u' || a WHERE rowid % 2 = 0;"
+                      "UPDATE foo SET id = printf('%.*c', 5000, 'n') WHERE id = printf('%.*c', 3000, 'k') || '7';"
+                      "DELETE FROM foo WHERE id = printf('%.*c', 3000, 'k') || '9';";
+    if (sqlite3_exec(db[0], sql, NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM foo;") != 49) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes WHERE length(pk) > 5000;") != 2) goto finalize;
+    
+    // the compressed payload is expanded in the arena of the receiver
+    if (!do_merge_using_payload(db[0], db[1], false, true)) goto finalize;
+    if (!do_compare_queries(db[0], "SELECT * FROM foo ORDER BY id;", db[1], "SELECT * FROM foo ORDER BY id;", -1, -1, false)) goto finalize;
+    
+    result = true;
+    
+finalize:
+    cloudsync_arena_free(&arena);
+    for (int i=0; i<2; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+int do_count_statements (sqlite3 *db) {
+    int count = 0;
+    for (sqlite3_stmt *vm = sqlite3_next_stmt(db, NULL); vm; vm = sqlite3_next_stmt(db, vm)) ++count;
+    return count;
+}
+
+bool do_test_lazy_statements (void) {
+    sqlite3 *db[2] = {NULL, NULL};
+    char path[256] = {0};
+    char sql[4096];
+    bool result = false;
+    
+    // 30 tables with 20 columns each would require more than 1500 statements if compiled when the tables are loaded
+    do_build_database_path(path, 0, time(NULL), 40);
+    file_delete_internal(path);
+    for (int i=0; i<2; ++i) {
+        if (sqlite3_open((i == 0) ? path : ":memory:", &db[i]) != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        for (int t=0; t<30; ++t) {
+            int len = snprintf(sql, sizeof(sql), "CREATE TABLE t%d (id TEXT PRIMARY KEY NOT NULL", t);
+            for (int c=0; c<20; ++c) len += snprintf(sql + len, sizeof(sql) - len, ", c%d TEXT", c);
+            snprintf(sql + len, sizeof(sql) - len, "); SELECT cloudsync_init('t%d');", t);
+            if (sqlite3_exec(db[i], sql, NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+        }
+    }
+    
+    // the statements of the tables are not compiled when the connection is opened
+    close_db(db[0]);
+    db[0] = NULL;
+    if (sqlite3_open(path, &db[0]) != SQLITE_OK) goto finalize;
+    sqlite3_cloudsync_init(db[0], NULL, NULL);
+    int nstmts = do_count_statements(db[0]);
+    if (nstmts > 30) goto finalize;
+    
+    // only the statements used by the changes of a table are compiled
+    if (sqlite3_exec(db[0], "INSERT INTO t3 (id, c0, c1) VALUES ('id1', 'a', 'b'), ('id2', 'c', 'd'); UPDATE t3 SET c5 = 'e' WHERE id = 'id1'; DELETE FROM t3 WHERE id = 'id2';", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    if (do_count_statements(db[0]) - nstmts > 10) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes WHERE tbl = 't3';") != 21) goto finalize;
+    
+    // the merge statements of the receiver are compiled when the changes are applied
+    if (!do_merge_using_payload(db[0], db[1], false, true)) goto finalize;
+    if (!do_compare_queries(db[0], "SELECT * FROM t3 ORDER BY id;", db[1], "SELECT * FROM t3 ORDER BY id;", -1, -1, false)) goto finalize;
+    if (!do_compare_queries(db[0], "SELECT tbl, pk, col_name, col_value, col_version, cl FROM cloudsync_changes;", db[1], "SELECT tbl, pk, col_name, col_value, col_version, cl FROM cloudsync_changes;", -1, -1, false)) goto finalize;
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<2; ++i) {
+        if (!result && db[i]) printf("do_test_lazy_statements error: %s\n", sqlite3_errmsg(db[i]));
+        close_db(db[i]);
+    }
+    if (path[0]) file_delete_internal(path);
+    return result;
+}
+
+bool do_test_siteid_ordinals (void) {
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    bool result = false;
+    
+    for (int i=0; i<3; ++i) {
+        int rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT, b TEXT); SELECT cloudsync_init('foo');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    int rc = sqlite3_exec(db[0], "INSERT INTO foo VALUES ('id1', 'a1', 'b1'), ('id2', 'a2', 'b2');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[1], "INSERT INTO foo VALUES ('id3', 'a3', 'b3');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // the site_id inserted by a rolled back transaction must be inserted again (its ordinal is now used by another site)
+    rc = sqlite3_exec(db[2], "BEGIN;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_values(db[0], db[2], false) == false) goto finalize;
+    rc = sqlite3_exec(db[2], "ROLLBACK; INSERT INTO cloudsync_site_id (site_id) VALUES (randomblob(16));", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_values(db[0], db[2], false) == false) goto finalize;
+    
+    // the same for a rolled back savepoint
+    rc = sqlite3_exec(db[2], "BEGIN; SAVEPOINT merge;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_values(db[1], db[2], false) == false) goto finalize;
+    rc = sqlite3_exec(db[2], "ROLLBACK TO merge; RELEASE merge; INSERT INTO cloudsync_site_id (site_id) VALUES (randomblob(16));", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_values(db[1], db[2], false) == false) goto finalize;
+    rc = sqlite3_exec(db[2], "COMMIT;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // every change must keep the site_id of its origin
+    for (int i=0; i<2; ++i) {
+        char *site_id = dbutils_text_select(db[i], "SELECT hex(cloudsync_siteid());");
+        if (!site_id) goto finalize;
+        char *sql = sqlite3_mprintf("SELECT count(*) FROM cloudsync_changes WHERE hex(site_id) = '%q';", site_id);
+        cloudsync_memory_free(site_id);
+        if (!sql) goto finalize;
+        sqlite3_int64 count = dbutils_int_select(db[2], sql);
+        sqlite3_free(sql);
+        if (count != dbutils_int_select(db[i], "SELECT count(*) FROM cloudsync_changes;")) goto finalize;
+    }
+    if (dbutils_int_select(db[2], "SELECT count(*) FROM cloudsync_site_id;") != 5) goto finalize;
+    
+    // merging again from a known site doesn't add any site_id
+    if (do_merge_values(db[0], db[2], false) == false) goto finalize;
+    if (dbutils_int_select(db[2], "SELECT count(*) FROM cloudsync_site_id;") != 5) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (!result && db[2]) printf("do_test_siteid_ordinals error: %s\n", sqlite3_errmsg(db[2]));
+    for (int i=0; i<3; ++i) close_db(db[i]);
+    return result;
+}
+
+typedef struct {
+    void    *ctx;
+    int     ncommits;
+} payload_apply_commits;
+
+static int do_test_payload_apply_commit_hook (void *xdata) {
+    // count the transactions and forward to the hook installed by the extension
+    payload_apply_commits *commits = (payload_apply_commits *)xdata;
+    ++commits->ncommits;
+    return cloudsync_commit_hook(commits->ctx);
+}
+
+bool do_test_payload_apply_grouping (void) {
+    sqlite3 *db[5] = {NULL, NULL, NULL, NULL, NULL};
+    bool result = false;
+    
+    // db[0] is the source, each destination uses different grouping options
+    const char *options[5] = {
+        NULL,
+        NULL,
+        "SELECT cloudsync_set('" CLOUDSYNC_KEY_APPLY_GROUP_DBVERSIONS "', '4');",
+        "SELECT cloudsync_set('" CLOUDSYNC_KEY_APPLY_GROUP_DBVERSIONS "', '0'); SELECT cloudsync_set('" CLOUDSYNC_KEY_APPLY_GROUP_ROWS "', '5');",
+        "SELECT cloudsync_set('" CLOUDSYNC_KEY_APPLY_GROUP_DBVERSIONS "', '0'); SELECT cloudsync_set('" CLOUDSYNC_KEY_APPLY_GROUP_MS "', '600000');"
+    };
+    
+    for (int i=0; i<5; ++i) {
+        int rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT, b TEXT); SELECT cloudsync_init('foo');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+        if (options[i]) rc = sqlite3_exec(db[i], options[i], NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // 10 db_versions, each one with 2 rows
+    for (int i=0; i<10; ++i) {
+        char sql[256];
+        snprintf(sql, sizeof(sql), "INSERT INTO foo VALUES ('id%d', 'a%d', 'b%d');", i, i, i);
+        int rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes;") != 20) goto finalize;
+    
+    // merged rows keep the db_version of the source, so count the transactions committed by the apply
+    // (the check marks stored at the end of the apply add the same number of commits to each destination)
+    int expected[5] = {0, 10, 3, 4, 1};
+    int extra = -1;
+    for (int i=1; i<5; ++i) {
+        payload_apply_commits commits = {NULL, 0};
+        commits.ctx = sqlite3_commit_hook(db[i], do_test_payload_apply_commit_hook, &commits);
+        if (do_merge_using_payload(db[0], db[i], true, true) == false) goto finalize;
+        if (extra == -1) extra = commits.ncommits - expected[i];
+        if (commits.ncommits - extra != expected[i]) goto finalize;
+        if (dbutils_int_select(db[i], "SELECT count(DISTINCT db_version) FROM cloudsync_changes;") != 10) goto finalize;
+        if (dbutils_int_select(db[i], "SELECT count(*) FROM foo;") != 10) goto finalize;
+        
+        // the high-water marks are stored with each group so the same payload is not applied again
+        if (do_merge_using_payload(db[0], db[i], true, true) == false) goto finalize;
+        if (dbutils_int_select(db[i], "SELECT count(*) FROM cloudsync_changes;") != 20) goto finalize;
+        sqlite3_commit_hook(db[i], cloudsync_commit_hook, commits.ctx);
+    }
+    
+    // a payload applied inside a transaction opened by the caller is part of it
+    int rc = sqlite3_exec(db[0], "INSERT INTO foo VALUES ('id10', 'a10', 'b10'); INSERT INTO foo VALUES ('id11', 'a11', 'b11');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[2], "BEGIN;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_using_payload(db[0], db[2], true, true) == false) goto finalize;
+    rc = sqlite3_exec(db[2], "ROLLBACK;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[2], "SELECT count(*) FROM foo;") != 10) goto finalize;
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<5; ++i) {
+        if (!result && db[i]) printf("do_test_payload_apply_grouping error: %s\n", sqlite3_errmsg(db[i]));
+        close_db(db[i]);
+    }
+    return result;
+}
+
+bool do_test_snapshot (void) {
+    sqlite3 *db[4] = {NULL, NULL, NULL, NULL};
+    sqlite3_stmt *vm = NULL;
+    char path[256] = {0};
+    bool result = false;
+    
+    for (int i=0; i<4; ++i) {
+        int rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER); SELECT cloudsync_init('foo');"
+                                 "CREATE TABLE bar (id INTEGER PRIMARY KEY NOT NULL, a TEXT); SELECT cloudsync_init('bar', 'cls', 1, 'packed');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // db[0] contains local changes, a tombstone and the changes merged from db[1]
+    int rc = sqlite3_exec(db[0], "INSERT INTO foo VALUES ('id1', 'a1', 1), ('id2', 'a2', 2), ('id3', 'a3', 3); UPDATE foo SET a = 'a11' WHERE id = 'id1'; DELETE FROM foo WHERE id = 'id3';"
+                                 "INSERT INTO bar VALUES (1, 'bar1'), (2, 'bar2'); UPDATE bar SET a = 'bar22' WHERE id = 2;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[1], "INSERT INTO foo VALUES ('id4', 'a4', 4); INSERT INTO bar VALUES (3, 'bar3');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_using_payload(db[1], db[0], true, true) == false) goto finalize;
+    
+    // install the in-memory snapshot of db[0] in db[2]
+    rc = sqlite3_prepare_v2(db[0], "SELECT cloudsync_snapshot_encode();", -1, &vm, NULL);
+    if (rc != SQLITE_OK || sqlite3_step(vm) != SQLITE_ROW) goto finalize;
+    sqlite3_stmt *vm2 = NULL;
+    rc = sqlite3_prepare_v2(db[2], "SELECT cloudsync_snapshot_decode(?);", -1, &vm2, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_bind_value(vm2, 1, sqlite3_column_value(vm, 0));
+    rc = sqlite3_step(vm2);
+    sqlite3_int64 nrows = sqlite3_column_int64(vm2, 0);
+    sqlite3_finalize(vm2);
+    if (rc != SQLITE_ROW || nrows != 6) goto finalize;
+    
+    // a snapshot cannot be installed twice
+    rc = sqlite3_prepare_v2(db[2], "SELECT cloudsync_snapshot_decode(?);", -1, &vm2, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_bind_value(vm2, 1, sqlite3_column_value(vm, 0));
+    rc = sqlite3_step(vm2);
+    sqlite3_finalize(vm2);
+    if (rc == SQLITE_ROW) goto finalize;
+    sqlite3_finalize(vm);
+    vm = NULL;
+    
+    // install the file snapshot of db[0] in db[3]
+    do_build_database_path(path, 0, time(NULL), 38);
+    file_delete_internal(path);
+    char *sql = sqlite3_mprintf("SELECT cloudsync_snapshot_save('%q') = cloudsync_db_version();", path);
+    sqlite3_int64 saved = dbutils_int_select(db[0], sql);
+    sqlite3_free(sql);
+    if (saved != 1) goto finalize;
+    sql = sqlite3_mprintf("SELECT cloudsync_snapshot_load('%q');", path);
+    nrows = dbutils_int_select(db[3], sql);
+    sqlite3_free(sql);
+    if (nrows != 6) goto finalize;
+    
+    // the installed databases have the same rows and clocks, with the origin of each change
+    const char *changes = "SELECT tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq FROM cloudsync_changes ORDER BY tbl, pk, col_name;";
+    for (int i=2; i<4; ++i) {
+        if (do_compare_queries(db[0], changes, db[i], changes, -1, -1, false) == false) goto finalize;
+        if (do_compare_queries(db[0], "SELECT * FROM foo ORDER BY id;", db[i], "SELECT * FROM foo ORDER BY id;", -1, -1, false) == false) goto finalize;
+        if (do_compare_queries(db[0], "SELECT * FROM bar ORDER BY id;", db[i], "SELECT * FROM bar ORDER BY id;", -1, -1, false) == false) goto finalize;
+        if (dbutils_int_select(db[i], "SELECT count(*) FROM cloudsync_changes WHERE site_id = cloudsync_siteid();") != 0) goto finalize;
+    }
+    
+    // incremental sync continues from the snapshot
+    rc = sqlite3_exec(db[1], "UPDATE foo SET a = 'a44' WHERE id = 'id4'; INSERT INTO bar VALUES (4, 'bar4');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_using_payload(db[1], db[0], true, true) == false) goto finalize;
+    if (do_merge_using_payload(db[1], db[2], true, true) == false) goto finalize;
+    if (do_compare_queries(db[0], changes, db[2], changes, -1, -1, false) == false) goto finalize;
+    
+    // local changes of the new device get newer db_versions and are sent to the other peers
+    sqlite3_int64 db_version = dbutils_int_select(db[2], "SELECT cloudsync_db_version();");
+    rc = sqlite3_exec(db[2], "UPDATE foo SET b = 22 WHERE id = 'id2'; UPDATE bar SET a = 'bar11' WHERE id = 1;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[2], "SELECT cloudsync_db_version();") <= db_version) goto finalize;
+    if (dbutils_int_select(db[2], "SELECT count(*) FROM cloudsync_changes WHERE site_id = cloudsync_siteid();") != 2) goto finalize;
+    if (do_merge_using_payload(db[2], db[0], true, true) == false) goto finalize;
+    if (do_compare_queries(db[0], changes, db[2], changes, -1, -1, false) == false) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (vm) sqlite3_finalize(vm);
+    if (path[0]) file_delete_internal(path);
+    for (int i=0; i<4; ++i) {
+        if (!result && db[i]) printf("do_test_snapshot error: %s\n", sqlite3_errmsg(db[i]));
+        close_db(db[i]);
+    }
+    return result;
+}
+
+bool do_test_sync_attached (void) {
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    char path[256] = {0};
+    bool result = false;
+    
+    // db[0] is the main database, db[1] is a replica stored in a file that db[0] attaches, db[2] is a third peer
+    do_build_database_path(path, 0, time(NULL), 39);
+    file_delete_internal(path);
+    for (int i=0; i<3; ++i) {
+        int rc = sqlite3_open((i == 1) ? path : ":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER); SELECT cloudsync_init('foo');"
+                                 "CREATE TABLE bar (id INTEGER PRIMARY KEY NOT NULL, a TEXT); SELECT cloudsync_init('bar', 'cls', 1, 'packed');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    int rc = sqlite3_exec(db[0], "INSERT INTO foo VALUES ('id1', 'a1', 1), ('id2', 'a2', 2); INSERT INTO bar VALUES (1, 'bar1');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[1], "INSERT INTO foo VALUES ('id3', 'a3', 3); INSERT INTO bar VALUES (2, 'bar2');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // the attached database must be a file initialized by cloudsync
+    rc = sqlite3_exec(db[0], "ATTACH DATABASE ':memory:' AS mem;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (sqlite3_exec(db[0], "SELECT cloudsync_sync_attached('mem');", NULL, NULL, NULL) == SQLITE_OK) goto finalize;
+    if (sqlite3_exec(db[0], "SELECT cloudsync_sync_attached('main');", NULL, NULL, NULL) == SQLITE_OK) goto finalize;
+    if (sqlite3_exec(db[0], "SELECT cloudsync_sync_attached('unknown');", NULL, NULL, NULL) == SQLITE_OK) goto finalize;
+    
+    char *sql = sqlite3_mprintf("ATTACH DATABASE '%q' AS replica;", path);
+    rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // first exchange: 5 columns from db[0] (2 rows of foo and 1 of bar) and 3 from db[1]
+    if (dbutils_int_select(db[0], "SELECT cloudsync_sync_attached('replica');") != 8) goto finalize;
+    
+    // clocks and origins are the same on both sides (db_version is local to each database)
+    const char *changes = "SELECT tbl, pk, col_name, col_value, col_version, site_id, cl FROM cloudsync_changes ORDER BY tbl, pk, col_name;";
+    if (do_compare_queries(db[0], changes, db[1], changes, -1, -1, false) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM foo ORDER BY id;", db[1], "SELECT * FROM foo ORDER BY id;", -1, -1, false) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM bar ORDER BY id;", db[1], "SELECT * FROM bar ORDER BY id;", -1, -1, false) == false) goto finalize;
+    
+    // nothing is exchanged again (the rows received by a side are not sent back to the other one)
+    if (dbutils_int_select(db[0], "SELECT cloudsync_sync_attached('replica');") != 0) goto finalize;
+    
+    // updates, conflicts and deletes in both directions
+    rc = sqlite3_exec(db[0], "UPDATE foo SET a = 'a11' WHERE id = 'id1'; DELETE FROM bar WHERE id = 2;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[1], "UPDATE foo SET b = 33 WHERE id = 'id3'; UPDATE foo SET a = 'a22' WHERE id = 'id2'; UPDATE foo SET a = 'a222' WHERE id = 'id2';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT cloudsync_sync_attached('replica');") <= 0) goto finalize;
+    if (do_compare_queries(db[0], changes, db[1], changes, -1, -1, false) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM foo ORDER BY id;", db[1], "SELECT * FROM foo ORDER BY id;", -1, -1, false) == false) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM bar;") != 1) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT b FROM foo WHERE id = 'id3';") != 33) goto finalize;
+    
+    // the changes of a third peer merged into the replica reach the main database with their origin
+    rc = sqlite3_exec(db[2], "INSERT INTO foo VALUES ('id4', 'a4', 4);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_using_payload(db[2], db[1], true, true) == false) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT cloudsync_sync_attached('replica');") != 2) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes WHERE pk = cloudsync_pk_encode('id4') AND site_id != cloudsync_siteid() AND site_id != (SELECT site_id FROM replica.cloudsync_site_id WHERE rowid = 0);") != 2) goto finalize;
+    if (do_compare_queries(db[0], changes, db[1], changes, -1, -1, false) == false) goto finalize;
+    
+    // the result is the same as exchanging payloads
+    if (do_merge_using_payload(db[0], db[2], false, true) == false) goto finalize;
+    if (do_compare_queries(db[0], changes, db[2], changes, -1, -1, false) == false) goto finalize;
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<3; ++i) {
+        if (!result && db[i]) printf("do_test_sync_attached error: %s\n", sqlite3_errmsg(db[i]));
+        close_db(db[i]);
+    }
+    if (path[0]) file_delete_internal(path);
+    return result;
+}
+
+bool do_test_backfill (void) {
+    sqlite3 *db[2] = {NULL, NULL};
+    bool result = false;
+    
+    for (int i=0; i<2; ++i) {
+        int rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER);"
+                                 "CREATE TABLE bar (id INTEGER PRIMARY KEY NOT NULL, a TEXT);", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // db[0] already contains 10 rows in each table, backfilled 3 rows at a time
+    int rc = sqlite3_exec(db[0], "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 10) INSERT INTO foo SELECT printf('id%02d', i), 'a' || i, i FROM n;"
+                                 "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 10) INSERT INTO bar SELECT i, 'bar' || i FROM n;"
+                                 "SELECT cloudsync_set('" CLOUDSYNC_KEY_BACKFILL_BATCH "', '3');"
+                                 "SELECT cloudsync_init('foo'); SELECT cloudsync_init('bar', 'cls', 1, 'packed');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[1], "SELECT cloudsync_init('foo'); SELECT cloudsync_init('bar', 'cls', 1, 'packed');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // only the first batch is backfilled by cloudsync_init
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM foo_cloudsync;") != 3 * 2) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM bar_cloudsync;") != 3) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT cloudsync_backfill_progress('foo') = '{\"rows\":3,\"total\":10,\"completed\":false}';") != 1) goto finalize;
+    
+    // a snapshot cannot be taken until the backfill is completed
+    if (sqlite3_exec(db[0], "SELECT cloudsync_snapshot_encode();", NULL, NULL, NULL) == SQLITE_OK) goto finalize;
+    
+    // local changes to the rows not yet backfilled are not overwritten by the next batches
+    rc = sqlite3_exec(db[0], "UPDATE foo SET a = 'a88' WHERE id = 'id08'; INSERT INTO foo VALUES ('id11', 'a11', 11); DELETE FROM foo WHERE id = 'id09';"
+                             "UPDATE bar SET a = 'bar88' WHERE id = 8; INSERT INTO bar VALUES (11, 'bar11');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    if (dbutils_int_select(db[0], "SELECT cloudsync_backfill('foo', 4);") != 4) goto finalize;
+    sqlite3_int64 batches = 0;
+    while (1) {
+        sqlite3_int64 nrows = dbutils_int_select(db[0], "SELECT cloudsync_backfill('foo') + cloudsync_backfill('bar');");
+        if (nrows < 0 || ++batches > 10) goto finalize;
+        if (nrows == 0) break;
+    }
+    if (dbutils_int_select(db[0], "SELECT cloudsync_backfill_progress('foo') = '{\"rows\":10,\"total\":10,\"completed\":true}';") != 1) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT cloudsync_backfill_progress('bar') = '{\"rows\":11,\"total\":11,\"completed\":true}';") != 1) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_table_settings WHERE key = '" CLOUDSYNC_KEY_BACKFILL_CURSOR "';") != 0) goto finalize;
+    
+    // every row has its clocks, the local changes are kept and each change has its own seq
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes WHERE tbl = 'foo' AND col_name != '" CLOUDSYNC_TOMBSTONE_VALUE "';") != 10 * 2) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes WHERE tbl = 'bar' AND col_name != '" CLOUDSYNC_TOMBSTONE_VALUE "';") != 11) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM (SELECT 1 FROM cloudsync_changes GROUP BY db_version, seq HAVING count(*) > 1);") != 0) goto finalize;
+    
+    // the backfilled rows are sent to the other peers
+    if (do_merge_using_payload(db[0], db[1], true, true) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM foo ORDER BY id;", db[1], "SELECT * FROM foo ORDER BY id;", -1, -1, false) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM bar ORDER BY id;", db[1], "SELECT * FROM bar ORDER BY id;", -1, -1, false) == false) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM foo;") != 10) goto finalize;
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<2; ++i) {
+        if (!result && db[i]) printf("do_test_backfill error: %s\n", sqlite3_errmsg(db[i]));
+        close_db(db[i]);
+    }
+    return result;
+}
+
+bool do_test_alter_dbversion (bool cleanup_databases) {
+    sqlite3 *db[2] = {NULL, NULL};
+    bool result = false;
+    
+    time_t timestamp = time(NULL);
+    int counter = test_counter++;
+    
+    db[0] = do_create_database_file(0, timestamp, counter);
+    if (!db[0]) goto finalize;
+    
+    int rc = sqlite3_exec(db[0], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, value TEXT); SELECT cloudsync_init('foo');"
+                                 "INSERT INTO foo VALUES ('id1', 'v1'); INSERT INTO foo VALUES ('id2', 'v2'); INSERT INTO foo VALUES ('id3', 'v3');"
+                                 "SELECT cloudsync_begin_alter('foo'); ALTER TABLE foo ADD COLUMN other TEXT; SELECT cloudsync_commit_alter('foo');"
+                                 "INSERT INTO foo VALUES ('id4', 'v4', NULL); INSERT INTO foo VALUES ('id5', 'v5', NULL);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_int64 db_version = dbutils_int_select(db[0], "SELECT max(db_version) FROM foo_cloudsync;");
+    if (db_version < 5) goto finalize;
+    
+    // the db_version stored by the alter is only a lower bound, a new connection must not go back to it
+    db[1] = do_create_database_file(0, timestamp, counter);
+    if (!db[1]) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT cloudsync_db_version();") != db_version) goto finalize;
+    rc = sqlite3_exec(db[1], "INSERT INTO foo VALUES ('id6', 'v6', NULL);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT db_version FROM foo_cloudsync WHERE pk = cloudsync_pk_encode('id6') LIMIT 1;") != db_version + 1) goto finalize;
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<2; ++i) {
+        if (!result && db[i]) printf("do_test_alter_dbversion error: %s\n", sqlite3_errmsg(db[i]));
+        close_db(db[i]);
+    }
+    if (cleanup_databases) {
+        char buf[256];
+        do_build_database_path(buf, 0, timestamp, counter);
+        file_delete_internal(buf);
+    }
+    return result;
+}
+
+bool do_test_alter_incremental (void) {
+    sqlite3 *db[2] = {NULL, NULL};
+    bool result = false;
+    
+    for (int i=0; i<2; ++i) {
+        int rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, a TEXT NOT NULL DEFAULT '', b TEXT); SELECT cloudsync_init('foo');"
+                                 "CREATE TABLE bar (id TEXT PRIMARY KEY NOT NULL, a TEXT, b TEXT); SELECT cloudsync_init('bar', 'cls', 0, 'packed');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    int rc = sqlite3_exec(db[0], "INSERT INTO foo VALUES ('id1', 'a1', 'b1'), ('id2', 'a2', 'b2'), ('id3', 'a3', 'b3'); UPDATE foo SET b = 'b11' WHERE id = 'id1'; DELETE FROM foo WHERE id = 'id3';"
+                                 "INSERT INTO bar VALUES ('id1', 'a1', 'b1'), ('id2', 'a2', 'b2'); UPDATE bar SET b = 'b22' WHERE id = 'id2';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_using_payload(db[0], db[1], true, true) == false) goto finalize;
+    
+    // adding a column and renaming a primary key column don't touch the meta-table of a per-column table
+    const char *clocks = "SELECT group_concat(hex(pk) || ':' || col_id || ':' || col_version || ':' || db_version || ':' || seq || ':' || site_id, ',') FROM (SELECT * FROM foo_cloudsync ORDER BY pk, col_id);";
+    for (int i=0; i<2; ++i) {
+        char *before = dbutils_text_select(db[i], clocks);
+        rc = sqlite3_exec(db[i], "SELECT cloudsync_begin_alter('foo'); ALTER TABLE foo ADD COLUMN c TEXT DEFAULT 'c1'; ALTER TABLE foo RENAME COLUMN id TO ident; SELECT cloudsync_commit_alter('foo');", NULL, NULL, NULL);
+        char *after = dbutils_text_select(db[i], clocks);
+        bool same = (before && after && strcmp(before, after) == 0);
+        if (before) cloudsync_memory_free(before);
+        if (after) cloudsync_memory_free(after);
+        if (rc != SQLITE_OK || !same) goto finalize;
+    }
+    
+    // a new primary key containing the old one re-keys the clocks, the versions of the other columns are kept
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_exec(db[i], "SELECT cloudsync_begin_alter('foo'); ALTER TABLE foo RENAME TO foo_old;"
+                                 "CREATE TABLE foo (ident TEXT NOT NULL, a TEXT NOT NULL DEFAULT '', b TEXT, c TEXT DEFAULT 'c1', PRIMARY KEY (ident, a));"
+                                 "INSERT INTO foo SELECT * FROM foo_old; DROP TABLE foo_old; SELECT cloudsync_commit_alter('foo');"
+                                 "SELECT cloudsync_begin_alter('bar'); ALTER TABLE bar RENAME TO bar_old;"
+                                 "CREATE TABLE bar (id TEXT NOT NULL, a TEXT NOT NULL DEFAULT '', b TEXT, PRIMARY KEY (id, a));"
+                                 "INSERT INTO bar SELECT * FROM bar_old; DROP TABLE bar_old; SELECT cloudsync_commit_alter('bar');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    if (dbutils_int_select(db[0], "SELECT col_version FROM cloudsync_changes WHERE tbl = 'foo' AND pk = cloudsync_pk_encode('id1', 'a1') AND col_name = 'b';") != 2) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT col_version FROM cloudsync_changes WHERE tbl = 'bar' AND pk = cloudsync_pk_encode('id2', 'a2') AND col_name = 'b';") != 2) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes WHERE col_name = 'a';") != 0) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM foo_cloudsync WHERE pk NOT IN (SELECT cloudsync_pk_encode(ident, a) FROM foo);") != 0) goto finalize;
+    
+    // the peers keep syncing with the new schema
+    rc = sqlite3_exec(db[0], "UPDATE foo SET b = 'b111' WHERE ident = 'id1'; INSERT INTO foo (ident, a, b) VALUES ('id4', 'a4', 'b4'); UPDATE bar SET b = 'b11' WHERE id = 'id1';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_using_payload(db[0], db[1], true, true) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM foo ORDER BY ident;", db[1], "SELECT * FROM foo ORDER BY ident;", -1, -1, false) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM bar ORDER BY id;", db[1], "SELECT * FROM bar ORDER BY id;", -1, -1, false) == false) goto finalize;
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<2; ++i) {
+        if (!result && db[i]) printf("do_test_alter_incremental error: %s\n", sqlite3_errmsg(db[i]));
+        close_db(db[i]);
+    }
+    return result;
+}
+
+sqlite3_int64 do_stats_value (sqlite3 *db, const char *tbl, const char *name) {
+    char *sql = (tbl) ? sqlite3_mprintf("SELECT value FROM cloudsync_stats WHERE tbl = '%q' AND name = '%q';", tbl, name) :
+                        sqlite3_mprintf("SELECT value FROM cloudsync_stats WHERE tbl IS NULL AND name = '%q';", name);
+    sqlite3_int64 value = dbutils_int_select(db, sql);
+    sqlite3_free(sql);
+    return value;
+}
+
+bool do_test_stats (void) {
+    sqlite3 *db[2] = {NULL, NULL};
+    bool result = false;
+    
+    for (int i=0; i<2; ++i) {
+        int rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, value TEXT); SELECT cloudsync_init('foo');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // local changes
+    int rc = sqlite3_exec(db[0], "INSERT INTO foo VALUES ('id1', 'v1'), ('id2', 'v2'), ('id3', 'v3'); UPDATE foo SET value = 'v11' WHERE id = 'id1';"
+                                 "UPDATE foo SET value = 'v2' WHERE id = 'id2'; DELETE FROM foo WHERE id = 'id3';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_stats_value(db[0], "foo", "local_inserts") != 3) goto finalize;
+    if (do_stats_value(db[0], "foo", "local_updates") != 1) goto finalize;
+    if (do_stats_value(db[0], "foo", "local_deletes") != 1) goto finalize;
+    if (do_stats_value(db[0], NULL, "local_inserts") != 3) goto finalize;
+    if (do_stats_value(db[0], "foo", "meta_statements") <= 0) goto finalize;
+    
+    // a local change on the receiver loses against a newer remote one, an older remote delete is skipped
+    rc = sqlite3_exec(db[1], "INSERT INTO foo VALUES ('id1', 'zzz'); INSERT INTO foo VALUES ('id3', 'v3'); DELETE FROM foo WHERE id = 'id3'; INSERT INTO foo VALUES ('id3', 'v33');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_using_payload(db[0], db[1], false, true) == false) goto finalize;
+    
+    sqlite3_int64 rows = dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes;");
+    if (do_stats_value(db[0], NULL, "rows_encoded") != rows) goto finalize;
+    if (do_stats_value(db[1], NULL, "rows_decoded") != rows) goto finalize;
+    if (do_stats_value(db[1], NULL, "payload_bytes_raw") <= 0) goto finalize;
+    if (do_stats_value(db[1], NULL, "payload_bytes_compressed") <= 0) goto finalize;
+    
+    sqlite3_int64 attempted = do_stats_value(db[1], "foo", "merges_attempted");
+    sqlite3_int64 won = do_stats_value(db[1], "foo", "merges_won");
+    sqlite3_int64 lost = do_stats_value(db[1], "foo", "merges_lost");
+    sqlite3_int64 skipped = do_stats_value(db[1], "foo", "merges_skipped_cl");
+    if (attempted != rows || won <= 0 || skipped <= 0 || won + lost + skipped != attempted) goto finalize;
+    if (do_stats_value(db[1], NULL, "merges_attempted") != attempted) goto finalize;
+    
+    // latency histograms
+    if (dbutils_int_select(db[0], "SELECT sum(value) FROM cloudsync_stats WHERE name = 'encode_latency_us' AND bucket IS NOT NULL;") != 1) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT sum(value) FROM cloudsync_stats WHERE name = 'apply_latency_us' AND bucket IS NOT NULL;") != 1) goto finalize;
+    
+    // reset
+    rc = sqlite3_exec(db[1], "SELECT cloudsync_stats_reset();", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT sum(value) FROM cloudsync_stats;") != 0) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_stats WHERE bucket IS NOT NULL;") != 0) goto finalize;
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<2; ++i) {
+        if (!result && db[i]) printf("do_test_stats error: %s\n", sqlite3_errmsg(db[i]));
+        close_db(db[i]);
+    }
+    return result;
+}
+
+bool do_test_packed_row_batch (void) {
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    char *v[2] = {NULL, NULL};
+    bool result = false;
+    
+    const char *changes_sql = "SELECT group_concat(tbl || ':' || hex(pk) || ':' || col_name || ':' || IFNULL(col_value, 'NULL') || ':' || col_version || ':' || seq || ':' || cl, ',') FROM (SELECT * FROM cloudsync_changes ORDER BY db_version, seq);";
+    
+    // db[0] and db[1] use the packed storage, db[2] the per-column one
+    for (int i=0; i<3; ++i) {
+        int rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        char *sql = sqlite3_mprintf("CREATE TABLE wide (id TEXT PRIMARY KEY NOT NULL, c1, c2, c3, c4, c5, c6, c7, c8, c9, c10, c11, c12, c13, c14, c15, c16, c17, c18, c19, c20);"
+                                    "SELECT cloudsync_init('wide', 'cls', 0, '%s');", (i < 2) ? "packed" : "rows");
+        rc = sqlite3_exec(db[i], sql, NULL, NULL, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    int rc = sqlite3_exec(db[0], "INSERT INTO wide (id) VALUES ('id1'), ('id2');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // the clock vector of a row is read and written once, regardless of the number of updated columns
+    sqlite3_int64 before = do_stats_value(db[0], "wide", "meta_statements");
+    rc = sqlite3_exec(db[0], "UPDATE wide SET c1 = 1, c2 = 2, c3 = 3, c4 = 4, c5 = 5, c6 = 6, c7 = 7, c8 = 8, c9 = 9, c10 = 10, c11 = 11, c12 = 12, c13 = 13, c14 = 14, c15 = 15, c16 = 16, c17 = 17, c18 = 18, c19 = 19, c20 = 20 WHERE id = 'id1';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_stats_value(db[0], "wide", "meta_statements") - before != 2) goto finalize;
+    
+    before = do_stats_value(db[0], "wide", "meta_statements");
+    rc = sqlite3_exec(db[0], "UPDATE wide SET c5 = 'a', c10 = 'b', c15 = 'c';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_stats_value(db[0], "wide", "meta_statements") - before != 4) goto finalize;
+    
+    // the same for the consecutive changes of a row merged from a payload (46 changes in 4 groups with the same
+    // pk and db_version: id2 at db_version 1, id1 at 2, id1 and id2 at 3)
+    before = do_stats_value(db[1], "wide", "meta_statements");
+    if (do_merge_using_payload(db[0], db[1], true, true) == false) goto finalize;
+    if (do_stats_value(db[1], "wide", "meta_statements") - before != 8) goto finalize;
+    if (do_merge_using_payload(db[0], db[2], true, true) == false) goto finalize;
+    
+    v[0] = dbutils_text_select(db[1], changes_sql);
+    v[1] = dbutils_text_select(db[2], changes_sql);
+    if (!v[0] || !v[1] || strcmp(v[0], v[1]) != 0) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM wide WHERE c5 = 'a' AND c10 = 'b' AND c15 = 'c' AND IFNULL(c20, 20) = 20;") != 2) goto finalize;
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<3; ++i) {
+        if (!result && db[i]) printf("do_test_packed_row_batch error: %s\n", sqlite3_errmsg(db[i]));
+        close_db(db[i]);
+    }
+    for (int i=0; i<2; ++i) {
+        if (v[i]) cloudsync_memory_free(v[i]);
+    }
+    return result;
+}
+
+bool do_test_stmt_cache (void) {
+    sqlite3 *db[2] = {NULL, NULL};
+    char sql[4096];
+    bool result = false;
+    int nstmts = 0;
+    
+    // 20 tables with 10 columns each use more than 400 statements, the budget is 32 on the sender
+    for (int i=0; i<2; ++i) {
+        if (sqlite3_open(":memory:", &db[i]) != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        for (int t=0; t<20; ++t) {
+            int len = snprintf(sql, sizeof(sql), "CREATE TABLE t%d (id TEXT PRIMARY KEY NOT NULL", t);
+            for (int c=0; c<10; ++c) len += snprintf(sql + len, sizeof(sql) - len, ", c%d TEXT", c);
+            snprintf(sql + len, sizeof(sql) - len, "); SELECT cloudsync_init('t%d');", t);
+            if (sqlite3_exec(db[i], sql, NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+        }
+    }
+    if (sqlite3_exec(db[0], "SELECT cloudsync_set('stmt_cache_size', '32');", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    nstmts = do_count_statements(db[0]);
+    
+    for (int t=0; t<20; ++t) {
+        int len = snprintf(sql, sizeof(sql), "INSERT INTO t%d VALUES ('id1'", t);
+        for (int c=0; c<10; ++c) len += snprintf(sql + len, sizeof(sql) - len, ", 'v%d'", c);
+        len += snprintf(sql + len, sizeof(sql) - len, "), ('id2'");
+        for (int c=0; c<10; ++c) len += snprintf(sql + len, sizeof(sql) - len, ", 'w%d'", c);
+        snprintf(sql + len, sizeof(sql) - len, "); UPDATE t%d SET c3 = 'u3', c7 = 'u7' WHERE id = 'id1'; DELETE FROM t%d WHERE id = 'id2';", t, t);
+        if (sqlite3_exec(db[0], sql, NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    }
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes;") != 220) goto finalize;
+    
+    // the evicted statements are compiled again when needed, the number of compiled statements stays bounded
+    if (do_count_statements(db[0]) > nstmts + 32) goto finalize;
+    if (do_stats_value(db[0], NULL, "stmt_cache_evictions") == 0) goto finalize;
+    if (do_stats_value(db[0], NULL, "stmt_cache_hits") == 0) goto finalize;
+    if (do_stats_value(db[0], NULL, "stmt_cache_misses") - do_stats_value(db[0], NULL, "stmt_cache_evictions") > 32) goto finalize;
+    
+    // the receiver has no limit, lowering its budget evicts the statements compiled by the merge
+    if (!do_merge_using_payload(db[0], db[1], false, true)) goto finalize;
+    nstmts = do_count_statements(db[1]);
+    if (sqlite3_exec(db[1], "SELECT cloudsync_set('stmt_cache_size', '32');", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    if (nstmts - do_count_statements(db[1]) < 200) goto finalize;
+    
+    // a second round of changes is merged with the evicted statements
+    if (sqlite3_exec(db[0], "UPDATE t0 SET c1 = 'x1'; UPDATE t19 SET c9 = 'x9'; DELETE FROM t5; INSERT INTO t5 (id, c0) VALUES ('id3', 'y0');", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    if (!do_merge_using_payload(db[0], db[1], false, true)) goto finalize;
+    if (do_stats_value(db[1], NULL, "stmt_cache_evictions") == 0) goto finalize;
+    for (int t=0; t<20; ++t) {
+        snprintf(sql, sizeof(sql), "SELECT * FROM t%d ORDER BY id;", t);
+        if (!do_compare_queries(db[0], sql, db[1], sql, -1, -1, false)) goto finalize;
+    }
+    if (!do_compare_queries(db[0], "SELECT tbl, pk, col_name, col_value, col_version, cl FROM cloudsync_changes;", db[1], "SELECT tbl, pk, col_name, col_value, col_version, cl FROM cloudsync_changes;", -1, -1, false)) goto finalize;
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<2; ++i) {
+        if (!result && db[i]) printf("do_test_stmt_cache error: %s\n", sqlite3_errmsg(db[i]));
+        close_db(db[i]);
+    }
+    return result;
+}
+
+bool do_test_shared_schema (void) {
+    sqlite3 *db[4] = {NULL, NULL, NULL, NULL};
+    char path[256] = {0};
+    bool result = false;
+    int nschemas = 0, nrefs = 0;
+    
+    do_build_database_path(path, 0, time(NULL), 41);
+    file_delete_internal(path);
+    if (sqlite3_open(path, &db[0]) != SQLITE_OK) goto finalize;
+    sqlite3_cloudsync_init(db[0], NULL, NULL);
+    for (int t=0; t<4; ++t) {
+        char sql[512];
+        snprintf(sql, sizeof(sql), "CREATE TABLE t%d (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER, c BLOB); SELECT cloudsync_init('t%d');", t, t);
+        if (sqlite3_exec(db[0], sql, NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    }
+    if (sqlite3_exec(db[0], "SELECT cloudsync_set('shared_schema', '1');", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    close_db(db[0]);
+    db[0] = NULL;
+    
+    // the connections opened on the same database share a single entry (one reference for each connection and table)
+    for (int i=0; i<2; ++i) {
+        if (sqlite3_open(path, &db[i]) != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+    }
+    schema_shared_info(&nschemas, &nrefs);
+    if (nschemas != 1 || nrefs != 2 * 5) goto finalize;
+    
+    // the shared metadata is used to track and read the changes of both connections
+    if (sqlite3_exec(db[0], "INSERT INTO t1 VALUES ('id1', 'a1', 1, x'01'), ('id2', 'a2', 2, x'02');", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    if (sqlite3_exec(db[1], "UPDATE t1 SET b = 10 WHERE id = 'id1'; DELETE FROM t1 WHERE id = 'id2'; INSERT INTO t3 (id, c) VALUES ('id3', x'03');", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes;") != 7) goto finalize;
+    if (!do_compare_queries(db[0], "SELECT tbl, pk, col_name, col_value, col_version, cl FROM cloudsync_changes;", db[1], "SELECT tbl, pk, col_name, col_value, col_version, cl FROM cloudsync_changes;", -1, -1, false)) goto finalize;
+    
+    // an in-memory database doesn't share its metadata
+    if (sqlite3_open(":memory:", &db[3]) != SQLITE_OK) goto finalize;
+    sqlite3_cloudsync_init(db[3], NULL, NULL);
+    if (sqlite3_exec(db[3], "SELECT cloudsync_set('shared_schema', '1');", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    for (int t=0; t<4; ++t) {
+        char sql[512];
+        snprintf(sql, sizeof(sql), "CREATE TABLE t%d (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER, c BLOB); SELECT cloudsync_init('t%d');", t, t);
+        if (sqlite3_exec(db[3], sql, NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    }
+    if (!do_merge_using_payload(db[1], db[3], false, true)) goto finalize;
+    if (!do_compare_queries(db[0], "SELECT * FROM t1 ORDER BY id;", db[3], "SELECT * FROM t1 ORDER BY id;", -1, -1, false)) goto finalize;
+    schema_shared_info(&nschemas, &nrefs);
+    if (nschemas != 1 || nrefs != 2 * 5) goto finalize;
+    
+    // altering a table invalidates the entry, a connection opened later discovers the new schema
+    if (sqlite3_exec(db[1], "SELECT cloudsync_begin_alter('t2'); ALTER TABLE t2 ADD COLUMN d TEXT; SELECT cloudsync_commit_alter('t2');", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    schema_shared_info(&nschemas, &nrefs);
+    if (nschemas != 0) goto finalize;
+    if (sqlite3_open(path, &db[2]) != SQLITE_OK) goto finalize;
+    sqlite3_cloudsync_init(db[2], NULL, NULL);
+    schema_shared_info(&nschemas, &nrefs);
+    if (nschemas != 1 || nrefs != 5) goto finalize;
+    if (sqlite3_exec(db[2], "INSERT INTO t2 (id, d) VALUES ('id4', 'd4');", NULL, NULL, NULL) != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_changes WHERE tbl = 't2' AND col_name = 'd' AND col_value = 'd4';") != 1) goto finalize;
+    
+    // the entries are released with the last connection that uses them
+    for (int i=0; i<4; ++i) {
+        close_db(db[i]);
+        db[i] = NULL;
+    }
+    schema_shared_info(&nschemas, &nrefs);
+    if (nschemas != 0) goto finalize;
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<4; ++i) {
+        if (!result && db[i]) printf("do_test_shared_schema error: %s\n", sqlite3_errmsg(db[i]));
+        close_db(db[i]);
+    }
+    if (path[0]) file_delete_internal(path);
+    return result;
+}
+
+typedef struct {
+    int     depth;
+    int     begins;
+    int     ends;
+    int64_t encode_rows;
+    int64_t apply_rows;
+    int64_t apply_bytes;
+    int     merges;
+    int     compress;
+    int     decompress;
+    bool    monotonic;
+    uint64_t last_ts;
+} trace_counter;
+
+void do_trace_callback (void *xdata, cloudsync_trace_event event, const char *phase, uint64_t ts_us, const cloudsync_trace_attrs *attrs) {
+    trace_counter *counter = (trace_counter *)xdata;
+    if (ts_us < counter->last_ts) counter->monotonic = false;
+    counter->last_ts = ts_us;
+    
+    if (event == CLOUDSYNC_TRACE_BEGIN) {
+        counter->begins++;
+        counter->depth++;
+        return;
+    }
+    
+    counter->ends++;
+    counter->depth--;
+    if (strcmp(phase, CLOUDSYNC_TRACE_ENCODE) == 0) counter->encode_rows = attrs->rows;
+    else if (strcmp(phase, CLOUDSYNC_TRACE_APPLY) == 0) {counter->apply_rows = attrs->rows; counter->apply_bytes = attrs->bytes;}
+    else if (strcmp(phase, CLOUDSYNC_TRACE_MERGE) == 0) counter->merges++;
+    else if (strcmp(phase, CLOUDSYNC_TRACE_COMPRESS) == 0) counter->compress++;
+    else if (strcmp(phase, CLOUDSYNC_TRACE_DECOMPRESS) == 0) counter->decompress++;
+}
+
+bool do_test_trace (void) {
+    sqlite3 *db[2] = {NULL, NULL};
+    trace_counter counter[2] = {{.monotonic = true}, {.monotonic = true}};
+    bool result = false;
+    
+    // the tracer is stored as connection client data
+    if (sqlite3_libversion_number() < 3044000) return true;
+    
+    for (int i=0; i<2; ++i) {
+        int rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, value TEXT); SELECT cloudsync_init('foo');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+        if (!cloudsync_set_trace_callback(db[i], do_trace_callback, &counter[i], NULL)) goto finalize;
+    }
+    
+    int rc = sqlite3_exec(db[0], "INSERT INTO foo VALUES ('id1', 'v1'), ('id2', 'v2'), ('id3', 'v3');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_using_payload(db[0], db[1], false, true) == false) goto finalize;
+    
+    // spans are balanced, timestamps are monotonic and the attributes are reported by the end events
+    sqlite3_int64 rows = dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes;");
+    for (int i=0; i<2; ++i) {
+        if (counter[i].depth != 0 || counter[i].begins != counter[i].ends || counter[i].begins == 0 || !counter[i].monotonic) goto finalize;
+    }
+    if (counter[0].encode_rows != rows || counter[1].apply_rows != rows || counter[1].apply_bytes <= 0) goto finalize;
+    if (counter[1].merges != 1 || counter[1].decompress != 1) goto finalize;
+    
+    // removing the callback stops tracing
+    int ends = counter[1].ends;
+    if (!cloudsync_set_trace_callback(db[1], NULL, NULL, NULL)) goto finalize;
+    rc = sqlite3_exec(db[0], "UPDATE foo SET value = 'v11' WHERE id = 'id1';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_using_payload(db[0], db[1], false, true) == false) goto finalize;
+    if (counter[1].ends != ends) goto finalize;
+    
+    #ifdef CLOUDSYNC_DESKTOP_OS
+    // Chrome trace event file sink
+    char path[256];
+    snprintf(path, sizeof(path), "cloudsync-trace-%lld.json", (long long)time(NULL));
+    char *sql = sqlite3_mprintf("SELECT cloudsync_trace_file('%q');", path);
+    rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[0], "UPDATE foo SET value = 'v22' WHERE id = 'id2'; SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes; SELECT cloudsync_trace_file(NULL);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    sqlite3_int64 len = 0;
+    char *json = cloudsync_file_read(path, &len);
+    file_delete_internal(path);
+    if (!json) goto finalize;
+    bool valid = (json[0] == '[' && strstr(json, "\"name\":\"encode\",\"cat\":\"cloudsync\",\"ph\":\"B\"") && strstr(json, "\"ph\":\"E\"") && strstr(json, "\n]\n"));
+    cloudsync_memory_free(json);
+    if (!valid) goto finalize;
+    #endif
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<2; ++i) {
+        if (!result && db[i]) printf("do_test_trace error: %s\n", sqlite3_errmsg(db[i]));
+        close_db(db[i]);
+    }
+    return result;
+}
+
+bool do_test_local_db_version (void) {
+    sqlite3 *db = NULL;
+    bool result = false;
+    
+    int rc = sqlite3_open(":memory:", &db);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_cloudsync_init(db, NULL, NULL);
+    
+    rc = sqlite3_exec(db, "CREATE TABLE foo (id TEXT PRIMARY KEY NOT NULL, value TEXT); SELECT cloudsync_init('foo');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    const char *sql = "SELECT CAST(value AS INTEGER) FROM cloudsync_settings WHERE key='" CLOUDSYNC_KEY_LOCAL_DBVERSION "';";
+    
+    // a committed local change must be persisted
+    rc = sqlite3_exec(db, "INSERT INTO foo VALUES ('id1', 'value1');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_int64 db_version = dbutils_int_select(db, "SELECT cloudsync_db_version();");
+    if (db_version <= 0 || dbutils_int_select(db, sql) != db_version) goto finalize;
+    
+    // a rolled back local change must not be persisted
+    rc = sqlite3_exec(db, "BEGIN; INSERT INTO foo VALUES ('id2', 'value2'); ROLLBACK;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, sql) != db_version) goto finalize;
+    
+    // an update that doesn't change any value is not a local change
+    rc = sqlite3_exec(db, "UPDATE foo SET value = 'value1' WHERE id = 'id1';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, sql) != db_version) goto finalize;
+    
+    // many local changes in the same transaction
+    rc = sqlite3_exec(db, "BEGIN; INSERT INTO foo VALUES ('id3', 'value3'); UPDATE foo SET value = 'value4' WHERE id = 'id1'; DELETE FROM foo WHERE id = 'id3'; COMMIT;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_int64 db_version2 = dbutils_int_select(db, "SELECT cloudsync_db_version();");
+    if (db_version2 <= db_version || dbutils_int_select(db, sql) != db_version2) goto finalize;
+    
+    // a change rolled back to a savepoint must not hide the following change of the same transaction
+    rc = sqlite3_exec(db, "BEGIN; SAVEPOINT s; INSERT INTO foo VALUES ('id5', 'value5'); ROLLBACK TO s; INSERT INTO foo VALUES ('id6', 'value6'); COMMIT;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_int64 db_version3 = dbutils_int_select(db, "SELECT cloudsync_db_version();");
+    if (db_version3 <= db_version2 || dbutils_int_select(db, sql) != db_version3) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (!result && db) printf("do_test_local_db_version error: %s\n", sqlite3_errmsg(db));
+    close_db(db);
+    return result;
+}
+
+int unittest_payload_apply_count = 0;
+
+bool unittest_payload_apply_count_callback(void **xdata, cloudsync_pk_decode_bind_context *d, sqlite3 *db, cloudsync_context *data, int step, int rc) {
+    if (step == CLOUDSYNC_PAYLOAD_APPLY_WILL_APPLY) ++unittest_payload_apply_count;
+    return true;
+}
+
+bool do_test_payload_site_versions (bool print_result) {
+    sqlite3 *db[2] = {NULL, NULL};
+    char *blob = NULL;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    int table_mask = TEST_PRIKEYS;
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        if (do_create_tables(table_mask, db[i]) == false) goto finalize;
+        if (do_augment_tables(table_mask, db[i], table_algo_crdt_cls) == false) goto finalize;
+    }
+    
+    do_insert(db[0], table_mask, NINSERT, print_result);
+    
+    const char *src_sql = "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;";
+    const char *dest_sql = "SELECT cloudsync_payload_decode(?);";
+    int blob_size = 0;
+    blob = dbutils_blob_select(db[0], src_sql, &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    
+    // first apply must store the high-water mark of the origin site
+    sqlite3_int64 nrows = dbutils_select(db[1], dest_sql, values, types, len, 1, SQLITE_INTEGER);
+    if (nrows <= 1) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_site_versions;") != 1) goto finalize;
+    
+    // replaying the same payload must skip every row below the mark before merging it
+    unittest_payload_apply_count = 0;
+    cloudsync_set_payload_apply_callback(db[1], unittest_payload_apply_count_callback);
+    if (dbutils_select(db[1], dest_sql, values, types, len, 1, SQLITE_INTEGER) != nrows) goto finalize;
+    cloudsync_set_payload_apply_callback(db[1], NULL);
+    if (unittest_payload_apply_count > 1) goto finalize;
+    cloudsync_memory_free(blob);
+    blob = NULL;
+    
+    // newer changes from the same origin must still be applied
+    do_update(db[0], table_mask, print_result);
+    blob = dbutils_blob_select(db[0], src_sql, &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    values[0] = blob;
+    len[0] = blob_size;
+    if (dbutils_select(db[1], dest_sql, values, types, len, 1, SQLITE_INTEGER) <= 0) goto finalize;
+    
+    char *sql = sqlite3_mprintf("SELECT * FROM \"%w\" ORDER BY first_name, \"" CUSTOMERS_TABLE_COLUMN_LASTNAME "\";", CUSTOMERS_TABLE);
+    result = do_compare_queries(db[0], sql, db[1], sql, -1, -1, print_result);
+    sqlite3_free(sql);
+    
+finalize:
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<2; ++i) {
+        if (!result && db[i] && (sqlite3_errcode(db[i]) != SQLITE_OK)) printf("do_test_payload_site_versions error: %s\n", sqlite3_errmsg(db[i]));
+        if (db[i]) close_db(db[i]);
+    }
+    return result;
+}
+
 // MARK: -
 
 bool do_test_fill_initial_data(int nclients, bool print_result, bool cleanup_databases) {
@@ -6056,6 +7653,7 @@ int main(int argc, const char * argv[]) {
     // test local changes
     result += test_report("Local Test:", do_test_local(test_mask, table_mask, db, print_result));
     result += test_report("VTab Test: ", do_test_vtab(db));
+    result += test_report("VTab Pushdown Test:", do_test_vtab_pushdown());
     result += test_report("Functions Test:", do_test_functions(db, print_result));
     result += test_report("Functions Test (Int):", do_test_internal_functions());
     result += test_report("String Func Test:", do_test_string_replace_prefix());
@@ -6108,6 +7706,28 @@ int main(int argc, const char * argv[]) {
     result += test_report("Test GrowOnlySet:", do_test_gos(6, print_result, cleanup_databases));
     result += test_report("Test Network Enc/Dec:", do_test_network_encode_decode(2, print_result, cleanup_databases, false));
     result += test_report("Test Network Enc/Dec 2:", do_test_network_encode_decode(2, print_result, cleanup_databases, true));
+    result += test_report("Test Payload Site Versions:", do_test_payload_site_versions(print_result));
+    result += test_report("Test Local DB Version:", do_test_local_db_version());
+    result += test_report("Test Metatable Columns:", do_test_metatable_columns(cleanup_databases));
+    result += test_report("Test Packed Storage:", do_test_packed_storage(cleanup_databases));
+    result += test_report("Test Integer PK Metatable:", do_test_integer_pk_metatable());
+    result += test_report("Test GC:", do_test_gc());
+    result += test_report("Test GC Site ID Cache:", do_test_gc_siteid_cache());
+    result += test_report("Test Row Cache:", do_test_row_cache());
+    result += test_report("Test Arena:", do_test_arena());
+    result += test_report("Test Lazy Statements:", do_test_lazy_statements());
+    result += test_report("Test Site ID Ordinals:", do_test_siteid_ordinals());
+    result += test_report("Test Payload Apply Grouping:", do_test_payload_apply_grouping());
+    result += test_report("Test Snapshot:", do_test_snapshot());
+    result += test_report("Test Sync Attached:", do_test_sync_attached());
+    result += test_report("Test Backfill:", do_test_backfill());
+    result += test_report("Test Alter Incremental:", do_test_alter_incremental());
+    result += test_report("Test Alter DB Version:", do_test_alter_dbversion(cleanup_databases));
+    result += test_report("Test Stats:", do_test_stats());
+    result += test_report("Test Packed Row Batch:", do_test_packed_row_batch());
+    result += test_report("Test Statement Cache:", do_test_stmt_cache());
+    result += test_report("Test Shared Schema:", do_test_shared_schema());
+    result += test_report("Test Trace:", do_test_trace());
     result += test_report("Test Fill Initial Data:", do_test_fill_initial_data(3, print_result, cleanup_databases));
     result += test_report("Test Alter Table 1:", do_test_alter(3, 1, print_result, cleanup_databases));
     result += test_report("Test Alter Table 2:", do_test_alter(3, 2, print_result, cleanup_databases));
@@ -6118,6 +7738,7 @@ finalize:
     if (rc != SQLITE_OK) printf("%s (%d)\n", (db) ? sqlite3_errmsg(db) : "N/A", rc);
     db = close_db(db);
     
+    schema_finalize();
     cloudsync_memory_finalize();
 
     sqlite3_int64 memory_used = sqlite3_memory_used();